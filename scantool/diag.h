@@ -50,6 +50,7 @@ extern "C" {
 
 // Nice to have anywhere...
 #define MIN(_a_, _b_) (((_a_) < (_b_) ? (_a_) : (_b_)))
+#define MAX(_a_, _b_) (((_a_) > (_b_) ? (_a_) : (_b_)))
 #define ARRAY_SIZE(x)	(sizeof(x) / sizeof((x)[0]))
 #define FLFMT "%s:%d:  "		//for debug messages
 
@@ -74,6 +75,13 @@ extern "C" {
 	#define UNUSED(X)	X	//how can we suppress "unused parameter" warnings on other compilers?
 #endif // __GNUC__
 
+//DIAG_TLS : thread-local storage qualifier, for per-thread library state (error code etc.)
+#ifdef MSVC
+	#define DIAG_TLS __declspec(thread)
+#else
+	#define DIAG_TLS __thread
+#endif
+
 //hacks for MS Visual studio / visual C
 #ifdef MSVC
 	typedef SSIZE_T ssize_t;	//XXX ssize_t is currently only needed because of diag_tty_unix.c:diag_tty_{read,write}.
@@ -121,6 +129,9 @@ typedef uint16_t flag_type;	//this is used for L2 type flags (see diag_l2.h)
 #define DIAG_IOCTL_GET_L2_DATA	0x2023	/* Get the L2 Keybytes etc into
 										 * diag_l2_data passed to us
 										 */
+#define DIAG_IOCTL_SET_EXPECT	0x2024	/* Set the expected responders, data = (const struct diag_l2_expect *).
+										 * Handled by L2 only, see diag_l2.h
+										 */
 #define DIAG_IOCTL_SETSPEED	0x2101	/* Set speed, bits etc. data = (const struct diag_serial_settings *); ret 0 if ok
 									 * Ignored if DIAG_L1_AUTOSPEED or DIAG_L1_NOTTY is set */
 #define DIAG_IOCTL_INITBUS	0x2201	/* Initialise the ecu bus, data = (struct diag_l1_initbus_args *)
@@ -144,6 +155,41 @@ typedef uint16_t flag_type;	//this is used for L2 type flags (see diag_l2.h)
  */
 #define DIAG_IOCTL_SETWM 0x2203
 
+/** Get the arrival time of the frame last returned by L0 recv().
+ * Only for L0s that timestamp frames on reception (SocketCAN).
+ *
+ * data = (unsigned long long *), set to microseconds on the diag_os_gethrt() timebase,
+ * i.e. comparable to diag_os_hrtus(diag_os_gethrt()) and to diag_os_getms() * 1000.
+ * ret 0 if ok.
+ */
+#define DIAG_IOCTL_GETRXTIME 0x2204
+
+/** Kernel ISO 15765-2 channels, for CAN L0s that can leave segmentation,
+ * flow control and STmin timing to the OS (SocketCAN with CAN_ISOTP).
+ * A channel is one (tx ID, rx ID) pair; messages go through it whole.
+ * L0s without this return DIAG_ERR_IOCTL_NOTSUPP. See struct diag_isotp_chan
+ * and struct diag_isotp_xfer in diag_l1.h.
+ *
+ * DIAG_IOCTL_ISOTP_OPEN : data = (struct diag_isotp_chan *), ->handle is set. ret 0 if ok
+ * DIAG_IOCTL_ISOTP_CLOSE : data = (struct diag_isotp_chan *)
+ * DIAG_IOCTL_ISOTP_SEND : data = (struct diag_isotp_xfer *). Returns once
+ *	the message is on the bus; ret 0 if ok
+ * DIAG_IOCTL_ISOTP_RECV : data = (struct diag_isotp_xfer *). Wait up to ->timeout
+ *	for a complete message on any open channel, and set ->handle and ->len;
+ *	ret 0 if ok, DIAG_ERR_TIMEOUT if there was none.
+ */
+#define DIAG_IOCTL_ISOTP_OPEN	0x2205
+#define DIAG_IOCTL_ISOTP_CLOSE	0x2206
+#define DIAG_IOCTL_ISOTP_SEND	0x2207
+#define DIAG_IOCTL_ISOTP_RECV	0x2208
+
+/*
+ * DIAG_IOCTL_CAN_RXEFF : CAN L0s, receive every 29-bit frame and drop 11-bit
+ *	ones as early as possible (J1939 monitoring). No data. ret 0 if ok;
+ *	L0s that can't filter return DIAG_ERR_IOCTL_NOTSUPP, L2 then drops them.
+ */
+#define DIAG_IOCTL_CAN_RXEFF	0x2209
+
 /****** debug control ******/
 // flag containers : diag_l0_debug, diag_l1_debug diag_l2_debug, diag_l3_debug, diag_cli_debug
 
@@ -193,6 +239,9 @@ struct diag_msg {
 //	#define	DIAG_FMT_DATAONLY	0x04	/* Rcvd data had L2/L3 headers removed XXX ALWAYS ! */
 	#define DIAG_FMT_CKSUMMED	0x08	/* Someone (L1/L2) checked the checksum */
 	#define DIAG_FMT_BADCS	0x10		// message has bad checksum
+	#define DIAG_FMT_ISO_PHYSADDR	0x20	/* Tx : physical addressing to msg->dest for this message only, even
+						 * on a functionally addressed connection. See DIAG_L2_FLAG_PHYSADDR */
+	#define DIAG_FMT_ISO_TESTER	0x40	/* Rx, monitor mode : frame was sent by a tester, not an ECU */
 
 	uint8_t	type;		/* Type from received frame */
 	uint8_t	dest;		/* Destination from received frame */
@@ -37,6 +37,7 @@
 #include "diag_dtc.h"
 #include "diag_l1.h"
 #include "diag_l2.h"
+#include "diag_l3.h"
 
 #include "utlist.h"
 
@@ -61,6 +62,9 @@ int diag_init(void) {	//returns 0 if normal exit
 	if ((rv = diag_l2_init())) {
 		return diag_iseterr(rv);
 	}
+	if ((rv = diag_l3_init())) {
+		return diag_iseterr(rv);
+	}
 	if ((rv = diag_os_init())) {
 		return diag_iseterr(rv);
 	}
@@ -79,6 +83,10 @@ int diag_end(void) {
 		return 0;
 	}
 
+	if (diag_l3_end()) {
+		fprintf(stderr, FLFMT "Could not close L3 level\n", FL);
+		rv=-1;
+	}
 	if (diag_l2_end()) {
 		fprintf(stderr, FLFMT "Could not close L2 level\n", FL);
 		rv=-1;
@@ -270,7 +278,8 @@ void smartcat(char *p1, const size_t s1, const char *p2 ) {
  * "diag_seterr" returns NULL so you can call it from a function
  * that returns a NULL pointer on error.
  */
-static int latchedCode;
+//one latched code per thread : each thread (adapter session) has its own error state
+static DIAG_TLS int latchedCode;
 
 static const struct {
 	const int code;
@@ -305,7 +314,7 @@ static const struct {
 const char *
 diag_errlookup(const int code) {
 	unsigned i;
-	static char ill_str[ERR_STR_LEN];
+	static DIAG_TLS char ill_str[ERR_STR_LEN];
 	for (i = 0; i < ARRAY_SIZE(edesc); i++) {
 		if (edesc[i].code == code) {
 			return edesc[i].desc;
@@ -434,7 +443,8 @@ diag_printmsg_header(FILE *fp, struct diag_msg *msg, bool timestamp, int msgnum)
 		fprintf(fp, "%lu.%03lu: ", msg->rxtime / 1000,
 			msg->rxtime % 1000);
 	}
-	fprintf(fp, "msg %02d src=0x%02X dest=0x%02X\n", msgnum, msg->src, msg->dest);
+	fprintf(fp, "msg %02d src=0x%02X dest=0x%02X%s\n", msgnum, msg->src, msg->dest,
+		(msg->fmt & DIAG_FMT_ISO_TESTER) ? " (tester)" : "");
 	fprintf(fp, "msg %02d data: ", msgnum);
 }
 
@@ -150,6 +150,19 @@ extern "C" {
 /* FA-FE	system supplier specific */
 /* FF		reserved by document */
 
+/* AccessTimingParameters (SID 0x83) timingParameterIdentifiers */
+#define DIAG_KW2K_ATP_RDLIM	0x00	/* read limits of possible timing parameters */
+#define DIAG_KW2K_ATP_SETDEF	0x01	/* set timing parameters to default values */
+#define DIAG_KW2K_ATP_RDCUR	0x02	/* read currently active timing parameters */
+#define DIAG_KW2K_ATP_SETVAL	0x03	/* set timing parameters to given values */
+
+/* AccessTimingParameters value resolution, in us per bit */
+#define DIAG_KW2K_ATP_RES_P2MIN	500
+#define DIAG_KW2K_ATP_RES_P2MAX	25000	/* (values <= 0xF0 only) */
+#define DIAG_KW2K_ATP_RES_P3MIN	500
+#define DIAG_KW2K_ATP_RES_P3MAX	250000
+#define DIAG_KW2K_ATP_RES_P4MIN	500
+
 /* Exports */
 char *diag_l3_iso14230_decode_response(struct diag_msg *, char *, const size_t);
 
@@ -0,0 +1,689 @@
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * Diag, Layer 0, CAN log replay
+ *
+ *	Plays back a recorded CAN bus into the stack, to test or benchmark
+ *	the CAN L2s and everything above them without a vehicle. Two log
+ *	formats are understood, recognized line by line :
+ *	- candump -l (can-utils) : "(1436509052.249713) can0 7E8#0641001F"
+ *	- Vector ASC : "   0.012345 1  7E8             Rx   d 8 06 41 00 ..."
+ *	("base hex|dec" and "timestamps absolute|relative" headers are honored)
+ *	Remote, error and CAN FD frames are skipped.
+ *
+ *	The file is mmap()ed and parsed one line per frame as recv() asks for
+ *	it, so even huge logs start immediately and are never loaded whole.
+ *	With "realtime", frames come out with the original spacing; without,
+ *	as fast as L2 reads them. "loop" starts over at the end of the file.
+ *	Frames sent by L2 are dropped : nothing on a log answers.
+ *	Frames delivered, skipped and the rate achieved are shown at the end
+ *	of the file (or at close).
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "diag.h"
+#include "diag_err.h"
+#include "diag_os.h"
+#include "diag_l0.h"
+#include "diag_l1.h"
+
+
+extern const struct diag_l0 diag_l0_canreplay;
+
+#define CR_FRAMELEN	(DIAG_L1_CAN_HDRLEN + DIAG_L1_CAN_MAXDLC)
+
+#define CR_FILE_DEF	"candump.log"
+#define CR_FILE_SN	"replayfile"
+#define CR_FILE_DESCR	"CAN log to replay (candump -l or Vector ASC)"
+#define CR_RT_SN	"realtime"
+#define CR_RT_DESCR	"Replay with the original timing (else as fast as possible)"
+#define CR_LOOP_SN	"loop"
+#define CR_LOOP_DESCR	"Start over at the end of the file"
+
+/* line parser results */
+#define CR_FRAME	0	/* frame is pending */
+#define CR_SKIP	1	/* frame we don't pass on (remote, error, CAN FD, filtered, garbled) */
+#define CR_OTHER	2	/* header, event, comment */
+
+struct cr_device {
+	const char *map;	/* whole file, NULL if not open */
+	size_t maplen;
+	const char *p;	/* next line to parse */
+
+	/* ASC headers */
+	bool asc_dec;	/* "base dec" */
+	bool asc_rel;	/* "timestamps relative" */
+	unsigned long long asc_tprev;
+
+	/* next frame, parsed but not returned yet */
+	bool pending;
+	uint8_t frame[CR_FRAMELEN];
+	unsigned int framelen;
+	unsigned long long ftime;	/* us, file timebase */
+
+	/* realtime : frame at file time ffirst is due at tbase (us, diag_os_gethrt() timebase) */
+	bool started;
+	unsigned long long ffirst, flast;
+	unsigned long long tbase;
+
+	bool rxeff;	/* DIAG_IOCTL_CAN_RXEFF : skip 11-bit frames */
+	unsigned long long lastrx;
+
+	/* stats */
+	unsigned long frames;
+	unsigned long skipped;
+	unsigned long long tfirst;	/* first frame delivered */
+	bool reported;
+
+	struct cfgi file;
+	struct cfgi realtime;
+	struct cfgi loop;
+};
+
+static void cr_close(struct diag_l0_device *dl0d);
+
+
+static int
+cr_init(void) {
+	return 0;
+}
+
+static int
+cr_new(struct diag_l0_device *dl0d) {
+	struct cr_device *dev;
+	int rv;
+
+	assert(dl0d);
+
+	rv = diag_calloc(&dev, 1);
+	if (rv != 0) {
+		return diag_iseterr(rv);
+	}
+	dl0d->l0_int = dev;
+
+	rv = diag_cfgn_str(&dev->file, CR_FILE_DEF, CR_FILE_DESCR, CR_FILE_SN);
+	if (rv != 0) {
+		free(dev);
+		return diag_iseterr(rv);
+	}
+	rv = diag_cfgn_bool(&dev->realtime, 1, 1);
+	if (rv == 0) {
+		rv = diag_cfgn_bool(&dev->loop, 0, 0);
+	}
+	if (rv != 0) {
+		diag_cfg_clear(&dev->file);
+		diag_cfg_clear(&dev->realtime);
+		free(dev);
+		return diag_iseterr(rv);
+	}
+	dev->realtime.descr = CR_RT_DESCR;
+	dev->realtime.shortname = CR_RT_SN;
+	dev->loop.descr = CR_LOOP_DESCR;
+	dev->loop.shortname = CR_LOOP_SN;
+
+	dev->file.next = &dev->realtime;
+	dev->realtime.next = &dev->loop;
+	dev->loop.next = NULL;
+
+	return 0;
+}
+
+static void
+cr_del(struct diag_l0_device *dl0d) {
+	struct cr_device *dev;
+
+	assert(dl0d);
+
+	dev = dl0d->l0_int;
+	if (!dev) {
+		return;
+	}
+
+	diag_cfg_clear(&dev->file);
+	diag_cfg_clear(&dev->realtime);
+	diag_cfg_clear(&dev->loop);
+	free(dev);
+	return;
+}
+
+static struct cfgi *
+cr_getcfg(struct diag_l0_device *dl0d) {
+	struct cr_device *dev;
+	if (dl0d == NULL) {
+		return diag_pseterr(DIAG_ERR_BADCFG);
+	}
+
+	dev = dl0d->l0_int;
+	return &dev->file;
+}
+
+/* Frames delivered and rate, once per open */
+static void
+cr_report(struct cr_device *dev) {
+	unsigned long long elapsed;
+
+	if (dev->reported || (dev->frames == 0)) {
+		return;
+	}
+	dev->reported = 1;
+	elapsed = diag_os_hrtus(diag_os_gethrt()) - dev->tfirst;
+	fprintf(stderr, "CAN replay : %lu frames (%lu skipped) in %llu ms, %llu frames/s\n",
+		dev->frames, dev->skipped, elapsed / 1000,
+		elapsed ? (dev->frames * 1000000ULL / elapsed) : 0);
+	return;
+}
+
+static void
+cr_close(struct diag_l0_device *dl0d) {
+	if (!dl0d) {
+		return;
+	}
+
+	struct cr_device *dev = dl0d->l0_int;
+
+	if (diag_l0_debug & DIAG_DEBUG_CLOSE) {
+		fprintf(stderr, FLFMT "link %p closing\n", FL, (void *)dl0d);
+	}
+
+	cr_report(dev);
+	if (dev->map) {
+		munmap((void *)dev->map, dev->maplen);
+	}
+	dev->map = NULL;
+	dev->pending = 0;
+	dev->rxeff = 0;
+	dl0d->opened = 0;
+	return;
+}
+
+static void
+cr_rewind(struct cr_device *dev) {
+	dev->p = dev->map;
+	dev->asc_dec = 0;
+	dev->asc_rel = 0;
+	dev->asc_tprev = 0;
+	dev->pending = 0;
+	return;
+}
+
+static int
+cr_open(struct diag_l0_device *dl0d, int iProtocol) {
+	struct cr_device *dev = dl0d->l0_int;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (iProtocol != DIAG_L1_CAN) {
+		fprintf(stderr, FLFMT "open: only CAN is supported\n", FL);
+		return diag_iseterr(DIAG_ERR_PROTO_NOTSUPP);
+	}
+
+	fd = open(dev->file.val.str, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, FLFMT "open: can't open \"%s\": %s\n",
+			FL, dev->file.val.str, strerror(errno));
+		return diag_iseterr(DIAG_ERR_BADIFADAPTER);
+	}
+	if ((fstat(fd, &st) < 0) || (st.st_size == 0)) {
+		fprintf(stderr, FLFMT "open: \"%s\" is empty\n", FL, dev->file.val.str);
+		close(fd);
+		return diag_iseterr(DIAG_ERR_BADIFADAPTER);
+	}
+	map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, FLFMT "open: can't map \"%s\": %s\n",
+			FL, dev->file.val.str, strerror(errno));
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	/* only a hint : read-ahead, and pages can go once used */
+	(void) posix_madvise(map, (size_t) st.st_size, POSIX_MADV_SEQUENTIAL);
+
+	dev->map = map;
+	dev->maplen = (size_t) st.st_size;
+	cr_rewind(dev);
+	dev->started = 0;
+	dev->lastrx = 0;
+	dev->frames = 0;
+	dev->skipped = 0;
+	dev->reported = 0;
+
+	if (diag_l0_debug & DIAG_DEBUG_OPEN) {
+		fprintf(stderr, FLFMT "link %p replaying %s (%llu bytes)%s%s\n", FL,
+			(void *)dl0d, dev->file.val.str, (unsigned long long) dev->maplen,
+			dev->realtime.val.b ? ", realtime" : "", dev->loop.val.b ? ", loop" : "");
+	}
+
+	dl0d->opened = 1;
+	return 0;
+}
+
+/*
+ * Line parsing helpers. Lines aren't 0-terminated : everything stops at
+ * "end", the end of the line.
+ */
+static const char *
+cr_skipws(const char *p, const char *end) {
+	while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == '\r'))) {
+		p++;
+	}
+	return p;
+}
+
+static int
+cr_digit(char c, bool hex) {
+	if ((c >= '0') && (c <= '9')) {
+		return c - '0';
+	}
+	if (!hex) {
+		return -1;
+	}
+	if ((c >= 'A') && (c <= 'F')) {
+		return c - 'A' + 10;
+	}
+	if ((c >= 'a') && (c <= 'f')) {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+/* Unsigned number, at most maxdigits. ret number of digits */
+static unsigned int
+cr_num(const char **pp, const char *end, bool hex, unsigned int maxdigits, uint32_t *val) {
+	const char *p = *pp;
+	unsigned int n = 0;
+	int d;
+
+	*val = 0;
+	while ((p < end) && (n < maxdigits) && ((d = cr_digit(*p, hex)) >= 0)) {
+		*val = *val * (hex ? 16 : 10) + (uint32_t) d;
+		p++;
+		n++;
+	}
+	*pp = p;
+	return n;
+}
+
+/* "<sec>.<fraction>" -> us, without going through a double. ret 0 if ok */
+static int
+cr_time(const char **pp, const char *end, unsigned long long *us) {
+	const char *p = *pp;
+	unsigned long long sec = 0, frac = 0;
+	unsigned int n = 0, nfrac = 0;
+
+	while ((p < end) && (*p >= '0') && (*p <= '9')) {
+		sec = sec * 10 + (unsigned long long) (*p - '0');
+		p++;
+		n++;
+	}
+	if ((n == 0) || (p >= end) || (*p != '.')) {
+		return -1;
+	}
+	p++;
+	while ((p < end) && (*p >= '0') && (*p <= '9')) {
+		if (nfrac < 6) {
+			frac = frac * 10 + (unsigned long long) (*p - '0');
+			nfrac++;
+		}
+		p++;
+	}
+	while (nfrac < 6) {
+		frac *= 10;
+		nfrac++;
+	}
+	*us = sec * 1000000ULL + frac;
+	*pp = p;
+	return 0;
+}
+
+static bool
+cr_word(const char *p, const char *end, const char *word) {
+	size_t len = strlen(word);
+
+	return ((size_t) (end - p) >= len) && (memcmp(p, word, len) == 0);
+}
+
+/* Store a frame in the DIAG_L1_CAN format */
+static int
+cr_setframe(struct cr_device *dev, uint32_t id, const uint8_t *data, unsigned int dlc) {
+	if (dev->rxeff && !(id & DIAG_L1_CAN_EFF)) {
+		return CR_SKIP;
+	}
+	dev->frame[0] = (uint8_t) (id >> 24);
+	dev->frame[1] = (uint8_t) (id >> 16);
+	dev->frame[2] = (uint8_t) (id >> 8);
+	dev->frame[3] = (uint8_t) id;
+	dev->frame[4] = (uint8_t) dlc;
+	memcpy(&dev->frame[DIAG_L1_CAN_HDRLEN], data, dlc);
+	dev->framelen = DIAG_L1_CAN_HDRLEN + dlc;
+	return CR_FRAME;
+}
+
+/* "(<time>) <if> <id>#<data>" */
+static int
+cr_candump(struct cr_device *dev, const char *p, const char *end) {
+	uint8_t data[DIAG_L1_CAN_MAXDLC];
+	unsigned int n, dlc;
+	uint32_t id, v;
+
+	p++;	/* '(' */
+	if (cr_time(&p, end, &dev->ftime) || (p >= end) || (*p != ')')) {
+		return CR_SKIP;
+	}
+	p = cr_skipws(p + 1, end);
+	while ((p < end) && (*p != ' ') && (*p != '\t')) {
+		p++;	/* interface name */
+	}
+	p = cr_skipws(p, end);
+
+	n = cr_num(&p, end, 1, 8, &id);
+	if ((p >= end) || (*p != '#')) {
+		return CR_SKIP;
+	}
+	if ((n == 3) && (id <= 0x7FF)) {
+		/* 11-bit */
+	} else if ((n == 8) && !(id & 0xE0000000)) {
+		/* bit 29 (CAN_ERR_FLAG) : error frame */
+		id |= DIAG_L1_CAN_EFF;
+	} else {
+		return CR_SKIP;
+	}
+	p++;
+	if ((p < end) && ((*p == '#') || (*p == 'R') || (*p == 'r'))) {
+		/* CAN FD, remote */
+		return CR_SKIP;
+	}
+
+	for (dlc = 0; (p < end) && (cr_digit(*p, 1) >= 0); dlc++) {
+		if ((dlc == DIAG_L1_CAN_MAXDLC) || (cr_num(&p, end, 1, 2, &v) != 2)) {
+			return CR_SKIP;
+		}
+		data[dlc] = (uint8_t) v;
+	}
+	return cr_setframe(dev, id, data, dlc);
+}
+
+/* ASC header, or "<time> <channel> <id>[x] <dir> d <dlc> <data...>" */
+static int
+cr_asc(struct cr_device *dev, const char *p, const char *end) {
+	uint8_t data[DIAG_L1_CAN_MAXDLC];
+	unsigned long long t;
+	unsigned int i, dlc;
+	uint32_t id, v;
+
+	if ((*p < '0') || (*p > '9')) {
+		if (cr_word(p, end, "base ")) {
+			p = cr_skipws(p + 5, end);
+			dev->asc_dec = cr_word(p, end, "dec");
+			p += 3;
+			p = cr_skipws(p, end);
+			if (cr_word(p, end, "timestamps ")) {
+				p = cr_skipws(p + 11, end);
+				dev->asc_rel = cr_word(p, end, "relative");
+			}
+		}
+		return CR_OTHER;
+	}
+
+	if (cr_time(&p, end, &t)) {
+		return CR_OTHER;
+	}
+	if (dev->asc_rel) {
+		t += dev->asc_tprev;
+	}
+	dev->asc_tprev = t;
+	dev->ftime = t;
+
+	/* channel number : anything else is an event, or a CAN FD frame */
+	p = cr_skipws(p, end);
+	if ((cr_num(&p, end, 0, 3, &v) == 0) || (p >= end) || ((*p != ' ') && (*p != '\t'))) {
+		return CR_OTHER;
+	}
+	p = cr_skipws(p, end);
+	if (cr_num(&p, end, !dev->asc_dec, dev->asc_dec ? 9 : 8, &id) == 0) {
+		return CR_SKIP;	/* ErrorFrame */
+	}
+	if ((p < end) && ((*p == 'x') || (*p == 'X'))) {
+		id = (id & DIAG_L1_CAN_IDMASK) | DIAG_L1_CAN_EFF;
+		p++;
+	} else if (id > 0x7FF) {
+		return CR_SKIP;
+	}
+	p = cr_skipws(p, end);
+	while ((p < end) && (*p != ' ') && (*p != '\t')) {
+		p++;	/* Rx / Tx */
+	}
+	p = cr_skipws(p, end);
+	if ((p >= end) || (*p != 'd')) {
+		return CR_SKIP;	/* 'r' : remote */
+	}
+	p = cr_skipws(p + 1, end);
+	if ((cr_num(&p, end, 1, 2, &v) == 0) || (v > DIAG_L1_CAN_MAXDLC)) {
+		return CR_SKIP;
+	}
+	dlc = v;
+	for (i = 0; i < dlc; i++) {
+		p = cr_skipws(p, end);
+		if (cr_num(&p, end, !dev->asc_dec, 3, &v) == 0) {
+			return CR_SKIP;
+		}
+		data[i] = (uint8_t) v;
+	}
+	return cr_setframe(dev, id, data, dlc);
+}
+
+/*
+ * Parse lines until the next usable frame, which becomes pending.
+ * ret 0 if ok, DIAG_ERR_TIMEOUT at the end of the file.
+ */
+static int
+cr_next(struct cr_device *dev) {
+	const char *end = dev->map + dev->maplen;
+
+	while (dev->p < end) {
+		const char *eol, *p;
+		int rv;
+
+		eol = memchr(dev->p, '\n', (size_t) (end - dev->p));
+		if (eol == NULL) {
+			eol = end;
+		}
+		p = cr_skipws(dev->p, eol);
+		dev->p = (eol < end) ? eol + 1 : end;
+		if (p == eol) {
+			continue;
+		}
+
+		rv = (*p == '(') ? cr_candump(dev, p, eol) : cr_asc(dev, p, eol);
+		if (rv == CR_FRAME) {
+			dev->pending = 1;
+			return 0;
+		}
+		if (rv == CR_SKIP) {
+			dev->skipped++;
+		}
+	}
+	return DIAG_ERR_TIMEOUT;
+}
+
+static int
+cr_recv(struct diag_l0_device *dl0d,
+		const char *subinterface, void *data, size_t len, unsigned int timeout) {
+	struct cr_device *dev = dl0d->l0_int;
+	unsigned long long now;
+
+	(void) subinterface;
+
+	if (!dev->pending && cr_next(dev)) {
+		if (dev->loop.val.b && dev->frames) {
+			/* next pass starts where this one ended */
+			dev->tbase += dev->flast - dev->ffirst;
+			cr_rewind(dev);
+			if (cr_next(dev) == 0) {
+				dev->ffirst = dev->flast = dev->ftime;
+			}
+		}
+		if (!dev->pending) {
+			/* a quiet bus from now on */
+			cr_report(dev);
+			diag_os_millisleep(timeout);
+			return DIAG_ERR_TIMEOUT;
+		}
+	}
+
+	if (len < dev->framelen) {
+		return diag_iseterr(DIAG_ERR_BADLEN);
+	}
+
+	now = diag_os_hrtus(diag_os_gethrt());
+	if (!dev->started) {
+		dev->ffirst = dev->flast = dev->ftime;
+		dev->tbase = now;
+		dev->started = 1;
+	}
+	if (dev->realtime.val.b) {
+		unsigned long long due;
+
+		/* time going backwards in the log : send right away */
+		due = dev->tbase + ((dev->ftime > dev->ffirst) ? (dev->ftime - dev->ffirst) : 0);
+		if (due > now) {
+			unsigned long long wait = (due - now + 999) / 1000;
+
+			if (wait > timeout) {
+				diag_os_millisleep(timeout);
+				return DIAG_ERR_TIMEOUT;
+			}
+			diag_os_millisleep((unsigned int) wait);
+		}
+		dev->lastrx = due;
+	} else {
+		dev->lastrx = now;
+	}
+	if (dev->ftime > dev->flast) {
+		dev->flast = dev->ftime;
+	}
+
+	memcpy(data, dev->frame, dev->framelen);
+	dev->pending = 0;
+	if (dev->frames == 0) {
+		dev->tfirst = now;
+	}
+	dev->frames++;
+
+	if ((diag_l0_debug & DIAG_DEBUG_READ) && (diag_l0_debug & DIAG_DEBUG_DATA)) {
+		fprintf(stderr, FLFMT "link %p rx ", FL, (void *)dl0d);
+		diag_data_dump(stderr, data, dev->framelen);
+		fprintf(stderr, "\n");
+	}
+
+	return (int) dev->framelen;
+}
+
+/* Nothing on a log listens : frames are dropped */
+static int
+cr_send(struct diag_l0_device *dl0d,
+		const char *subinterface, const void *data, size_t len) {
+	(void) subinterface;
+
+	if (len == 0) {
+		return diag_iseterr(DIAG_ERR_BADLEN);
+	}
+
+	if ((diag_l0_debug & DIAG_DEBUG_WRITE) && (diag_l0_debug & DIAG_DEBUG_DATA)) {
+		fprintf(stderr, FLFMT "link %p tx (dropped) ", FL, (void *)dl0d);
+		diag_data_dump(stderr, data, len);
+		fprintf(stderr, "\n");
+	}
+	return 0;
+}
+
+static uint32_t
+cr_getflags(struct diag_l0_device *dl0d) {
+	uint32_t flags;
+
+	flags = DIAG_L1_DOESL2FRAME | DIAG_L1_DOESL2CKSUM | DIAG_L1_STRIPSL2CKSUM |
+		DIAG_L1_AUTOSPEED | DIAG_L1_NOTTY;
+
+	if (diag_l0_debug & DIAG_DEBUG_PROTO) {
+		fprintf(stderr, FLFMT "getflags link %p flags 0x%X\n",
+			FL, (void *)dl0d, flags);
+	}
+
+	return flags;
+}
+
+static int
+cr_ioctl(struct diag_l0_device *dl0d, unsigned cmd, void *data) {
+	struct cr_device *dev = dl0d->l0_int;
+	int rv = 0;
+
+	switch (cmd) {
+	case DIAG_IOCTL_IFLUSH:
+		/* the log is what's on the bus : don't skip any of it */
+		rv = 0;
+		break;
+	case DIAG_IOCTL_GETRXTIME:
+		if (dev->lastrx == 0) {
+			rv = DIAG_ERR_GENERAL;
+			break;
+		}
+		*(unsigned long long *)data = dev->lastrx;
+		rv = 0;
+		break;
+	case DIAG_IOCTL_CAN_RXEFF:
+		dev->rxeff = 1;
+		if (dev->pending && !(dev->frame[0] & 0x80)) {
+			dev->pending = 0;
+			dev->skipped++;
+		}
+		rv = 0;
+		break;
+	default:
+		rv = DIAG_ERR_IOCTL_NOTSUPP;
+		break;
+	}
+
+	return rv;
+}
+
+const struct diag_l0 diag_l0_canreplay = {
+	"CAN log replay (candump, ASC)",
+	"CANREPLAY",
+	DIAG_L1_CAN,
+	cr_init,
+	cr_new,
+	cr_getcfg,
+	cr_del,
+	cr_open,
+	cr_close,
+	cr_getflags,
+	cr_recv,
+	cr_send,
+	cr_ioctl
+};
@@ -44,7 +44,7 @@
 
 
 #define ELM_BUFSIZE 1000	//fit even max-length iso14230 frames, at 3 ASCII chars per byte.
-#define ELM_SLOWNESS	100	//Add this many ms to read timeouts, because ELMs are sloooow
+#define ELM_DRAIN_TIMEOUT	100	//ms to wait for the rest of an error message
 #define ELM_PURGETIME	400	//Time to wait (ms) for a response to "ATI" command
 
 struct elm_device {
@@ -1029,7 +1029,8 @@ elm_send(struct diag_l0_device *dl0d,
 
 /*
  * Get data (blocking), returns number of bytes read, between 1 and len
-  * ELM returns a string with format "%02X %02X %02X[...]\n" . But it's slow so we add ELM_SLOWNESS ms to the specified timeout.
+  * ELM returns a string with format "%02X %02X %02X[...]\n" . It's slow, but L2 accounts for that :
+  * it pads its timeouts by an offset calibrated on the measured latency, see struct diag_l2_rxcal.
  * We convert this received ascii string to hex before returning.
  * note : "len" is the number of bytes read on the OBD bus, *NOT* the number of ASCII chars received on the serial link !
  * TODO decode possible error strings ! Essential because ELM can reply
@@ -1061,7 +1062,7 @@ elm_recv(struct diag_l0_device *dl0d,
 	}
 
 	t0=diag_os_getms();
-	tf=t0+timeout + ELM_SLOWNESS;	//timeout when tf is reached
+	tf=t0+timeout;	//timeout when tf is reached
 
 	steplen=2;
 	wp=0;
@@ -1072,7 +1073,7 @@ elm_recv(struct diag_l0_device *dl0d,
 	if (diag_l0_debug & DIAG_DEBUG_READ) {
 		fprintf(stderr,
 			FLFMT
-			"Expecting 3*%d bytes from ELM, %u ms timeout(+400)...",
+			"Expecting 3*%d bytes from ELM, %u ms timeout...",
 			FL, (int)len, timeout);
 	}
 
@@ -1136,7 +1137,7 @@ elm_recv(struct diag_l0_device *dl0d,
 				fprintf(stderr, FLFMT "ELM sscanf failed to eat '%s'\n", FL, rxbuf);
 			}
 			/* finish pulling the error message or whatever garbage */
-			rv = diag_tty_read(dev->tty_int, rxbuf+wp, sizeof(rxbuf) - wp, ELM_SLOWNESS);
+			rv = diag_tty_read(dev->tty_int, rxbuf+wp, sizeof(rxbuf) - wp, ELM_DRAIN_TIMEOUT);
 			if (rv >= 0) {
 				rxbuf[wp + rv] = 0x00;
 			}
@@ -252,11 +252,13 @@ void sim_find_responses(struct sim_ecu_response **resp_pp, FILE *fp, const uint8
 	char line_buf[1280+1]; // 255 response bytes * 5 ("0xYY ") + tolerance for a token ("abc1 ") = 1280.
 	int end_responses = 0;
 	int request_found = 0;
-	struct sim_ecu_response *resp_p;
+	struct sim_ecu_response *resp_p = NULL;
+	struct sim_ecu_response *tmp_p;
 
 
 	// walk to the end of the list (last valid item).
-	LL_FOREACH(*resp_pp, resp_p) {
+	LL_FOREACH(*resp_pp, tmp_p) {
+		resp_p = tmp_p;
 		resp_count++;
 	}
 
@@ -700,6 +702,42 @@ sim_initbus(struct diag_l0_device *dl0d, struct diag_l1_initbus_args *in) {
 }
 
 
+// CAN : every frame is a request of its own (frame format in diag_l1.h),
+// and responses may still be pending : the bus is full duplex, so flow
+// control frames go out while an ECU is sending.
+static int
+sim_send_can(struct diag_l0_device *dl0d, const uint8_t *data, size_t len) {
+	struct sim_device *dev = dl0d->l0_int;
+	size_t flen;
+
+	while (len > 0) {
+		if ((len <= DIAG_L1_CAN_HDRLEN) || (data[4] > DIAG_L1_CAN_MAXDLC)) {
+			return diag_iseterr(DIAG_ERR_BADLEN);
+		}
+		flen = DIAG_L1_CAN_HDRLEN + data[4];
+		if (flen > len) {
+			return diag_iseterr(DIAG_ERR_BADLEN);
+		}
+		if (diag_l0_debug & DIAG_DEBUG_WRITE) {
+			fprintf(stderr, FLFMT "dl0d=%p sending CAN frame, %u bytes\n", FL, (void *)dl0d, (unsigned int)flen);
+			if (diag_l0_debug & DIAG_DEBUG_DATA) {
+				fprintf(stderr, FLFMT "L0 sim sending: ", FL);
+				diag_data_dump(stderr, data, flen);
+				fprintf(stderr, "\n");
+			}
+		}
+		memcpy(dev->sim_last_ecu_request, data, flen);
+		sim_find_responses(&dev->sim_last_ecu_responses, dev->fp, data, (uint8_t) flen);
+		data += flen;
+		len -= flen;
+	}
+
+	if (diag_l0_debug & DIAG_DEBUG_DATA) {
+		sim_dump_ecu_responses(dev->sim_last_ecu_responses);
+	}
+	return 0;
+}
+
 // Simulates the send of a request.
 // Returns 0 on success, -1 on failure.
 // Should be called with the full message to send, because
@@ -715,6 +753,10 @@ sim_send(struct diag_l0_device *dl0d,
 		return diag_iseterr(DIAG_ERR_BADLEN);
 	}
 
+	if (dev->protocol == DIAG_L1_CAN) {
+		return sim_send_can(dl0d, data, len);
+	}
+
 	if (len > 255) {
 		fprintf(stderr, FLFMT "Error : calling sim_send with len >255 bytes! (%u)\n", FL, (unsigned int) len);
 		return diag_iseterr(DIAG_ERR_GENERAL);
@@ -870,7 +912,7 @@ static int sim_ioctl(struct diag_l0_device *dl0d, unsigned cmd, void *data) {
 const struct diag_l0 diag_l0_sim = {
 	"Car Simulator interface",
 	"CARSIM",
-	DIAG_L1_J1850_VPW | DIAG_L1_J1850_PWM | DIAG_L1_ISO9141 | DIAG_L1_ISO14230 | DIAG_L1_RAW,
+	DIAG_L1_J1850_VPW | DIAG_L1_J1850_PWM | DIAG_L1_ISO9141 | DIAG_L1_ISO14230 | DIAG_L1_CAN | DIAG_L1_RAW,
 	sim_init,
 	sim_new,
 	sim_getcfg,
@@ -0,0 +1,854 @@
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * Diag, Layer 0, Linux SocketCAN interface (CAN_RAW)
+ *
+ *	Any CAN adapter with a kernel driver (can0, slcan0, ...) or a virtual
+ *	bus (vcan0). The interface must already be up and its bitrate set,
+ *	e.g. "ip link set can0 up type can bitrate 500000".
+ *
+ *	Frames are exchanged with L2 in the DIAG_L1_CAN format (see diag_l1.h).
+ *	- by default a kernel filter only lets the OBD response IDs through
+ *	(0x7E8-0x7EF, 0x18DAF100-0x18DAF1FF), so other bus traffic never
+ *	wakes us up; J1939 (DIAG_IOCTL_CAN_RXEFF) gets all 29-bit frames instead;
+ *	- recv() drains up to SC_BATCH frames per system call, and send()
+ *	pushes all the frames it was given with one sendmmsg();
+ *	- every frame is timestamped by the kernel on arrival (SO_TIMESTAMPNS);
+ *	the timestamp of the last frame returned by recv() is available with
+ *	DIAG_IOCTL_GETRXTIME.
+ *
+ *	If the kernel has CAN_ISOTP, L2 can also open ISO 15765-2 channels
+ *	(DIAG_IOCTL_ISOTP_*) : one CAN_ISOTP socket per (tx ID, rx ID) pair,
+ *	with segmentation, flow control and STmin left to the kernel. While
+ *	channels are open the CAN_RAW socket receives nothing, so frames
+ *	aren't queued twice; sending raw frames still works.
+ */
+
+#define _GNU_SOURCE	/* recvmmsg, sendmmsg */
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <poll.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "diag.h"
+#include "diag_err.h"
+#include "diag_os.h"
+#include "diag_l0.h"
+#include "diag_l1.h"
+
+#ifdef HAVE_LINUX_CAN_ISOTP_H	/* from cconf.h */
+#include <linux/can/isotp.h>
+#endif
+
+
+extern const struct diag_l0 diag_l0_socketcan;
+
+#define SC_BATCH	32	/* max frames per recvmmsg() / sendmmsg() */
+#define SC_TXWAIT	100	/* ms to wait for room in the tx queue */
+#define SC_MAXISOTP	8	/* kernel ISO-TP channels */
+
+#define SC_IF_DEF	"vcan0"
+#define SC_IF_SN	"canif"
+#define SC_IF_DESCR	"CAN network interface"
+#define SC_FILT_SN	"obdfilter"
+#define SC_FILT_DESCR	"Only receive OBD response IDs (7E8-7EF, 18DAF1xx)"
+
+struct sc_device {
+	int protocol;
+	int fd;
+
+	/* frames received by the last recvmmsg(), not returned yet */
+	struct can_frame rxq[SC_BATCH];
+	unsigned long long rxts[SC_BATCH];	/* arrival time (us), diag_os_gethrt() timebase */
+	unsigned int rxn;	/* frames in rxq */
+	unsigned int rxi;	/* next frame to return */
+
+	unsigned long long lastrx;	/* arrival time of the frame last returned by recv() */
+
+	int ifindex;
+	int isotp[SC_MAXISOTP];	/* CAN_ISOTP sockets, -1 : unused */
+	unsigned int nisotp;	/* sockets in use */
+	unsigned int isotp_next;	/* where DIAG_IOCTL_ISOTP_RECV looks first */
+	bool rxeff;	/* DIAG_IOCTL_CAN_RXEFF : all 29-bit frames, no 11-bit */
+
+	struct cfgi ifname;
+	struct cfgi obdfilt;
+};
+
+static void sc_close(struct diag_l0_device *dl0d);
+
+
+/*
+ * Init must be callable even if no physical interface is
+ * present, it's just here for the code to initialise its
+ * variables, etc.
+ */
+static int
+sc_init(void) {
+	return 0;
+}
+
+static int
+sc_new(struct diag_l0_device *dl0d) {
+	struct sc_device *dev;
+	unsigned int i;
+	int rv;
+
+	assert(dl0d);
+
+	rv = diag_calloc(&dev, 1);
+	if (rv != 0) {
+		return diag_iseterr(rv);
+	}
+
+	dev->fd = -1;
+	for (i = 0; i < SC_MAXISOTP; i++) {
+		dev->isotp[i] = -1;
+	}
+	dl0d->l0_int = dev;
+
+	rv = diag_cfgn_str(&dev->ifname, SC_IF_DEF, SC_IF_DESCR, SC_IF_SN);
+	if (rv != 0) {
+		free(dev);
+		return diag_iseterr(rv);
+	}
+
+	rv = diag_cfgn_bool(&dev->obdfilt, 1, 1);
+	if (rv != 0) {
+		diag_cfg_clear(&dev->ifname);
+		free(dev);
+		return diag_iseterr(rv);
+	}
+	dev->obdfilt.descr = SC_FILT_DESCR;
+	dev->obdfilt.shortname = SC_FILT_SN;
+
+	dev->ifname.next = &dev->obdfilt;
+	dev->obdfilt.next = NULL;
+
+	return 0;
+}
+
+static void sc_del(struct diag_l0_device *dl0d) {
+	struct sc_device *dev;
+
+	assert(dl0d);
+
+	dev = dl0d->l0_int;
+	if (!dev) {
+		return;
+	}
+
+	diag_cfg_clear(&dev->ifname);
+	diag_cfg_clear(&dev->obdfilt);
+	free(dev);
+	return;
+}
+
+static struct cfgi *sc_getcfg(struct diag_l0_device *dl0d) {
+	struct sc_device *dev;
+	if (dl0d == NULL) {
+		return diag_pseterr(DIAG_ERR_BADCFG);
+	}
+
+	dev = dl0d->l0_int;
+	return &dev->ifname;
+}
+
+static void
+sc_close(struct diag_l0_device *dl0d) {
+	if (!dl0d) {
+		return;
+	}
+
+	struct sc_device *dev = dl0d->l0_int;
+	unsigned int i;
+
+	if (diag_l0_debug & DIAG_DEBUG_CLOSE) {
+		fprintf(stderr, FLFMT "link %p closing\n", FL, (void *)dl0d);
+	}
+
+	for (i = 0; i < SC_MAXISOTP; i++) {
+		if (dev->isotp[i] >= 0) {
+			close(dev->isotp[i]);
+			dev->isotp[i] = -1;
+		}
+	}
+	dev->nisotp = 0;
+	dev->rxeff = 0;
+
+	if (dev->fd >= 0) {
+		close(dev->fd);
+	}
+	dev->fd = -1;
+	dev->rxn = dev->rxi = 0;
+	dl0d->opened = 0;
+
+	return;
+}
+
+/*
+ * Set the CAN_RAW receive filter : nothing while kernel ISO-TP channels are
+ * open, else the OBD response IDs or everything according to the config.
+ * ret 0 if ok
+ */
+static int
+sc_setfilter(struct sc_device *dev) {
+	/* 11-bit 7E8-7EF and 29-bit 18DAF1xx : responses to the tester */
+	static const struct can_filter obd_rx[] = {
+		{ 0x7E8, CAN_EFF_FLAG | CAN_RTR_FLAG | 0x7F8 },
+		{ CAN_EFF_FLAG | 0x18DAF100, CAN_EFF_FLAG | CAN_RTR_FLAG | 0x1FFFFF00 }
+	};
+	static const struct can_filter all_rx = { 0, 0 };
+	static const struct can_filter eff_rx = { CAN_EFF_FLAG, CAN_EFF_FLAG | CAN_RTR_FLAG };
+	int rv;
+
+	if (dev->nisotp) {
+		rv = setsockopt(dev->fd, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0);
+	} else if (dev->rxeff) {
+		rv = setsockopt(dev->fd, SOL_CAN_RAW, CAN_RAW_FILTER,
+				&eff_rx, sizeof(eff_rx));
+	} else if (dev->obdfilt.val.b) {
+		rv = setsockopt(dev->fd, SOL_CAN_RAW, CAN_RAW_FILTER,
+				obd_rx, sizeof(obd_rx));
+	} else {
+		rv = setsockopt(dev->fd, SOL_CAN_RAW, CAN_RAW_FILTER,
+				&all_rx, sizeof(all_rx));
+	}
+	if (rv < 0) {
+		fprintf(stderr, FLFMT "can't set filter: %s\n", FL, strerror(errno));
+		return DIAG_ERR_GENERAL;
+	}
+	return 0;
+}
+
+/*
+ * Open a CAN_RAW socket on the configured interface.
+ */
+static int sc_open(struct diag_l0_device *dl0d, int iProtocol) {
+	struct sc_device *dev = dl0d->l0_int;
+	struct sockaddr_can addr;
+	struct ifreq ifr;
+	int on = 1;
+
+	if (iProtocol != DIAG_L1_CAN) {
+		fprintf(stderr, FLFMT "open: only CAN is supported\n", FL);
+		return diag_iseterr(DIAG_ERR_PROTO_NOTSUPP);
+	}
+
+	if (strlen(dev->ifname.val.str) >= sizeof(ifr.ifr_name)) {
+		return diag_iseterr(DIAG_ERR_BADCFG);
+	}
+
+	dev->protocol = iProtocol;
+	dev->rxn = dev->rxi = 0;
+	dev->lastrx = 0;
+
+	dev->fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (dev->fd < 0) {
+		fprintf(stderr, FLFMT "open: can't create CAN socket: %s\n",
+			FL, strerror(errno));
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	strcpy(ifr.ifr_name, dev->ifname.val.str);
+	if (ioctl(dev->fd, SIOCGIFINDEX, &ifr) < 0) {
+		fprintf(stderr, FLFMT "open: no CAN interface \"%s\": %s\n",
+			FL, dev->ifname.val.str, strerror(errno));
+		sc_close(dl0d);
+		return diag_iseterr(DIAG_ERR_BADIFADAPTER);
+	}
+
+	dev->ifindex = ifr.ifr_ifindex;
+
+	if (dev->obdfilt.val.b && (sc_setfilter(dev) != 0)) {
+		sc_close(dl0d);
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+
+	/* not fatal : recv() falls back to the time it picked up the frame */
+	if (setsockopt(dev->fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+		fprintf(stderr, FLFMT "open: no kernel timestamps: %s\n",
+			FL, strerror(errno));
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+	if (bind(dev->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, FLFMT "open: can't bind to \"%s\": %s\n",
+			FL, dev->ifname.val.str, strerror(errno));
+		sc_close(dl0d);
+		return diag_iseterr(DIAG_ERR_BADIFADAPTER);
+	}
+
+	if (diag_l0_debug & DIAG_DEBUG_OPEN) {
+		fprintf(stderr, FLFMT "link %p opened %s, ifindex %d%s\n", FL,
+			(void *)dl0d, dev->ifname.val.str, ifr.ifr_ifindex,
+			dev->obdfilt.val.b ? ", OBD filter" : "");
+	}
+
+	dl0d->opened = 1;
+	return 0;
+}
+
+static canid_t
+sc_canid(uint32_t id) {
+	if (id & DIAG_L1_CAN_EFF) {
+		return (id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+	}
+	return id & CAN_SFF_MASK;
+}
+
+/*
+ * Fill the receive queue : wait up to timeout for the first frame,
+ * then take everything that is already queued in the socket.
+ * Returns # of frames received, or <0 if error.
+ */
+static int
+sc_fill(struct sc_device *dev, unsigned int timeout) {
+	struct mmsghdr msgs[SC_BATCH];
+	struct iovec iov[SC_BATCH];
+	/* room for one SCM_TIMESTAMPNS per frame; size_t to get cmsghdr alignment */
+	size_t ctl[SC_BATCH][(CMSG_SPACE(sizeof(struct timespec)) + sizeof(size_t) - 1) / sizeof(size_t)];
+	struct pollfd pfd;
+	struct timespec now_real;
+	unsigned long long now_us;
+	int i, rv;
+
+	pfd.fd = dev->fd;
+	pfd.events = POLLIN;
+	rv = poll(&pfd, 1, (int) timeout);
+	if (rv == 0) {
+		return DIAG_ERR_TIMEOUT;
+	}
+	if (rv < 0) {
+		if (errno == EINTR) {
+			return DIAG_ERR_TIMEOUT;
+		}
+		fprintf(stderr, FLFMT "poll error: %s\n", FL, strerror(errno));
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < SC_BATCH; i++) {
+		iov[i].iov_base = &dev->rxq[i];
+		iov[i].iov_len = sizeof(struct can_frame);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = ctl[i];
+		msgs[i].msg_hdr.msg_controllen = sizeof(ctl[i]);
+	}
+
+	rv = recvmmsg(dev->fd, msgs, SC_BATCH, MSG_DONTWAIT, NULL);
+	if (rv < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+			return DIAG_ERR_TIMEOUT;
+		}
+		fprintf(stderr, FLFMT "recvmmsg error: %s\n", FL, strerror(errno));
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+
+	/* kernel timestamps are CLOCK_REALTIME; move them to our timebase */
+	clock_gettime(CLOCK_REALTIME, &now_real);
+	now_us = diag_os_hrtus(diag_os_gethrt());
+
+	for (i = 0; i < rv; i++) {
+		struct cmsghdr *cmsg;
+		unsigned long long ts = now_us;
+
+		for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL;
+				cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+			struct timespec kts;
+			long long age;
+
+			if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_TIMESTAMPNS)) {
+				continue;
+			}
+			memcpy(&kts, CMSG_DATA(cmsg), sizeof(kts));
+			age = ((long long) now_real.tv_sec - kts.tv_sec) * 1000000LL +
+				(now_real.tv_nsec - kts.tv_nsec) / 1000;
+			if ((age > 0) && ((unsigned long long) age < now_us)) {
+				ts = now_us - (unsigned long long) age;
+			}
+		}
+		dev->rxts[i] = ts;
+	}
+
+	dev->rxn = (unsigned int) rv;
+	dev->rxi = 0;
+	return rv;
+}
+
+/*
+ * Return one frame in the DIAG_L1_CAN format.
+ * Error and RTR frames are dropped here.
+ */
+static int
+sc_recv(struct diag_l0_device *dl0d,
+		const char *subinterface, void *data, size_t len, unsigned int timeout) {
+	struct sc_device *dev = dl0d->l0_int;
+	uint8_t *dp = data;
+	struct can_frame *cf;
+	uint32_t id;
+	unsigned int dlc;
+	int rv;
+
+	(void) subinterface;
+
+	while (1) {
+		if (dev->rxi >= dev->rxn) {
+			rv = sc_fill(dev, timeout);
+			if (rv < 0) {
+				return rv;
+			}
+			continue;
+		}
+		cf = &dev->rxq[dev->rxi];
+		if (!(cf->can_id & (CAN_ERR_FLAG | CAN_RTR_FLAG))) {
+			break;
+		}
+		dev->rxi++;
+	}
+
+	dlc = cf->can_dlc;
+	if (dlc > DIAG_L1_CAN_MAXDLC) {
+		dlc = DIAG_L1_CAN_MAXDLC;
+	}
+	if (len < DIAG_L1_CAN_HDRLEN + dlc) {
+		/* leave it queued, caller may retry with a bigger buffer */
+		return diag_iseterr(DIAG_ERR_BADLEN);
+	}
+
+	if (cf->can_id & CAN_EFF_FLAG) {
+		id = (cf->can_id & CAN_EFF_MASK) | DIAG_L1_CAN_EFF;
+	} else {
+		id = cf->can_id & CAN_SFF_MASK;
+	}
+	dp[0] = (uint8_t) (id >> 24);
+	dp[1] = (uint8_t) (id >> 16);
+	dp[2] = (uint8_t) (id >> 8);
+	dp[3] = (uint8_t) id;
+	dp[4] = (uint8_t) dlc;
+	memcpy(&dp[DIAG_L1_CAN_HDRLEN], cf->data, dlc);
+
+	dev->lastrx = dev->rxts[dev->rxi];
+	dev->rxi++;
+
+	if ((diag_l0_debug & DIAG_DEBUG_READ) && (diag_l0_debug & DIAG_DEBUG_DATA)) {
+		fprintf(stderr, FLFMT "link %p rx ", FL, (void *)dl0d);
+		diag_data_dump(stderr, dp, DIAG_L1_CAN_HDRLEN + dlc);
+		fprintf(stderr, "\n");
+	}
+
+	return (int) (DIAG_L1_CAN_HDRLEN + dlc);
+}
+
+/*
+ * Send one or more frames, back to back in the DIAG_L1_CAN format.
+ * All of them go to the kernel with a single sendmmsg() when the tx queue has room.
+ */
+static int
+sc_send(struct diag_l0_device *dl0d,
+		const char *subinterface, const void *data, size_t len) {
+	struct sc_device *dev = dl0d->l0_int;
+	const uint8_t *dp = data;
+	struct can_frame txq[SC_BATCH];
+	struct mmsghdr msgs[SC_BATCH];
+	struct iovec iov[SC_BATCH];
+	unsigned int n, sent;
+	unsigned long tstall = 0;	/* diag_os_getms() at the first ENOBUFS */
+	bool stalled = 0;
+	int rv;
+
+	(void) subinterface;
+
+	if (len == 0) {
+		return diag_iseterr(DIAG_ERR_BADLEN);
+	}
+
+	if ((diag_l0_debug & DIAG_DEBUG_WRITE) && (diag_l0_debug & DIAG_DEBUG_DATA)) {
+		fprintf(stderr, FLFMT "link %p tx ", FL, (void *)dl0d);
+		diag_data_dump(stderr, data, len);
+		fprintf(stderr, "\n");
+	}
+
+	while (len) {
+		/* unpack as many frames as fit in one batch */
+		for (n = 0; len && (n < SC_BATCH); n++) {
+			uint32_t id;
+			unsigned int dlc;
+
+			if (len < DIAG_L1_CAN_HDRLEN) {
+				return diag_iseterr(DIAG_ERR_BADLEN);
+			}
+			id = ((uint32_t) dp[0] << 24) | ((uint32_t) dp[1] << 16) |
+				((uint32_t) dp[2] << 8) | dp[3];
+			dlc = dp[4];
+			if ((dlc > DIAG_L1_CAN_MAXDLC) || (len < DIAG_L1_CAN_HDRLEN + dlc)) {
+				return diag_iseterr(DIAG_ERR_BADLEN);
+			}
+
+			memset(&txq[n], 0, sizeof(txq[n]));
+			txq[n].can_id = sc_canid(id);
+			txq[n].can_dlc = (uint8_t) dlc;
+			memcpy(txq[n].data, &dp[DIAG_L1_CAN_HDRLEN], dlc);
+
+			memset(&msgs[n], 0, sizeof(msgs[n]));
+			iov[n].iov_base = &txq[n];
+			iov[n].iov_len = sizeof(struct can_frame);
+			msgs[n].msg_hdr.msg_iov = &iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+
+			dp += DIAG_L1_CAN_HDRLEN + dlc;
+			len -= DIAG_L1_CAN_HDRLEN + dlc;
+		}
+
+		/* ENOBUFS : tx queue full; wait until it drains a bit, but give up
+		 * if nothing gets out for SC_TXWAIT ms (bus-off, no ACK...) : POLLOUT
+		 * only covers the socket buffer, not the device queue. */
+		for (sent = 0; sent < n; ) {
+			rv = sendmmsg(dev->fd, &msgs[sent], n - sent, 0);
+			if (rv > 0) {
+				sent += (unsigned int) rv;
+				stalled = 0;
+				continue;
+			}
+			if ((rv < 0) && (errno == EINTR)) {
+				continue;
+			}
+			if ((rv < 0) && ((errno == ENOBUFS) || (errno == EAGAIN))) {
+				struct pollfd pfd;
+				unsigned long now = diag_os_getms();
+
+				if (!stalled) {
+					stalled = 1;
+					tstall = now;
+				} else if ((now - tstall) > SC_TXWAIT) {
+					if (diag_l0_debug & DIAG_DEBUG_WRITE) {
+						fprintf(stderr, FLFMT "link %p tx queue stuck for %lums, "
+							"%u of %u frames sent\n", FL, (void *)dl0d,
+							now - tstall, sent, n);
+					}
+					return diag_iseterr(DIAG_ERR_TIMEOUT);
+				}
+				pfd.fd = dev->fd;
+				pfd.events = POLLOUT;
+				if (poll(&pfd, 1, SC_TXWAIT) > 0) {
+					diag_os_millisleep(1);
+					continue;
+				}
+			}
+			fprintf(stderr, FLFMT "sendmmsg error: %s\n", FL,
+				(rv < 0) ? strerror(errno) : "nothing sent");
+			return diag_iseterr(DIAG_ERR_GENERAL);
+		}
+	}
+
+	return 0;
+}
+
+
+static uint32_t
+sc_getflags(struct diag_l0_device *dl0d) {
+	uint32_t flags;
+
+	/* frames come and go whole, and CAN does its own CRC */
+	flags = DIAG_L1_DOESL2FRAME | DIAG_L1_DOESL2CKSUM | DIAG_L1_STRIPSL2CKSUM |
+		DIAG_L1_AUTOSPEED | DIAG_L1_NOTTY;
+
+	if (diag_l0_debug & DIAG_DEBUG_PROTO) {
+		fprintf(stderr, FLFMT "getflags link %p flags 0x%X\n",
+			FL, (void *)dl0d, flags);
+	}
+
+	return flags;
+}
+
+#ifdef HAVE_LINUX_CAN_ISOTP_H
+
+/* STmin encoding -> ns. Reserved values mean the max, 127 ms */
+static uint32_t
+sc_stmin_ns(uint8_t stmin) {
+	if (stmin <= 0x7F) {
+		return stmin * 1000000UL;
+	}
+	if ((stmin >= 0xF1) && (stmin <= 0xF9)) {
+		return (stmin - 0xF0) * 100000UL;
+	}
+	return 127000000UL;
+}
+
+/* One CAN_ISOTP socket for the channel; ret 0 if ok */
+static int
+sc_isotp_open(struct sc_device *dev, struct diag_isotp_chan *ch) {
+	struct sockaddr_can addr;
+	struct can_isotp_options opts;
+	struct can_isotp_fc_options fc;
+	uint32_t txst;
+	unsigned int i;
+	int fd;
+
+	for (i = 0; i < SC_MAXISOTP; i++) {
+		if (dev->isotp[i] < 0) {
+			break;
+		}
+	}
+	if (i == SC_MAXISOTP) {
+		return DIAG_ERR_GENERAL;
+	}
+
+	fd = socket(PF_CAN, SOCK_DGRAM, CAN_ISOTP);
+	if (fd < 0) {
+		/* no can-isotp module : L2 will do without */
+		if (diag_l0_debug & DIAG_DEBUG_OPEN) {
+			fprintf(stderr, FLFMT "no CAN_ISOTP sockets: %s\n", FL, strerror(errno));
+		}
+		return DIAG_ERR_IOCTL_NOTSUPP;
+	}
+
+	memset(&opts, 0, sizeof(opts));
+	/* have write() wait for the end of the transfer, and report failures */
+	opts.flags = CAN_ISOTP_WAIT_TX_DONE;
+	if (ch->pad) {
+		opts.flags |= CAN_ISOTP_TX_PADDING;
+		opts.txpad_content = ch->padbyte;
+	}
+	if (ch->txstmin) {
+		/* the kernel can only replace the peer's STmin, not add a floor */
+		opts.flags |= CAN_ISOTP_FORCE_TXSTMIN;
+	}
+	fc.bs = ch->rxbs;
+	fc.stmin = ch->rxstmin;
+	fc.wftmax = 0;
+	txst = sc_stmin_ns(ch->txstmin);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = dev->ifindex;
+	addr.can_addr.tp.tx_id = sc_canid(ch->txid);
+	addr.can_addr.tp.rx_id = sc_canid(ch->rxid);
+
+	if ((setsockopt(fd, SOL_CAN_ISOTP, CAN_ISOTP_OPTS, &opts, sizeof(opts)) < 0) ||
+			(setsockopt(fd, SOL_CAN_ISOTP, CAN_ISOTP_RECV_FC, &fc, sizeof(fc)) < 0) ||
+			(ch->txstmin &&
+			(setsockopt(fd, SOL_CAN_ISOTP, CAN_ISOTP_TX_STMIN, &txst, sizeof(txst)) < 0)) ||
+			(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)) {
+		fprintf(stderr, FLFMT "CAN_ISOTP setup failed: %s\n", FL, strerror(errno));
+		close(fd);
+		return DIAG_ERR_IOCTL_NOTSUPP;
+	}
+
+	dev->isotp[i] = fd;
+	dev->nisotp++;
+	if (dev->nisotp == 1) {
+		(void) sc_setfilter(dev);
+		dev->rxn = dev->rxi = 0;
+	}
+	ch->handle = (int) i;
+
+	if (diag_l0_debug & DIAG_DEBUG_OPEN) {
+		fprintf(stderr, FLFMT "ISO-TP channel %u : tx 0x%lX rx 0x%lX\n", FL, i,
+			(unsigned long) (ch->txid & DIAG_L1_CAN_IDMASK),
+			(unsigned long) (ch->rxid & DIAG_L1_CAN_IDMASK));
+	}
+	return 0;
+}
+
+static int
+sc_isotp_close(struct sc_device *dev, const struct diag_isotp_chan *ch) {
+	if ((ch->handle < 0) || (ch->handle >= SC_MAXISOTP) ||
+			(dev->isotp[ch->handle] < 0)) {
+		return DIAG_ERR_BADVAL;
+	}
+	close(dev->isotp[ch->handle]);
+	dev->isotp[ch->handle] = -1;
+	dev->nisotp--;
+	if (dev->nisotp == 0) {
+		(void) sc_setfilter(dev);
+	}
+	return 0;
+}
+
+static int
+sc_isotp_send(struct sc_device *dev, const struct diag_isotp_xfer *x) {
+	ssize_t rv;
+
+	if ((x->handle < 0) || (x->handle >= SC_MAXISOTP) ||
+			(dev->isotp[x->handle] < 0)) {
+		return DIAG_ERR_BADVAL;
+	}
+
+	do {
+		rv = write(dev->isotp[x->handle], x->data, x->len);
+	} while ((rv < 0) && (errno == EINTR));
+
+	if (rv < 0) {
+		fprintf(stderr, FLFMT "ISO-TP send error: %s\n", FL, strerror(errno));
+		if ((errno == ECOMM) || (errno == ETIMEDOUT)) {
+			/* no flow control from the peer */
+			return DIAG_ERR_TIMEOUT;
+		}
+		return (errno == EMSGSIZE)? DIAG_ERR_BADLEN : DIAG_ERR_GENERAL;
+	}
+	return ((size_t) rv == x->len)? 0 : DIAG_ERR_GENERAL;
+}
+
+/*
+ * Wait for a complete message on any channel. Channels are polled
+ * starting after the one that delivered last, so a chatty ECU can't
+ * starve the others.
+ */
+static int
+sc_isotp_recv(struct sc_device *dev, struct diag_isotp_xfer *x) {
+	struct pollfd pfd[SC_MAXISOTP];
+	unsigned int map[SC_MAXISOTP];
+	unsigned long t0, elapsed;
+	unsigned int i, j, n;
+	ssize_t rv;
+
+	t0 = diag_os_getms();
+	while (1) {
+		for (n = 0, j = 0; j < SC_MAXISOTP; j++) {
+			i = (dev->isotp_next + j) % SC_MAXISOTP;
+			if (dev->isotp[i] < 0) {
+				continue;
+			}
+			pfd[n].fd = dev->isotp[i];
+			pfd[n].events = POLLIN;
+			pfd[n].revents = 0;
+			map[n++] = i;
+		}
+		if (n == 0) {
+			return DIAG_ERR_GENERAL;
+		}
+
+		elapsed = diag_os_getms() - t0;
+		if (elapsed > x->timeout) {
+			return DIAG_ERR_TIMEOUT;
+		}
+		rv = poll(pfd, n, (int) (x->timeout - elapsed));
+		if (rv == 0) {
+			return DIAG_ERR_TIMEOUT;
+		}
+		if (rv < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, FLFMT "poll error: %s\n", FL, strerror(errno));
+			return DIAG_ERR_GENERAL;
+		}
+
+		for (j = 0; j < n; j++) {
+			if (!(pfd[j].revents & (POLLIN | POLLERR))) {
+				continue;
+			}
+			i = map[j];
+			rv = read(dev->isotp[i], x->data, x->len);
+			if (rv > 0) {
+				x->handle = (int) i;
+				x->len = (unsigned int) rv;
+				dev->isotp_next = (i + 1) % SC_MAXISOTP;
+				return 0;
+			}
+			/* the kernel dropped a broken transfer (timeout, wrong SN...) */
+			if (diag_l0_debug & DIAG_DEBUG_READ) {
+				fprintf(stderr, FLFMT "ISO-TP channel %u : %s\n", FL, i,
+					(rv < 0)? strerror(errno) : "empty message");
+			}
+		}
+	}
+}
+
+#endif	/* HAVE_LINUX_CAN_ISOTP_H */
+
+
+static int sc_ioctl(struct diag_l0_device *dl0d, unsigned cmd, void *data) {
+	struct sc_device *dev = dl0d->l0_int;
+	int rv = 0;
+
+	switch (cmd) {
+	case DIAG_IOCTL_IFLUSH:
+		/* drop queued frames and anything pending in the socket */
+		dev->rxn = dev->rxi = 0;
+		while (sc_fill(dev, 0) > 0) {}
+		dev->rxn = dev->rxi = 0;
+		rv = 0;
+		break;
+	case DIAG_IOCTL_GETRXTIME:
+		if (dev->lastrx == 0) {
+			rv = DIAG_ERR_GENERAL;
+			break;
+		}
+		*(unsigned long long *)data = dev->lastrx;
+		rv = 0;
+		break;
+	case DIAG_IOCTL_CAN_RXEFF:
+		dev->rxeff = 1;
+		rv = sc_setfilter(dev);
+		break;
+#ifdef HAVE_LINUX_CAN_ISOTP_H
+	case DIAG_IOCTL_ISOTP_OPEN:
+		rv = sc_isotp_open(dev, (struct diag_isotp_chan *)data);
+		break;
+	case DIAG_IOCTL_ISOTP_CLOSE:
+		rv = sc_isotp_close(dev, (const struct diag_isotp_chan *)data);
+		break;
+	case DIAG_IOCTL_ISOTP_SEND:
+		rv = sc_isotp_send(dev, (const struct diag_isotp_xfer *)data);
+		break;
+	case DIAG_IOCTL_ISOTP_RECV:
+		rv = sc_isotp_recv(dev, (struct diag_isotp_xfer *)data);
+		break;
+#endif
+	default:
+		rv = DIAG_ERR_IOCTL_NOTSUPP;
+		break;
+	}
+
+	return rv;
+}
+
+const struct diag_l0 diag_l0_socketcan = {
+	"Linux SocketCAN interface",
+	"SOCKETCAN",
+	DIAG_L1_CAN,
+	sc_init,
+	sc_new,
+	sc_getcfg,
+	sc_del,
+	sc_open,
+	sc_close,
+	sc_getflags,
+	sc_recv,
+	sc_send,
+	sc_ioctl
+};
@@ -147,6 +147,41 @@ extern "C" {
 #define DIAG_L1_RES2 0x40	/* Reserved */
 #define	DIAG_L1_RAW		0x80	/* Raw data interface */
 
+/*
+ * CAN frame format between L2 and L0 (DIAG_L1_CAN) :
+ *	4 bytes	identifier, big-endian; DIAG_L1_CAN_EFF is set for 29-bit IDs
+ *	1 byte	DLC (0 to 8)
+ *	DLC bytes	data
+ * L0 recv() returns exactly one frame per call. send() accepts several
+ * frames back to back; L0 may put them on the bus with a single write.
+ * Frames are not padded : L2 must send DLC 8 if the protocol requires it.
+ */
+#define DIAG_L1_CAN_HDRLEN	5
+#define DIAG_L1_CAN_MAXDLC	8
+#define DIAG_L1_CAN_EFF		0x80000000UL	/* 29-bit (extended) identifier */
+#define DIAG_L1_CAN_IDMASK	0x1FFFFFFFUL
+
+/* Kernel ISO-TP channel, see DIAG_IOCTL_ISOTP_OPEN. IDs as in CAN frames above;
+ * bs / stmin values are the ISO 15765-2 encodings. */
+struct diag_isotp_chan {
+	uint32_t txid;	/* messages and our flow control frames are sent with this ID */
+	uint32_t rxid;	/* messages and the peer's flow control frames arrive with this ID */
+	uint8_t rxbs;	/* block size in our flow control frames; 0 : no limit */
+	uint8_t rxstmin;	/* separation time in our flow control frames */
+	uint8_t txstmin;	/* separation time between our consecutive frames, if more than the peer asks for */
+	bool pad;	/* pad frames to 8 bytes */
+	uint8_t padbyte;
+	int handle;	/* set by L0 */
+};
+
+/* Message through a kernel ISO-TP channel, see DIAG_IOCTL_ISOTP_SEND / _RECV */
+struct diag_isotp_xfer {
+	int handle;	/* send : channel to use. recv : set to the channel the message came from */
+	uint8_t *data;
+	unsigned int len;	/* send : message length. recv : buffer size, then message length */
+	unsigned int timeout;	/* recv only, ms */
+};
+
 /*
  * Number of concurrently supported logical interfaces
  * remember a single physical interface may be many logical interfaces
@@ -50,7 +50,7 @@ int diag_l2_debug;
 
 /* struct to manage L2 stuff, used in here only */
 static struct {
-	diag_mtx *connlist_mtx;            // mutex for accessing dl2conn_list
+	diag_mtx *connlist_mtx;            // mutex for accessing dl2conn_list and dl2l_list
 	struct diag_l2_conn *dl2conn_list; // linked-list of current diag_l2_conn-s
 	struct diag_l2_link *dl2l_list;    // linked-list of current L2-L0 links
 	bool init_done;
@@ -85,27 +85,77 @@ static int diag_l2_rmconn(struct diag_l2_conn *dl2c) {
 
 	diag_os_lock(l2internal.connlist_mtx);
 	LL_DELETE(l2internal.dl2conn_list, dl2c);
+	dl2c->diag_link->nconns--;
 	diag_os_unlock(l2internal.connlist_mtx);
 
 	return 0;
 }
 
 /*
- * Called regularly to check timeouts etc (call at least once per
- * second)
- * Note: This is called from a signal handler.
+ * Whether d_l2_conn needs a keepalive at time "now" (ms) : it would otherwise
+ * reach P3max idle, counting from its last activity (tlast : our last
+ * send/recv/request, tbus : last bytes seen on the bus), so normal traffic
+ * makes them unnecessary.
+ * Caller must hold connlist_mtx or the link's xfer_mtx.
+ */
+static bool
+diag_l2_ka_due(const struct diag_l2_conn *d_l2_conn, unsigned long now) {
+	unsigned long idle, interval;
+
+	/*
+	 * If in monitor mode, or the connection isn't open,
+	 * or L1 does the keepalive, do nothing. L1 only knows
+	 * about the ECU it initialized, not attached connections.
+	 */
+	if (((d_l2_conn->diag_l2_type & DIAG_L2_TYPE_INITMASK) ==DIAG_L2_TYPE_MONINIT) ||
+			(d_l2_conn->diag_l2_state != DIAG_L2_STATE_OPEN) ||
+			((d_l2_conn->diag_link->l1flags & DIAG_L1_DOESKEEPALIVE) &&
+			!d_l2_conn->attached)) {
+		return 0;
+	}
+	if (!d_l2_conn->ka_fn && !d_l2_conn->l2proto->diag_l2_proto_timeout) {
+		return 0;
+	}
+
+	interval = d_l2_conn->tinterval;
+	if (interval == 0) {
+		interval = d_l2_conn->diag_l2_p3max / 2;
+		if (d_l2_conn->diag_l2_p3max < interval + DIAG_L2_KEEPALIVE_MARGIN) {
+			interval = (d_l2_conn->diag_l2_p3max > DIAG_L2_KEEPALIVE_MARGIN) ?
+				d_l2_conn->diag_l2_p3max - DIAG_L2_KEEPALIVE_MARGIN : 0;
+		}
+	}
+
+	//we're subtracting unsigned values but since the clock is
+	//monotonic, the difference will always be >= 0
+	idle = now - d_l2_conn->tlast;
+	if ((now - d_l2_conn->tbus) < idle) {
+		idle = now - d_l2_conn->tbus;
+	}
+	return idle > interval;
+}
+
+/*
+ * Keepalive scheduler, called regularly (every ALARM_TIMEOUT ms) by the
+ * periodic callback. This is the only place keepalives are sent from, for
+ * every layer : upper layers that need their own register it with
+ * diag_l2_set_keepalive().
  *
- * XXX Uses functions not async-signal-safe.
- * This parses through the l2internal.dl2conn_list linked-list and
- * calls the  ->diag_l2_proto_timeout function for every dl2conn
- * that has expired.
+ * Connections that need one (see diag_l2_ka_due()) are picked with
+ * connlist_mtx held, then served with only their link's xfer_mtx held :
+ * on a shared link, the keepalive's response goes through diag_l2_demux(),
+ * which takes connlist_mtx. A connection whose link is busy (xfer_mtx
+ * taken) is skipped : it gets another chance on the next call. A listening
+ * pipe worker holds xfer_mtx nearly all the time, so it also calls this
+ * between receives (see diag_l2_pipe_listen1()).
  *
- * In order for this to work well, all L2
+ * XXX Uses functions not async-signal-safe.
  */
 void
 diag_l2_timer(void) {
-	struct diag_l2_conn	*d_l2_conn;
-
+	struct diag_l2_conn *due[DIAG_L2_KA_MAXDUE];
+	struct diag_l2_conn *d_l2_conn;
+	unsigned int ndue = 0, i;
 	unsigned long now;
 
 	if (!diag_os_trylock(l2internal.connlist_mtx)) {
@@ -115,31 +165,78 @@ diag_l2_timer(void) {
 	now=diag_os_getms();	/* XXX probably Not async safe */
 
 	LL_FOREACH(l2internal.dl2conn_list, d_l2_conn) {
-		int expired = 0;
+		if (ndue == ARRAY_SIZE(due)) {
+			/* the rest on the next call */
+			break;
+		}
+		if (diag_l2_ka_due(d_l2_conn, now)) {
+			due[ndue++] = d_l2_conn;
+		}
+	}
+	diag_os_unlock(l2internal.connlist_mtx);
+
+	for (i = 0; i < ndue; i++) {
+		if (!diag_os_trylock(l2internal.connlist_mtx)) {
+			return;
+		}
+		/* it may have been stopped meanwhile */
+		LL_FOREACH(l2internal.dl2conn_list, d_l2_conn) {
+			if (d_l2_conn == due[i]) {
+				break;
+			}
+		}
+		/* Never in the middle of a request */
+		if ((d_l2_conn == NULL) ||
+				!diag_os_trylock(d_l2_conn->diag_link->xfer_mtx)) {
+			diag_os_unlock(l2internal.connlist_mtx);
+			continue;
+		}
+		diag_os_unlock(l2internal.connlist_mtx);
 
 		/*
-		 * If in monitor mode, or the connection isn't open,
-		 * or L1 does the keepalive, do nothing
+		 * diag_l2_StopCommunications() needs xfer_mtx before closing it,
+		 * so the connection stays valid until we let go. Check again :
+		 * it might have been closed, or used, since we picked it.
 		 */
-		if (((d_l2_conn->diag_l2_type & DIAG_L2_TYPE_INITMASK) ==DIAG_L2_TYPE_MONINIT) ||
-				(d_l2_conn->diag_l2_state != DIAG_L2_STATE_OPEN) ||
-				(d_l2_conn->diag_link->l1flags & DIAG_L1_DOESKEEPALIVE)) {
-			continue;
+		if (diag_l2_ka_due(d_l2_conn, diag_os_getms())) {
+			if (d_l2_conn->ka_fn) {
+				(void) d_l2_conn->ka_fn(d_l2_conn->ka_handle);
+			} else {
+				d_l2_conn->l2proto->diag_l2_proto_timeout(d_l2_conn);
+			}
 		}
+		diag_l2_xfer_end(d_l2_conn);
+	}
+	return;
+}
 
-		/* Check the send timers vs requested expiry time */
+void
+diag_l2_xfer_begin(struct diag_l2_conn *d_l2_conn) {
+	diag_os_lock(d_l2_conn->diag_link->xfer_mtx);
+}
 
-		//we're subtracting unsigned values but since the clock is
-		//monotonic, the difference will always be >= 0
-		expired = ((now - d_l2_conn->tlast) > d_l2_conn->tinterval)? 1:0 ;
+/* Also publishes our bus activity to the other connections on the link */
+void
+diag_l2_xfer_end(struct diag_l2_conn *d_l2_conn) {
+	struct diag_l2_link *dl2l = d_l2_conn->diag_link;
 
-		/* If expired, call the timeout routine */
-		if (expired && d_l2_conn->l2proto->diag_l2_proto_timeout) {
-			d_l2_conn->l2proto->diag_l2_proto_timeout(d_l2_conn);
-		}
+	if ((long) (d_l2_conn->tbus - dl2l->tbus) > 0) {
+		dl2l->tbus = d_l2_conn->tbus;
 	}
+	diag_os_unlock(dl2l->xfer_mtx);
+}
+
+void
+diag_l2_set_keepalive(struct diag_l2_conn *d_l2_conn,
+		int (*fn)(void *handle), void *handle) {
+	/* the timer holds either while it looks at them, and calls
+	 * them with xfer_mtx held : it can't be using the old one */
+	diag_l2_xfer_begin(d_l2_conn);
+	diag_os_lock(l2internal.connlist_mtx);
+	d_l2_conn->ka_fn = fn;
+	d_l2_conn->ka_handle = handle;
 	diag_os_unlock(l2internal.connlist_mtx);
-	return;
+	diag_l2_xfer_end(d_l2_conn);
 }
 
 /*
@@ -152,6 +249,257 @@ diag_l2_addmsg(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg) {
 	return;
 }
 
+/*
+ * Called by the proto receive routines for every frame received, with the
+ * frame's source address. Ret 1 once every expected responder
+ * (DIAG_IOCTL_SET_EXPECT) has answered : the caller can stop listening.
+ * Always 0 if no responders are expected.
+ */
+int
+diag_l2_expect_done(struct diag_l2_conn *d_l2_conn, uint8_t src) {
+	unsigned int i;
+	unsigned int all;
+
+	if (d_l2_conn->expect_count == 0) {
+		return 0;
+	}
+
+	for (i = 0; i < d_l2_conn->expect_count; i++) {
+		if (d_l2_conn->expect_addr[i] == src) {
+			d_l2_conn->expect_seen |= 1U << i;
+		}
+	}
+
+	all = (1U << d_l2_conn->expect_count) - 1;
+	return (d_l2_conn->expect_seen == all);
+}
+
+/* Set (or clear, if de == NULL) the expected responders. */
+static int
+diag_l2_setexpect(struct diag_l2_conn *d_l2_conn, const struct diag_l2_expect *de) {
+	if (de == NULL) {
+		d_l2_conn->expect_count = 0;
+		d_l2_conn->expect_seen = 0;
+		return 0;
+	}
+	if (de->count > DIAG_L2_MAXEXPECT) {
+		return DIAG_ERR_BADVAL;
+	}
+	memcpy(d_l2_conn->expect_addr, de->addr, de->count);
+	d_l2_conn->expect_count = de->count;
+	d_l2_conn->expect_seen = 0;
+	return 0;
+}
+
+/*
+ * Called by the proto send routines before sending a request : P3min
+ * counts from the end of the last response (or our last request), not from
+ * when the caller got around to sending the next one. Any time spent since
+ * then, processing results etc, is deducted from the wait.
+ */
+void
+diag_l2_waitp3(struct diag_l2_conn *d_l2_conn) {
+	unsigned long elapsed, tbus;
+
+	//another connection on the link may have used the bus since
+	tbus = d_l2_conn->tbus;
+	if ((long) (d_l2_conn->diag_link->tbus - tbus) > 0) {
+		tbus = d_l2_conn->diag_link->tbus;
+	}
+
+	//unsigned, but the clock is monotonic
+	elapsed = diag_os_getms() - tbus;
+	if (elapsed < d_l2_conn->diag_l2_p3min) {
+		diag_os_millisleep((unsigned int) (d_l2_conn->diag_l2_p3min - elapsed));
+	}
+	return;
+}
+
+/*
+ * Receive timeout calibration, see struct diag_l2_rxcal.
+ */
+void
+diag_l2_rxcal_reset(struct diag_l2_rxcal *rc, unsigned int init) {
+	rc->offset = init;
+	rc->init = init;
+	rc->peak = 0;
+	rc->samples = 0;
+	rc->misses = 0;
+	rc->calibrated = 0;
+	return;
+}
+
+/* Offset that would have covered a lateness of "late" ms */
+static unsigned int
+diag_l2_rxcal_want(unsigned int late) {
+	return late + (late / 4) + DIAG_L2_RXCAL_GUARD;
+}
+
+/*
+ * Data arriving late eats into the margin, so that widens the offset right
+ * away. Shrinking only happens at the end of a window, from the worst
+ * lateness seen during it : on the first window the offset drops straight
+ * to that estimate, later on by half at most per window. A window with too
+ * few responses tells nothing and is discarded.
+ */
+void
+diag_l2_rxcal_update(struct diag_l2_rxcal *rc, unsigned int nominal,
+		unsigned long elapsed, bool timedout) {
+	unsigned int late, want, win;
+
+	if (timedout) {
+		rc->misses++;
+		if ((rc->misses > DIAG_L2_RXCAL_BUDGET) && (rc->offset < rc->init)) {
+			if (diag_l2_debug & DIAG_DEBUG_TIMER) {
+				fprintf(stderr, FLFMT "rxcal %p: %u timeouts, offset %u -> %u ms\n",
+					FL, (void *)rc, rc->misses, rc->offset, rc->init);
+			}
+			diag_l2_rxcal_reset(rc, rc->init);
+			return;
+		}
+	} else {
+		late = (elapsed > nominal) ? (unsigned int) (elapsed - nominal) : 0;
+		if (late > rc->peak) {
+			rc->peak = late;
+		}
+		want = diag_l2_rxcal_want(late);
+		if (want > rc->offset) {
+			rc->offset = want;
+		}
+	}
+
+	rc->samples++;
+	win = rc->calibrated ? DIAG_L2_RXCAL_WINDOW : DIAG_L2_RXCAL_FIRSTWIN;
+	if (rc->samples < win) {
+		return;
+	}
+
+	if ((rc->samples - rc->misses) >= (win / 2)) {
+		want = diag_l2_rxcal_want(rc->peak);
+		if (rc->calibrated && (want < (rc->offset / 2))) {
+			want = rc->offset / 2;
+		}
+		if (want < rc->offset) {
+			if (diag_l2_debug & DIAG_DEBUG_TIMER) {
+				fprintf(stderr, FLFMT "rxcal %p: peak %u, offset %u -> %u ms\n",
+					FL, (void *)rc, rc->peak, rc->offset, want);
+			}
+			rc->offset = want;
+		}
+		rc->calibrated = 1;
+	}
+	rc->peak = 0;
+	rc->samples = 0;
+	rc->misses = 0;
+	return;
+}
+
+unsigned int
+diag_l2_rxtout(const struct diag_l2_conn *d_l2_conn, unsigned int nominal) {
+	return nominal + d_l2_conn->rxcal_rsp.offset;
+}
+
+/* Per-frame adapter latency also shows in the first response, so the
+ * first-response offset is a floor. */
+unsigned int
+diag_l2_rxtout_gap(const struct diag_l2_conn *d_l2_conn, unsigned int nominal) {
+	return nominal + MAX(d_l2_conn->rxcal_gap.offset, d_l2_conn->rxcal_rsp.offset);
+}
+
+/*
+ * Default timings for a new connection : we are going to assume that the
+ * ISO default timing values are general suitable defaults
+ */
+static void
+diag_l2_conn_defaults(struct diag_l2_conn *d_l2_conn) {
+	d_l2_conn->diag_l2_p1min = ISO_14230_TIM_MIN_P1;
+	d_l2_conn->diag_l2_p1max = ISO_14230_TIM_MAX_P1;
+	d_l2_conn->diag_l2_p2min = ISO_14230_TIM_MIN_P2;
+	d_l2_conn->diag_l2_p2max = ISO_14230_TIM_MAX_P2;
+	d_l2_conn->diag_l2_p2emin = ISO_14230_TIM_MIN_P2E;
+	d_l2_conn->diag_l2_p2emax = ISO_14230_TIM_MAX_P2E;
+	d_l2_conn->diag_l2_p3min = ISO_14230_TIM_MIN_P3;
+	d_l2_conn->diag_l2_p3max = ISO_14230_TIM_MAX_P3;
+	d_l2_conn->diag_l2_p4min = ISO_14230_TIM_MIN_P4;
+	d_l2_conn->diag_l2_p4max = ISO_14230_TIM_MAX_P4;
+
+	d_l2_conn->tinterval = 0;	//default keepalive interval : derived from p3max
+	return;
+}
+
+/* Whether responses received by this connection must be sorted by source */
+static bool
+diag_l2_demux_needed(const struct diag_l2_conn *d_l2_conn) {
+	return (d_l2_conn->diag_link->nconns > 1) &&
+		!(d_l2_conn->diag_l2_type & DIAG_L2_TYPE_FUNCADDR);
+}
+
+/*
+ * Sort responses on a shared link : frames in "chain" sent by another ECU
+ * are queued on the connection to that ECU (rxq), or dropped if there is
+ * none. Frames without a source address (L1 strips headers) are kept.
+ * Returns what's left for d_l2_conn, possibly NULL.
+ * Caller must hold the link's xfer_mtx.
+ */
+static struct diag_msg *
+diag_l2_demux(struct diag_l2_conn *d_l2_conn, struct diag_msg *chain) {
+	struct diag_msg *msg, *mine = NULL;
+	struct diag_l2_conn *dl2c;
+
+	diag_os_lock(l2internal.connlist_mtx);
+	while (chain != NULL) {
+		msg = chain;
+		chain = chain->next;
+		msg->next = NULL;
+
+		if ((msg->src == 0) || (msg->src == d_l2_conn->diag_l2_destaddr)) {
+			LL_APPEND(mine, msg);
+			continue;
+		}
+		LL_FOREACH(l2internal.dl2conn_list, dl2c) {
+			if ((dl2c->diag_link == d_l2_conn->diag_link) &&
+					(dl2c->diag_l2_destaddr == msg->src) &&
+					(dl2c->diag_l2_state == DIAG_L2_STATE_OPEN)) {
+				break;
+			}
+		}
+		if (diag_l2_debug & DIAG_DEBUG_READ) {
+			fprintf(stderr, FLFMT "demux: frame from 0x%02X %s\n", FL,
+				msg->src, dl2c ? "queued" : "dropped");
+		}
+		if (dl2c == NULL) {
+			diag_freemsg(msg);
+		} else {
+			LL_APPEND(dl2c->rxq, msg);
+		}
+	}
+	diag_os_unlock(l2internal.connlist_mtx);
+	return mine;
+}
+
+/* diag_l2_recv() callback wrapper for shared links */
+struct diag_l2_demux_rcv {
+	struct diag_l2_conn *d_l2_conn;
+	void (*callback)(void *handle, struct diag_msg *msg);
+	void *handle;
+};
+
+static void
+diag_l2_demux_rcv(void *handle, struct diag_msg *msg) {
+	struct diag_l2_demux_rcv *dr = handle;
+	struct diag_msg *mine;
+
+	/* the proto frees its chain after we return */
+	mine = diag_l2_demux(dr->d_l2_conn, diag_dupmsg(msg));
+	if (mine != NULL) {
+		if (dr->callback) {
+			dr->callback(dr->handle, mine);
+		}
+		diag_freemsg(mine);
+	}
+	return;
+}
+
 /************************************************************************/
 /*  PUBLIC Interface starts here					*/
 /************************************************************************/
@@ -210,6 +558,7 @@ diag_l2_closelink(struct diag_l2_link *dl2l) {
 		diag_l1_close(dl2l->l2_dl0d);
 	}
 
+	diag_os_delmtx(dl2l->xfer_mtx);
 	free(dl2l);
 
 	return 0;
@@ -235,7 +584,9 @@ diag_l2_open(struct diag_l0_device *dl0d, int L1protocol) {
 	}
 
 	/* try to find in linked list */
+	diag_os_lock(l2internal.connlist_mtx);
 	dl2l = diag_l2_findlink(dl0d);
+	diag_os_unlock(l2internal.connlist_mtx);
 
 	if (dl2l) {
 		if (diag_l2_debug & DIAG_DEBUG_OPEN) {
@@ -262,13 +613,22 @@ diag_l2_open(struct diag_l0_device *dl0d, int L1protocol) {
 		return diag_iseterr(rv);
 	}
 
+	dl2l->xfer_mtx = diag_os_newrmtx();
+	if (dl2l->xfer_mtx == NULL) {
+		free(dl2l);
+		diag_l1_close(dl0d);
+		return diag_iseterr(DIAG_ERR_NOMEM);
+	}
+
 	dl2l->l2_dl0d = dl0d;
 	dl2l->l1flags = diag_l1_getflags(dl0d);
 	dl2l->l1type = diag_l1_gettype(dl0d);
 	dl2l->l1proto = L1protocol;
 
 	/* Put ourselves at the head of the list. */
+	diag_os_lock(l2internal.connlist_mtx);
 	LL_PREPEND(l2internal.dl2l_list, dl2l);
+	diag_os_unlock(l2internal.connlist_mtx);
 
 	return 0;
 }
@@ -352,21 +712,22 @@ diag_l2_StartCommunications(struct diag_l0_device *dl0d, int L2protocol, flag_ty
 			target & 0xff, source & 0xff);
 	}
 
+	diag_os_lock(l2internal.connlist_mtx);
+
 	/* there must be a dl2l with the desired dl0d. */
 	dl2l = diag_l2_findlink(dl0d);
 	if (!dl2l) {
 		fprintf(stderr, "No dl2l with requested dl0 !?\n");
+		diag_os_unlock(l2internal.connlist_mtx);
 		return diag_pseterr(DIAG_ERR_GENERAL);
 	}
 
 	/*
 	 * Check connection doesn't exist already, if it does, do not reuse !
-	 * with the current L1/L2 structure, hoping to share one L1 between more than one l2
-	 * is a bad idea.
+	 * Another init would disturb the sessions already running on the
+	 * link; diag_l2_AttachCommunications() is the way to share it.
 	 */
 
-	diag_os_lock(l2internal.connlist_mtx);
-
 	LL_FOREACH(l2internal.dl2conn_list, d_l2_conn) {
 		if (d_l2_conn->diag_link == dl2l) {
 			fprintf(stderr, "Already an L2 connection with specified dl0-dl2l, cannot reuse !\n");
@@ -408,25 +769,29 @@ diag_l2_StartCommunications(struct diag_l0_device *dl0d, int L2protocol, flag_ty
 	d_l2_conn->diag_l2_srcaddr = source ;
 	d_l2_conn->diag_l2_destaddr = target ;
 
-	/*
-	 * We are going to assume that the ISO default timing values
-	 * are general suitable defaults
-	 */
-	d_l2_conn->diag_l2_p1min = ISO_14230_TIM_MIN_P1;
-	d_l2_conn->diag_l2_p1max = ISO_14230_TIM_MAX_P1;
-	d_l2_conn->diag_l2_p2min = ISO_14230_TIM_MIN_P2;
-	d_l2_conn->diag_l2_p2max = ISO_14230_TIM_MAX_P2;
-	d_l2_conn->diag_l2_p2emin = ISO_14230_TIM_MIN_P2E;
-	d_l2_conn->diag_l2_p2emax = ISO_14230_TIM_MAX_P2E;
-	d_l2_conn->diag_l2_p3min = ISO_14230_TIM_MIN_P3;
-	d_l2_conn->diag_l2_p3max = ISO_14230_TIM_MAX_P3;
-	d_l2_conn->diag_l2_p4min = ISO_14230_TIM_MIN_P4;
-	d_l2_conn->diag_l2_p4max = ISO_14230_TIM_MAX_P4;
+	diag_l2_conn_defaults(d_l2_conn);
 
-	d_l2_conn->tinterval = (ISO_14230_TIM_MAX_P3 * 2/3);	//default keepalive interval.
+	if (dl2l->l1flags & DIAG_L1_DOESL2FRAME) {
+		diag_l2_rxcal_reset(&d_l2_conn->rxcal_rsp, DIAG_L2_RXCAL_INIT_SMART);
+		diag_l2_rxcal_reset(&d_l2_conn->rxcal_gap, DIAG_L2_RXCAL_INIT_SMART);
+	} else {
+		diag_l2_rxcal_reset(&d_l2_conn->rxcal_rsp, DIAG_L2_RXCAL_INIT);
+		diag_l2_rxcal_reset(&d_l2_conn->rxcal_gap, 0);
+	}
 
 	d_l2_conn->diag_l2_state = DIAG_L2_STATE_CLOSED;
 
+	/*
+	 * Attach connection info to our main list already, so that nobody
+	 * else can start a connection on this link. The timer ignores it
+	 * until it's OPEN, so we don't need to hold the lock during the
+	 * (possibly very long) protocol startcomms : this lets other
+	 * sessions (on other L0 devices) run in the meantime.
+	 */
+	LL_PREPEND(l2internal.dl2conn_list, d_l2_conn);
+	dl2l->nconns++;
+	diag_os_unlock(l2internal.connlist_mtx);
+
 	/* Now do protocol version of StartCommunications */
 
 	rv = d_l2_conn->l2proto->diag_l2_proto_startcomms(d_l2_conn,
@@ -440,21 +805,14 @@ diag_l2_StartCommunications(struct diag_l0_device *dl0d, int L2protocol, flag_ty
 				rv);
 		}
 
+		diag_l2_rmconn(d_l2_conn);
 		free(d_l2_conn);
-		diag_os_unlock(l2internal.connlist_mtx);
 		return diag_pseterr(rv);
 	}
 
-	/*
-	 * note target for quick lookup of connection for received messages
-	 * - unless we're re-using a established connection, then no need
-	 * to re-note.
-	 */
-
-	/* And attach connection info to our main list */
-	LL_PREPEND(l2internal.dl2conn_list, d_l2_conn);
-
 	d_l2_conn->tlast=diag_os_getms();
+	d_l2_conn->tbus = d_l2_conn->tlast;	//not all protos track it during init; be conservative
+	dl2l->tbus = d_l2_conn->tbus;
 	d_l2_conn->diag_l2_state = DIAG_L2_STATE_OPEN;
 
 	if (diag_l2_debug & DIAG_DEBUG_OPEN) {
@@ -462,7 +820,95 @@ diag_l2_StartCommunications(struct diag_l0_device *dl0d, int L2protocol, flag_ty
 			(void *)d_l2_conn);
 	}
 
+	return d_l2_conn;
+}
+
+/*
+ * Start a connection to ECU "target" sharing the link and init of "base".
+ * The new connection gets default timings, as the ECU didn't negotiate
+ * anything yet, but inherits the receive timeout calibration : that's
+ * mostly the adapter's.
+ */
+struct diag_l2_conn *
+diag_l2_AttachCommunications(struct diag_l2_conn *base, target_type target) {
+	struct diag_l2_conn *d_l2_conn;
+	struct diag_l2_link *dl2l;
+	int rv;
+
+	assert(base != NULL);
+	dl2l = base->diag_link;
+
+	if (diag_l2_debug & DIAG_DEBUG_OPEN) {
+		fprintf(stderr, FLFMT "_AttachCommunications base=%p target=0x%X\n",
+			FL, (void *)base, target & 0xff);
+	}
+
+	if (base->l2proto->diag_l2_proto_attach == NULL) {
+		return diag_pseterr(DIAG_ERR_PROTO_NOTSUPP);
+	}
+
+	diag_os_lock(l2internal.connlist_mtx);
+
+	LL_FOREACH(l2internal.dl2conn_list, d_l2_conn) {
+		if ((d_l2_conn->diag_link == dl2l) &&
+				(d_l2_conn->diag_l2_destaddr == target)) {
+			fprintf(stderr, FLFMT "Already a connection to 0x%X on this link !\n",
+				FL, target & 0xff);
+			diag_os_unlock(l2internal.connlist_mtx);
+			return diag_pseterr(DIAG_ERR_GENERAL);
+		}
+	}
+
+	if (base->diag_l2_state != DIAG_L2_STATE_OPEN) {
+		diag_os_unlock(l2internal.connlist_mtx);
+		return diag_pseterr(DIAG_ERR_GENERAL);
+	}
+
+	rv = diag_calloc(&d_l2_conn, 1);
+	if (rv != 0) {
+		diag_os_unlock(l2internal.connlist_mtx);
+		return diag_pseterr(rv);
+	}
+
+	d_l2_conn->diag_link = dl2l;
+	d_l2_conn->l2proto = base->l2proto;
+	d_l2_conn->diag_l2_type = base->diag_l2_type & ~DIAG_L2_TYPE_FUNCADDR;
+	d_l2_conn->diag_l2_srcaddr = base->diag_l2_srcaddr;
+	d_l2_conn->diag_l2_destaddr = target;
+	d_l2_conn->diag_l2_physaddr = target;
+	d_l2_conn->diag_l2_speed = base->diag_l2_speed;
+	d_l2_conn->diag_l2_kb1 = base->diag_l2_kb1;
+	d_l2_conn->diag_l2_kb2 = base->diag_l2_kb2;
+	diag_l2_conn_defaults(d_l2_conn);
+	d_l2_conn->rxcal_rsp = base->rxcal_rsp;
+	d_l2_conn->rxcal_gap = base->rxcal_gap;
+	d_l2_conn->attached = 1;
+	d_l2_conn->diag_l2_state = DIAG_L2_STATE_CLOSED;
+
+	LL_PREPEND(l2internal.dl2conn_list, d_l2_conn);
+	dl2l->nconns++;
 	diag_os_unlock(l2internal.connlist_mtx);
+
+	diag_l2_xfer_begin(d_l2_conn);
+	rv = d_l2_conn->l2proto->diag_l2_proto_attach(d_l2_conn, base);
+	diag_l2_xfer_end(d_l2_conn);
+
+	if (rv < 0) {
+		if (diag_l2_debug & DIAG_DEBUG_OPEN) {
+			fprintf(stderr, FLFMT "protocol attach returned %d\n", FL, rv);
+		}
+		diag_l2_rmconn(d_l2_conn);
+		diag_freemsg(d_l2_conn->diag_msg);
+		free(d_l2_conn);
+		return diag_pseterr(rv);
+	}
+
+	d_l2_conn->tlast = diag_os_getms();
+	if (d_l2_conn->tbus == 0) {
+		d_l2_conn->tbus = d_l2_conn->tlast;
+	}
+	d_l2_conn->diag_l2_state = DIAG_L2_STATE_OPEN;
+
 	return d_l2_conn;
 }
 
@@ -477,6 +923,8 @@ int
 diag_l2_StopCommunications(struct diag_l2_conn *d_l2_conn) {
 	assert(d_l2_conn != NULL);
 
+	/* wait for a keepalive in progress, if any */
+	diag_l2_xfer_begin(d_l2_conn);
 	d_l2_conn->diag_l2_state = DIAG_L2_STATE_CLOSING;
 
 	/*
@@ -485,6 +933,7 @@ diag_l2_StopCommunications(struct diag_l2_conn *d_l2_conn) {
 	if (d_l2_conn->l2proto->diag_l2_proto_stopcomms) {
 		(void)d_l2_conn->l2proto->diag_l2_proto_stopcomms(d_l2_conn);
 	}
+	diag_l2_xfer_end(d_l2_conn);
 
 	//remove from the main linked list
 	diag_l2_rmconn(d_l2_conn);
@@ -496,6 +945,9 @@ diag_l2_StopCommunications(struct diag_l2_conn *d_l2_conn) {
 	if (d_l2_conn->diag_msg != NULL) {
 		diag_freemsg(d_l2_conn->diag_msg);
 	}
+	if (d_l2_conn->rxq != NULL) {
+		diag_freemsg(d_l2_conn->rxq);
+	}
 
 	//and free() the connection.
 	free(d_l2_conn);
@@ -520,12 +972,15 @@ diag_l2_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg) {
 	}
 
 	/* Call protocol specific send routine */
+	diag_l2_xfer_begin(d_l2_conn);
 	rv = d_l2_conn->l2proto->diag_l2_proto_send(d_l2_conn, msg);
 
 	if (rv==0) {
 		//update timestamp
 		d_l2_conn->tlast = diag_os_getms();
+		d_l2_conn->rxcal_armed = 1;
 	}
+	diag_l2_xfer_end(d_l2_conn);
 
 
 	return rv? diag_iseterr(rv):0 ;
@@ -546,7 +1001,23 @@ diag_l2_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg, int *errva
 	}
 
 	/* Call protocol specific send routine */
+	diag_l2_xfer_begin(d_l2_conn);
+	if (d_l2_conn->rxq != NULL) {
+		/* anything from before this request is stale now */
+		diag_freemsg(d_l2_conn->rxq);
+		d_l2_conn->rxq = NULL;
+	}
 	rxmsg = d_l2_conn->l2proto->diag_l2_proto_request(d_l2_conn, msg, errval);
+	if ((rxmsg != NULL) && diag_l2_demux_needed(d_l2_conn)) {
+		rxmsg = diag_l2_demux(d_l2_conn, rxmsg);
+		if (rxmsg == NULL) {
+			*errval = DIAG_ERR_TIMEOUT;
+		}
+	}
+	if (rxmsg != NULL) {
+		d_l2_conn->tlast = diag_os_getms();
+	}
+	diag_l2_xfer_end(d_l2_conn);
 
 	if (diag_l2_debug & DIAG_DEBUG_WRITE) {
 		fprintf(stderr, FLFMT "_request returns %p, err %d\n",
@@ -556,13 +1027,409 @@ diag_l2_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg, int *errva
 	if (rxmsg==NULL) {
 		return diag_pseterr(*errval);
 	}
-		//update timers
-	d_l2_conn->tlast = diag_os_getms();
 
 	return rxmsg;
 }
 
 
+/*
+ * Send a batch of requests back-to-back. Each request is sent as soon as the
+ * previous response has completed, so the only inter-request gap is the
+ * p3min wait done by the protocol send routine: no host-side processing
+ * happens between requests.
+ * Results are stored in the array; a failed request doesn't abort the batch.
+ * Returns the number of requests that got a response, or <0 on error.
+ */
+int
+diag_l2_request_batch(struct diag_l2_conn *d_l2_conn, struct diag_l2_batch_req *reqs,
+	unsigned int nreqs) {
+	unsigned int i;
+	int good = 0;
+
+	if ((d_l2_conn == NULL) || (reqs == NULL)) {
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
+
+	if (diag_l2_debug & DIAG_DEBUG_WRITE) {
+		fprintf(stderr, FLFMT "_request_batch dl2c=%p, %u requests\n", FL,
+			(void *)d_l2_conn, nreqs);
+	}
+
+	for (i = 0; i < nreqs; i++) {
+		reqs[i].errval = 0;
+		reqs[i].rxmsg = diag_l2_request(d_l2_conn, reqs[i].txmsg, &reqs[i].errval);
+		if (reqs[i].rxmsg != NULL) {
+			good++;
+		} else if (reqs[i].errval == 0) {
+			reqs[i].errval = DIAG_ERR_GENERAL;
+		}
+	}
+
+	return good;
+}
+
+
+/*
+ * Request pipeline. The worker thread is the only user of the L2 connection
+ * while the pipeline exists; requests and results go through two queues
+ * protected by pipe->mtx. Results go to the completion callback instead of
+ * rxq if there is one.
+ */
+struct diag_l2_pipe_entry {
+	struct diag_msg *txmsg;	/* copy of the request; NULL for frames received while listening */
+	struct diag_l2_expect expect;
+	bool use_expect;
+	bool cancelled;		/* set by diag_l2_pipe_cancel() while in flight : drop the result */
+	void *handle;
+	struct diag_msg *rxmsg;	/* responses */
+	int errval;
+	struct diag_l2_pipe_entry *next;
+};
+
+struct diag_l2_pipe {
+	struct diag_l2_conn *d_l2_conn;
+	diag_mtx *mtx;		/* protects the queues and "stop" */
+	diag_evt *txevt;	/* set when a request is queued, or when stopping */
+	diag_evt *rxevt;	/* set when a result is queued */
+	struct diag_l2_pipe_entry *txq;
+	struct diag_l2_pipe_entry *rxq;
+	struct diag_l2_pipe_entry *cur;	/* being sent by the worker */
+	void (*cb)(void *handle, struct diag_msg *rxmsg, int errval);
+	bool listen;		/* receive unsolicited frames while idle */
+	void *listen_handle;
+	bool stop;
+	diag_thread *thr;
+};
+
+#define DIAG_L2_PIPE_IDLEWAIT	100	/* ms; worker re-checks "stop" at least this often */
+
+static void
+diag_l2_pipe_freeentries(struct diag_l2_pipe_entry *list) {
+	struct diag_l2_pipe_entry *pe, *tmp;
+
+	LL_FOREACH_SAFE(list, pe, tmp) {
+		diag_freemsg(pe->txmsg);
+		diag_freemsg(pe->rxmsg);
+		free(pe);
+	}
+	return;
+}
+
+/* worker : hand a completed entry to the callback, or queue it for _pop() */
+static void
+diag_l2_pipe_done(struct diag_l2_pipe *dp, struct diag_l2_pipe_entry *pe) {
+	void (*cb)(void *handle, struct diag_msg *rxmsg, int errval);
+
+	diag_os_lock(dp->mtx);
+	if (dp->cur == pe) {
+		dp->cur = NULL;
+	}
+	if (pe->cancelled) {
+		diag_os_unlock(dp->mtx);
+		diag_l2_pipe_freeentries(pe);
+		return;
+	}
+	cb = dp->cb;
+	if (cb == NULL) {
+		LL_APPEND(dp->rxq, pe);
+	}
+	diag_os_unlock(dp->mtx);
+
+	if (cb == NULL) {
+		diag_os_setevt(dp->rxevt);
+		return;
+	}
+	cb(pe->handle, pe->rxmsg, pe->errval);
+	pe->rxmsg = NULL;	/* belongs to the callback now */
+	diag_l2_pipe_freeentries(pe);
+	return;
+}
+
+/* rx callback for listening : keep a copy of the frames */
+static void
+diag_l2_pipe_rcv(void *handle, struct diag_msg *msg) {
+	struct diag_l2_pipe_entry *pe = handle;
+	struct diag_msg *rmsg;
+
+	rmsg = diag_dupmsg(msg);
+	if (rmsg == NULL) {
+		pe->errval = DIAG_ERR_NOMEM;
+		return;
+	}
+	LL_CONCAT(pe->rxmsg, rmsg);
+	return;
+}
+
+/* worker : nothing to send; receive for a while, deliver whatever came in */
+static void
+diag_l2_pipe_listen1(struct diag_l2_pipe *dp, void *handle) {
+	struct diag_l2_pipe_entry *pe;
+	int rv;
+
+	if (diag_calloc(&pe, 1)) {
+		(void) diag_os_waitevt(dp->txevt, DIAG_L2_PIPE_IDLEWAIT);
+		return;
+	}
+	pe->handle = handle;
+	diag_os_lock(dp->mtx);
+	dp->cur = pe;
+	diag_os_unlock(dp->mtx);
+
+	rv = diag_l2_recv(dp->d_l2_conn, DIAG_L2_PIPE_IDLEWAIT, diag_l2_pipe_rcv, pe);
+	if ((rv < 0) && (rv != DIAG_ERR_TIMEOUT)) {
+		pe->errval = rv;
+		/* don't spin on a broken link */
+		(void) diag_os_waitevt(dp->txevt, DIAG_L2_PIPE_IDLEWAIT);
+	}
+	if ((pe->rxmsg == NULL) && (pe->errval == 0)) {
+		/* nothing received */
+		pe->cancelled = 1;
+	}
+	diag_l2_pipe_done(dp, pe);
+
+	/*
+	 * We're about to take xfer_mtx again for the next receive : the
+	 * periodic trylock would almost never get it, send any keepalive
+	 * due now, while the link is free.
+	 */
+	diag_l2_timer();
+	return;
+}
+
+/* worker thread : send queued requests back-to-back */
+static void
+diag_l2_pipe_run(void *arg) {
+	struct diag_l2_pipe *dp = (struct diag_l2_pipe *) arg;
+	struct diag_l2_conn *d_l2_conn = dp->d_l2_conn;
+	struct diag_l2_pipe_entry *pe;
+	bool stop, listen;
+	void *listen_handle;
+
+	while (1) {
+		diag_os_lock(dp->mtx);
+		pe = dp->txq;
+		if (pe) {
+			LL_DELETE(dp->txq, pe);
+			dp->cur = pe;
+		}
+		stop = dp->stop;
+		listen = dp->listen;
+		listen_handle = dp->listen_handle;
+		diag_os_unlock(dp->mtx);
+
+		if (pe == NULL) {
+			if (stop) {
+				break;
+			}
+			if (listen) {
+				diag_l2_pipe_listen1(dp, listen_handle);
+			} else {
+				(void) diag_os_waitevt(dp->txevt, DIAG_L2_PIPE_IDLEWAIT);
+			}
+			continue;
+		}
+
+		(void) diag_l2_setexpect(d_l2_conn, pe->use_expect? &pe->expect:NULL);
+		pe->errval = 0;
+		pe->rxmsg = diag_l2_request(d_l2_conn, pe->txmsg, &pe->errval);
+		if ((pe->rxmsg == NULL) && (pe->errval == 0)) {
+			pe->errval = DIAG_ERR_GENERAL;
+		}
+		(void) diag_l2_setexpect(d_l2_conn, NULL);
+
+		diag_l2_pipe_done(dp, pe);
+	}
+	return;
+}
+
+struct diag_l2_pipe *
+diag_l2_pipe_new(struct diag_l2_conn *d_l2_conn) {
+	struct diag_l2_pipe *dp;
+
+	if (d_l2_conn == NULL) {
+		return diag_pseterr(DIAG_ERR_BADVAL);
+	}
+	if (d_l2_conn->l2proto->diag_l2_proto_request == NULL) {
+		return diag_pseterr(DIAG_ERR_PROTO_NOTSUPP);
+	}
+
+	if (diag_calloc(&dp, 1)) {
+		return diag_pseterr(DIAG_ERR_NOMEM);
+	}
+	dp->d_l2_conn = d_l2_conn;
+	dp->mtx = diag_os_newmtx();
+	dp->txevt = diag_os_newevt();
+	dp->rxevt = diag_os_newevt();
+	if (!dp->mtx || !dp->txevt || !dp->rxevt) {
+		goto err_free;
+	}
+
+	dp->thr = diag_os_newthread(diag_l2_pipe_run, dp);
+	if (dp->thr == NULL) {
+		goto err_free;
+	}
+
+	if (diag_l2_debug & DIAG_DEBUG_OPEN) {
+		fprintf(stderr, FLFMT "pipe_new dl2c=%p : pipe %p\n", FL,
+			(void *)d_l2_conn, (void *)dp);
+	}
+	return dp;
+
+err_free:
+	if (dp->mtx) {
+		diag_os_delmtx(dp->mtx);
+	}
+	if (dp->txevt) {
+		diag_os_delevt(dp->txevt);
+	}
+	if (dp->rxevt) {
+		diag_os_delevt(dp->rxevt);
+	}
+	free(dp);
+	return diag_pseterr(DIAG_ERR_GENERAL);
+}
+
+int
+diag_l2_pipe_push(struct diag_l2_pipe *dp, struct diag_msg *txmsg,
+		const struct diag_l2_expect *expect, void *handle) {
+	struct diag_l2_pipe_entry *pe;
+
+	if ((expect != NULL) && (expect->count > DIAG_L2_MAXEXPECT)) {
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
+	if (diag_calloc(&pe, 1)) {
+		return diag_iseterr(DIAG_ERR_NOMEM);
+	}
+	pe->txmsg = diag_dupsinglemsg(txmsg);
+	if (pe->txmsg == NULL) {
+		free(pe);
+		return diag_iseterr(DIAG_ERR_NOMEM);
+	}
+	if (expect) {
+		pe->expect = *expect;
+		pe->use_expect = 1;
+	}
+	pe->handle = handle;
+
+	diag_os_lock(dp->mtx);
+	LL_APPEND(dp->txq, pe);
+	diag_os_unlock(dp->mtx);
+	diag_os_setevt(dp->txevt);
+	return 0;
+}
+
+void
+diag_l2_pipe_setcb(struct diag_l2_pipe *dp,
+		void (*cb)(void *handle, struct diag_msg *rxmsg, int errval)) {
+	diag_os_lock(dp->mtx);
+	dp->cb = cb;
+	diag_os_unlock(dp->mtx);
+	return;
+}
+
+void
+diag_l2_pipe_listen(struct diag_l2_pipe *dp, bool enable, void *handle) {
+	diag_os_lock(dp->mtx);
+	dp->listen = enable;
+	dp->listen_handle = handle;
+	diag_os_unlock(dp->mtx);
+	diag_os_setevt(dp->txevt);
+	return;
+}
+
+int
+diag_l2_pipe_cancel(struct diag_l2_pipe *dp, void *handle) {
+	struct diag_l2_pipe_entry *pe, *tmp;
+	struct diag_l2_pipe_entry *dropped = NULL;
+	int count = 0;
+
+	diag_os_lock(dp->mtx);
+	LL_FOREACH_SAFE(dp->txq, pe, tmp) {
+		if (pe->handle == handle) {
+			LL_DELETE(dp->txq, pe);
+			LL_APPEND(dropped, pe);
+			count++;
+		}
+	}
+	LL_FOREACH_SAFE(dp->rxq, pe, tmp) {
+		if (pe->handle == handle) {
+			LL_DELETE(dp->rxq, pe);
+			LL_APPEND(dropped, pe);
+			count++;
+		}
+	}
+	if (dp->cur && (dp->cur->handle == handle)) {
+		dp->cur->cancelled = 1;
+		count++;
+	}
+	if (dp->listen && (dp->listen_handle == handle)) {
+		dp->listen = 0;
+	}
+	diag_os_unlock(dp->mtx);
+
+	diag_l2_pipe_freeentries(dropped);
+	return count;
+}
+
+int
+diag_l2_pipe_pop(struct diag_l2_pipe *dp, unsigned int timeout,
+		struct diag_msg **rxmsg, int *errval, void **handle) {
+	struct diag_l2_pipe_entry *pe;
+	unsigned long t0 = diag_os_getms();
+	unsigned long elapsed;
+
+	while (1) {
+		diag_os_lock(dp->mtx);
+		pe = dp->rxq;
+		if (pe) {
+			LL_DELETE(dp->rxq, pe);
+		}
+		diag_os_unlock(dp->mtx);
+
+		if (pe) {
+			break;
+		}
+		elapsed = diag_os_getms() - t0;
+		if (elapsed >= timeout) {
+			return DIAG_ERR_TIMEOUT;
+		}
+		(void) diag_os_waitevt(dp->rxevt, (unsigned int) (timeout - elapsed));
+	}
+
+	*rxmsg = pe->rxmsg;
+	*errval = pe->errval;
+	if (handle) {
+		*handle = pe->handle;
+	}
+	diag_freemsg(pe->txmsg);
+	free(pe);
+	return 0;
+}
+
+void
+diag_l2_pipe_del(struct diag_l2_pipe *dp) {
+	struct diag_l2_pipe_entry *pending;
+
+	diag_os_lock(dp->mtx);
+	pending = dp->txq;
+	dp->txq = NULL;
+	dp->listen = 0;
+	dp->stop = 1;
+	diag_os_unlock(dp->mtx);
+	diag_os_setevt(dp->txevt);
+
+	diag_os_jointhread(dp->thr);
+
+	diag_l2_pipe_freeentries(pending);
+	diag_l2_pipe_freeentries(dp->rxq);
+	diag_os_delmtx(dp->mtx);
+	diag_os_delevt(dp->txevt);
+	diag_os_delevt(dp->rxevt);
+	free(dp);
+	return;
+}
+
+
 /*
  * Recv a message - will end up calling the callback routine with a message
  * or an error if an error has occurred
@@ -582,13 +1449,38 @@ diag_l2_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout,
 			(void *)d_l2_conn, timeout);
 	}
 
+	diag_l2_xfer_begin(d_l2_conn);
+
+	/* Frames for us, received by another connection on the link */
+	if (d_l2_conn->rxq != NULL) {
+		struct diag_msg *rxq = d_l2_conn->rxq;
+
+		d_l2_conn->rxq = NULL;
+		diag_l2_xfer_end(d_l2_conn);
+		if (callback) {
+			callback(handle, rxq);
+		}
+		diag_freemsg(rxq);
+		return 0;
+	}
+
 	/* Call protocol specific recv routine */
-	rv = d_l2_conn->l2proto->diag_l2_proto_recv(d_l2_conn, timeout, callback, handle);
+	if (diag_l2_demux_needed(d_l2_conn)) {
+		struct diag_l2_demux_rcv dr = {d_l2_conn, callback, handle};
+
+		rv = d_l2_conn->l2proto->diag_l2_proto_recv(d_l2_conn, timeout,
+			diag_l2_demux_rcv, &dr);
+	} else {
+		rv = d_l2_conn->l2proto->diag_l2_proto_recv(d_l2_conn, timeout, callback, handle);
+	}
 
 	if (rv==0) {
 		//update timers if success
 		d_l2_conn->tlast = diag_os_getms();
-	} else if (diag_l2_debug & DIAG_DEBUG_READ) {
+	}
+	diag_l2_xfer_end(d_l2_conn);
+
+	if ((rv != 0) && (diag_l2_debug & DIAG_DEBUG_READ)) {
 		fprintf(stderr, FLFMT "diag_l2_recv returns %d\n", FL, rv);
 	}
 
@@ -630,6 +1522,9 @@ int diag_l2_ioctl(struct diag_l2_conn *d_l2_conn, unsigned int cmd, void *data)
 		d->kb1 = d_l2_conn->diag_l2_kb1;
 		d->kb2 = d_l2_conn->diag_l2_kb2;
 		break;
+	case DIAG_IOCTL_SET_EXPECT:
+		rv = diag_l2_setexpect(d_l2_conn, (const struct diag_l2_expect *)data);
+		break;
 	case DIAG_IOCTL_SETSPEED:
 		if (dl2l->l1flags & (DIAG_L1_AUTOSPEED | DIAG_L1_NOTTY)) {
 			break;
@@ -29,6 +29,8 @@
  * - Layer 2 interface definitions
  */
 
+#include "diag_os.h"	/* diag_mtx, ALARM_TIMEOUT */
+
 /*
  * Structure of definitions of L2 types supported
  */
@@ -51,12 +53,60 @@ struct diag_l2_link {
 	uint32_t	l1flags;		/* L1 flags, filled with diag_l1_getflags in diag_l2_open*/
 	int	l1type;			/* L1 type (see diag_l1.h): mask of supported L1 protos. */
 
+	/*
+	 * Transmit arbiter, shared by every connection on the link : held for
+	 * each whole request (send + receive), so only one ECU is talked to
+	 * at a time; diag_l2_timer() never injects a keepalive while it's
+	 * taken. Recursive, so upper layers can wrap several L2 calls with
+	 * diag_l2_xfer_begin()/_end().
+	 */
+	diag_mtx *xfer_mtx;
+	unsigned long tbus;	/* Last bus activity on the link, any connection (ms) */
+	unsigned int nconns;	/* Connections using the link */
+
 	struct diag_l2_link *next;		/* linked list of all connections */
 
 };
 
 struct diag_msg;
 
+#define DIAG_L2_MAXEXPECT	8	/* Max expected responders, see DIAG_IOCTL_SET_EXPECT */
+
+/* Keepalives are sent when a connection has been idle for P3max/2, or P3max
+ * minus this long if that is sooner (unless tinterval is set). The timer only
+ * trylocks the connection list and the link, so it can miss a few ticks in a
+ * row while the link is busy : the margin covers several of them plus getting
+ * the request out. */
+#define DIAG_L2_KEEPALIVE_MARGIN	(3 * ALARM_TIMEOUT + 200)
+#define DIAG_L2_KA_MAXDUE	8	/* Max keepalives sent per diag_l2_timer() call */
+
+/*
+ * Receive timeout calibration.
+ * A receive timeout is the nominal protocol value (P2max etc.) plus an offset
+ * covering OS, adapter and ECU latencies that no standard accounts for.
+ * Instead of a fixed pad, each connection measures how late data actually
+ * arrives past the nominal time, and keeps the smallest offset that covered
+ * it with some margin. Timeouts are the error budget : if too many requests
+ * time out in a window, the offset goes back to its initial value and
+ * calibration starts over. See diag_l2_rxcal_update().
+ */
+#define DIAG_L2_RXCAL_INIT	20	/* initial offset (ms) for passive interfaces */
+#define DIAG_L2_RXCAL_INIT_SMART	250	/* initial offset (ms) for DIAG_L1_DOESL2FRAME interfaces :
+						 * they unframe and checksum (ELMs also hex-encode) before passing data */
+#define DIAG_L2_RXCAL_FIRSTWIN	8	/* samples before the first estimate */
+#define DIAG_L2_RXCAL_WINDOW	16	/* samples between later adjustments */
+#define DIAG_L2_RXCAL_BUDGET	2	/* timeouts tolerated per window */
+#define DIAG_L2_RXCAL_GUARD	5	/* ms always added to the worst lateness seen */
+
+struct diag_l2_rxcal {
+	unsigned int offset;	/* ms currently added to nominal timeouts */
+	unsigned int init;	/* offset used until calibrated, and after a backoff */
+	unsigned int peak;	/* worst lateness (ms past nominal) in the current window */
+	unsigned int samples;	/* samples in the current window, incl. misses */
+	unsigned int misses;	/* timeouts in the current window */
+	bool calibrated;	/* first window done */
+};
+
 /*
  * A structure to represent a link to an ECU from here
  * There is one of these per ECU we are talking to - we may be talking to
@@ -78,7 +128,10 @@ struct diag_l2_conn {
 	//tlast is updated when diag_l2_send, _recv,
 	//  _request, or _startcomm is called succesfully.
 	unsigned long tlast;		// Time of last received || sent data, in ms.
-	unsigned long tinterval;	// How long before expiry (usually set by startcomms() once). Set to -1 for "never"
+	unsigned long tinterval;	// Idle time before a keepalive is due. 0 (default) : derived from P3max, see DIAG_L2_KEEPALIVE_MARGIN;
+					// protos may set it in their startcomms(). Set to -1 for "never"
+	unsigned long tbus;		// Time of last bus activity (end of our last send, or last bytes received), in ms.
+					// Used by diag_l2_waitp3() to send the next request exactly P3min after the last response.
 
 	const struct diag_l2_proto *l2proto;	/* Protocol handler */
 
@@ -140,6 +193,40 @@ struct diag_l2_conn {
 	/* Generic 'msg' holder */
 	struct diag_msg	*diag_msg;
 
+	/*
+	 * Set if started with diag_l2_AttachCommunications() : this connection
+	 * reuses the init of another one on the same link.
+	 * rxq holds frames from our ECU that were received by another
+	 * connection on the link; they're delivered by our next diag_l2_recv().
+	 */
+	bool attached;
+	struct diag_msg *rxq;
+
+	/* Keepalive provided by an upper layer (diag_l2_set_keepalive);
+	 * replaces the proto's diag_l2_proto_timeout. */
+	int (*ka_fn)(void *ka_handle);
+	void *ka_handle;
+
+	/*
+	 * Expected responders, set with DIAG_IOCTL_SET_EXPECT. While
+	 * expect_count != 0, the receive routine returns as soon as every
+	 * address in expect_addr[] has sent a frame, instead of waiting out
+	 * the inter-message timeout. expect_seen is a bitmask (bit n = expect_addr[n])
+	 * reset at the start of each receive.
+	 */
+	uint8_t	expect_addr[DIAG_L2_MAXEXPECT];
+	unsigned int	expect_count;
+	unsigned int	expect_seen;
+
+	/*
+	 * Receive timeout offsets, see struct diag_l2_rxcal. rxcal_rsp covers
+	 * the wait for the first response to a request, rxcal_gap the wait
+	 * for further responses after a frame. rxcal_armed is set by
+	 * diag_l2_send() : only the first receive after a request is a sample.
+	 */
+	struct diag_l2_rxcal rxcal_rsp;
+	struct diag_l2_rxcal rxcal_gap;
+	bool rxcal_armed;
 };
 
 
@@ -180,7 +267,8 @@ struct diag_l2_conn {
 #define DIAG_L2_PROT_MB2	8	/* MB protocol 2 */
 #define DIAG_L2_PROT_D2		9	/* Volvo D2 over K-line (kw D3 B0) */
 #define DIAG_L2_PROT_TEST	10 /* Dummy L2 test driver */
-#define DIAG_L2_PROT_MAX	11	/* Maximum number of protocols */
+#define DIAG_L2_PROT_J1939	11	/* SAE J1939 over CAN (29-bit IDs, 250k) */
+#define DIAG_L2_PROT_MAX	12	/* Maximum number of protocols */
 
 /*
  * l2proto_list : static-allocated list of supported L2 protocols.
@@ -226,23 +314,33 @@ extern const struct diag_l2_proto *l2proto_list[];
  * SAE J1978 is the ODB II ScanTool specification document
  */
 #define DIAG_L2_IDLE_J1978	0x20
+
+/*
+ * DIAG_L2_TYPE_CAN29 : ISO15765 with 29-bit CAN IDs (normal fixed
+ * addressing) instead of 11-bit IDs
+ */
+#define DIAG_L2_TYPE_CAN29	0x40
+
+/*
+ * DIAG_L2_TYPE_CANKERNEL : ISO15765, leave the transport to L0's kernel
+ * ISO-TP channels if it has them (see diag_l2_can.h)
+ */
+#define DIAG_L2_TYPE_CANKERNEL	0x80
 /*****/
 
 
 
 
-// Special Timeout for so-called "Smart" interfaces;
-// Slower than any protocol, give them time to unframe
-// and checksum the data:
-#define SMART_TIMEOUT 150
-#define RXTOFFSET 20	//ms to add to some diag_l1_recv calls in L2 code
-				//In theory this should be 0... It's a band-aid
-				//hack to allow system to system variations but NEEDS
-				//to be replaced by something runtime-configurable either
-				//by the user or some auto-configured feature of the
-				//scantool (not implemented yet)
 
+/* struct diag_l2_expect: Used for DIAG_IOCTL_SET_EXPECT */
+//Only useful when each expected ECU sends exactly one frame per request
+//(J1979 modes 1/2 for instance); the caller must clear it (count=0) before
+//sending requests that can get multi-frame responses.
 
+struct diag_l2_expect {
+	unsigned int count;	/* Number of addresses in addr[]; 0 = disable */
+	uint8_t addr[DIAG_L2_MAXEXPECT];	/* Source addresses of expected responders */
+};
 
 /* struct diag_l2_data: Used for DIAG_IOCTL_GET_L2_DATA */
 //this isn't used frequently but L3_vag will eventually need it,
@@ -286,6 +384,13 @@ struct	diag_l2_data {
  */
 #define DIAG_L2_FLAG_CONNECTS_ALWAYS 0x10
 
+/*
+ * L2 honours DIAG_FMT_ISO_PHYSADDR on sent messages, i.e. single ECUs
+ * can be addressed physically on a functionally addressed connection
+ * (ISO14230 headers with address info). Not applicable if L1 is DATAONLY.
+ */
+#define DIAG_L2_FLAG_PHYSADDR	0x20
+
 
 
 /*
@@ -294,6 +399,28 @@ struct	diag_l2_data {
 /* Add a msg to a L2 connection */
 void diag_l2_addmsg(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg);
 
+/* Note a frame from "src" was received; ret 1 if all expected responders
+ * have now answered (see DIAG_IOCTL_SET_EXPECT), 0 otherwise. */
+int diag_l2_expect_done(struct diag_l2_conn *d_l2_conn, uint8_t src);
+
+/* Wait until P3min has elapsed since the last bus activity (tbus);
+ * returns immediately if it already has. For the proto send routines. */
+void diag_l2_waitp3(struct diag_l2_conn *d_l2_conn);
+
+/* Receive timeouts, for the proto receive routines : "nominal" plus the
+ * calibrated offset. diag_l2_rxtout() is for the first response to a
+ * request, diag_l2_rxtout_gap() for further responses. */
+unsigned int diag_l2_rxtout(const struct diag_l2_conn *d_l2_conn, unsigned int nominal);
+unsigned int diag_l2_rxtout_gap(const struct diag_l2_conn *d_l2_conn, unsigned int nominal);
+
+/* Feed one measurement to a calibrator : data arrived "elapsed" ms into a
+ * wait of diag_l2_rxtout*(nominal), or the wait timed out. */
+void diag_l2_rxcal_update(struct diag_l2_rxcal *rc, unsigned int nominal,
+		unsigned long elapsed, bool timedout);
+
+/* Start (over) with offset "init" */
+void diag_l2_rxcal_reset(struct diag_l2_rxcal *rc, unsigned int init);
+
 
 /* Public functions */
 
@@ -340,6 +467,19 @@ struct diag_l2_conn *diag_l2_StartCommunications(struct diag_l0_device *, int L2
  */
 int diag_l2_StopCommunications(struct diag_l2_conn *);
 
+/** Start a session with another ECU, over the link and init of an open one
+ *
+ * For ECUs reachable with the same init (e.g. those woken by a functional
+ * fast init) : no bus init is done, so switching ECUs costs at most one
+ * request. Connections on a link take turns for each request, and their
+ * responses are sorted by source address.
+ * Not supported by every L2 protocol (diag_l2_proto_attach).
+ *	@param base : open connection whose link and init are reused
+ *	@param target : address of the new ECU
+ *	@return a new struct diag_l2_conn, to stop with diag_l2_StopCommunications()
+ */
+struct diag_l2_conn *diag_l2_AttachCommunications(struct diag_l2_conn *base, target_type target);
+
 /** Send a message (blocking)
  *	@param connection self-explanatory
  *	@param msg same. NOTE, the source address MAY
@@ -379,6 +519,108 @@ int diag_l2_recv(struct diag_l2_conn *connection, unsigned int timeout,
 struct diag_msg *diag_l2_request(struct diag_l2_conn *connection, struct diag_msg *msg,
 		int *errval);
 
+/** Request batch entry, see diag_l2_request_batch() */
+struct diag_l2_batch_req {
+	struct diag_msg *txmsg;	/* request to send (filled by caller) */
+	struct diag_msg *rxmsg;	/* response, or NULL if failed. Caller must free */
+	int errval;		/* 0 if ok, else DIAG_ERR_* */
+};
+
+/** Send an array of requests back-to-back.
+ *
+ *	Each request is sent as soon as the previous response has
+ *	completed, i.e. after only the p3min delay enforced by the L2
+ *	protocol. Results are stored in the array; decoding and printing
+ *	should be done by the caller once the whole batch is finished,
+ *	to keep it off the bus-critical path.
+ *
+ *	@param reqs array of nreqs requests; rxmsg and errval are filled in.
+ *	@return number of requests that got a response, or <0 on error.
+ */
+int diag_l2_request_batch(struct diag_l2_conn *connection, struct diag_l2_batch_req *reqs,
+		unsigned int nreqs);
+
+/** Request pipeline; also the asynchronous request API.
+ *
+ *	Requests are queued with diag_l2_pipe_push(); a worker thread sends
+ *	each of them with diag_l2_request() as soon as the bus allows it
+ *	(P3min after the previous response, see diag_l2_waitp3()), no matter
+ *	how long the caller takes to process the previous results.
+ *	Results are returned in request order by diag_l2_pipe_pop(), or passed
+ *	to a completion callback (diag_l2_pipe_setcb()). The caller's handle
+ *	identifies each request, and can be used to cancel it.
+ *	While a pipeline exists, the caller must not use the L2 connection
+ *	directly.
+ */
+struct diag_l2_pipe;
+
+/** Start a pipeline (and its worker thread) on an open L2 connection.
+ *	@return new pipeline, to be deleted with diag_l2_pipe_del(); NULL if failed
+ */
+struct diag_l2_pipe *diag_l2_pipe_new(struct diag_l2_conn *connection);
+
+/** Queue a request. txmsg is copied and can be freed by the caller.
+ *	@param expect : optional expected responders (see DIAG_IOCTL_SET_EXPECT), or NULL
+ *	@param handle : returned as-is by diag_l2_pipe_pop() with the result
+ *	@return 0 if ok
+ */
+int diag_l2_pipe_push(struct diag_l2_pipe *dp, struct diag_msg *txmsg,
+		const struct diag_l2_expect *expect, void *handle);
+
+/** Set a completion callback : from now on, results are passed to cb()
+ *	instead of being queued for diag_l2_pipe_pop(). cb is called from the
+ *	worker thread, with the same arguments _pop() would return; it must free
+ *	rxmsg. It shouldn't take long : the next request waits for it.
+ *	cb=NULL reverts to _pop().
+ */
+void diag_l2_pipe_setcb(struct diag_l2_pipe *dp,
+		void (*cb)(void *handle, struct diag_msg *rxmsg, int errval));
+
+/** Listen while idle : when no request is queued, frames received on the
+ *	connection (e.g. in monitor mode) are returned like results, with
+ *	errval=0 and the given handle.
+ */
+void diag_l2_pipe_listen(struct diag_l2_pipe *dp, bool enable, void *handle);
+
+/** Cancel requests : queued ones are discarded, the one being sent is
+ *	completed on the bus but its result is dropped, and results not yet
+ *	popped are freed; listening with that handle stops. A callback that
+ *	already started may still complete.
+ *	@return number of requests / results cancelled
+ */
+int diag_l2_pipe_cancel(struct diag_l2_pipe *dp, void *handle);
+
+/** Get the next result, waiting up to "timeout" ms for it.
+ *	@param rxmsg : set to the response (caller must free), or NULL if the request failed
+ *	@param errval : set to 0 if ok, else DIAG_ERR_*
+ *	@param handle : set to the handle given to diag_l2_pipe_push()
+ *	@return 0 if a result was returned, DIAG_ERR_TIMEOUT if none was ready in time
+ */
+int diag_l2_pipe_pop(struct diag_l2_pipe *dp, unsigned int timeout,
+		struct diag_msg **rxmsg, int *errval, void **handle);
+
+/** Stop and delete a pipeline : the request being sent (if any) is completed,
+ *	requests and results still queued are discarded.
+ */
+void diag_l2_pipe_del(struct diag_l2_pipe *dp);
+
+/** Mark the start of a transaction on a connection : until the matching
+ * diag_l2_xfer_end(), the keepalive scheduler leaves it alone, and other
+ * connections on the same link wait.
+ * diag_l2_send, _recv and _request already do this; upper layers use it to
+ * keep a send + receive sequence together. Calls may be nested.
+ */
+void diag_l2_xfer_begin(struct diag_l2_conn *d_l2_conn);
+void diag_l2_xfer_end(struct diag_l2_conn *d_l2_conn);
+
+/** Replace the L2 keepalive of a connection with an upper layer's (e.g.
+ *	J1979 over ISO9141, which has none). diag_l2_timer() calls
+ *	fn(handle) when the connection would otherwise reach P3max idle, inside
+ *	diag_l2_xfer_begin()/_end(). fn=NULL reverts to the L2 keepalive.
+ */
+void diag_l2_set_keepalive(struct diag_l2_conn *d_l2_conn,
+		int (*fn)(void *handle), void *handle);
+
 /** Send IOCTL to L2/L1
  *	@param command : IOCTL #, defined in diag.h
  *	@param data	optional input/output data
@@ -419,6 +661,10 @@ struct diag_l2_proto {
 	//diag_l2_proto_timeout : this is called periodically (interval
 	//defined in struct diag_l2_conn, usually to send keepalive messages.
 	void (*diag_l2_proto_timeout)(struct diag_l2_conn *);
+	//diag_l2_proto_attach : optional, see diag_l2_AttachCommunications.
+	//Set up the new connection (addresses and timings already filled in)
+	//from the session of "base", without initializing the bus. Ret 0 if ok
+	int (*diag_l2_proto_attach)(struct diag_l2_conn *, struct diag_l2_conn *base);
 };
 
 #if defined(__cplusplus)
@@ -1,15 +1,999 @@
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * Diag
+ *
+ * L2 driver for ISO 15765-2 (CAN transport protocol, "ISO-TP"),
+ * see diag_l2_can.h
+ *
+ * Sending : a first frame, then blocks of consecutive frames as allowed by
+ * the peer's flow control frames (block size BS, separation time STmin).
+ * Without STmin, a block goes to L1 with a single diag_l1_send().
+ *
+ * Receiving : every first frame is answered with a flow control frame
+ * built from the connection settings (by default : send everything, no
+ * delay). The message is allocated with the length announced by the first
+ * frame, and consecutive frames are copied straight into it. Up to
+ * CAN_MAXRX responses (one per ECU, e.g. after a functional request) are
+ * reassembled side by side.
+ *
+ * With L0s that have kernel ISO-TP channels, all of the above is left to the
+ * kernel (see can_kopen()); only functional requests, always single frames,
+ * still go out through diag_l1_send().
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
 #include "diag.h"
+#include "diag_err.h"
+#include "diag_os.h"
+#include "diag_iso14230.h"
+#include "diag_l1.h"
 #include "diag_l2.h"
+
 #include "diag_l2_can.h"
 
+#define CAN_MAXLEN	4095	/* 12-bit length in first frames */
+#define CAN_FRAMELEN	(DIAG_L1_CAN_HDRLEN + DIAG_L1_CAN_MAXDLC)
+#define CAN_TXBATCH	32	/* max consecutive frames per diag_l1_send() */
+#define CAN_MAXRX	DIAG_L2_MAXEXPECT	/* concurrent reassemblies */
+
+/* Timings (ms), ISO 15765-2 and 15765-4 */
+#define CAN_P2	50	/* P2can : request -> response */
+#define CAN_P2E	5000	/* P2*can : "response pending" -> response */
+#define CAN_N_BS	1000	/* first / consecutive frame -> flow control */
+#define CAN_N_CR	1000	/* between consecutive frames */
+#define CAN_MAXWFT	10	/* max flow control "wait" frames in a row */
+
+/* Protocol control information, high nibble of the first data byte */
+#define PCI_SF	0x00	/* single frame */
+#define PCI_FF	0x10	/* first frame */
+#define PCI_CF	0x20	/* consecutive frame */
+#define PCI_FC	0x30	/* flow control */
+
+/* Flow status, low nibble of flow control frames */
+#define FC_CTS	0	/* continue to send */
+#define FC_WAIT	1
+#define FC_OVFLW	2	/* overflow : message too long for the receiver */
+
+/* ISO 15765-4 11-bit IDs; ECUs are numbered 0-7 */
+#define CAN_ID11_FUNC	0x7DFUL
+#define CAN_ID11_PHYS	0x7E0UL	/* requests to ECU n : 0x7E0 + n */
+#define CAN_ID11_RESP	0x7E8UL	/* responses from ECU n : 0x7E8 + n */
+
+/* 29-bit normal fixed addressing : 0x18DA<target><source>, functional 0x18DB<target><source> */
+#define CAN_ID29_PHYS	0x18DA0000UL
+#define CAN_ID29_FUNC	0x18DB0000UL
+
+struct dl2p_can_rx {
+	struct diag_msg *msg;	/* message being reassembled; NULL : slot free */
+	uint32_t id;	/* ID of the sender's frames */
+	unsigned int got;	/* bytes of msg->data received so far */
+	unsigned long tlast;	/* time of the last frame, ms */
+	uint8_t sn;	/* next sequence number */
+	uint8_t bsleft;	/* consecutive frames until we send flow control; 0 : no limit */
+};
+
+struct dl2p_can {
+	struct diag_l2_can_cfg cfg;
+
+	bool ext;	/* 29-bit IDs */
+	bool func;	/* functional requests */
+	uint8_t tester;	/* our address, part of 29-bit IDs */
+	uint32_t txid;	/* requests are sent with this ID */
+	uint32_t rxid;	/* physical addressing : responses come with this ID */
+
+	struct dl2p_can_rx rx[CAN_MAXRX];
+	uint8_t txbuf[CAN_TXBATCH * CAN_FRAMELEN];
+
+	/* Kernel transport, see can_kopen() */
+	bool kernel;	/* L0 channels in use */
+	bool kshared;	/* channel belongs to the base connection (attached connections) */
+	struct diag_isotp_chan kchan[CAN_MAXRX];
+	unsigned int nkchan;
+	uint8_t kbuf[CAN_MAXLEN];
+};
+
+extern const struct diag_l2_proto diag_l2_proto_can;
+
+static void can_kopen(struct diag_l2_conn *d_l2_conn);
+static void can_kclose(struct diag_l2_conn *d_l2_conn);
+static int can_ksend(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg);
+
+
+int dl2p_can_setcfg(struct diag_l2_conn *dl2c, const struct diag_l2_can_cfg *cfg) {
+	struct dl2p_can *dp;
+
+	if (dl2c->l2proto != &diag_l2_proto_can) {
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
+	dp = (struct dl2p_can *)dl2c->diag_l2_proto_data;
+	dp->cfg = *cfg;
+	if (!dp->kshared) {
+		/* kernel channels take the flow control settings when they open */
+		can_kclose(dl2c);
+		can_kopen(dl2c);
+	}
+	return 0;
+}
+
+int dl2p_can_getcfg(struct diag_l2_conn *dl2c, struct diag_l2_can_cfg *cfg) {
+	if (dl2c->l2proto != &diag_l2_proto_can) {
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
+	*cfg = ((struct dl2p_can *)dl2c->diag_l2_proto_data)->cfg;
+	return 0;
+}
+
+int dl2p_can_kernel(struct diag_l2_conn *dl2c) {
+	if (dl2c->l2proto != &diag_l2_proto_can) {
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
+	return ((struct dl2p_can *)dl2c->diag_l2_proto_data)->kernel;
+}
+
+/* Set the request and response IDs to reach "target" (a functional
+ * address if dp->func). ret 0 if ok */
+static int
+can_setids(struct dl2p_can *dp, uint8_t target) {
+	if (dp->ext) {
+		if (dp->func) {
+			dp->txid = DIAG_L1_CAN_EFF | CAN_ID29_FUNC |
+					((uint32_t) target << 8) | dp->tester;
+			dp->rxid = 0;
+		} else {
+			dp->txid = DIAG_L1_CAN_EFF | CAN_ID29_PHYS |
+					((uint32_t) target << 8) | dp->tester;
+			dp->rxid = DIAG_L1_CAN_EFF | CAN_ID29_PHYS |
+					((uint32_t) dp->tester << 8) | target;
+		}
+		return 0;
+	}
+
+	if (dp->func) {
+		dp->txid = CAN_ID11_FUNC;
+		dp->rxid = 0;
+		return 0;
+	}
+	/* ECUs go by the low byte of their response ID, 0xE8-0xEF; the
+	 * low byte of their request ID, 0xE0-0xE7, is accepted too */
+	if ((target & 0xF0) != 0xE0) {
+		fprintf(stderr, FLFMT "11-bit IDs : physical address must be 0xE0-0xEF, not 0x%X\n",
+			FL, target);
+		return DIAG_ERR_BADVAL;
+	}
+	dp->txid = CAN_ID11_PHYS | (target & 7);
+	dp->rxid = CAN_ID11_RESP | (target & 7);
+	return 0;
+}
+
+/* Whether we're interested in frames with this ID */
+static bool
+can_accept(const struct dl2p_can *dp, uint32_t id) {
+	if (!dp->func) {
+		return id == dp->rxid;
+	}
+	if (dp->ext) {
+		return (id & ~0xFFUL) ==
+			(DIAG_L1_CAN_EFF | CAN_ID29_PHYS | ((uint32_t) dp->tester << 8));
+	}
+	return (id & ~7UL) == CAN_ID11_RESP;
+}
+
+/* ID of the flow control frames for a peer sending with "id" */
+static uint32_t
+can_fcid(uint32_t id) {
+	if (id & DIAG_L1_CAN_EFF) {
+		/* swap target and source */
+		return (id & ~0xFFFFUL) | ((id & 0xFF) << 8) | ((id >> 8) & 0xFF);
+	}
+	return id - (CAN_ID11_RESP - CAN_ID11_PHYS);
+}
+
+static uint32_t
+can_getid(const uint8_t *buf) {
+	return ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16) |
+		((uint32_t) buf[2] << 8) | buf[3];
+}
+
+/* Fill in the header of a frame whose "len" data bytes are already at
+ * buf[DIAG_L1_CAN_HDRLEN], and pad it. ret total frame length */
+static unsigned int
+can_seal(const struct dl2p_can *dp, uint8_t *buf, uint32_t id, unsigned int len) {
+	buf[0] = (uint8_t) (id >> 24);
+	buf[1] = (uint8_t) (id >> 16);
+	buf[2] = (uint8_t) (id >> 8);
+	buf[3] = (uint8_t) id;
+	if (dp->cfg.pad && (len < DIAG_L1_CAN_MAXDLC)) {
+		memset(&buf[DIAG_L1_CAN_HDRLEN + len], dp->cfg.padbyte,
+			DIAG_L1_CAN_MAXDLC - len);
+		len = DIAG_L1_CAN_MAXDLC;
+	}
+	buf[4] = (uint8_t) len;
+	return DIAG_L1_CAN_HDRLEN + len;
+}
+
+/* STmin encoding -> microseconds. Reserved values mean the max, 127 ms */
+static unsigned long
+can_stmin_us(uint8_t stmin) {
+	if (stmin <= 0x7F) {
+		return stmin * 1000UL;
+	}
+	if ((stmin >= 0xF1) && (stmin <= 0xF9)) {
+		return (stmin - 0xF0) * 100UL;
+	}
+	return 127000UL;
+}
+
+/* Sub-millisecond separation times can't be slept, spin for those */
+static void
+can_stwait(unsigned long us) {
+	unsigned long long t0;
+
+	if (us >= 1000) {
+		diag_os_millisleep((unsigned int) (us / 1000));
+		us %= 1000;
+	}
+	t0 = diag_os_gethrt();
+	while (diag_os_hrtus(diag_os_gethrt() - t0) < us) {
+		continue;
+	}
+	return;
+}
+
+static void
+can_rxabort(struct dl2p_can_rx *rx) {
+	diag_freemsg(rx->msg);
+	rx->msg = NULL;
+	return;
+}
+
+static void
+can_rxreset(struct dl2p_can *dp) {
+	unsigned int i;
+
+	for (i = 0; i < CAN_MAXRX; i++) {
+		if (dp->rx[i].msg) {
+			can_rxabort(&dp->rx[i]);
+		}
+	}
+	return;
+}
+
+/* Let the peer sending with "id" go on */
+static int
+can_sendfc(struct diag_l2_conn *d_l2_conn, uint32_t id) {
+	struct dl2p_can *dp = (struct dl2p_can *)d_l2_conn->diag_l2_proto_data;
+	uint8_t buf[CAN_FRAMELEN];
+	unsigned int len;
+	int rv;
+
+	buf[DIAG_L1_CAN_HDRLEN] = PCI_FC | FC_CTS;
+	buf[DIAG_L1_CAN_HDRLEN + 1] = dp->cfg.rxbs;
+	buf[DIAG_L1_CAN_HDRLEN + 2] = dp->cfg.rxstmin;
+	len = can_seal(dp, buf, can_fcid(id), 3);
+
+	rv = diag_l1_send(d_l2_conn->diag_link->l2_dl0d, NULL, buf, len, 0);
+	return rv? diag_iseterr(rv):0;
+}
+
+/* Fill in the details of a message received from "id" */
+static void
+can_msgdone(const struct dl2p_can *dp, struct diag_msg *msg, uint32_t id) {
+	msg->src = (uint8_t) id;
+	msg->dest = (id & DIAG_L1_CAN_EFF)? (uint8_t) (id >> 8) : dp->tester;
+	msg->fmt = DIAG_FMT_FRAMED | DIAG_FMT_CKSUMMED;
+	msg->rxtime = diag_os_getms();
+	return;
+}
+
+/*
+ * Process one frame from L1. If it completes a message, the message is
+ * returned in *done. Frames we're not interested in are ignored.
+ * ret 0 if ok, <0 if we couldn't send flow control or allocate a message.
+ */
+static int
+can_rxframe(struct diag_l2_conn *d_l2_conn, const uint8_t *buf, unsigned int len,
+		struct diag_msg **done) {
+	struct dl2p_can *dp = (struct dl2p_can *)d_l2_conn->diag_l2_proto_data;
+	struct dl2p_can_rx *slot = NULL;
+	struct diag_msg *msg;
+	const uint8_t *data = &buf[DIAG_L1_CAN_HDRLEN];
+	uint32_t id;
+	unsigned int dlc, n, i;
+
+	*done = NULL;
+	if (len <= DIAG_L1_CAN_HDRLEN) {
+		return 0;
+	}
+	id = can_getid(buf);
+	dlc = buf[4];
+	if ((dlc == 0) || (dlc > DIAG_L1_CAN_MAXDLC) ||
+			(len < DIAG_L1_CAN_HDRLEN + dlc) || !can_accept(dp, id)) {
+		return 0;
+	}
+
+	for (i = 0; i < CAN_MAXRX; i++) {
+		if (dp->rx[i].msg && (dp->rx[i].id == id)) {
+			slot = &dp->rx[i];
+			break;
+		}
+	}
+
+	switch (data[0] & 0xF0) {
+	case PCI_SF:
+		n = data[0] & 0x0F;
+		if ((n == 0) || (n >= dlc)) {
+			return 0;
+		}
+		if (slot) {
+			/* sender gave up on the previous message */
+			can_rxabort(slot);
+		}
+		msg = diag_allocmsg(n);
+		if (msg == NULL) {
+			return diag_iseterr(DIAG_ERR_NOMEM);
+		}
+		memcpy(msg->data, &data[1], n);
+		break;
+	case PCI_FF:
+		n = ((data[0] & 0x0F) << 8) | data[1];
+		if ((dlc != DIAG_L1_CAN_MAXDLC) || (n < DIAG_L1_CAN_MAXDLC)) {
+			return 0;
+		}
+		if (slot) {
+			can_rxabort(slot);
+		} else {
+			for (i = 0; i < CAN_MAXRX; i++) {
+				if (dp->rx[i].msg == NULL) {
+					slot = &dp->rx[i];
+					break;
+				}
+			}
+			if (slot == NULL) {
+				fprintf(stderr, FLFMT "too many concurrent messages, ignoring 0x%lX\n",
+					FL, (unsigned long) (id & DIAG_L1_CAN_IDMASK));
+				return 0;
+			}
+		}
+		slot->msg = diag_allocmsg(n);
+		if (slot->msg == NULL) {
+			return diag_iseterr(DIAG_ERR_NOMEM);
+		}
+		memcpy(slot->msg->data, &data[2], DIAG_L1_CAN_MAXDLC - 2);
+		slot->id = id;
+		slot->got = DIAG_L1_CAN_MAXDLC - 2;
+		slot->sn = 1;
+		slot->bsleft = dp->cfg.rxbs;
+		slot->tlast = diag_os_getms();
+		return can_sendfc(d_l2_conn, id);
+	case PCI_CF:
+		if (slot == NULL) {
+			return 0;
+		}
+		if ((data[0] & 0x0F) != slot->sn) {
+			if (diag_l2_debug & DIAG_DEBUG_READ) {
+				fprintf(stderr, FLFMT "0x%lX : wrong sequence number %u (expected %u), dropping message\n",
+					FL, (unsigned long) (id & DIAG_L1_CAN_IDMASK),
+					data[0] & 0x0F, slot->sn);
+			}
+			can_rxabort(slot);
+			return 0;
+		}
+		n = MIN(slot->msg->len - slot->got, dlc - 1);
+		memcpy(&slot->msg->data[slot->got], &data[1], n);
+		slot->got += n;
+		slot->sn = (slot->sn + 1) & 0x0F;
+		slot->tlast = diag_os_getms();
+		if (slot->got < slot->msg->len) {
+			if (slot->bsleft && (--slot->bsleft == 0)) {
+				slot->bsleft = dp->cfg.rxbs;
+				return can_sendfc(d_l2_conn, id);
+			}
+			return 0;
+		}
+		msg = slot->msg;
+		slot->msg = NULL;
+		break;
+	default:
+		/* flow control (we're not sending), or reserved */
+		return 0;
+	}
+
+	can_msgdone(dp, msg, id);
+	*done = msg;
+	return 0;
+}
+
+/*
+ * Kernel transport : wait for a complete message on any of our L0 channels.
+ * ret 0 if ok (*done is NULL if the message wasn't for us), <0 on errors
+ * incl. DIAG_ERR_TIMEOUT.
+ */
+static int
+can_krecv(struct diag_l2_conn *d_l2_conn, unsigned int timeout, struct diag_msg **done) {
+	struct dl2p_can *dp = (struct dl2p_can *)d_l2_conn->diag_l2_proto_data;
+	struct diag_isotp_xfer x;
+	struct diag_msg *msg;
+	unsigned int i;
+	int rv;
+
+	*done = NULL;
+	x.data = dp->kbuf;
+	x.len = sizeof(dp->kbuf);
+	x.timeout = timeout;
+	rv = diag_l1_ioctl(d_l2_conn->diag_link->l2_dl0d, DIAG_IOCTL_ISOTP_RECV, &x);
+	if (rv == DIAG_ERR_TIMEOUT) {
+		return rv;
+	}
+	if (rv != 0) {
+		return diag_iseterr(rv);
+	}
+
+	for (i = 0; i < dp->nkchan; i++) {
+		if (dp->kchan[i].handle == x.handle) {
+			break;
+		}
+	}
+	if ((i == dp->nkchan) || (x.len == 0)) {
+		return 0;
+	}
+
+	msg = diag_allocmsg(x.len);
+	if (msg == NULL) {
+		return diag_iseterr(DIAG_ERR_NOMEM);
+	}
+	memcpy(msg->data, dp->kbuf, x.len);
+	can_msgdone(dp, msg, dp->kchan[i].rxid);
+	*done = msg;
+	return 0;
+}
+
+/*
+ * Protocol receive routine
+ *
+ * Receive and reassemble messages, and save them on d_l2_conn->diag_msg.
+ * The first response must arrive within timeout, further responses within
+ * P2can of the previous one; messages being reassembled may take longer,
+ * as long as their frames are at most N_Cr apart. With physical addressing,
+ * returns as soon as one message is complete.
+ * "Response pending" negative responses (7F xx 78) are not returned; they
+ * extend the wait to P2*can.
+ *
+ * Ret 0 if ok, whether or not there were any messages.
+ */
+static int
+dl2p_can_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
+	struct dl2p_can *dp = (struct dl2p_can *)d_l2_conn->diag_l2_proto_data;
+	uint8_t buf[CAN_FRAMELEN];
+	struct diag_msg *msg = NULL;
+	unsigned long t0, now, deadline, tpend, tend;
+	unsigned int nominal, i;
+	uint8_t pendsrc = 0;
+	bool rxcal;
+	int rv;
+
+	diag_freemsg(d_l2_conn->diag_msg);
+	d_l2_conn->diag_msg = NULL;
+	d_l2_conn->expect_seen = 0;
+
+	/* Only the first receive after a request measures response latency */
+	rxcal = d_l2_conn->rxcal_armed;
+	d_l2_conn->rxcal_armed = 0;
+	nominal = timeout;
+
+	t0 = diag_os_getms();
+	deadline = t0 + diag_l2_rxtout(d_l2_conn, nominal);
+	tpend = t0;	/* no response pending */
+
+	while (1) {
+		now = diag_os_getms();
+		tend = MAX(deadline, tpend);
+		for (i = 0; i < CAN_MAXRX; i++) {
+			struct dl2p_can_rx *rx = &dp->rx[i];
+
+			if (rx->msg == NULL) {
+				continue;
+			}
+			if (now - rx->tlast >= CAN_N_CR) {
+				if (diag_l2_debug & DIAG_DEBUG_READ) {
+					fprintf(stderr, FLFMT "0x%lX : timeout after %u/%u bytes, dropping message\n",
+						FL, (unsigned long) (rx->id & DIAG_L1_CAN_IDMASK),
+						rx->got, rx->msg->len);
+				}
+				can_rxabort(rx);
+				continue;
+			}
+			tend = MAX(tend, rx->tlast + CAN_N_CR);
+		}
+		if (tend <= now) {
+			break;
+		}
+
+		if (dp->kernel) {
+			rv = can_krecv(d_l2_conn, (unsigned int) (tend - now), &msg);
+		} else {
+			rv = diag_l1_recv(d_l2_conn->diag_link->l2_dl0d, NULL, buf, sizeof(buf),
+					(unsigned int) (tend - now));
+			if (rv >= 0) {
+				rv = can_rxframe(d_l2_conn, buf, (unsigned int) rv, &msg);
+			}
+		}
+		if (rv == DIAG_ERR_TIMEOUT) {
+			continue;
+		}
+		if (rv < 0) {
+			diag_freemsg(d_l2_conn->diag_msg);
+			d_l2_conn->diag_msg = NULL;
+			return rv;
+		}
+		if (msg == NULL) {
+			continue;
+		}
+
+		now = diag_os_getms();
+		if (rxcal) {
+			diag_l2_rxcal_update(&d_l2_conn->rxcal_rsp, nominal, now - t0, 0);
+			rxcal = 0;
+		}
+
+		if ((msg->len >= 3) && (msg->data[0] == DIAG_KW2K_RC_NR) &&
+				(msg->data[2] == DIAG_KW2K_RC_RCR_RP)) {
+			pendsrc = msg->src;
+			tpend = now + diag_l2_rxtout_gap(d_l2_conn, d_l2_conn->diag_l2_p2emax);
+			diag_freemsg(msg);
+			continue;
+		}
+		if (msg->src == pendsrc) {
+			tpend = t0;
+		}
+
+		if ((diag_l2_debug & DIAG_DEBUG_DATA) && (diag_l2_debug & DIAG_DEBUG_READ)) {
+			fprintf(stderr, FLFMT "0x%X : %u bytes: ", FL, msg->src, msg->len);
+			diag_data_dump(stderr, msg->data, msg->len);
+			fprintf(stderr, "\n");
+		}
+		diag_l2_addmsg(d_l2_conn, msg);
+
+		if (!dp->func || diag_l2_expect_done(d_l2_conn, msg->src)) {
+			break;
+		}
+		deadline = now + diag_l2_rxtout_gap(d_l2_conn, d_l2_conn->diag_l2_p2max);
+	}
+
+	if (rxcal) {
+		diag_l2_rxcal_update(&d_l2_conn->rxcal_rsp, nominal, 0, 1);
+	}
+	return 0;
+}
+
+/* Wait for the flow control frame from the peer we're sending to.
+ * ret 0 if ok, with the peer's block size and STmin */
+static int
+can_waitfc(struct diag_l2_conn *d_l2_conn, uint8_t *bs, uint8_t *stmin) {
+	struct dl2p_can *dp = (struct dl2p_can *)d_l2_conn->diag_l2_proto_data;
+	uint8_t buf[CAN_FRAMELEN];
+	unsigned long now, tend;
+	unsigned int nwait = 0;
+	int rv;
+
+	tend = diag_os_getms() + diag_l2_rxtout_gap(d_l2_conn, CAN_N_BS);
+	while (1) {
+		now = diag_os_getms();
+		if (tend <= now) {
+			fprintf(stderr, FLFMT "no flow control from 0x%lX\n",
+				FL, (unsigned long) (dp->rxid & DIAG_L1_CAN_IDMASK));
+			return diag_iseterr(DIAG_ERR_TIMEOUT);
+		}
+		rv = diag_l1_recv(d_l2_conn->diag_link->l2_dl0d, NULL, buf, sizeof(buf),
+				(unsigned int) (tend - now));
+		if (rv == DIAG_ERR_TIMEOUT) {
+			continue;
+		}
+		if (rv < 0) {
+			return diag_iseterr(rv);
+		}
+		if ((rv < DIAG_L1_CAN_HDRLEN + 3) || (buf[4] < 3) ||
+				(can_getid(buf) != dp->rxid) ||
+				((buf[DIAG_L1_CAN_HDRLEN] & 0xF0) != PCI_FC)) {
+			continue;
+		}
+
+		switch (buf[DIAG_L1_CAN_HDRLEN] & 0x0F) {
+		case FC_CTS:
+			*bs = buf[DIAG_L1_CAN_HDRLEN + 1];
+			*stmin = buf[DIAG_L1_CAN_HDRLEN + 2];
+			return 0;
+		case FC_WAIT:
+			if (++nwait > CAN_MAXWFT) {
+				fprintf(stderr, FLFMT "0x%lX keeps asking to wait, giving up\n",
+					FL, (unsigned long) (dp->rxid & DIAG_L1_CAN_IDMASK));
+				return diag_iseterr(DIAG_ERR_TIMEOUT);
+			}
+			tend = diag_os_getms() + diag_l2_rxtout_gap(d_l2_conn, CAN_N_BS);
+			break;
+		case FC_OVFLW:
+			fprintf(stderr, FLFMT "message too long for 0x%lX\n",
+				FL, (unsigned long) (dp->rxid & DIAG_L1_CAN_IDMASK));
+			return diag_iseterr(DIAG_ERR_BADLEN);
+		default:
+			return diag_iseterr(DIAG_ERR_BADDATA);
+		}
+	}
+}
+
+/* Segmented send, physical addressing only */
+static int
+can_txmulti(struct diag_l2_conn *d_l2_conn, const uint8_t *data, unsigned int len) {
+	struct dl2p_can *dp = (struct dl2p_can *)d_l2_conn->diag_l2_proto_data;
+	struct diag_l0_device *dl0d = d_l2_conn->diag_link->l2_dl0d;
+	uint8_t *buf = dp->txbuf;
+	unsigned long st;
+	unsigned int off, n, nbuf, blk;
+	uint8_t bs, stmin, sn;
+	int rv;
+
+	buf[DIAG_L1_CAN_HDRLEN] = PCI_FF | (uint8_t) (len >> 8);
+	buf[DIAG_L1_CAN_HDRLEN + 1] = (uint8_t) len;
+	off = DIAG_L1_CAN_MAXDLC - 2;
+	memcpy(&buf[DIAG_L1_CAN_HDRLEN + 2], data, off);
+	nbuf = can_seal(dp, buf, dp->txid, DIAG_L1_CAN_MAXDLC);
+	rv = diag_l1_send(dl0d, NULL, buf, nbuf, 0);
+	if (rv) {
+		return diag_iseterr(rv);
+	}
+
+	sn = 1;
+	while (off < len) {
+		rv = can_waitfc(d_l2_conn, &bs, &stmin);
+		if (rv < 0) {
+			return rv;
+		}
+		st = MAX(can_stmin_us(stmin), can_stmin_us(dp->cfg.txstmin));
+
+		/* One block : without a separation time, frames are
+		 * batched; else they go one by one. */
+		nbuf = 0;
+		for (blk = 0; (off < len) && ((bs == 0) || (blk < bs)); blk++) {
+			uint8_t *frame = &buf[nbuf];
+
+			n = MIN(len - off, DIAG_L1_CAN_MAXDLC - 1);
+			frame[DIAG_L1_CAN_HDRLEN] = PCI_CF | sn;
+			memcpy(&frame[DIAG_L1_CAN_HDRLEN + 1], &data[off], n);
+			nbuf += can_seal(dp, frame, dp->txid, n + 1);
+			off += n;
+			sn = (sn + 1) & 0x0F;
+
+			if (st || (off >= len) || ((blk + 1) == bs) ||
+					(nbuf + CAN_FRAMELEN > sizeof(dp->txbuf))) {
+				rv = diag_l1_send(dl0d, NULL, buf, nbuf, 0);
+				if (rv) {
+					return diag_iseterr(rv);
+				}
+				nbuf = 0;
+				if (st && (off < len) && ((blk + 1) != bs)) {
+					can_stwait(st);
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+static int
+dl2p_can_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg) {
+	struct dl2p_can *dp = (struct dl2p_can *)d_l2_conn->diag_l2_proto_data;
+	unsigned int len;
+	int rv;
+
+	if (diag_l2_debug & DIAG_DEBUG_WRITE) {
+		fprintf(stderr, FLFMT "_send %p msg %p len %u to 0x%lX\n",
+			FL, (void *)d_l2_conn, (void *)msg, msg->len,
+			(unsigned long) (dp->txid & DIAG_L1_CAN_IDMASK));
+	}
+
+	if ((msg->len == 0) || (msg->len > CAN_MAXLEN)) {
+		return diag_iseterr(DIAG_ERR_BADLEN);
+	}
+
+	if (dp->kernel && !dp->func) {
+		return can_ksend(d_l2_conn, msg);
+	}
+
+	/* Anything half received is stale now */
+	can_rxreset(dp);
+
+	if (msg->len < DIAG_L1_CAN_MAXDLC) {
+		dp->txbuf[DIAG_L1_CAN_HDRLEN] = PCI_SF | (uint8_t) msg->len;
+		memcpy(&dp->txbuf[DIAG_L1_CAN_HDRLEN + 1], msg->data, msg->len);
+		len = can_seal(dp, dp->txbuf, dp->txid, msg->len + 1);
+		rv = diag_l1_send(d_l2_conn->diag_link->l2_dl0d, NULL, dp->txbuf, len, 0);
+		return rv? diag_iseterr(rv):0;
+	}
+
+	if (dp->func) {
+		/* Nobody would send flow control : ISO 15765-4 only allows
+		 * single frame functional requests. */
+		return diag_iseterr(DIAG_ERR_BADLEN);
+	}
+	return can_txmulti(d_l2_conn, msg->data, msg->len);
+}
+
+/* Kernel transport, physical addressing : any length goes through the channel */
+static int
+can_ksend(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg) {
+	struct dl2p_can *dp = (struct dl2p_can *)d_l2_conn->diag_l2_proto_data;
+	struct diag_isotp_xfer x;
+	int rv;
+
+	x.handle = dp->kchan[0].handle;
+	x.data = msg->data;
+	x.len = msg->len;
+	x.timeout = 0;
+	rv = diag_l1_ioctl(d_l2_conn->diag_link->l2_dl0d, DIAG_IOCTL_ISOTP_SEND, &x);
+	return rv? diag_iseterr(rv):0;
+}
+
+static int
+dl2p_can_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout,
+	void (*callback)(void *handle, struct diag_msg *msg),
+	void *handle) {
+	struct diag_msg *tmsg;
+	int rv;
+
+	rv = dl2p_can_int_recv(d_l2_conn, timeout);
+	if (rv < 0) {
+		return rv;
+	}
+	if (d_l2_conn->diag_msg == NULL) {
+		return DIAG_ERR_TIMEOUT;
+	}
+
+	tmsg = d_l2_conn->diag_msg;
+	d_l2_conn->diag_msg = NULL;
+
+	if (callback) {
+		callback(handle, tmsg);
+	}
+	diag_freemsg(tmsg);
+	return 0;
+}
+
+static struct diag_msg *
+dl2p_can_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg,
+		int *errval) {
+	struct diag_msg *rmsg;
+	int rv;
+
+	rv = diag_l2_send(d_l2_conn, msg);
+	if (rv < 0) {
+		*errval = rv;
+		return diag_pseterr(rv);
+	}
+
+	rv = dl2p_can_int_recv(d_l2_conn, d_l2_conn->diag_l2_p2max);
+	if (rv < 0) {
+		*errval = rv;
+		return diag_pseterr(rv);
+	}
+	if (d_l2_conn->diag_msg == NULL) {
+		*errval = DIAG_ERR_TIMEOUT;
+		return NULL;
+	}
+
+	rmsg = d_l2_conn->diag_msg;
+	d_l2_conn->diag_msg = NULL;
+	return rmsg;
+}
+
+static void
+can_timings(struct diag_l2_conn *d_l2_conn) {
+	d_l2_conn->diag_l2_p2min = 0;
+	d_l2_conn->diag_l2_p2max = CAN_P2;
+	d_l2_conn->diag_l2_p2emin = 0;
+	d_l2_conn->diag_l2_p2emax = CAN_P2E;
+	d_l2_conn->diag_l2_p3min = 0;
+	d_l2_conn->diag_l2_p4min = 0;
+	return;
+}
+
+/*
+ * Leave the transport to L0 if it has kernel ISO-TP channels, and the
+ * settings allow : one channel per (request ID, response ID) pair. With
+ * 29-bit functional addressing the responders aren't known in advance, so
+ * that stays with this driver. If any channel fails to open, everything
+ * stays with this driver.
+ */
+static void
+can_kopen(struct diag_l2_conn *d_l2_conn) {
+	struct dl2p_can *dp = (struct dl2p_can *)d_l2_conn->diag_l2_proto_data;
+	unsigned int i, n;
+
+	if (!dp->cfg.kernel || (dp->func && dp->ext)) {
+		return;
+	}
+
+	n = dp->func? CAN_MAXRX : 1;
+	for (i = 0; i < n; i++) {
+		struct diag_isotp_chan *ch = &dp->kchan[i];
+
+		if (dp->func) {
+			ch->txid = CAN_ID11_PHYS + i;
+			ch->rxid = CAN_ID11_RESP + i;
+		} else {
+			ch->txid = dp->txid;
+			ch->rxid = dp->rxid;
+		}
+		ch->rxbs = dp->cfg.rxbs;
+		ch->rxstmin = dp->cfg.rxstmin;
+		ch->txstmin = dp->cfg.txstmin;
+		ch->pad = dp->cfg.pad;
+		ch->padbyte = dp->cfg.padbyte;
+		if (diag_l1_ioctl(d_l2_conn->diag_link->l2_dl0d, DIAG_IOCTL_ISOTP_OPEN, ch) != 0) {
+			can_kclose(d_l2_conn);
+			return;
+		}
+		dp->nkchan++;
+	}
+	dp->kernel = 1;
+	can_rxreset(dp);
+
+	if (diag_l2_debug & DIAG_DEBUG_OPEN) {
+		fprintf(stderr, FLFMT "dl2conn %p : kernel ISO-TP, %u channel(s)\n",
+			FL, (void *)d_l2_conn, dp->nkchan);
+	}
+	return;
+}
+
+static void
+can_kclose(struct diag_l2_conn *d_l2_conn) {
+	struct dl2p_can *dp = (struct dl2p_can *)d_l2_conn->diag_l2_proto_data;
+	unsigned int i;
+
+	if (!dp->kshared) {
+		for (i = 0; i < dp->nkchan; i++) {
+			(void) diag_l1_ioctl(d_l2_conn->diag_link->l2_dl0d,
+					DIAG_IOCTL_ISOTP_CLOSE, &dp->kchan[i]);
+		}
+	}
+	dp->nkchan = 0;
+	dp->kernel = 0;
+	dp->kshared = 0;
+	return;
+}
+
+/*
+ * No init on CAN : just check L1 passes raw frames, and set up the IDs.
+ * DIAG_L2_TYPE_FUNCADDR : functional requests (target is ignored with 11-bit
+ * IDs, normally 0x33 with 29-bit IDs).
+ * DIAG_L2_TYPE_CAN29 : 29-bit IDs.
+ * DIAG_L2_TYPE_CANKERNEL : kernel ISO-TP if L0 has it (cfg.kernel).
+ */
+static int
+dl2p_can_startcomms(struct diag_l2_conn *d_l2_conn, flag_type flags,
+	UNUSED(unsigned int bitrate), target_type target, source_type source) {
+	struct dl2p_can *dp;
+	const struct diag_l2_can_cfg defcfg = DL2P_CAN_DEFAULT_CFG;
+	int rv;
+
+	if ((d_l2_conn->diag_link->l1proto != DIAG_L1_CAN) ||
+			(d_l2_conn->diag_link->l1flags & DIAG_L1_DATAONLY)) {
+		return diag_iseterr(DIAG_ERR_PROTO_NOTSUPP);
+	}
+
+	rv = diag_calloc(&dp, 1);
+	if (rv != 0) {
+		return diag_iseterr(rv);
+	}
+	dp->cfg = defcfg;
+	if (flags & DIAG_L2_TYPE_CANKERNEL) {
+		dp->cfg.kernel = 1;
+	}
+	dp->ext = (flags & DIAG_L2_TYPE_CAN29)? 1:0;
+	dp->func = (flags & DIAG_L2_TYPE_FUNCADDR)? 1:0;
+	dp->tester = source;
+	rv = can_setids(dp, target);
+	if (rv != 0) {
+		free(dp);
+		return diag_iseterr(rv);
+	}
+
+	d_l2_conn->diag_l2_proto_data = (void *)dp;
+	can_timings(d_l2_conn);
+
+	(void)diag_l2_ioctl(d_l2_conn, DIAG_IOCTL_IFLUSH, NULL);
+	can_kopen(d_l2_conn);
+	if (diag_l2_debug & DIAG_DEBUG_OPEN) {
+		fprintf(stderr, FLFMT "dl2conn %p : tx 0x%lX, %s transport\n", FL,
+			(void *)d_l2_conn, (unsigned long) (dp->txid & DIAG_L1_CAN_IDMASK),
+			dp->kernel? "kernel":"freediag");
+	}
+	return 0;
+}
+
+static int
+dl2p_can_stopcomms(struct diag_l2_conn *d_l2_conn) {
+	struct dl2p_can *dp = (struct dl2p_can *)d_l2_conn->diag_l2_proto_data;
+
+	if (dp) {
+		can_kclose(d_l2_conn);
+		can_rxreset(dp);
+		free(dp);
+	}
+	d_l2_conn->diag_l2_proto_data = NULL;
+	return 0;
+}
+
+/* Attached connections are physical, with the ID scheme, settings and
+ * transport of base; kernel channels base already has are shared. */
+static int
+dl2p_can_attach(struct diag_l2_conn *dl2c, struct diag_l2_conn *base) {
+	const struct dl2p_can *bp = (const struct dl2p_can *)base->diag_l2_proto_data;
+	struct dl2p_can *dp;
+	int rv;
+
+	rv = diag_calloc(&dp, 1);
+	if (rv != 0) {
+		return diag_iseterr(rv);
+	}
+	dp->cfg = bp->cfg;
+	dp->ext = bp->ext;
+	dp->tester = bp->tester;
+	rv = can_setids(dp, dl2c->diag_l2_destaddr);
+	if (rv != 0) {
+		free(dp);
+		return diag_iseterr(rv);
+	}
+
+	dl2c->diag_l2_proto_data = dp;
+	can_timings(dl2c);
+
+	if (bp->kernel) {
+		unsigned int i;
+
+		for (i = 0; i < bp->nkchan; i++) {
+			if ((bp->kchan[i].txid == dp->txid) && (bp->kchan[i].rxid == dp->rxid)) {
+				dp->kchan[0] = bp->kchan[i];
+				dp->nkchan = 1;
+				dp->kernel = 1;
+				dp->kshared = 1;
+				break;
+			}
+		}
+		if (!dp->kernel) {
+			can_kopen(dl2c);
+		}
+	}
+	return 0;
+}
+
 const struct diag_l2_proto diag_l2_proto_can = {
 	DIAG_L2_PROT_CAN,
 	"CAN",
-	0,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
+	DIAG_L2_FLAG_FRAMED | DIAG_L2_FLAG_CONNECTS_ALWAYS,
+	dl2p_can_startcomms,
+	dl2p_can_stopcomms,
+	dl2p_can_send,
+	dl2p_can_recv,
+	dl2p_can_request,
 	NULL,
-	NULL
+	dl2p_can_attach
 };
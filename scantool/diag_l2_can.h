@@ -22,15 +22,71 @@
  *
  *************************************************************************
  *
- * CAN.  Not written, but put in its own file for modularity.  It used
- * to be inline in L2.
+ * CAN : ISO 15765-2 transport (ISO-TP), with the ISO 15765-4 (OBD) addressing
+ * schemes : 11-bit IDs (0x7DF / 0x7E0-0x7E7 -> 0x7E8-0x7EF), or 29-bit
+ * normal fixed addressing (0x18DB33F1 / 0x18DAxxF1 -> 0x18DAF1xx) with
+ * DIAG_L2_TYPE_CAN29.
+ *
+ * Needs a L0 that passes raw CAN frames, see DIAG_L1_CAN in diag_l1.h.
+ * Messages up to 4095 bytes are segmented / reassembled here, with flow
+ * control in both directions. Responses to functional requests are
+ * reassembled concurrently, one per responding ECU; msg->src is the low
+ * byte of the response ID (0xE8-0xEF for 11-bit IDs, the ECU address
+ * for 29-bit IDs).
+ *
+ * If L0 offers kernel ISO-TP channels (DIAG_IOCTL_ISOTP_OPEN, e.g. SocketCAN
+ * with CAN_ISOTP) and cfg.kernel is set (off by default; DIAG_L2_TYPE_CANKERNEL
+ * at startcomms, "set isotp kernel" in scantool), the transport is left to
+ * it : one channel per (request ID, response ID) pair, i.e. one for physical
+ * addressing, eight for 11-bit functional addressing. 29-bit functional
+ * addressing always uses the engine in this driver, since the responders
+ * aren't known in advance. See dl2p_can_kernel().
  *
  */
 
+#include <stdbool.h>
+#include <stdint.h>
+
+struct diag_l2_conn;
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
 
+/** Flow control settings.
+ * The defaults are the fastest settings : peers get our permission to send
+ * everything at once, and we send as fast as the peer's flow control frames
+ * allow.
+ */
+struct diag_l2_can_cfg {
+	uint8_t rxbs;	/** block size announced in our flow control frames; 0 : no limit */
+	uint8_t rxstmin;	/** separation time announced in our flow control frames (STmin encoding) */
+	uint8_t txstmin;	/** minimum separation time between our consecutive frames (STmin encoding),
+				 * applied if the peer asks for less */
+	bool pad;	/** pad frames to 8 bytes (required by ISO 15765-4) */
+	uint8_t padbyte;
+	bool kernel;	/** leave the transport to L0 if it can (default off); with
+			 * kernel ISO-TP, txstmin replaces the peer's STmin
+			 * instead of being a floor */
+};
+
+#define DL2P_CAN_DEFAULT_CFG	{ 0, 0, 0, 1, 0x00, 0 }
+
+/** Change flow control settings of a connection
+ * @return 0 if ok
+ */
+int dl2p_can_setcfg(struct diag_l2_conn *dl2c, const struct diag_l2_can_cfg *cfg);
+
+/** Get flow control settings of a connection
+ * @return 0 if ok
+ */
+int dl2p_can_getcfg(struct diag_l2_conn *dl2c, struct diag_l2_can_cfg *cfg);
+
+/** Transport used by a connection
+ * @return 1 if L0 does it (kernel ISO-TP), 0 if this driver does, <0 if not a CAN connection
+ */
+int dl2p_can_kernel(struct diag_l2_conn *dl2c);
+
 #if defined(__cplusplus)
 }
 #endif
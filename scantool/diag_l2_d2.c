@@ -306,6 +306,25 @@ dl2p_d2_timeout(struct diag_l2_conn *d_l2_conn) {
 	}
 }
 
+/*
+ * After the initial wake-up, D2 ECUs are addressed by the header alone :
+ * nothing to send, the caller can ping the new ECU to check it's there.
+ */
+static int
+dl2p_d2_attach(struct diag_l2_conn *d_l2_conn, struct diag_l2_conn *base) {
+	struct diag_l2_d2 *dp;
+	int rv;
+
+	rv = diag_calloc(&dp, 1);
+	if (rv != 0) {
+		return diag_iseterr(rv);
+	}
+	dp->srcaddr = ((struct diag_l2_d2 *)base->diag_l2_proto_data)->srcaddr;
+	dp->dstaddr = d_l2_conn->diag_l2_destaddr;
+	d_l2_conn->diag_l2_proto_data = (void *)dp;
+	return 0;
+}
+
 const struct diag_l2_proto diag_l2_proto_d2 = {
 	DIAG_L2_PROT_D2,
 	"D2",
@@ -315,5 +334,6 @@ const struct diag_l2_proto diag_l2_proto_d2 = {
 	dl2p_d2_send,
 	dl2p_d2_recv,
 	dl2p_d2_request,
-	dl2p_d2_timeout
+	dl2p_d2_timeout,
+	dl2p_d2_attach
 };
@@ -26,6 +26,7 @@
  *
  */
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -178,6 +179,164 @@ dl2p_14230_decode(uint8_t *data, int len,
 	return (*hdrlen + *datalen + 1);
 }
 
+/*
+ * Monitor mode helper : from the first <len> bytes of a frame, return its
+ * total length (header + data + ckslen), 0 if more bytes are needed to tell,
+ * or <0 if this can't be the start of a 14230 frame.
+ * Unlike dl2p_14230_decode() this is silent, as it's called for every byte.
+ */
+static int
+dl2p_14230_framelen(const uint8_t *data, int len, int ckslen) {
+	int hdrlen, datalen;
+
+	if (len < 1) {
+		return 0;
+	}
+	if ((data[0] & 0xC0) == 0x40) {
+		/* CARB mode format byte, not part of 14230 */
+		return -1;
+	}
+
+	hdrlen = 1;
+	if (data[0] & 0x80) {
+		hdrlen += 2;	/* Target and source addresses */
+	}
+	datalen = data[0] & 0x3F;
+	if (datalen == 0) {
+		hdrlen += 1;	/* Additional length byte */
+		if (len < hdrlen) {
+			return 0;
+		}
+		datalen = data[hdrlen - 1];
+		if (datalen == 0) {
+			return -1;
+		}
+	}
+	return hdrlen + datalen + ckslen;
+}
+
+/*
+ * Monitor mode receive. We only listen, so the byte stream holds tester
+ * requests and ECU responses, possibly back to back, and whatever the
+ * fastinit wakeup pattern left behind. We read one byte at a time and
+ * timestamp each one; a frame ends as soon as its header says it's complete.
+ * If the line goes quiet mid-frame for longer than a legal inter-byte time
+ * (between P1max and P2min), the partial frame is discarded; a lone 0x00
+ * there is the fastinit wakeup pattern. Bytes that can't start a frame are
+ * dropped one at a time until a plausible header lines up.
+ *
+ * Raw frames (header and checksum included) are added to d_l2_conn->diag_msg
+ * with rxtime set to the arrival of their first byte. Frames that look like
+ * they come from a tester get DIAG_FMT_ISO_TESTER : according to the source
+ * address if there is one, otherwise if the frame followed at least P3min of
+ * silence (ECUs have to respond within P2max).
+ *
+ * Returns once the bus was idle for P2max after at least one frame, with the
+ * length of the first frame; DIAG_ERR_TIMEOUT if no frame was seen.
+ */
+static int
+dl2p_14230_monrecv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
+	struct diag_l2_14230 *dp;
+	struct diag_msg *tmsg;
+	unsigned long long tnow;
+	unsigned long gap = 0, tfirst = 0;
+	unsigned int tout, tgap;
+	int rv, flen, ckslen;
+
+	dp = (struct diag_l2_14230 *)d_l2_conn->diag_l2_proto_data;
+	ckslen = (d_l2_conn->diag_link->l1flags & DIAG_L1_STRIPSL2CKSUM) ? 0 : 1;
+	tgap = (d_l2_conn->diag_l2_p1max + d_l2_conn->diag_l2_p2min) / 2;
+	dp->rxoffset = 0;
+
+	while (1) {
+		if (dp->rxoffset) {
+			tout = tgap;
+		} else if (d_l2_conn->diag_msg) {
+			tout = d_l2_conn->diag_l2_p2max;
+		} else {
+			tout = timeout;
+		}
+
+		rv = diag_l1_recv(d_l2_conn->diag_link->l2_dl0d, 0,
+				&dp->rxbuf[dp->rxoffset], 1, tout);
+		tnow = diag_os_gethrt();
+
+		if (rv == DIAG_ERR_TIMEOUT) {
+			if (dp->rxoffset == 0) {
+				break;	/* Idle bus */
+			}
+			if ((dp->rxoffset > 1) || dp->rxbuf[0]) {
+				dp->mon_dropped += dp->rxoffset;
+				if (diag_l2_debug & DIAG_DEBUG_READ) {
+					fprintf(stderr, FLFMT "monitor: dropped truncated frame (%lu bytes dropped so far): ",
+						FL, dp->mon_dropped);
+					diag_data_dump(stderr, dp->rxbuf, (size_t) dp->rxoffset);
+					fprintf(stderr, "\n");
+				}
+			}
+			dp->rxoffset = 0;
+			continue;
+		}
+		if (rv <= 0) {
+			return rv;
+		}
+
+		d_l2_conn->tbus = diag_os_getms();
+		if (dp->rxoffset == 0) {
+			tfirst = d_l2_conn->tbus;
+			/* Silence before this frame; unknown for the very first one */
+			gap = dp->mon_tlast ?
+				(unsigned long) (diag_os_hrtus(tnow - dp->mon_tlast) / 1000) :
+				ULONG_MAX;
+		}
+		dp->mon_tlast = tnow;
+		dp->rxoffset++;
+
+		while (dp->rxoffset) {
+			flen = dl2p_14230_framelen(dp->rxbuf, dp->rxoffset, ckslen);
+			if (flen == 0) {
+				break;	/* Need more header bytes */
+			}
+			if (flen < 0) {
+				/* Resync : whatever follows was mid-stream too */
+				dp->mon_dropped++;
+				dp->rxoffset--;
+				memmove(dp->rxbuf, &dp->rxbuf[1], (size_t) dp->rxoffset);
+				gap = 0;
+				continue;
+			}
+			if (dp->rxoffset < flen) {
+				break;
+			}
+
+			tmsg = diag_allocmsg((size_t) flen);
+			if (tmsg == NULL) {
+				return diag_iseterr(DIAG_ERR_NOMEM);
+			}
+			memcpy(tmsg->data, dp->rxbuf, (size_t) flen);
+			tmsg->rxtime = tfirst;
+			if (dp->rxbuf[0] & 0x80) {
+				if ((dp->rxbuf[2] >= ISO14230_TESTER_MIN) &&
+					(dp->rxbuf[2] <= ISO14230_TESTER_MAX)) {
+					tmsg->fmt |= DIAG_FMT_ISO_TESTER;
+				}
+			} else if (gap >= d_l2_conn->diag_l2_p3min) {
+				tmsg->fmt |= DIAG_FMT_ISO_TESTER;
+			}
+			diag_l2_addmsg(d_l2_conn, tmsg);
+
+			dp->rxoffset -= flen;
+			memmove(dp->rxbuf, &dp->rxbuf[flen], (size_t) dp->rxoffset);
+			gap = 0;
+		}
+	}
+
+	if (d_l2_conn->diag_msg == NULL) {
+		return DIAG_ERR_TIMEOUT;
+	}
+	return (int) d_l2_conn->diag_msg->len;
+}
+
 /*
  * Internal receive function: does all the message building, but doesn't
  * do call back. Strips header and checksum; if address info was present
@@ -210,7 +369,10 @@ static int
 dl2p_14230_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 	struct diag_l2_14230 *dp;
 	int rv, l1_doesl2frame, l1flags;
-	unsigned int tout;
+	bool monframing;
+	bool rxcal;
+	unsigned int tout, nominal;
+	unsigned long tr;
 	int state;
 	struct diag_msg	*tmsg, *lastmsg;
 
@@ -234,6 +396,7 @@ dl2p_14230_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 		diag_freemsg(d_l2_conn->diag_msg);
 		d_l2_conn->diag_msg = NULL;
 	}
+	d_l2_conn->expect_seen = 0;
 
 	l1flags = d_l2_conn->diag_link->l1flags;
 
@@ -243,14 +406,20 @@ dl2p_14230_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 		l1_doesl2frame = 0;
 	}
 
-	if (l1_doesl2frame) {
-		if (timeout < SMART_TIMEOUT) { /* Extend timeouts */
-			timeout += 100;
-		}
-	}
+	/* Only the first receive after a request measures response latency */
+	rxcal = d_l2_conn->rxcal_armed;
+	d_l2_conn->rxcal_armed = 0;
+	nominal = timeout;
+	timeout = diag_l2_rxtout(d_l2_conn, nominal);
 
 
-	while (1) {
+	/* Passive framing needs per-byte timing, so not with smart L1s */
+	monframing = dp->monitor_mode && !l1_doesl2frame;
+	if (monframing) {
+		rv = dl2p_14230_monrecv(d_l2_conn, timeout);
+	}
+
+	while (!monframing) {
 		switch (state) {
 		case ST_STATE1:
 			tout = timeout;
@@ -266,7 +435,7 @@ dl2p_14230_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 		case ST_STATE3:
 			//State 3: we timed out during state 2
 			if (l1_doesl2frame) {
-				tout = 150;	/* Arbitrary, short, value ... */
+				tout = diag_l2_rxtout_gap(d_l2_conn, d_l2_conn->diag_l2_p2max);
 			} else {
 				tout = d_l2_conn->diag_l2_p2max;
 			}
@@ -286,6 +455,7 @@ dl2p_14230_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 		 * In l1_doesl2frame mode, we get full frames, so we don't
 		 * do the read in state2
 		 */
+		tr = diag_os_getms();
 		if ((state == ST_STATE2) && l1_doesl2frame) {
 			rv = DIAG_ERR_TIMEOUT;
 		} else {
@@ -309,6 +479,9 @@ dl2p_14230_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 				 * the timeout error
 				 */
 				if (dp->rxoffset == 0) {
+					if (rxcal) {
+						diag_l2_rxcal_update(&d_l2_conn->rxcal_rsp, nominal, 0, 1);
+					}
 					break;
 				}
 				/*
@@ -344,6 +517,17 @@ dl2p_14230_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 
 				}
 				state = ST_STATE3;
+				/*
+				 * Frames with address info carry the source in
+				 * the 3rd byte : stop early if all expected ECUs
+				 * have answered.
+				 */
+				if (((l1flags & DIAG_L1_NOHDRS) == 0) && (tmsg->len >= 3) &&
+					(tmsg->data[0] & 0x80) &&
+					diag_l2_expect_done(d_l2_conn, tmsg->data[2])) {
+					rv = d_l2_conn->diag_msg->len;
+					break;
+				}
 				continue;
 			case ST_STATE3:
 				/*
@@ -363,26 +547,26 @@ dl2p_14230_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 
 		/* Data received OK */
 		dp->rxoffset += rv;
+		d_l2_conn->tbus = diag_os_getms();
 
-		/* This was wrong : some valid 14230 frames can start with 0x00, and
-		 * would have their first byte deleted systematically.
-		 * Note, this is still wrong (monitor mode will still drop some valid frames),
-		 * but arguably less so.
+		/*
+		 * Smart L1 in monitor mode : a lone 0x00 "frame" is the
+		 * fastinit wakeup pattern, pretend it didn't exist.
+		 * (Valid frames can start with 0x00, those are kept.)
 		 */
-		if (dp->monitor_mode &&
-			(dp->rxoffset && (dp->rxbuf[0] == 0))) {
-			/*
-			 * We get this when in
-			 * monitor mode and there is
-			 * a fastinit, pretend it didn't exist
-			 */
-			dp->rxoffset--;
-			if (dp->rxoffset) {
-				memcpy(&dp->rxbuf[0], &dp->rxbuf[1],
-				       (size_t)dp->rxoffset);
-			}
+		if (dp->monitor_mode && (dp->rxoffset == 1) &&
+			(dp->rxbuf[0] == 0)) {
+			dp->rxoffset = 0;
 			continue;
 		}
+		if ((state == ST_STATE1) && rxcal) {
+			diag_l2_rxcal_update(&d_l2_conn->rxcal_rsp, nominal,
+				d_l2_conn->tbus - tr, 0);
+			rxcal = 0;
+		} else if ((state == ST_STATE3) && l1_doesl2frame) {
+			diag_l2_rxcal_update(&d_l2_conn->rxcal_gap, d_l2_conn->diag_l2_p2max,
+				d_l2_conn->tbus - tr, 0);
+		}
 		if ( (state == ST_STATE1) || (state == ST_STATE3) ) {
 			/*
 			 * Got some data in state1/3, now we're in a message
@@ -413,7 +597,7 @@ dl2p_14230_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 			rv = dl2p_14230_decode( tmsg->data,
 				tmsg->len,
 				&hdrlen, &datalen, &source, &dest,
-				dp->first_frame);
+				dp->first_frame && !monframing);
 
 			if (rv <= 0 || rv > 260) { /* decode failure */
 				return diag_iseterr(rv);
@@ -475,7 +659,7 @@ dl2p_14230_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 				dest);
 		}
 
-		tmsg->fmt = DIAG_FMT_FRAMED;
+		tmsg->fmt = (tmsg->fmt & DIAG_FMT_ISO_TESTER) | DIAG_FMT_FRAMED;
 
 		if ((l1flags & DIAG_L1_NOHDRS)==0) {
 			if ((tmsg->data[0] & 0xC0) == 0xC0) {
@@ -520,6 +704,8 @@ dl2p_14230_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 
 static int
 dl2p_14230_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg);
+static int
+dl2p_14230_atp(struct diag_l2_conn *d_l2_conn);
 /*
  * The complex initialisation routine for ISO14230, which supports
  * 2 types of initialisation (5-BAUD, FAST) and functional
@@ -537,7 +723,6 @@ dl2p_14230_startcomms( struct diag_l2_conn	*d_l2_conn, flag_type flags,
 	int rv;
 	unsigned int wait_time;
 	uint8_t cbuf[MAXRBUF];
-	unsigned int timeout;
 	struct diag_serial_settings set;
 
 	struct diag_l1_initbus_args in;
@@ -642,15 +827,10 @@ dl2p_14230_startcomms( struct diag_l2_conn	*d_l2_conn, flag_type flags,
 			rv=DIAG_ERR_GENERAL;
 			break;
 		}
-
-		if (d_l2_conn->diag_link->l1flags & DIAG_L1_DOESL2FRAME) {
-			timeout = 200;
-		} else {
-			timeout = d_l2_conn->diag_l2_p2max + RXTOFFSET;
-		}
+		d_l2_conn->rxcal_armed = 1;
 
 		/* And wait for a response, ISO14230 says will arrive in P2 */
-		rv = dl2p_14230_int_recv(d_l2_conn, timeout);
+		rv = dl2p_14230_int_recv(d_l2_conn, d_l2_conn->diag_l2_p2max);
 		if (rv < 0) {
 			break;
 		}
@@ -795,8 +975,8 @@ dl2p_14230_startcomms( struct diag_l2_conn	*d_l2_conn, flag_type flags,
 		fprintf(stderr, FLFMT "new modeflags=0x%04X\n", FL,
 			dp->modeflags);
 	}
-	//For now, we won't bother with Normal / Extended timings. We don't
-	//need to unless we use the AccessTimingParameters service (scary)
+	//For now, we won't bother with Normal / Extended timings; only the
+	//normal set is changed by AccessTimingParameters (see _atp() below)
 
 	/*
 	 * Now, we want to remove any rubbish left
@@ -821,6 +1001,18 @@ dl2p_14230_startcomms( struct diag_l2_conn	*d_l2_conn, flag_type flags,
 	/* And we're done */
 	dp->state = STATE_ESTABLISHED ;
 
+	/*
+	 * Try to get faster timings from the ECU. Only done with physical
+	 * addressing (we don't want to change the timings of every ECU on the
+	 * bus), and not with smart interfaces that handle timing themselves.
+	 * Failure is not an error : we just keep the default timings.
+	 */
+	if ((dp->initype != DIAG_L2_TYPE_MONINIT) &&
+			!(dp->modeflags & ISO14230_FUNCADDR) &&
+			!(d_l2_conn->diag_link->l1flags & (DIAG_L1_DOESL2FRAME | DIAG_L1_DOESFULLINIT))) {
+		(void) dl2p_14230_atp(d_l2_conn);
+	}
+
 	return 0;
 }
 
@@ -829,6 +1021,80 @@ static struct diag_msg *
 dl2p_14230_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg,
 		int *errval);
 
+/*
+ * Build the header for msg in hdr[], the shortest one the ECU accepts
+ * according to its keybytes (iso14230-2 4.2, 5.2.4.1). On the wire, before
+ * the data bytes and checksum :
+ *
+ *	Fmt			1 byte : no addresses, len < 64 in Fmt
+ *	Fmt Len			2 bytes : no addresses, length byte
+ *	Fmt Tgt Src		3 bytes : addresses, len < 64 in Fmt
+ *	Fmt Tgt Src Len		4 bytes : addresses, length byte
+ *
+ * Fmt = A1 A0 L5..L0 : A1A0 = 00 no address bytes, 10 physical, 11 functional
+ * addressing; L5..L0 = data length, or 0 if a Len byte follows.
+ * e.g. J1979 "01 0C" to ECU 0x10, from 0xF1 : "82 10 F1 01 0C" with
+ * addresses, "02 01 0C" without.
+ *
+ * Addresses are left out when the ECU accepts it, the message goes to the
+ * ECU we initialized with physical addressing, and no other connection
+ * shares the link (otherwise the header has to say who's talking to whom).
+ * If the ECU only takes addressless headers, we have no choice.
+ * Without keybytes (some smart L1s), we use addresses and len in Fmt.
+ *
+ * Returns header length, or <0 if the ECU can't take this message.
+ */
+static int
+dl2p_14230_header(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg,
+		uint8_t *hdr) {
+	struct diag_l2_14230 *dp;
+	uint8_t dest, src;
+	bool funcaddr;
+	bool addrs;
+	int offset;
+
+	dp = (struct diag_l2_14230 *)d_l2_conn->diag_l2_proto_data;
+
+	/* If user supplied addresses, use them, else use the originals */
+	dest = msg->dest ? msg->dest : dp->dstaddr;
+	src = msg->src ? msg->src : dp->srcaddr;
+	funcaddr = (dp->modeflags & ISO14230_FUNCADDR) &&
+			!(msg->fmt & DIAG_FMT_ISO_PHYSADDR);
+
+	if (!(dp->modeflags & ISO14230_SHORTHDR)) {
+		addrs = 1;
+	} else if (!(dp->modeflags & ISO14230_LONGHDR)) {
+		addrs = 0;
+	} else {
+		addrs = funcaddr || (dest != dp->dstaddr) || (src != dp->srcaddr) ||
+				(d_l2_conn->diag_link->nconns > 1);
+	}
+
+	if (addrs) {
+		hdr[0] = funcaddr ? 0xC0 : 0x80;
+		hdr[1] = dest;
+		hdr[2] = src;
+		offset = 3;
+	} else {
+		hdr[0] = 0;
+		offset = 1;
+	}
+
+	if ((msg->len < 64) &&
+			((dp->modeflags & ISO14230_FMTLEN) || !(dp->modeflags & ISO14230_LENBYTE))) {
+		//length in format byte if the ECU supports it, or doesn't support a length byte
+		hdr[0] |= msg->len;
+	} else if (dp->modeflags & ISO14230_LENBYTE) {
+		hdr[offset] = msg->len;
+		offset += 1;
+	} else {
+		fprintf(stderr, FLFMT "can't send >64 byte msgs to this ECU !\n", FL);
+		return DIAG_ERR_BADLEN;
+	}
+
+	return offset;
+}
+
 /* _stopcomms:
  * Send a stopcomms message, and wait for the +ve response, for upto
  * p3max
@@ -918,61 +1184,14 @@ dl2p_14230_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg) {
 	if (d_l2_conn->diag_link->l1flags & DIAG_L1_DATAONLY) {
 		rv = diag_l1_send (d_l2_conn->diag_link->l2_dl0d, NULL,
 				msg->data, msg->len, d_l2_conn->diag_l2_p4min);
+		d_l2_conn->tbus = diag_os_getms();
 		return rv? diag_iseterr(rv):0;
 	}
 
 	/* Build the new message */
-
-	if ((dp->modeflags & ISO14230_LONGHDR) || !(dp->modeflags & ISO14230_SHORTHDR)) {
-		//we use full headers if they're supported or if we don't have a choice.
-		//set the "address present" bit
-		//and functional addressing if applicable
-		if (dp->modeflags & ISO14230_FUNCADDR) {
-			buf[0] = 0xC0;
-		} else {
-			buf[0] = 0x80;
-		}
-
-		/* If user supplied addresses, use them, else use the originals */
-		if (msg->dest) {
-			buf[1] = msg->dest;
-		} else {
-			buf[1] = dp->dstaddr;
-		}
-
-		if (msg->src) {
-			buf[2] = msg->src;
-		} else {
-			buf[2] = dp->srcaddr;
-		}
-		offset = 3;
-	} else if (dp->modeflags & ISO14230_SHORTHDR) {
-		//here, short addressless headers are required.
-		//basic format byte : 0
-		buf[0]=0;
-		offset = 1 ;
-	}
-
-
-
-	if ((dp->modeflags & ISO14230_FMTLEN)|| !(dp->modeflags & ISO14230_LENBYTE)) {
-		//if ECU supports length in format byte, or doesn't support extra len byte
-		if (msg->len < 64) {
-			buf[0] |= msg->len;
-		} else {
-			//len >=64, can we use a length byte ?
-			if (dp->modeflags & ISO14230_LENBYTE) {
-				buf[offset] = msg->len;
-				offset += 1;
-			} else {
-				fprintf(stderr, FLFMT "can't send >64 byte msgs to this ECU !\n", FL);
-				return diag_iseterr(DIAG_ERR_BADLEN);
-			}
-		}
-	} else if (dp->modeflags & ISO14230_LENBYTE) {
-		// if the ecu needs a length byte
-		buf[offset] = msg->len;
-		offset += 1;
+	offset = dl2p_14230_header(d_l2_conn, msg, buf);
+	if (offset < 0) {
+		return diag_iseterr(offset);
 	}
 
 	memcpy(&buf[offset], msg->data, msg->len);
@@ -991,13 +1210,14 @@ dl2p_14230_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg) {
 		fprintf(stderr, "\n");
 	}
 
-	/* Wait p3min milliseconds, but not if doing fast/slow init */
+	/* Wait until p3min after the last response, but not if doing fast/slow init */
 	if (dp->state == STATE_ESTABLISHED) {
-		diag_os_millisleep(d_l2_conn->diag_l2_p3min);
+		diag_l2_waitp3(d_l2_conn);
 	}
 
 	rv = diag_l1_send (d_l2_conn->diag_link->l2_dl0d, NULL,
 		buf, len, d_l2_conn->diag_l2_p4min);
+	d_l2_conn->tbus = diag_os_getms();
 
 	return rv? diag_iseterr(rv):0;
 }
@@ -1076,7 +1296,7 @@ dl2p_14230_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg,
 		/* do read only if no messages pending */
 		if (!d_l2_conn->diag_msg) {
 			rv = dl2p_14230_int_recv(d_l2_conn,
-				d_l2_conn->diag_l2_p2max + 10);
+				d_l2_conn->diag_l2_p2max);
 
 			if (rv < 0) {
 				*errval = DIAG_ERR_TIMEOUT;
@@ -1161,6 +1381,129 @@ dl2p_14230_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg,
 	return rmsg;
 }
 
+/*
+ * AccessTimingParameters negotiation (iso14230-3 SID 0x83) :
+ * read the limits of the ECU's timing parameters, then request the
+ * shortest P2min, P2max and P3min it supports (clamped to what we can handle
+ * reliably). P3max is left unchanged, P4min is only ever increased.
+ * If the ECU doesn't support the service or refuses the new values, the
+ * connection keeps its current timings.
+ * Ret 0 if new timings were applied.
+ */
+static int
+dl2p_14230_atp(struct diag_l2_conn *d_l2_conn) {
+	struct diag_msg msg = {0};
+	struct diag_msg *rxmsg;
+	uint8_t data[7];
+	uint8_t lim[5];	/* raw P2min, P2max, P3min, P3max, P4min limits */
+	unsigned int p2min, p2max, p3min, p4min;
+	int errval;
+
+	msg.data = data;
+	msg.len = 2;
+	data[0] = DIAG_KW2K_SI_ATP;
+	data[1] = DIAG_KW2K_ATP_RDLIM;
+
+	rxmsg = dl2p_14230_request(d_l2_conn, &msg, &errval);
+	if (rxmsg == NULL) {
+		if (diag_l2_debug & DIAG_DEBUG_PROTO) {
+			fprintf(stderr, FLFMT "_atp: no response to read limits (%d)\n",
+				FL, errval);
+		}
+		return errval? errval:DIAG_ERR_GENERAL;
+	}
+
+	if (errval || (rxmsg->len < 7) || (rxmsg->data[0] != DIAG_KW2K_RC_ATPPR) ||
+			(rxmsg->data[1] != DIAG_KW2K_ATP_RDLIM) ||
+			(rxmsg->data[3] > 0xF0)) {
+		/* neg response, malformed, or special P2max encoding */
+		if (diag_l2_debug & DIAG_DEBUG_PROTO) {
+			fprintf(stderr, FLFMT "_atp: ECU refused read limits, "
+				"keeping default timings\n", FL);
+		}
+		diag_freemsg(rxmsg);
+		return DIAG_ERR_ECUSAIDNO;
+	}
+	memcpy(lim, &rxmsg->data[2], sizeof(lim));
+	diag_freemsg(rxmsg);
+
+	/* Convert limits to ms, rounding up */
+	p2min = (lim[0] * DIAG_KW2K_ATP_RES_P2MIN + 999) / 1000;
+	p2max = (lim[1] * DIAG_KW2K_ATP_RES_P2MAX + 999) / 1000;
+	p3min = (lim[2] * DIAG_KW2K_ATP_RES_P3MIN + 999) / 1000;
+	p4min = (lim[4] * DIAG_KW2K_ATP_RES_P4MIN + 999) / 1000;
+
+	/* Clamp to safe values */
+	if (p2max < ISO14230_ATP_MIN_P2MAX) {
+		p2max = ISO14230_ATP_MIN_P2MAX;
+	}
+	if (p2max > d_l2_conn->diag_l2_p2max) {
+		p2max = d_l2_conn->diag_l2_p2max;
+	}
+	if (p2min >= p2max) {
+		p2min = d_l2_conn->diag_l2_p2min;
+	}
+	if (p3min < ISO14230_ATP_MIN_P3MIN) {
+		p3min = ISO14230_ATP_MIN_P3MIN;
+	}
+	if (p3min > d_l2_conn->diag_l2_p3min) {
+		p3min = d_l2_conn->diag_l2_p3min;
+	}
+	if (p4min < d_l2_conn->diag_l2_p4min) {
+		p4min = d_l2_conn->diag_l2_p4min;
+	}
+
+	/* Now request those values. */
+	msg.len = 7;
+	data[1] = DIAG_KW2K_ATP_SETVAL;
+	data[2] = (uint8_t) (p2min * 1000 / DIAG_KW2K_ATP_RES_P2MIN);
+	data[3] = (uint8_t) (p2max * 1000 / DIAG_KW2K_ATP_RES_P2MAX);
+	data[4] = (uint8_t) (p3min * 1000 / DIAG_KW2K_ATP_RES_P3MIN);
+	data[5] = (uint8_t) (d_l2_conn->diag_l2_p3max * 1000 / DIAG_KW2K_ATP_RES_P3MAX);
+	data[6] = (uint8_t) (p4min * 1000 / DIAG_KW2K_ATP_RES_P4MIN);
+
+	rxmsg = dl2p_14230_request(d_l2_conn, &msg, &errval);
+	if (rxmsg == NULL) {
+		/*
+		 * We can't know if the ECU switched timings or not; the defaults
+		 * are always the safest choice so try to restore them.
+		 */
+		if (diag_l2_debug & DIAG_DEBUG_PROTO) {
+			fprintf(stderr, FLFMT "_atp: no response to set values, "
+				"resetting defaults\n", FL);
+		}
+		msg.len = 2;
+		data[1] = DIAG_KW2K_ATP_SETDEF;
+		rxmsg = dl2p_14230_request(d_l2_conn, &msg, &errval);
+		if (rxmsg) {
+			diag_freemsg(rxmsg);
+		}
+		return DIAG_ERR_TIMEOUT;
+	}
+
+	if (errval || (rxmsg->len < 1) || (rxmsg->data[0] != DIAG_KW2K_RC_ATPPR)) {
+		if (diag_l2_debug & DIAG_DEBUG_PROTO) {
+			fprintf(stderr, FLFMT "_atp: ECU refused new timings, "
+				"keeping default timings\n", FL);
+		}
+		diag_freemsg(rxmsg);
+		return DIAG_ERR_ECUSAIDNO;
+	}
+	diag_freemsg(rxmsg);
+
+	d_l2_conn->diag_l2_p2min = p2min;
+	d_l2_conn->diag_l2_p2max = p2max;
+	d_l2_conn->diag_l2_p3min = p3min;
+	d_l2_conn->diag_l2_p4min = p4min;
+
+	if (diag_l2_debug & DIAG_DEBUG_PROTO) {
+		fprintf(stderr, FLFMT "_atp: new timings P2=%u-%u P3min=%u P4min=%u\n",
+			FL, p2min, p2max, p3min, p4min);
+	}
+
+	return 0;
+}
+
 /*
  * Timeout, - if we don't send something to the ECU it will timeout
  * soon, so send it a keepalive message now.
@@ -1170,10 +1513,6 @@ dl2p_14230_timeout(struct diag_l2_conn *d_l2_conn) {
 	struct diag_l2_14230 *dp;
 	struct diag_msg msg = {0};
 	uint8_t data[256];
-	unsigned int timeout;
-	int debug_l2_orig=diag_l2_debug;	//save debug flags; disable them for this procedure
-	int debug_l1_orig=diag_l1_debug;
-	int debug_l0_orig=diag_l0_debug;
 
 	dp = (struct diag_l2_14230 *)d_l2_conn->diag_l2_proto_data;
 
@@ -1183,10 +1522,8 @@ dl2p_14230_timeout(struct diag_l2_conn *d_l2_conn) {
 				FL, (void *)d_l2_conn);
 	}
 
-	diag_l2_debug=0;	//disable
-	diag_l1_debug=0;
-	diag_l0_debug=0;
-
+	/* Debug flags are left alone : this runs in the periodic callback
+	 * thread, while the main thread reads them. */
 	msg.data = data;
 
 	/* Prepare the "keepalive" message */
@@ -1213,30 +1550,100 @@ dl2p_14230_timeout(struct diag_l2_conn *d_l2_conn) {
 	/* Send it, important to use l2_send as it updates the timers */
 	(void)diag_l2_send(d_l2_conn, &msg);
 
+	/* Get the response in p2max; _int_recv adds the calibrated offset */
+	(void)diag_l2_recv(d_l2_conn, d_l2_conn->diag_l2_p2max, NULL, NULL);
+}
+/*
+ * _attach : talk to another ECU over the session set up by base's init.
+ * ECUs woken by a functional init are in session already, others may
+ * accept a StartCommunication request without the wake-up pattern; either
+ * way, any response (positive or negative) proves the ECU is listening.
+ * Needs address bytes in the headers, which DATAONLY L1s don't let us set.
+ */
+static int
+dl2p_14230_attach(struct diag_l2_conn *d_l2_conn, struct diag_l2_conn *base) {
+	struct diag_l2_14230 *dp, *bp;
+	struct diag_msg msg = {0};
+	struct diag_msg *rxmsg, *rsp;
+	uint8_t data[1];
+	int rv, errval = 0;
+
+	bp = (struct diag_l2_14230 *)base->diag_l2_proto_data;
+
+	if (bp->monitor_mode ||
+			(d_l2_conn->diag_link->l1flags & DIAG_L1_DATAONLY) ||
+			((bp->modeflags & ISO14230_SHORTHDR) && !(bp->modeflags & ISO14230_LONGHDR))) {
+		return diag_iseterr(DIAG_ERR_PROTO_NOTSUPP);
+	}
+
+	rv = diag_calloc(&dp, 1);
+	if (rv != 0) {
+		return diag_iseterr(rv);
+	}
+	dp->initype = bp->initype;
+	dp->srcaddr = bp->srcaddr;
+	dp->dstaddr = d_l2_conn->diag_l2_destaddr;
+	dp->modeflags = bp->modeflags & ~ISO14230_FUNCADDR;
+	dp->state = STATE_ESTABLISHED;
+	d_l2_conn->diag_l2_proto_data = (void *)dp;
+
+	data[0] = DIAG_KW2K_SI_SCR;
+	msg.data = data;
+	msg.len = 1;
+	rxmsg = dl2p_14230_request(d_l2_conn, &msg, &errval);
+	if (rxmsg == NULL) {
+		free(dp);
+		d_l2_conn->diag_l2_proto_data = NULL;
+		return diag_iseterr(errval ? errval : DIAG_ERR_TIMEOUT);
+	}
+
 	/*
-	 * Get the response in p2max, we allow longer, and even
-	 * longer on "smart" L2 interfaces
+	 * Other ECUs may be talking on the shared link : only a response
+	 * from the target counts. Any response does (an ECU already in a
+	 * session may refuse a second StartCommunication), it's alive.
 	 */
-	timeout = d_l2_conn->diag_l2_p2max;
-	if (d_l2_conn->diag_link->l1flags & DIAG_L1_DOESL2FRAME) {
-		if (timeout < SMART_TIMEOUT) {
-			timeout += SMART_TIMEOUT;
+	for (rsp = rxmsg; rsp != NULL; rsp = rsp->next) {
+		if ((rsp->src == dp->dstaddr) && (rsp->len >= 1)) {
+			break;
+		}
+	}
+	if (rsp == NULL) {
+		if (diag_l2_debug & DIAG_DEBUG_PROTO) {
+			fprintf(stderr, FLFMT "_attach 0x%02X : no response from it\n",
+				FL, dp->dstaddr);
 		}
+		diag_freemsg(rxmsg);
+		free(dp);
+		d_l2_conn->diag_l2_proto_data = NULL;
+		return diag_iseterr(DIAG_ERR_TIMEOUT);
 	}
-	(void)diag_l2_recv(d_l2_conn, timeout, NULL, NULL);
-	diag_l2_debug=debug_l2_orig;	//restore debug flags
-	diag_l1_debug=debug_l1_orig;
-	diag_l0_debug=debug_l0_orig;
 
+	if ((rsp->data[0] == DIAG_KW2K_RC_SCRPR) && (rsp->len >= 3)) {
+		/* Fresh session : this ECU's own keybytes apply */
+		d_l2_conn->diag_l2_kb1 = rsp->data[1];
+		d_l2_conn->diag_l2_kb2 = rsp->data[2];
+		dp->modeflags &= ~(ISO14230_FMTLEN | ISO14230_LENBYTE);
+		dp->modeflags |= ((d_l2_conn->diag_l2_kb1 & 1)? ISO14230_FMTLEN:0) |
+				((d_l2_conn->diag_l2_kb1 & 2)? ISO14230_LENBYTE:0);
+	}
+
+	if (diag_l2_debug & DIAG_DEBUG_PROTO) {
+		fprintf(stderr, FLFMT "_attach 0x%02X : response 0x%02X, modeflags=0x%04X\n",
+			FL, dp->dstaddr, rsp->data[0], dp->modeflags);
+	}
+	diag_freemsg(rxmsg);
+	return 0;
 }
+
 const struct diag_l2_proto diag_l2_proto_iso14230 = {
 	DIAG_L2_PROT_ISO14230,
 	"ISO14230",
-	DIAG_L2_FLAG_FRAMED | DIAG_L2_FLAG_KEEPALIVE,
+	DIAG_L2_FLAG_FRAMED | DIAG_L2_FLAG_KEEPALIVE | DIAG_L2_FLAG_PHYSADDR,
 	dl2p_14230_startcomms,
 	dl2p_14230_stopcomms,
 	dl2p_14230_send,
 	dl2p_14230_recv,
 	dl2p_14230_request,
-	dl2p_14230_timeout
+	dl2p_14230_timeout,
+	dl2p_14230_attach
 };
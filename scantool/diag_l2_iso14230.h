@@ -51,7 +51,9 @@ struct diag_l2_14230 {
 					monitor mode when we need to find
 					out whether we see a CARB or normal
 					init */
-	bool monitor_mode;	/* if set, expect possible spurious 0x00 bytes caused by fastinit break */
+	bool monitor_mode;	/* if set, passively frame bus traffic; see dl2p_14230_monrecv() */
+	unsigned long long mon_tlast;	/* monitor : hrt timestamp of last byte seen (0 : none yet) */
+	unsigned long mon_dropped;	/* monitor : bytes discarded while resyncing */
 
 	uint8_t rxbuf[MAXRBUF];	/* Receive buffer, for building message in */
 	int rxoffset;		/* Offset to write into buffer */
@@ -67,13 +69,14 @@ struct diag_l2_14230 {
 
 //ISO14230_LONGHDR : if set, we can send headers with the address bytes.
 // Set according to the keybytes. If this and SHORTHDR are set, we
-// send addressless headers by default.
+// send addressless headers unless the message needs addresses; see
+// dl2p_14230_header().
 #define ISO14230_LONGHDR 0x2
 
 //ISO14230_LENBYTE: If set, tell the iso14230 code to always use messages
 // with a length byte. This is primarily for SSF14230 - the Swedish vehicle
 // implementation of ISO14230, but is set if required by the StartComms keybytes.
-//If FMTLEN and LENBYTE are set, then we choose the most adequate.
+//If FMTLEN and LENBYTE are set, then we choose the shortest.
 #define ISO14230_LENBYTE 0x4
 
 //ISO14230_FMTLEN: if set, we can send headers with the length encoded in
@@ -89,6 +92,18 @@ struct diag_l2_14230 {
 
 
 
+// Source addresses reserved for off-board test equipment (SAE J2178-1).
+// Used to tell tester requests from ECU responses in monitor mode.
+#define ISO14230_TESTER_MIN	0xF0
+#define ISO14230_TESTER_MAX	0xFD
+
+
+// Lower bounds for timings negotiated with AccessTimingParameters (ms).
+// We can't reliably detect the end of responses with a shorter P2max,
+// nor guarantee much less than ~10ms between requests on most OSes.
+#define ISO14230_ATP_MIN_P2MAX	25
+#define ISO14230_ATP_MIN_P3MIN	10
+
 
 #if defined(__cplusplus)
 extern "C" {
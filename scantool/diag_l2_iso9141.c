@@ -95,13 +95,13 @@ dl2p_iso9141_wakeupECU(struct diag_l2_conn *d_l2_conn) {
 	// The L1 device has read the 0x55, and reset the previous speed.
 
 	// Receive the first KeyByte:
-	rv = diag_l1_recv (d_l2_conn->diag_link->l2_dl0d, 0, &kb1, 1, W2max+RXTOFFSET);
+	rv = diag_l1_recv (d_l2_conn->diag_link->l2_dl0d, 0, &kb1, 1, diag_l2_rxtout(d_l2_conn, W2max));
 	if (rv < 0) {
 		return diag_iseterr(DIAG_ERR_WRONGKB);
 	}
 
 	// Receive the second KeyByte:
-	rv = diag_l1_recv (d_l2_conn->diag_link->l2_dl0d, 0, &kb2, 1, W3max+RXTOFFSET);
+	rv = diag_l1_recv (d_l2_conn->diag_link->l2_dl0d, 0, &kb2, 1, diag_l2_rxtout(d_l2_conn, W3max));
 	if (rv < 0) {
 		return diag_iseterr(DIAG_ERR_WRONGKB);
 	}
@@ -139,12 +139,11 @@ dl2p_iso9141_wakeupECU(struct diag_l2_conn *d_l2_conn) {
 			return diag_iseterr(rv);
 		}
 
-		// Wait for the address byte inverted:
-		// XXX I added RXTOFFSET as a band-aid fix for systems, like
-		//mine, that don't receive ~addr with only W4max. See #define
+		// Wait for the address byte inverted. Some systems
+		//don't receive ~addr within W4max alone, hence the offset.
 		//NOTE : l2_iso14230 uses a huge 350ms timeout for this!!
 		rv = diag_l1_recv (d_l2_conn->diag_link->l2_dl0d, 0,
-					&inv_address, 1, W4max + RXTOFFSET);
+					&inv_address, 1, diag_l2_rxtout(d_l2_conn, W4max));
 		if (rv < 0) {
 			if (diag_l2_debug & DIAG_DEBUG_OPEN) {
 				fprintf(stderr,
@@ -349,6 +348,9 @@ int
 dl2p_iso9141_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 	int rv, l1_doesl2frame, l1flags;
 	unsigned int tout = 0;
+	unsigned int nominal;
+	unsigned long tr;
+	bool rxcal;
 	int state;
 	struct diag_l2_iso9141 *dp;
 	struct diag_msg *tmsg, *lastmsg;
@@ -369,16 +371,18 @@ dl2p_iso9141_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 		diag_freemsg(d_l2_conn->diag_msg);
 		d_l2_conn->diag_msg = NULL;
 	}
+	d_l2_conn->expect_seen = 0;
 
 	// Check if L1 device does L2 framing:
 	l1flags = d_l2_conn->diag_link->l1flags;
 	l1_doesl2frame = (l1flags & DIAG_L1_DOESL2FRAME);
-	if (l1_doesl2frame) {
-		// Extend timeouts for the "smart" interfaces:
-		if (timeout < SMART_TIMEOUT) {
-			timeout += SMART_TIMEOUT;
-		}
-	}
+
+	// Extend timeouts by the calibrated offset; only the first
+	// receive after a request measures response latency.
+	rxcal = d_l2_conn->rxcal_armed;
+	d_l2_conn->rxcal_armed = 0;
+	nominal = timeout;
+	timeout = diag_l2_rxtout(d_l2_conn, nominal);
 
 	// Message read cycle: byte-per-byte for passive interfaces,
 	// frame-per-frame for smart interfaces (DOESL2FRAME).
@@ -412,16 +416,16 @@ dl2p_iso9141_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 				// but we'll use p3min.
 				// Aditionaly, for "smart" interfaces, we expand
 				// the timeout to let them process the data.
-				//TODO: maybe set tout=p3min + margin ?
 				tout = d_l2_conn->diag_l2_p3min;
 				if (l1_doesl2frame) {
-					tout += SMART_TIMEOUT;
+					tout = diag_l2_rxtout_gap(d_l2_conn, tout);
 				}
 				break;
 		}
 
 		// If L0/L1 does L2 framing, we get full frames, so we don't
 		// need to do the read byte-per-byte (skip state2):
+		tr = diag_os_getms();
 		if ((state == ST_STATE2) && l1_doesl2frame) {
 			rv = DIAG_ERR_TIMEOUT;
 		} else if (dp->rxoffset == MAXLEN_ISO9141) {
@@ -440,6 +444,9 @@ dl2p_iso9141_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 					// If we got 0 bytes on the 1st read,
 					// just return the timeout error.
 					if (dp->rxoffset == 0) {
+						if (rxcal) {
+							diag_l2_rxcal_update(&d_l2_conn->rxcal_rsp, nominal, 0, 1);
+						}
 						break;
 					}
 
@@ -472,6 +479,15 @@ dl2p_iso9141_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 					// Add received message to response list:
 					diag_l2_addmsg(d_l2_conn, tmsg);
 
+					// Source address is the 3rd header byte; if every
+					// expected ECU has answered, no need to wait for more.
+					if (((l1flags & DIAG_L1_NOHDRS) == 0) && (tmsg->len >= 3) &&
+						diag_l2_expect_done(d_l2_conn, tmsg->data[2])) {
+						rv = d_l2_conn->diag_msg->len;
+						state = ST_STATE3;
+						break;
+					}
+
 					// Finished this one, get more:
 					state = ST_STATE3;
 					continue;
@@ -501,10 +517,20 @@ dl2p_iso9141_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 		// Data received OK.
 		// Add length to offset.
 		dp->rxoffset += (uint8_t) rv;
+		d_l2_conn->tbus = diag_os_getms();
 
 		// This is where some tweaking might be needed if
 		// we are in monitor mode... but not yet.
 
+		if ((state == ST_STATE1) && rxcal) {
+			diag_l2_rxcal_update(&d_l2_conn->rxcal_rsp, nominal,
+				d_l2_conn->tbus - tr, 0);
+			rxcal = 0;
+		} else if ((state == ST_STATE3) && l1_doesl2frame) {
+			diag_l2_rxcal_update(&d_l2_conn->rxcal_gap, d_l2_conn->diag_l2_p3min,
+				d_l2_conn->tbus - tr, 0);
+		}
+
 		// Got some data in state1/3, now we're in a message!
 		if ((state == ST_STATE1) || (state == ST_STATE3)) {
 			state = ST_STATE2;
@@ -656,7 +682,6 @@ dl2p_iso9141_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout,
 static int
 dl2p_iso9141_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg) {
 	int rv;
-	unsigned int sleeptime;
 	uint8_t buf[MAXLEN_ISO9141];
 	int offset;
 	struct diag_l2_iso9141 *dp;
@@ -675,15 +700,11 @@ dl2p_iso9141_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg) {
 	}
 
 	/*
-	 * Make sure enough time between last receive and this send
-	 * In fact, because of the timeout on recv(), this is pretty small, but
-	 * we take the safe road and wait the whole of p3min plus whatever
-	 * delay happened before
+	 * Make sure enough time between last receive and this send.
+	 * Because of the p3min timeout at the end of recv(), this is
+	 * often nothing at all.
 	 */
-	sleeptime = d_l2_conn->diag_l2_p3min;
-	if (sleeptime > 0) {
-		diag_os_millisleep(sleeptime);
-	}
+	diag_l2_waitp3(d_l2_conn);
 
 	offset = 0;
 
@@ -691,6 +712,7 @@ dl2p_iso9141_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg) {
 	if (d_l2_conn->diag_link->l1flags & DIAG_L1_DATAONLY) {
 		rv = diag_l1_send (d_l2_conn->diag_link->l2_dl0d, NULL,
 				msg->data, msg->len, d_l2_conn->diag_l2_p4min);
+		d_l2_conn->tbus = diag_os_getms();
 		return rv? diag_iseterr(rv):0;
 	}
 
@@ -718,7 +740,7 @@ dl2p_iso9141_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg) {
 	// Send it over the L1 link:
 	rv = diag_l1_send (d_l2_conn->diag_link->l2_dl0d, NULL,
 			buf, (size_t)offset, d_l2_conn->diag_l2_p4min);
-
+	d_l2_conn->tbus = diag_os_getms();
 
 	return rv? diag_iseterr(rv):0;
 }
@@ -738,7 +760,7 @@ dl2p_iso9141_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg,
 	}
 
 	/* And wait for response */
-	rv = dl2p_iso9141_int_recv(d_l2_conn, d_l2_conn->diag_l2_p2max + RXTOFFSET);
+	rv = dl2p_iso9141_int_recv(d_l2_conn, d_l2_conn->diag_l2_p2max);
 	if ((rv >= 0) && d_l2_conn->diag_msg) {
 		/* OK */
 		rmsg = d_l2_conn->diag_msg;
@@ -761,5 +783,6 @@ const struct diag_l2_proto diag_l2_proto_iso9141 = {
 	dl2p_iso9141_send,
 	dl2p_iso9141_recv,
 	dl2p_iso9141_request,
+	NULL,
 	NULL
 };
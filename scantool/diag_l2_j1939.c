@@ -0,0 +1,613 @@
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * Diag
+ *
+ * L2 driver for SAE J1939-21, see diag_l2_j1939.h
+ *
+ * Single frames become messages as they are. Transport protocol transfers
+ * (TP.CM BAM or RTS, then TP.DT packets) are reassembled whoever they are
+ * addressed to : the message is allocated with the size announced by
+ * TP.CM, and each TP.DT packet is copied to its place according to its
+ * sequence number, so packets sent again after a CTS don't hurt. The
+ * message is passed up once every packet has been seen; CTS and EndOfMsgAck
+ * aren't needed for that. Up to J1939_MAXTP transfers (one per source /
+ * destination pair) are reassembled side by side.
+ *
+ * L0 is asked (DIAG_IOCTL_CAN_RXEFF) to drop 11-bit frames itself; if it
+ * can't, they are dropped here.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "diag.h"
+#include "diag_err.h"
+#include "diag_os.h"
+#include "diag_l1.h"
+#include "diag_l2.h"
+
+#include "diag_l2_j1939.h"
+
+#define J1939_FRAMELEN	(DIAG_L1_CAN_HDRLEN + DIAG_L1_CAN_MAXDLC)
+#define J1939_RXBATCH	64	/* max frames read by one recv() call once a message is ready */
+#define J1939_DRAINTMO	1	/* ms, L1 timeout while draining the queue */
+#define J1939_MAXTP	32	/* concurrent TP reassemblies */
+#define J1939_TXPRIO	6
+
+/* Timings (ms), J1939-21 */
+#define J1939_TR	200	/* request -> response */
+#define J1939_T3	1250	/* longest gap in a TP transfer (RTS -> CTS -> DT) */
+
+/* TP.CM control bytes */
+#define TPCM_RTS	16
+#define TPCM_CTS	17
+#define TPCM_EOMA	19
+#define TPCM_BAM	32
+#define TPCM_ABORT	255
+
+#define J1939_PDU2	240	/* PF >= 240 : broadcast, PS is a group extension */
+#define J1939_GLOBAL	0xFF	/* destination address */
+
+struct j1939_tp {
+	struct diag_msg *msg;	/* being reassembled, NULL : slot unused */
+	unsigned int size;	/* data bytes announced by TP.CM */
+	uint8_t src;
+	uint8_t dest;
+	uint8_t npkts;	/* packets announced by TP.CM */
+	uint8_t got;	/* different packets seen */
+	uint8_t seen[32];	/* bitmap, packet n is bit (n - 1) */
+	unsigned long tlast;	/* last TP frame of this transfer */
+};
+
+struct dl2p_j1939 {
+	struct dl2p_j1939_stats stats;
+	struct j1939_tp tp[J1939_MAXTP];
+	unsigned int ntp;	/* slots in use */
+};
+
+extern const struct diag_l2_proto diag_l2_proto_j1939;
+
+
+int dl2p_j1939_getstats(struct diag_l2_conn *dl2c, struct dl2p_j1939_stats *stats) {
+	if (dl2c->l2proto != &diag_l2_proto_j1939) {
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
+	*stats = ((struct dl2p_j1939 *)dl2c->diag_l2_proto_data)->stats;
+	return 0;
+}
+
+static void
+j1939_tpdrop(struct dl2p_j1939 *dp, struct j1939_tp *tp, bool lost) {
+	diag_freemsg(tp->msg);
+	tp->msg = NULL;
+	dp->ntp--;
+	if (lost) {
+		dp->stats.tp_lost++;
+	}
+	return;
+}
+
+static struct j1939_tp *
+j1939_tpfind(struct dl2p_j1939 *dp, uint8_t src, uint8_t dest) {
+	unsigned int i;
+
+	if (dp->ntp == 0) {
+		return NULL;
+	}
+	for (i = 0; i < J1939_MAXTP; i++) {
+		struct j1939_tp *tp = &dp->tp[i];
+
+		if (tp->msg && (tp->src == src) && (tp->dest == dest)) {
+			return tp;
+		}
+	}
+	return NULL;
+}
+
+/* Drop transfers that went quiet for longer than T3 */
+static void
+j1939_tpexpire(struct dl2p_j1939 *dp, unsigned long now) {
+	unsigned int i;
+
+	for (i = 0; (i < J1939_MAXTP) && dp->ntp; i++) {
+		struct j1939_tp *tp = &dp->tp[i];
+
+		if (tp->msg && ((long) (now - tp->tlast) > J1939_T3)) {
+			if (diag_l2_debug & DIAG_DEBUG_READ) {
+				fprintf(stderr, FLFMT "TP %02X -> %02X : timeout after %u/%u packets\n",
+					FL, tp->src, tp->dest, tp->got, tp->npkts);
+			}
+			j1939_tpdrop(dp, tp, 1);
+		}
+	}
+	return;
+}
+
+/* TP.CM : start a transfer (BAM, RTS) or drop one (abort). Anything else
+ * is between the two nodes. */
+static void
+j1939_tpcm(struct dl2p_j1939 *dp, uint8_t prio, uint8_t src, uint8_t dest,
+		const uint8_t *data, unsigned int dlc) {
+	struct j1939_tp *tp, *oldest;
+	unsigned int size, i;
+	uint32_t pgn;
+
+	if (dlc != DIAG_L1_CAN_MAXDLC) {
+		dp->stats.ignored++;
+		return;
+	}
+
+	switch (data[0]) {
+	case TPCM_BAM:
+	case TPCM_RTS:
+		break;
+	case TPCM_ABORT:
+		/* from either end */
+		tp = j1939_tpfind(dp, src, dest);
+		if (tp == NULL) {
+			tp = j1939_tpfind(dp, dest, src);
+		}
+		if (tp) {
+			j1939_tpdrop(dp, tp, 1);
+		}
+		return;
+	default:
+		return;
+	}
+
+	size = data[1] | (data[2] << 8);
+	pgn = data[5] | ((uint32_t) data[6] << 8) | ((uint32_t) (data[7] & 0x03) << 16);
+	if ((size <= DIAG_L1_CAN_MAXDLC) || (size > DL2P_J1939_MAXLEN) ||
+			(data[3] != (size + 6) / 7)) {
+		dp->stats.ignored++;
+		return;
+	}
+
+	tp = j1939_tpfind(dp, src, dest);
+	if (tp) {
+		/* sender started over */
+		j1939_tpdrop(dp, tp, 1);
+	}
+	oldest = NULL;
+	for (i = 0, tp = NULL; i < J1939_MAXTP; i++) {
+		if (dp->tp[i].msg == NULL) {
+			tp = &dp->tp[i];
+			break;
+		}
+		if (!oldest || ((long) (dp->tp[i].tlast - oldest->tlast) < 0)) {
+			oldest = &dp->tp[i];
+		}
+	}
+	if (tp == NULL) {
+		j1939_tpdrop(dp, oldest, 1);
+		tp = oldest;
+	}
+
+	tp->msg = diag_allocmsg(DL2P_J1939_HDRLEN + size);
+	if (tp->msg == NULL) {
+		return;
+	}
+	dp->ntp++;
+	tp->msg->data[0] = (uint8_t) pgn;
+	tp->msg->data[1] = (uint8_t) (pgn >> 8);
+	tp->msg->data[2] = (uint8_t) (pgn >> 16);
+	tp->msg->src = src;
+	tp->msg->dest = dest;
+	tp->msg->type = prio;
+	tp->size = size;
+	tp->src = src;
+	tp->dest = dest;
+	tp->npkts = data[3];
+	tp->got = 0;
+	memset(tp->seen, 0, sizeof(tp->seen));
+	tp->tlast = diag_os_getms();
+	return;
+}
+
+/* TP.DT : copy the packet in place. Returns the message once complete */
+static struct diag_msg *
+j1939_tpdt(struct dl2p_j1939 *dp, uint8_t src, uint8_t dest,
+		const uint8_t *data, unsigned int dlc) {
+	struct j1939_tp *tp;
+	struct diag_msg *msg;
+	unsigned int sn, ofs, n;
+
+	tp = j1939_tpfind(dp, src, dest);
+	sn = data[0];
+	if ((tp == NULL) || (dlc < 2) || (sn == 0) || (sn > tp->npkts)) {
+		return NULL;
+	}
+	tp->tlast = diag_os_getms();
+
+	ofs = (sn - 1) * 7;
+	n = MIN(dlc - 1, tp->size - ofs);
+	memcpy(&tp->msg->data[DL2P_J1939_HDRLEN + ofs], &data[1], n);
+	if (!(tp->seen[(sn - 1) / 8] & (1 << ((sn - 1) % 8)))) {
+		tp->seen[(sn - 1) / 8] |= (uint8_t) (1 << ((sn - 1) % 8));
+		tp->got++;
+	}
+	if (tp->got < tp->npkts) {
+		return NULL;
+	}
+
+	msg = tp->msg;
+	tp->msg = NULL;
+	dp->ntp--;
+	dp->stats.tp_done++;
+	return msg;
+}
+
+/*
+ * Process one frame from L1. If it completes a message, *done is set.
+ * ret 0 if ok, <0 on errors
+ */
+static int
+j1939_rxframe(struct dl2p_j1939 *dp, const uint8_t *buf, unsigned int len,
+		struct diag_msg **done) {
+	struct diag_msg *msg;
+	uint32_t id, pgn;
+	unsigned int dlc;
+	uint8_t prio, src, dest;
+
+	*done = NULL;
+	dp->stats.frames++;
+	if (len < DIAG_L1_CAN_HDRLEN) {
+		dp->stats.ignored++;
+		return 0;
+	}
+	id = ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16) |
+		((uint32_t) buf[2] << 8) | buf[3];
+	dlc = buf[4];
+	if (!(id & DIAG_L1_CAN_EFF) || (dlc > DIAG_L1_CAN_MAXDLC) ||
+			(len < DIAG_L1_CAN_HDRLEN + dlc)) {
+		dp->stats.ignored++;
+		return 0;
+	}
+	buf += DIAG_L1_CAN_HDRLEN;
+
+	prio = (uint8_t) ((id >> 26) & 0x07);
+	src = (uint8_t) id;
+	pgn = (id >> 8) & 0x3FFFF;
+	if (((pgn >> 8) & 0xFF) < J1939_PDU2) {
+		dest = (uint8_t) pgn;
+		pgn &= 0x3FF00;
+	} else {
+		dest = J1939_GLOBAL;
+	}
+
+	switch (pgn) {
+	case DL2P_J1939_PGN_TPCM:
+		j1939_tpcm(dp, prio, src, dest, buf, dlc);
+		return 0;
+	case DL2P_J1939_PGN_TPDT:
+		msg = j1939_tpdt(dp, src, dest, buf, dlc);
+		if (msg == NULL) {
+			return 0;
+		}
+		break;
+	default:
+		msg = diag_allocmsg(DL2P_J1939_HDRLEN + dlc);
+		if (msg == NULL) {
+			return diag_iseterr(DIAG_ERR_NOMEM);
+		}
+		msg->data[0] = (uint8_t) pgn;
+		msg->data[1] = (uint8_t) (pgn >> 8);
+		msg->data[2] = (uint8_t) (pgn >> 16);
+		memcpy(&msg->data[DL2P_J1939_HDRLEN], buf, dlc);
+		msg->src = src;
+		msg->dest = dest;
+		msg->type = prio;
+		break;
+	}
+
+	msg->fmt = DIAG_FMT_FRAMED | DIAG_FMT_CKSUMMED;
+	msg->rxtime = diag_os_getms();
+	dp->stats.msgs++;
+	*done = msg;
+	return 0;
+}
+
+/* Response wanted by a request */
+struct j1939_match {
+	uint8_t src;	/* J1939_GLOBAL : any */
+	uint32_t pgn;
+	uint32_t pgn2;	/* also accepted, e.g. ACK */
+};
+
+/*
+ * Wait up to timeout ms for a first message, then read on until L1 has
+ * nothing left (or J1939_RXBATCH frames were read). Messages are added to
+ * d_l2_conn->diag_msg. If "match" is set (requests), stop as soon as the
+ * response arrives instead; a transfer from the responder that's still
+ * under way at the deadline extends the wait.
+ * ret 0 if ok (d_l2_conn->diag_msg may be NULL), <0 on errors
+ */
+
+static int
+dl2p_j1939_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout,
+		const struct j1939_match *match) {
+	struct dl2p_j1939 *dp = (struct dl2p_j1939 *)d_l2_conn->diag_l2_proto_data;
+	uint8_t buf[J1939_FRAMELEN];
+	struct diag_msg *msg, *last = NULL;
+	unsigned long now, deadline;
+	unsigned int nframes = 0;
+	unsigned int tmo;
+	bool draining = 0;
+	int rv;
+
+	diag_freemsg(d_l2_conn->diag_msg);
+	d_l2_conn->diag_msg = NULL;
+
+	now = diag_os_getms();
+	deadline = now + timeout;
+
+	while (1) {
+		if (dp->ntp) {
+			j1939_tpexpire(dp, now);
+		}
+		if (draining) {
+			if (nframes >= J1939_RXBATCH) {
+				break;
+			}
+			tmo = J1939_DRAINTMO;
+		} else {
+			if ((long) (deadline - now) <= 0) {
+				struct j1939_tp *tp;
+
+				/* a response transfer is still coming in */
+				tp = (match && (match->src != J1939_GLOBAL)) ?
+					j1939_tpfind(dp, match->src, d_l2_conn->diag_l2_srcaddr) : NULL;
+				if (tp == NULL) {
+					tp = match? j1939_tpfind(dp, match->src, J1939_GLOBAL) : NULL;
+				}
+				if (tp == NULL) {
+					break;
+				}
+				deadline = tp->tlast + J1939_T3;
+			}
+			tmo = (unsigned int) (deadline - now);
+			if (tmo == 0) {
+				tmo = 1;
+			}
+		}
+
+		rv = diag_l1_recv(d_l2_conn->diag_link->l2_dl0d, NULL, buf, sizeof(buf), tmo);
+		now = diag_os_getms();
+		if (rv == DIAG_ERR_TIMEOUT) {
+			if (draining) {
+				break;
+			}
+			continue;
+		}
+		if (rv < 0) {
+			diag_freemsg(d_l2_conn->diag_msg);
+			d_l2_conn->diag_msg = NULL;
+			return rv;
+		}
+		nframes++;
+
+		rv = j1939_rxframe(dp, buf, (unsigned int) rv, &msg);
+		if (rv < 0) {
+			diag_freemsg(d_l2_conn->diag_msg);
+			d_l2_conn->diag_msg = NULL;
+			return rv;
+		}
+		if (msg == NULL) {
+			continue;
+		}
+
+		if (last) {
+			last->next = msg;
+		} else {
+			d_l2_conn->diag_msg = msg;
+		}
+		last = msg;
+
+		if (match == NULL) {
+			draining = 1;
+		} else if (((match->src == J1939_GLOBAL) || (msg->src == match->src)) &&
+				((DL2P_J1939_GETPGN(msg->data) == match->pgn) ||
+				(DL2P_J1939_GETPGN(msg->data) == match->pgn2))) {
+			break;
+		}
+	}
+	return 0;
+}
+
+static int
+dl2p_j1939_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout,
+		void (*callback)(void *handle, struct diag_msg *msg), void *handle) {
+	struct diag_msg *tmsg;
+	int rv;
+
+	rv = dl2p_j1939_int_recv(d_l2_conn, timeout, NULL);
+	if (rv < 0) {
+		return rv;
+	}
+	if (d_l2_conn->diag_msg == NULL) {
+		return DIAG_ERR_TIMEOUT;
+	}
+
+	tmsg = d_l2_conn->diag_msg;
+	d_l2_conn->diag_msg = NULL;
+
+	if (callback) {
+		callback(handle, tmsg);
+	}
+	diag_freemsg(tmsg);
+	return 0;
+}
+
+/* Single frames only, see diag_l2_j1939.h */
+static int
+dl2p_j1939_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg) {
+	uint8_t buf[J1939_FRAMELEN];
+	unsigned int dlc;
+	uint32_t pgn, id;
+	uint8_t dest;
+	int rv;
+
+	if ((msg->len < DL2P_J1939_HDRLEN) ||
+			(msg->len > DL2P_J1939_HDRLEN + DIAG_L1_CAN_MAXDLC)) {
+		return diag_iseterr(DIAG_ERR_BADLEN);
+	}
+	dlc = msg->len - DL2P_J1939_HDRLEN;
+	pgn = DL2P_J1939_GETPGN(msg->data);
+
+	id = DIAG_L1_CAN_EFF | ((uint32_t) J1939_TXPRIO << 26) | (pgn << 8) |
+		d_l2_conn->diag_l2_srcaddr;
+	if (((pgn >> 8) & 0xFF) < J1939_PDU2) {
+		dest = (msg->fmt & DIAG_FMT_ISO_PHYSADDR)? msg->dest :
+			d_l2_conn->diag_l2_destaddr;
+		id = (id & ~(uint32_t) 0xFF00) | ((uint32_t) dest << 8);
+	}
+
+	buf[0] = (uint8_t) (id >> 24);
+	buf[1] = (uint8_t) (id >> 16);
+	buf[2] = (uint8_t) (id >> 8);
+	buf[3] = (uint8_t) id;
+	buf[4] = (uint8_t) dlc;
+	memcpy(&buf[DIAG_L1_CAN_HDRLEN], &msg->data[DL2P_J1939_HDRLEN], dlc);
+
+	rv = diag_l1_send(d_l2_conn->diag_link->l2_dl0d, NULL, buf,
+			DIAG_L1_CAN_HDRLEN + dlc, 0);
+	return rv? diag_iseterr(rv):0;
+}
+
+/*
+ * Send, and return what the destination sent back : for a request PGN, the
+ * requested PGN or an acknowledgment; otherwise the first message from the
+ * destination. Other traffic heard meanwhile is dropped.
+ */
+static struct diag_msg *
+dl2p_j1939_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg,
+		int *errval) {
+	struct j1939_match match;
+	struct diag_msg *rmsg, *tmsg;
+	int rv;
+
+	rv = diag_l2_send(d_l2_conn, msg);
+	if (rv < 0) {
+		*errval = rv;
+		return diag_pseterr(rv);
+	}
+
+	match.src = (msg->fmt & DIAG_FMT_ISO_PHYSADDR)? msg->dest :
+		d_l2_conn->diag_l2_destaddr;
+	if ((DL2P_J1939_GETPGN(msg->data) == DL2P_J1939_PGN_RQST) &&
+			(msg->len >= DL2P_J1939_HDRLEN + 3)) {
+		match.pgn = DL2P_J1939_GETPGN(&msg->data[DL2P_J1939_HDRLEN]);
+		match.pgn2 = DL2P_J1939_PGN_ACKM;
+	} else {
+		match.pgn = match.pgn2 = DL2P_J1939_GETPGN(msg->data);
+	}
+
+	rv = dl2p_j1939_int_recv(d_l2_conn, d_l2_conn->diag_l2_p2max, &match);
+	if (rv < 0) {
+		*errval = rv;
+		return diag_pseterr(rv);
+	}
+
+	/* keep only the response */
+	rmsg = NULL;
+	while (d_l2_conn->diag_msg) {
+		tmsg = d_l2_conn->diag_msg;
+		d_l2_conn->diag_msg = tmsg->next;
+		tmsg->next = NULL;
+		if ((rmsg == NULL) &&
+				((match.src == J1939_GLOBAL) || (tmsg->src == match.src)) &&
+				((DL2P_J1939_GETPGN(tmsg->data) == match.pgn) ||
+				(DL2P_J1939_GETPGN(tmsg->data) == match.pgn2))) {
+			rmsg = tmsg;
+		} else {
+			diag_freemsg(tmsg);
+		}
+	}
+	if (rmsg == NULL) {
+		*errval = DIAG_ERR_TIMEOUT;
+		return NULL;
+	}
+	return rmsg;
+}
+
+/*
+ * No init on J1939 : check L1 passes raw CAN frames, and ask L0 for every
+ * 29-bit frame.
+ */
+static int
+dl2p_j1939_startcomms(struct diag_l2_conn *d_l2_conn, UNUSED(flag_type flags),
+	UNUSED(unsigned int bitrate), UNUSED(target_type target), UNUSED(source_type source)) {
+	struct dl2p_j1939 *dp;
+	int rv;
+
+	if ((d_l2_conn->diag_link->l1proto != DIAG_L1_CAN) ||
+			(d_l2_conn->diag_link->l1flags & DIAG_L1_DATAONLY)) {
+		return diag_iseterr(DIAG_ERR_PROTO_NOTSUPP);
+	}
+
+	rv = diag_calloc(&dp, 1);
+	if (rv != 0) {
+		return diag_iseterr(rv);
+	}
+	d_l2_conn->diag_l2_proto_data = (void *)dp;
+
+	d_l2_conn->diag_l2_p2min = 0;
+	d_l2_conn->diag_l2_p2max = J1939_TR;
+	d_l2_conn->diag_l2_p2emin = 0;
+	d_l2_conn->diag_l2_p2emax = J1939_T3;
+	d_l2_conn->diag_l2_p3min = 0;
+	d_l2_conn->diag_l2_p4min = 0;
+
+	rv = diag_l1_ioctl(d_l2_conn->diag_link->l2_dl0d, DIAG_IOCTL_CAN_RXEFF, NULL);
+	if ((rv != 0) && (diag_l2_debug & DIAG_DEBUG_OPEN)) {
+		fprintf(stderr, FLFMT "L0 can't filter 11-bit frames, dropping them here\n", FL);
+	}
+	(void)diag_l2_ioctl(d_l2_conn, DIAG_IOCTL_IFLUSH, NULL);
+	return 0;
+}
+
+static int
+dl2p_j1939_stopcomms(struct diag_l2_conn *d_l2_conn) {
+	struct dl2p_j1939 *dp = (struct dl2p_j1939 *)d_l2_conn->diag_l2_proto_data;
+	unsigned int i;
+
+	if (dp) {
+		for (i = 0; i < J1939_MAXTP; i++) {
+			diag_freemsg(dp->tp[i].msg);
+		}
+		free(dp);
+	}
+	d_l2_conn->diag_l2_proto_data = NULL;
+	return 0;
+}
+
+const struct diag_l2_proto diag_l2_proto_j1939 = {
+	DIAG_L2_PROT_J1939,
+	"J1939",
+	DIAG_L2_FLAG_FRAMED | DIAG_L2_FLAG_CONNECTS_ALWAYS,
+	dl2p_j1939_startcomms,
+	dl2p_j1939_stopcomms,
+	dl2p_j1939_send,
+	dl2p_j1939_recv,
+	dl2p_j1939_request,
+	NULL,
+	NULL
+};
@@ -0,0 +1,81 @@
+#ifndef _DIAG_L2_J1939_H_
+#define _DIAG_L2_J1939_H_
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * L2 driver for SAE J1939-21 (heavy vehicle CAN, 29-bit IDs), mainly for
+ * passive monitoring : every parameter group heard on the bus is passed up,
+ * with J1939-21 transport protocol messages (BAM broadcasts, and RTS/CTS
+ * transfers between other nodes) reassembled.
+ *
+ * Messages passed up (and sent) have this format :
+ *	data[0..2] : PGN, little-endian (same order as in TP.CM and request frames)
+ *	data[3..] : parameter group data, 0 to 1785 bytes
+ *	src : source address; dest : destination address, 0xFF for PDU2
+ *	(broadcast) PGNs; type : priority (0-7).
+ *
+ * recv() waits for the first message, then also passes up whatever else L1
+ * already has queued (up to J1939_RXBATCH frames), in one callback.
+ * send() only does single frames (up to 8 data bytes), with priority 6;
+ * PDU1 PGNs go to msg->dest if DIAG_FMT_ISO_PHYSADDR is set, else to the
+ * connection target address.
+ */
+
+#include <stdint.h>
+
+struct diag_l2_conn;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define DL2P_J1939_HDRLEN	3	/* PGN bytes in front of the data */
+#define DL2P_J1939_MAXLEN	1785	/* 255 TP packets of 7 bytes */
+
+/* well-known PGNs */
+#define DL2P_J1939_PGN_ACKM	0xE800	/* acknowledgment */
+#define DL2P_J1939_PGN_RQST	0xEA00	/* request */
+#define DL2P_J1939_PGN_TPDT	0xEB00	/* TP.DT */
+#define DL2P_J1939_PGN_TPCM	0xEC00	/* TP.CM */
+#define DL2P_J1939_PGN_DM1	0xFECA	/* active DTCs */
+#define DL2P_J1939_PGN_DM2	0xFECB	/* previously active DTCs */
+
+/** Counters since the connection started */
+struct dl2p_j1939_stats {
+	unsigned long frames;	/** CAN frames received, incl. ignored */
+	unsigned long ignored;	/** 11-bit and malformed frames */
+	unsigned long msgs;	/** messages passed up, incl. reassembled */
+	unsigned long tp_done;	/** transport protocol messages reassembled */
+	unsigned long tp_lost;	/** transport protocol transfers aborted, timed out or superseded */
+};
+
+/** Get counters of a J1939 connection
+ * @return 0 if ok
+ */
+int dl2p_j1939_getstats(struct diag_l2_conn *dl2c, struct dl2p_j1939_stats *stats);
+
+/** PGN of a message in the format above */
+#define DL2P_J1939_GETPGN(data)	((uint32_t) (data)[0] | ((uint32_t) (data)[1] << 8) | \
+				((uint32_t) ((data)[2] & 0x03) << 16))
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _DIAG_L2_J1939_H_ */
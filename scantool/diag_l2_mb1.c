@@ -455,5 +455,6 @@ const struct diag_l2_proto diag_l2_proto_mb1 = {
 	dl2p_mb1_send,
 	dl2p_mb1_recv,
 	dl2p_mb1_request,
-	dl2p_mb1_timeout
+	dl2p_mb1_timeout,
+	NULL
 };
@@ -28,6 +28,8 @@
  */
 
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "diag.h"
@@ -35,11 +37,231 @@
 #include "diag_l2.h"
 #include "diag_err.h"
 #include "diag_os.h"
+#include "diag_ring.h"
 #include "diag_tty.h"
 
 #include "diag_l2_raw.h" /* prototypes for this file */
 
 
+/*
+ * Capture state, in d_l2_conn->diag_l2_proto_data while capturing.
+ * The ring holds records already in file format (see diag_l2_raw.h).
+ * dl2p_raw_recv() is the only producer, the ring worker writes them to
+ * the file; ring.mtx also protects the counters, and is never held
+ * during file I/O.
+ */
+struct dl2p_raw_capture {
+	FILE *fp;
+	struct diag_ring ring;
+	unsigned long long t0;	/* hrt at start */
+	unsigned int pending_drops;	/* chunks dropped since the last record */
+
+	struct dl2p_raw_capstats stats;
+};
+
+#define RAWCAP_FLUSH_MS	100	/* writer flushes at least this often */
+
+/*
+ * recv : store one chunk with its timestamp. Never blocks on the writer;
+ * if the ring is full the chunk is dropped and counted.
+ */
+static void
+rawcap_store(struct dl2p_raw_capture *rc, unsigned long long hrt,
+		const uint8_t *data, size_t len) {
+	uint8_t hdr[DL2P_RAWCAP_RECHDR];
+	unsigned long long tus;
+	unsigned int drops;
+	int i;
+
+	tus = diag_os_hrtus(hrt - rc->t0);
+
+	diag_ring_lock(&rc->ring);
+	rc->stats.chunks++;
+	rc->stats.bytes += len;
+	if (diag_ring_room(&rc->ring) < (len + sizeof(hdr))) {
+		rc->stats.dropped_chunks++;
+		rc->stats.dropped_bytes += len;
+		rc->pending_drops++;
+		diag_ring_unlock(&rc->ring);
+		return;
+	}
+	drops = (rc->pending_drops > 0xFFFF) ? 0xFFFF : rc->pending_drops;
+	rc->pending_drops = 0;
+
+	for (i = 0; i < 8; i++) {
+		hdr[i] = (uint8_t) (tus >> (8 * i));
+	}
+	hdr[8] = (uint8_t) len;
+	hdr[9] = (uint8_t) (len >> 8);
+	hdr[10] = (uint8_t) drops;
+	hdr[11] = (uint8_t) (drops >> 8);
+	diag_ring_put(&rc->ring, hdr, sizeof(hdr));
+	diag_ring_put(&rc->ring, data, len);
+	diag_ring_unlock(&rc->ring);
+	return;
+}
+
+/* ring worker : write the ring to the file. stats.err is read and set
+ * under the ring mutex like the rest of the stats, since getstats() may
+ * read it meanwhile. */
+static size_t
+rawcap_write(void *handle, size_t pos, size_t len) {
+	struct dl2p_raw_capture *rc = handle;
+	bool failed;
+	int err;
+
+	diag_os_lock(rc->ring.mtx);
+	err = rc->stats.err;
+	diag_os_unlock(rc->ring.mtx);
+
+	/* contiguous part only; the rest on the next pass */
+	if (len > (rc->ring.size - pos)) {
+		len = rc->ring.size - pos;
+	}
+	failed = (err == 0) &&
+		(fwrite(&rc->ring.buf[pos], 1, len, rc->fp) != len);
+	if (failed) {
+		fprintf(stderr, FLFMT "capture : write error, data will be lost\n", FL);
+	}
+
+	diag_os_lock(rc->ring.mtx);
+	if (failed) {
+		rc->stats.err = DIAG_ERR_GENERAL;
+	} else if (err == 0) {
+		rc->stats.written += len;
+	}
+	diag_os_unlock(rc->ring.mtx);
+	return len;
+}
+
+int
+dl2p_raw_capture_start(struct diag_l2_conn *d_l2_conn, const char *filename,
+		size_t ringsize) {
+	struct dl2p_raw_capture *rc;
+	uint8_t fhdr[DL2P_RAWCAP_FILEHDR] = DL2P_RAWCAP_MAGIC;
+	unsigned int speed = d_l2_conn->diag_l2_speed;
+	int rv;
+
+	if (d_l2_conn->l2proto->diag_l2_protocol != DIAG_L2_PROT_RAW) {
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
+	if (d_l2_conn->diag_l2_proto_data != NULL) {
+		fprintf(stderr, FLFMT "capture already running !\n", FL);
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	if (ringsize < (DL2P_RAWCAP_RECHDR + MAXRBUF)) {
+		ringsize = DL2P_RAWCAP_RECHDR + MAXRBUF;
+	}
+
+	rv = diag_calloc(&rc, 1);
+	if (rv != 0) {
+		return diag_iseterr(rv);
+	}
+
+	rc->fp = fopen(filename, "wb");
+	if (rc->fp == NULL) {
+		fprintf(stderr, FLFMT "could not create %s\n", FL, filename);
+		free(rc);
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	fhdr[8] = DL2P_RAWCAP_VERSION;
+	fhdr[12] = (uint8_t) speed;
+	fhdr[13] = (uint8_t) (speed >> 8);
+	fhdr[14] = (uint8_t) (speed >> 16);
+	fhdr[15] = (uint8_t) (speed >> 24);
+	if (fwrite(fhdr, 1, sizeof(fhdr), rc->fp) != sizeof(fhdr)) {
+		rv = DIAG_ERR_GENERAL;
+		goto err_free;
+	}
+	rc->stats.written = sizeof(fhdr);
+
+	rc->t0 = diag_os_gethrt();
+	rv = diag_ring_start(&rc->ring, ringsize, RAWCAP_FLUSH_MS,
+			rawcap_write, NULL, rc);
+	if (rv != 0) {
+		goto err_free;
+	}
+
+	d_l2_conn->diag_l2_proto_data = rc;
+	return 0;
+
+err_free:
+	fclose(rc->fp);
+	free(rc);
+	return diag_iseterr(rv);
+}
+
+int
+dl2p_raw_capture_getstats(struct diag_l2_conn *d_l2_conn,
+		struct dl2p_raw_capstats *stats) {
+	struct dl2p_raw_capture *rc;
+
+	if (d_l2_conn->l2proto->diag_l2_protocol != DIAG_L2_PROT_RAW) {
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
+	rc = (struct dl2p_raw_capture *) d_l2_conn->diag_l2_proto_data;
+	if (rc == NULL) {
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	diag_os_lock(rc->ring.mtx);
+	*stats = rc->stats;
+	diag_os_unlock(rc->ring.mtx);
+	return 0;
+}
+
+int
+dl2p_raw_capture_stop(struct diag_l2_conn *d_l2_conn,
+		struct dl2p_raw_capstats *stats) {
+	struct dl2p_raw_capture *rc;
+	int rv;
+
+	if (d_l2_conn->l2proto->diag_l2_protocol != DIAG_L2_PROT_RAW) {
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
+	rc = (struct dl2p_raw_capture *) d_l2_conn->diag_l2_proto_data;
+	if (rc == NULL) {
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	d_l2_conn->diag_l2_proto_data = NULL;
+
+	diag_ring_stop(&rc->ring);
+
+	/* chunks dropped after the last record : no record to carry them,
+	 * so end with an empty one. The writer is gone, nothing else
+	 * touches rc now. */
+	if (rc->pending_drops && (rc->stats.err == 0)) {
+		uint8_t hdr[DL2P_RAWCAP_RECHDR];
+		unsigned long long tus = diag_os_hrtus(diag_os_gethrt() - rc->t0);
+		unsigned int drops;
+		int i;
+
+		drops = (rc->pending_drops > 0xFFFF) ? 0xFFFF : rc->pending_drops;
+		for (i = 0; i < 8; i++) {
+			hdr[i] = (uint8_t) (tus >> (8 * i));
+		}
+		hdr[8] = 0;
+		hdr[9] = 0;
+		hdr[10] = (uint8_t) drops;
+		hdr[11] = (uint8_t) (drops >> 8);
+		if (fwrite(hdr, 1, sizeof(hdr), rc->fp) != sizeof(hdr)) {
+			rc->stats.err = DIAG_ERR_GENERAL;
+		} else {
+			rc->stats.written += sizeof(hdr);
+		}
+		rc->pending_drops = 0;
+	}
+
+	if ((fclose(rc->fp) != 0) && (rc->stats.err == 0)) {
+		rc->stats.err = DIAG_ERR_GENERAL;
+	}
+	if (stats) {
+		*stats = rc->stats;
+	}
+	rv = rc->stats.err;
+
+	free(rc);
+	return rv? diag_iseterr(rv):0;
+}
 
 
 int
@@ -64,6 +286,7 @@ source_type source) {
 	}
 
 	//set tgt and src address in d_l2_conn
+	d_l2_conn->diag_l2_speed=bitrate;
 	d_l2_conn->diag_l2_destaddr=target;
 	d_l2_conn->diag_l2_srcaddr=source;
 
@@ -74,7 +297,10 @@ source_type source) {
 */
 
 int
-dl2p_raw_stopcomms(UNUSED(struct diag_l2_conn *pX)) {
+dl2p_raw_stopcomms(struct diag_l2_conn *pX) {
+	if (pX->diag_l2_proto_data != NULL) {
+		(void) dl2p_raw_capture_stop(pX, NULL);
+	}
 	return 0;
 }
 
@@ -104,6 +330,7 @@ dl2p_raw_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout,
 	void (*callback)(void *handle, struct diag_msg *msg), void *handle) {
 	uint8_t rxbuf[MAXRBUF];
 	struct diag_msg msg = {0};	//local message structure that will disappear when we return
+	struct dl2p_raw_capture *rc;
 	int rv;
 
 	/*
@@ -116,7 +343,12 @@ dl2p_raw_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout,
 		return rv;
 	}
 
-	msg.len = (uint8_t) rv;
+	rc = (struct dl2p_raw_capture *) d_l2_conn->diag_l2_proto_data;
+	if (rc != NULL) {
+		rawcap_store(rc, diag_os_gethrt(), rxbuf, (size_t) rv);
+	}
+
+	msg.len = (unsigned) rv;
 	msg.data = rxbuf;
 	/* This is raw, unframed data; we don't set .fmt */
 	msg.next = NULL;
@@ -170,7 +402,7 @@ dl2p_raw_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg,
 	if (rmsg == NULL) {
 		return diag_pseterr(DIAG_ERR_NOMEM);
 	}
-	memcpy(&rmsg->data, rxbuf, (size_t)rv);	/* Data */
+	memcpy(rmsg->data, rxbuf, (size_t)rv);	/* Data */
 	rmsg->fmt = 0;
 	rmsg->rxtime = diag_os_getms();
 
@@ -186,5 +418,6 @@ const struct diag_l2_proto diag_l2_proto_raw = {
 	dl2p_raw_send,
 	dl2p_raw_recv,
 	dl2p_raw_request,
+	NULL,
 	NULL
 };
@@ -62,6 +62,61 @@ dl2p_raw_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout,
 struct diag_msg *
 dl2p_raw_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg, int *errval);
 
+/*
+ * Capture mode : while capturing, every chunk dl2p_raw_recv() gets from L1
+ * is also copied, with a timestamp, into a preallocated ring; a writer
+ * thread flushes the ring to a binary file. Receiving never waits for the
+ * file : if the writer falls behind and the ring is full, chunks are
+ * dropped and counted. The recv callback is still called, so it can be
+ * NULL to record without printing anything.
+ *
+ * File format, all values little-endian :
+ *	header : "FDRAWCAP" ; u8 version (1) ; 3 bytes 0 ; u32 bitrate
+ *	records : u64 timestamp (us since capture start, when the chunk was
+ *		received) ; u16 len ; u16 chunks dropped just before this one
+ *		(saturated) ; len data bytes
+ *	If chunks were dropped after the last one recorded, the file ends
+ *	with a record of len 0 carrying that count, stamped at stop time.
+ */
+#define DL2P_RAWCAP_MAGIC	"FDRAWCAP"
+#define DL2P_RAWCAP_VERSION	1
+#define DL2P_RAWCAP_FILEHDR	16
+#define DL2P_RAWCAP_RECHDR	12
+#define DL2P_RAWCAP_DEFRING	(1024 * 1024)	/* default ring size, bytes */
+
+struct dl2p_raw_capstats {
+	unsigned long long chunks;	/* received, incl. dropped */
+	unsigned long long bytes;
+	unsigned long long dropped_chunks;	/* ring was full */
+	unsigned long long dropped_bytes;
+	unsigned long long written;	/* bytes written to the file, incl. file and record headers */
+	int err;	/* 0, or first write error */
+};
+
+/*
+ * Start capturing to a new file "filename", with a ring of ringsize bytes.
+ * ret 0 if ok
+ */
+int
+dl2p_raw_capture_start(struct diag_l2_conn *d_l2_conn, const char *filename,
+	size_t ringsize);
+
+/*
+ * Get counters of a running capture. ret 0 if ok
+ */
+int
+dl2p_raw_capture_getstats(struct diag_l2_conn *d_l2_conn,
+	struct dl2p_raw_capstats *stats);
+
+/*
+ * Stop capturing : flush the ring, close the file. Final counters are
+ * copied to *stats if not NULL. Done by stopcomms if still running.
+ * ret 0 if ok, <0 if something couldn't be written
+ */
+int
+dl2p_raw_capture_stop(struct diag_l2_conn *d_l2_conn,
+	struct dl2p_raw_capstats *stats);
+
 
 #if defined(__cplusplus)
 }
@@ -236,6 +236,8 @@ dl2p_j1850_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 	unsigned long long t_done;	//time elapsed
 	unsigned long long t_us;	//total timeout, in us
 	unsigned long long t0;	//start time
+	unsigned int nominal;
+	bool rxcal;
 
 	int l1flags = d_l2_conn->diag_link->l1flags;
 
@@ -256,8 +258,12 @@ dl2p_j1850_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 		return diag_iseterr(DIAG_ERR_PROTO_NOTSUPP);
 	}
 
-	/* Extend timeouts since L0/L1 does framing */
-	timeout += SMART_TIMEOUT;
+	/* Extend timeouts since L0/L1 does framing; only the first receive
+	 * after a request measures response latency. */
+	rxcal = d_l2_conn->rxcal_armed;
+	d_l2_conn->rxcal_armed = 0;
+	nominal = timeout;
+	timeout = diag_l2_rxtout(d_l2_conn, nominal);
 	t_us = timeout * 1000ULL;
 	t_done = 0;
 
@@ -349,8 +355,18 @@ dl2p_j1850_int_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout) {
 
 		diag_l2_addmsg(d_l2_conn, tmsg);
 
+		if (rxcal) {
+			diag_l2_rxcal_update(&d_l2_conn->rxcal_rsp, nominal,
+				(unsigned long) (t_done / 1000), 0);
+			rxcal = 0;
+		}
+
 	}	//while !timed out
 
+	if (rxcal) {
+		diag_l2_rxcal_update(&d_l2_conn->rxcal_rsp, nominal, 0, 1);
+	}
+
 	dp->state = STATE_ESTABLISHED;
 	return 0;
 }
@@ -452,5 +468,6 @@ const struct diag_l2_proto diag_l2_proto_saej1850 = {
 	dl2p_j1850_send,
 	dl2p_j1850_recv,
 	dl2p_j1850_request,
+	NULL,
 	NULL
 };
@@ -3,27 +3,146 @@
  *
   * Copyright (C) 2017-2018 fenugrec
  *
- * Test L2 driver. Only intended for use by diag_test.c
- * to exercise low-level libdiag code paths.
+ * Test L2 driver. Originally only intended for use by diag_test.c
+ * to exercise low-level libdiag code paths; it is also a synthetic J1979
+ * traffic source : N virtual ECUs answer every request, and recv() without
+ * a pending request returns unsolicited mode 1 responses at a configurable
+ * rate. This lets L3, the scantool callbacks, logging etc. be benchmarked
+ * at rates far beyond what a real bus can do. See diag_l2_test.h.
  *
  */
 
+#include <stdlib.h>
+#include <string.h>
 
 #include "diag.h"
 #include "diag_l2.h"
 #include "diag_err.h"
 #include "diag_os.h"
 
+#include "diag_l2_test.h"
+#include "utlist.h"
+
 #define TEST_TIMER_DURATION 500	/** time (ms) before returning from timer callback func */
 
+#define TEST_ECU0	0x10	/* address of the first virtual ECU */
+#define TEST_TESTER	0xF1
+
+extern const struct diag_l2_proto diag_l2_proto_test;
+
+static struct diag_l2_test_cfg dl2p_test_cfg = DL2P_TEST_DEFAULT_CFG;
+
+/* PIDs cycled through for unsolicited frames */
+static const uint8_t dl2p_test_pids[] = {0x04, 0x05, 0x0C, 0x0D, 0x0F, 0x10, 0x11};
+
+struct dl2p_test {
+	struct diag_l2_test_cfg cfg;
+	struct diag_l2_test_stats stats;
+
+	unsigned long tstart;	/* for rate limiting */
+	unsigned long unsol;	/* unsolicited frames generated */
+
+	uint8_t rq_mode;	/* last request, not answered yet */
+	uint8_t rq_pid;
+	bool rq_pending;
+};
+
+
+void dl2p_test_setcfg(const struct diag_l2_test_cfg *cfg) {
+	dl2p_test_cfg = *cfg;
+	return;
+}
+
+int dl2p_test_getstats(struct diag_l2_conn *dl2c, struct diag_l2_test_stats *stats) {
+	struct dl2p_test *dt;
+
+	if (dl2c->l2proto != &diag_l2_proto_test) {
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
+	dt = (struct dl2p_test *)dl2c->diag_l2_proto_data;
+	*stats = dt->stats;
+	return 0;
+}
+
+/* Build one J1979-shaped response frame, as L2 would deliver it (no header / checksum) */
+static struct diag_msg *
+dl2p_test_frame(struct dl2p_test *dt, unsigned int ecu, uint8_t mode, uint8_t pid) {
+	struct diag_msg *msg;
+	unsigned int len, i;
+
+	len = dt->cfg.datalen;
+	if (len < 2) {
+		len = 2;
+	}
+	msg = diag_allocmsg(len);
+	if (msg == NULL) {
+		return NULL;
+	}
+	msg->data[0] = mode | 0x40;
+	msg->data[1] = pid;
+	for (i = 2; i < len; i++) {
+		msg->data[i] = (uint8_t) (dt->stats.frames + i);
+	}
+	msg->src = (uint8_t) (TEST_ECU0 + ecu);
+	msg->dest = TEST_TESTER;
+	msg->fmt = DIAG_FMT_FRAMED | DIAG_FMT_CKSUMMED;
+	msg->rxtime = diag_os_getms();
+
+	dt->stats.frames++;
+	if (dt->cfg.badevery && ((dt->stats.frames % dt->cfg.badevery) == 0)) {
+		/* alternate between truncated frames and bad checksums */
+		dt->stats.bad++;
+		if (dt->stats.bad & 1) {
+			msg->len = 1;
+		} else {
+			msg->fmt |= DIAG_FMT_BADCS;
+		}
+	}
+	return msg;
+}
+
+/* One response per ECU to the pending request */
+static struct diag_msg *
+dl2p_test_responses(struct dl2p_test *dt) {
+	struct diag_msg *chain = NULL;
+	struct diag_msg *msg;
+	unsigned int i;
+
+	for (i = 0; i < dt->cfg.necus; i++) {
+		msg = dl2p_test_frame(dt, i, dt->rq_mode, dt->rq_pid);
+		if (msg == NULL) {
+			break;
+		}
+		LL_APPEND(chain, msg);
+	}
+	dt->rq_pending = 0;
+	return chain;
+}
+
 
 int dl2p_test_startcomms( struct diag_l2_conn *dl2c, flag_type flags,
 						unsigned int bitrate, target_type target, source_type source) {
-	(void) dl2c;
+	struct dl2p_test *dt;
+	int rv;
+
 	(void) flags;
 	(void) bitrate;
 	(void) target;
 	(void) source;
+
+	rv = diag_calloc(&dt, 1);
+	if (rv != 0) {
+		return diag_iseterr(rv);
+	}
+	dt->cfg = dl2p_test_cfg;
+	if (dt->cfg.necus == 0) {
+		dt->cfg.necus = 1;
+	}
+	if (dt->cfg.maxbatch == 0) {
+		dt->cfg.maxbatch = 1;
+	}
+	dt->tstart = diag_os_getms();
+	dl2c->diag_l2_proto_data = dt;
 	return 0;
 }
 
@@ -31,31 +150,109 @@ int dl2p_test_startcomms( struct diag_l2_conn *dl2c, flag_type flags,
 */
 
 int dl2p_test_stopcomms(struct diag_l2_conn *pX) {
-	(void) pX;
+	free(pX->diag_l2_proto_data);
+	pX->diag_l2_proto_data = NULL;
 	return 0;
 }
 
+/* Any request is accepted; every ECU answers it on the next recv() */
 int dl2p_test_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg) {
-	(void) d_l2_conn;
-	(void) msg;
-	return diag_iseterr(DIAG_ERR_BADVAL);
+	struct dl2p_test *dt = (struct dl2p_test *)d_l2_conn->diag_l2_proto_data;
+
+	if (msg->len < 1) {
+		return diag_iseterr(DIAG_ERR_BADLEN);
+	}
+	dt->rq_mode = msg->data[0];
+	dt->rq_pid = (msg->len > 1) ? msg->data[1] : 0;
+	dt->rq_pending = 1;
+	return 0;
 }
 
 int dl2p_test_recv(struct diag_l2_conn *d_l2_conn, unsigned int timeout,
 			void (*callback)(void *handle, struct diag_msg *msg), void *handle) {
-	(void) d_l2_conn;
-	(void) timeout;
-	(void) callback;
-	(void) handle;
-	return diag_iseterr(DIAG_ERR_BADVAL);
+	struct dl2p_test *dt = (struct dl2p_test *)d_l2_conn->diag_l2_proto_data;
+	struct diag_msg *chain = NULL;
+	struct diag_msg *msg;
+	unsigned long due, i;
+
+	if (dt->rq_pending) {
+		chain = dl2p_test_responses(dt);
+	} else {
+		due = dt->cfg.maxbatch;
+		if (dt->cfg.rate) {
+			unsigned long elapsed = diag_os_getms() - dt->tstart;
+
+			due = (unsigned long) ((unsigned long long) elapsed * dt->cfg.rate / 1000) - dt->unsol;
+			if (due == 0) {
+				/* wait for the next frame, if it's due before the timeout */
+				unsigned long next;
+
+				next = (unsigned long) ((unsigned long long) (dt->unsol + 1) * 1000 / dt->cfg.rate);
+				next = (next > elapsed) ? next - elapsed : 0;
+				if (next > timeout) {
+					diag_os_millisleep(timeout);
+					return DIAG_ERR_TIMEOUT;
+				}
+				diag_os_millisleep((unsigned int) next);
+				due = 1;
+			}
+			if (due > dt->cfg.maxbatch) {
+				due = dt->cfg.maxbatch;
+			}
+		}
+		for (i = 0; i < due; i++) {
+			msg = dl2p_test_frame(dt, dt->unsol % dt->cfg.necus, 1,
+				dl2p_test_pids[dt->unsol % ARRAY_SIZE(dl2p_test_pids)]);
+			if (msg == NULL) {
+				break;
+			}
+			dt->unsol++;
+			LL_APPEND(chain, msg);
+		}
+	}
+
+	if (chain == NULL) {
+		return diag_iseterr(DIAG_ERR_NOMEM);
+	}
+	if (callback) {
+		callback(handle, chain);
+	}
+	diag_freemsg(chain);
+	return 0;
 }
 
 struct diag_msg * dl2p_test_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg,
 			int *errval) {
-	(void) d_l2_conn;
-	(void) msg;
-	*errval = DIAG_ERR_GENERAL;
-	return diag_pseterr(DIAG_ERR_BADVAL);
+	struct diag_msg *chain;
+	int rv;
+
+	rv = dl2p_test_send(d_l2_conn, msg);
+	if (rv != 0) {
+		*errval = rv;
+		return diag_pseterr(rv);
+	}
+	chain = dl2p_test_responses((struct dl2p_test *)d_l2_conn->diag_l2_proto_data);
+	if (chain == NULL) {
+		*errval = DIAG_ERR_NOMEM;
+		return diag_pseterr(DIAG_ERR_NOMEM);
+	}
+	*errval = 0;
+	return chain;
+}
+
+/* Attached connections share the settings of base, not its counters */
+int dl2p_test_attach(struct diag_l2_conn *dl2c, struct diag_l2_conn *base) {
+	struct dl2p_test *dt;
+	int rv;
+
+	rv = diag_calloc(&dt, 1);
+	if (rv != 0) {
+		return diag_iseterr(rv);
+	}
+	dt->cfg = ((struct dl2p_test *)base->diag_l2_proto_data)->cfg;
+	dt->tstart = diag_os_getms();
+	dl2c->diag_l2_proto_data = dt;
+	return 0;
 }
 
 void dl2p_test_timer(struct diag_l2_conn *dl2c) {
@@ -67,11 +264,12 @@ void dl2p_test_timer(struct diag_l2_conn *dl2c) {
 const struct diag_l2_proto diag_l2_proto_test = {
 	DIAG_L2_PROT_TEST,
 	"TEST",
-	0,
+	DIAG_L2_FLAG_FRAMED,
 	dl2p_test_startcomms,
 	dl2p_test_stopcomms,
 	dl2p_test_send,
 	dl2p_test_recv,
 	dl2p_test_request,
-	dl2p_test_timer
+	dl2p_test_timer,
+	dl2p_test_attach
 };
@@ -0,0 +1,52 @@
+#ifndef _DIAG_L2_TEST_H_
+#define _DIAG_L2_TEST_H_
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ * Copyright (C) 2017-2018 fenugrec
+ *
+ * Test L2 driver : synthetic J1979 traffic source, to exercise and benchmark
+ * L3 and the application stack without any bus in the way.
+ * Only built with BUILD_DIAGTEST.
+ *
+ */
+
+#include <stdint.h>
+
+struct diag_l2_conn;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/** Load generator settings.
+ * Connections take a copy of the settings when they start.
+ */
+struct diag_l2_test_cfg {
+	unsigned int necus;	/** number of virtual ECUs (addresses 0x10, 0x11, ...) */
+	unsigned int rate;	/** unsolicited frames per second, all ECUs together; 0 : as fast as possible */
+	unsigned int datalen;	/** bytes per frame, incl. mode and PID (J1979 : 2 to 7) */
+	unsigned int badevery;	/** make every Nth frame malformed; 0 : never */
+	unsigned int maxbatch;	/** max frames returned by one recv() call */
+};
+
+#define DL2P_TEST_DEFAULT_CFG	{ 2, 0, 6, 0, 32 }
+
+/** Counters since the connection started */
+struct diag_l2_test_stats {
+	unsigned long frames;	/** frames generated, incl. malformed */
+	unsigned long bad;	/** malformed frames generated */
+};
+
+/** Change settings for connections started from now on */
+void dl2p_test_setcfg(const struct diag_l2_test_cfg *cfg);
+
+/** Get counters of a connection using the test driver
+ * @return 0 if ok
+ */
+int dl2p_test_getstats(struct diag_l2_conn *dl2c, struct diag_l2_test_stats *stats);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _DIAG_L2_TEST_H_ */
@@ -888,5 +888,6 @@ const struct diag_l2_proto diag_l2_proto_vag = {
 	dl2p_vag_send,
 	dl2p_vag_recv,
 	dl2p_vag_request,
-	dl2p_vag_timeout
+	dl2p_vag_timeout,
+	NULL
 };
@@ -41,6 +41,40 @@
 int diag_l3_debug;
 
 static struct diag_l3_conn	*diag_l3_list;
+static diag_mtx *l3list_mtx;	//protects diag_l3_list
+static bool l3_init_done;
+
+
+int diag_l3_init(void) {
+	if (l3_init_done) {
+		return 0;
+	}
+	l3list_mtx = diag_os_newmtx();
+	assert(l3list_mtx != NULL);
+	diag_l3_list = NULL;
+	l3_init_done = 1;
+	return 0;
+}
+
+int diag_l3_end(void) {
+	diag_os_delmtx(l3list_mtx);
+	l3_init_done = 0;
+	return 0;
+}
+
+
+/*
+ * Keepalive hook registered with L2 for protos that have a timer : the L2
+ * scheduler decides when it's due, we just pass the time since our last
+ * traffic.
+ */
+static int
+diag_l3_keepalive(void *handle) {
+	struct diag_l3_conn *d_l3_conn = handle;
+
+	return d_l3_conn->d_l3_proto->diag_l3_proto_timer(d_l3_conn,
+		diag_os_getms() - d_l3_conn->timer);
+}
 
 
 struct diag_l3_conn *
@@ -103,10 +137,18 @@ diag_l3_start(const char *protocol, struct diag_l2_conn *d_l2_conn) {
 		 */
 		d_l3_conn->timer=diag_os_getms();
 
+		/* Our keepalive replaces L2's, if it has none */
+		if (dp->diag_l3_proto_timer &&
+			!(d_l3_conn->d_l3l2_flags & DIAG_L2_FLAG_KEEPALIVE)) {
+			diag_l2_set_keepalive(d_l2_conn, diag_l3_keepalive, d_l3_conn);
+		}
+
 		/*
 		 * And add to list
 		 */
+		diag_os_lock(l3list_mtx);
 		LL_PREPEND(diag_l3_list, d_l3_conn);
+		diag_os_unlock(l3list_mtx);
 
 	}
 
@@ -127,7 +169,12 @@ int diag_l3_stop(struct diag_l3_conn *d_l3_conn) {
 	const struct diag_l3_proto *dp = d_l3_conn->d_l3_proto;
 
 	/* Remove from list */
+	diag_os_lock(l3list_mtx);
 	LL_DELETE(diag_l3_list, d_l3_conn);
+	diag_os_unlock(l3list_mtx);
+	if (d_l3_conn->d_l3l2_conn->ka_handle == d_l3_conn) {
+		diag_l2_set_keepalive(d_l3_conn->d_l3l2_conn, NULL, NULL);
+	}
 
 	rv = dp->diag_l3_proto_stop(d_l3_conn);
 
@@ -202,7 +249,9 @@ diag_l3_request(struct diag_l3_conn *dl3c, struct diag_msg *txmsg, int *errval)
 
 	/* Call protocol specific send routine */
 	if (dl3p->diag_l3_proto_request) {
+		diag_l2_xfer_begin(dl3c->d_l3l2_conn);
 		rxmsg = dl3p->diag_l3_proto_request(dl3c, txmsg, errval);
+		diag_l2_xfer_end(dl3c->d_l3l2_conn);
 	} else {
 		rxmsg = NULL;
 	}
@@ -221,37 +270,156 @@ diag_l3_request(struct diag_l3_conn *dl3c, struct diag_msg *txmsg, int *errval)
 	return rxmsg;
 }
 
-/*
- * Note: This is called regularly from a signal handler.
- * (see diag_os.c)
- * XXX This calls non async-signal-safe functions!
- */
+/* rx callback for diag_l3_request_batch : keep a copy of the response(s) */
+static void
+diag_l3_batch_rcv(void *handle, struct diag_msg *msg) {
+	struct diag_l3_batch_req *req = handle;
+	struct diag_msg *rmsg;
+
+	rmsg = diag_dupmsg(msg);
+	if (rmsg == NULL) {
+		req->errval = DIAG_ERR_NOMEM;
+		return;
+	}
+	LL_CONCAT(req->rxmsg, rmsg);
+	return;
+}
+
+int
+diag_l3_request_batch(struct diag_l3_conn *dl3c, struct diag_l3_batch_req *reqs,
+	unsigned int nreqs, unsigned int timeout,
+	bool (*abort)(void *abort_handle), void *abort_handle) {
+	struct diag_l2_expect noexpect = {0};
+	unsigned int i;
+	int rv;
+	int good = 0;
+	int expecting = 0;
 
-void diag_l3_timer(void) {
-	/*
-	 * Regular timer routine
-	 * Call protocol specific timer
-	 */
-	struct diag_l3_conn *conn;
-	unsigned long now=diag_os_getms();
+	if ((dl3c == NULL) || (reqs == NULL)) {
+		return diag_iseterr(DIAG_ERR_BADVAL);
+	}
 
-	LL_FOREACH(diag_l3_list, conn) {
-		/* Call L3 timer routine for this connection */
-		const struct diag_l3_proto *dp = conn->d_l3_proto;
+	if (diag_l3_debug & DIAG_DEBUG_WRITE) {
+		fprintf(stderr, FLFMT "_request_batch dl3c=%p, %u requests\n", FL,
+			(void *)dl3c, nreqs);
+	}
+
+	for (i = 0; i < nreqs; i++) {
+		reqs[i].rxmsg = NULL;
+		reqs[i].errval = 0;
+	}
 
-		//skip connection if L1 does the keepalive stuff
-		if (conn->d_l3l1_flags & DIAG_L1_DOESKEEPALIVE) {
+	/* Nothing but send + recv in here : everything else is for the caller */
+	for (i = 0; i < nreqs; i++) {
+		if ((i > 0) && abort && abort(abort_handle)) {
+			for (; i < nreqs; i++) {
+				reqs[i].errval = DIAG_ERR_GENERAL;
+			}
+			break;
+		}
+		if (reqs[i].expect) {
+			(void) diag_l3_ioctl(dl3c, DIAG_IOCTL_SET_EXPECT, (void *)reqs[i].expect);
+			expecting = 1;
+		} else if (expecting) {
+			(void) diag_l3_ioctl(dl3c, DIAG_IOCTL_SET_EXPECT, &noexpect);
+			expecting = 0;
+		}
+		diag_l2_xfer_begin(dl3c->d_l3l2_conn);
+		rv = diag_l3_send(dl3c, reqs[i].txmsg);
+		if (rv != 0) {
+			diag_l2_xfer_end(dl3c->d_l3l2_conn);
+			reqs[i].errval = rv;
 			continue;
 		}
+		rv = diag_l3_recv(dl3c, timeout, diag_l3_batch_rcv, &reqs[i]);
+		diag_l2_xfer_end(dl3c->d_l3l2_conn);
+		if (rv < 0) {
+			reqs[i].errval = rv;
+		} else if (reqs[i].rxmsg == NULL) {
+			reqs[i].errval = DIAG_ERR_TIMEOUT;
+		}
+		if (reqs[i].errval == 0) {
+			good++;
+		}
+	}
 
-		if (dp->diag_l3_proto_timer) {
-			unsigned long diffms;
+	if (expecting) {
+		(void) diag_l3_ioctl(dl3c, DIAG_IOCTL_SET_EXPECT, &noexpect);
+	}
 
-			diffms = now - conn->timer;
+	return good;
+}
 
-			(void) dp->diag_l3_proto_timer(conn, diffms);
-		}
+
+struct diag_l3_pipe {
+	struct diag_l3_conn *dl3c;
+	struct diag_l2_pipe *l2p;
+};
+
+struct diag_l3_pipe *
+diag_l3_pipe_new(struct diag_l3_conn *dl3c) {
+	struct diag_l3_pipe *dp;
+	int rv;
+
+	if (!(dl3c->d_l3l2_flags & DIAG_L2_FLAG_FRAMED)) {
+		/* results would be L2 fragments the L3 proto never saw */
+		return diag_pseterr(DIAG_ERR_PROTO_NOTSUPP);
+	}
+
+	rv = diag_calloc(&dp, 1);
+	if (rv != 0) {
+		return diag_pseterr(rv);
+	}
+	dp->dl3c = dl3c;
+	dp->l2p = diag_l2_pipe_new(dl3c->d_l3l2_conn);
+	if (dp->l2p == NULL) {
+		free(dp);
+		return diag_pseterr(DIAG_ERR_GENERAL);
 	}
+	return dp;
+}
+
+int
+diag_l3_pipe_push(struct diag_l3_pipe *dp, struct diag_msg *txmsg,
+		const struct diag_l2_expect *expect, void *handle) {
+	return diag_l2_pipe_push(dp->l2p, txmsg, expect, handle);
+}
+
+void
+diag_l3_pipe_setcb(struct diag_l3_pipe *dp,
+		void (*cb)(void *handle, struct diag_msg *rxmsg, int errval)) {
+	diag_l2_pipe_setcb(dp->l2p, cb);
+	return;
+}
+
+void
+diag_l3_pipe_listen(struct diag_l3_pipe *dp, bool enable, void *handle) {
+	diag_l2_pipe_listen(dp->l2p, enable, handle);
+	return;
+}
+
+int
+diag_l3_pipe_cancel(struct diag_l3_pipe *dp, void *handle) {
+	return diag_l2_pipe_cancel(dp->l2p, handle);
+}
+
+int
+diag_l3_pipe_pop(struct diag_l3_pipe *dp, unsigned int timeout,
+		struct diag_msg **rxmsg, int *errval, void **handle) {
+	int rv;
+
+	rv = diag_l2_pipe_pop(dp->l2p, timeout, rxmsg, errval, handle);
+	if ((rv == 0) && (*errval == 0)) {
+		dp->dl3c->timer = diag_os_getms();
+	}
+	return rv;
+}
+
+void
+diag_l3_pipe_del(struct diag_l3_pipe *dp) {
+	diag_l2_pipe_del(dp->l2p);
+	free(dp);
+	return;
 }
 
 
@@ -32,6 +32,7 @@ extern "C" {
 #endif
 
 struct diag_l2_conn;
+struct diag_l2_expect;
 struct diag_msg;
 
 /** Layer 3 connection info
@@ -94,10 +95,12 @@ struct diag_l3_proto {
 		char *buf,
 		const size_t bufsize);
 
-	/* Timer (optional)
-	 * If defined, this is called from diag_l3_timer()
-	 * by the periodic callback (in diag_os); the ms argument
-	 * is the difference (in ms) between [now] and [diag_l3_conn->timer].
+	/* Keepalive timer (optional)
+	 * If defined, and L2 doesn't do keepalives itself, this is called by
+	 * the L2 keepalive scheduler (diag_l2_timer) when the connection
+	 * would otherwise reach P3max idle : it should send a keepalive
+	 * request. The ms argument is the difference (in ms) between [now]
+	 * and [diag_l3_conn->timer].
 	 * ret 0 if ok
 	 */
 	int (*diag_l3_proto_timer)(struct diag_l3_conn *, unsigned long ms);
@@ -105,6 +108,16 @@ struct diag_l3_proto {
 };
 
 
+/** Initialize L3 layer
+ * Must be called once before using any L3 function (done by diag_init())
+ */
+int diag_l3_init(void);
+
+/** De-initialize L3 layer
+ * opposite of diag_l3_init()
+ */
+int diag_l3_end(void);
+
 /** Start L3 connection
  *
  * must free() everything if it fails;
@@ -146,6 +159,69 @@ void diag_l3_decode(struct diag_l3_conn *d_l3_conn, struct diag_msg *msg,
 struct diag_msg *diag_l3_request(struct diag_l3_conn *dl3c, struct diag_msg *txmsg,
 		int *errval);
 
+/** Request batch entry, see diag_l3_request_batch() */
+struct diag_l3_batch_req {
+	struct diag_msg *txmsg;	/* request to send (filled by caller) */
+	struct diag_msg *rxmsg;	/* copy of all responses received, or NULL. Caller must free */
+	int errval;		/* 0 if ok, else DIAG_ERR_* */
+	const struct diag_l2_expect *expect;	/* optional expected responders (DIAG_IOCTL_SET_EXPECT), or NULL */
+};
+
+/** Send an array of requests back-to-back.
+ *
+ * Uses send + recv so that protocols without a _request function (J1979)
+ * can return responses from multiple ECUs. Each request is sent as soon as
+ * the previous recv returns, leaving only the L2 p3min delay between them.
+ * The caller processes the results after the batch has completed.
+ * If a request has an expected responder set, it is applied before sending
+ * that request; it is cleared again at the end of the batch.
+ * @param timeout : recv timeout for each request, in ms
+ * @param abort : if not NULL, called with abort_handle before each request
+ *	but the first; if it returns true, the remaining requests are not sent
+ *	and keep errval = DIAG_ERR_GENERAL.
+ * @return number of requests that got a response, or <0 on error.
+ */
+int diag_l3_request_batch(struct diag_l3_conn *dl3c, struct diag_l3_batch_req *reqs,
+	unsigned int nreqs, unsigned int timeout,
+	bool (*abort)(void *abort_handle), void *abort_handle);
+
+/** Request pipeline / asynchronous requests on an L3 connection.
+ *
+ * Same semantics as the L2 pipeline (see diag_l2_pipe_new()), which does the
+ * work : requests and results are passed as-is, so this is only available
+ * if L2 frames messages (DIAG_L2_FLAG_FRAMED), which is when the L3
+ * protocols leave them untouched too. A result with errval=0 counts as L3
+ * activity (d_l3_conn->timer).
+ * While a pipeline exists, the caller must not use the L3 connection
+ * directly.
+ */
+struct diag_l3_pipe;
+
+/** @return new pipeline, to be deleted with diag_l3_pipe_del(); NULL if
+ * failed or L2 doesn't frame messages (DIAG_ERR_PROTO_NOTSUPP) */
+struct diag_l3_pipe *diag_l3_pipe_new(struct diag_l3_conn *dl3c);
+
+/** see diag_l2_pipe_push() */
+int diag_l3_pipe_push(struct diag_l3_pipe *dp, struct diag_msg *txmsg,
+	const struct diag_l2_expect *expect, void *handle);
+
+/** see diag_l2_pipe_setcb() */
+void diag_l3_pipe_setcb(struct diag_l3_pipe *dp,
+	void (*cb)(void *handle, struct diag_msg *rxmsg, int errval));
+
+/** see diag_l2_pipe_listen() */
+void diag_l3_pipe_listen(struct diag_l3_pipe *dp, bool enable, void *handle);
+
+/** see diag_l2_pipe_cancel() */
+int diag_l3_pipe_cancel(struct diag_l3_pipe *dp, void *handle);
+
+/** see diag_l2_pipe_pop() */
+int diag_l3_pipe_pop(struct diag_l3_pipe *dp, unsigned int timeout,
+	struct diag_msg **rxmsg, int *errval, void **handle);
+
+/** see diag_l2_pipe_del() */
+void diag_l3_pipe_del(struct diag_l3_pipe *dp);
+
 /** Send ioctl to the specified
  * L3
  *
@@ -153,14 +229,6 @@ struct diag_msg *diag_l3_request(struct diag_l3_conn *dl3c, struct diag_msg *txm
  */
 int diag_l3_ioctl(struct diag_l3_conn *connection, unsigned int cmd, void *data);
 
-/** Periodic timer dispatcher
- *
- * (call only from diag_os_*.c) *
- * This calls the diag_l3_proto_timer function of every
- * diag_l3_conn in the diag_l3_list linked-list.
- */
-void diag_l3_timer(void);
-
 
 /* Base implementations:
  * these are defined in diag_l3.c and perform no operation.
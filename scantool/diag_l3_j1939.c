@@ -0,0 +1,627 @@
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * L3 SAE J1939 : SPN decoding and bus monitor, see diag_l3_j1939.h
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diag.h"
+#include "diag_err.h"
+#include "diag_os.h"
+#include "diag_ring.h"
+#include "diag_l2.h"
+#include "diag_l3.h"
+#include "diag_l2_j1939.h"
+#include "diag_l3_j1939.h"
+
+#include "utlist.h"
+
+
+/*
+ * SPN table, J1939-71 / J1939-73. Must stay sorted by PGN : lookups are a
+ * binary search for the first entry of a PGN.
+ */
+static const struct diag_l3_j1939_spn j1939_spns[] = {
+	{ 91, 0xF003, 8, 8, 0.4, 0, "Accelerator Pedal Position 1", "%" },
+	{ 92, 0xF003, 16, 8, 1, 0, "Engine Percent Load At Current Speed", "%" },
+	{ 512, 0xF004, 8, 8, 1, -125, "Driver's Demand Engine - Percent Torque", "%" },
+	{ 513, 0xF004, 16, 8, 1, -125, "Actual Engine - Percent Torque", "%" },
+	{ 190, 0xF004, 24, 16, 0.125, 0, "Engine Speed", "rpm" },
+	{ 524, 0xF005, 0, 8, 1, -125, "Transmission Selected Gear", "" },
+	{ 523, 0xF005, 24, 8, 1, -125, "Transmission Current Gear", "" },
+	{ 987, 0xFECA, 0, 2, 1, 0, "Protect Lamp Status", "" },
+	{ 624, 0xFECA, 2, 2, 1, 0, "Amber Warning Lamp Status", "" },
+	{ 623, 0xFECA, 4, 2, 1, 0, "Red Stop Lamp Status", "" },
+	{ 1213, 0xFECA, 6, 2, 1, 0, "Malfunction Indicator Lamp Status", "" },
+	{ 244, 0xFEE0, 0, 32, 0.125, 0, "Trip Distance", "km" },
+	{ 245, 0xFEE0, 32, 32, 0.125, 0, "Total Vehicle Distance", "km" },
+	{ 247, 0xFEE5, 0, 32, 0.05, 0, "Engine Total Hours of Operation", "h" },
+	{ 182, 0xFEE9, 0, 32, 0.5, 0, "Engine Trip Fuel", "L" },
+	{ 250, 0xFEE9, 32, 32, 0.5, 0, "Engine Total Fuel Used", "L" },
+	{ 110, 0xFEEE, 0, 8, 1, -40, "Engine Coolant Temperature", "degC" },
+	{ 174, 0xFEEE, 8, 8, 1, -40, "Engine Fuel Temperature 1", "degC" },
+	{ 175, 0xFEEE, 16, 16, 0.03125, -273, "Engine Oil Temperature 1", "degC" },
+	{ 94, 0xFEEF, 0, 8, 4, 0, "Engine Fuel Delivery Pressure", "kPa" },
+	{ 98, 0xFEEF, 16, 8, 0.4, 0, "Engine Oil Level", "%" },
+	{ 100, 0xFEEF, 24, 8, 4, 0, "Engine Oil Pressure", "kPa" },
+	{ 109, 0xFEEF, 48, 8, 2, 0, "Engine Coolant Pressure", "kPa" },
+	{ 111, 0xFEEF, 56, 8, 0.4, 0, "Engine Coolant Level", "%" },
+	{ 84, 0xFEF1, 8, 16, 1.0 / 256, 0, "Wheel-Based Vehicle Speed", "km/h" },
+	{ 183, 0xFEF2, 0, 16, 0.05, 0, "Engine Fuel Rate", "L/h" },
+	{ 184, 0xFEF2, 16, 16, 1.0 / 512, 0, "Engine Instantaneous Fuel Economy", "km/L" },
+	{ 51, 0xFEF2, 48, 8, 0.4, 0, "Engine Throttle Valve 1 Position", "%" },
+	{ 108, 0xFEF5, 0, 8, 0.5, 0, "Barometric Pressure", "kPa" },
+	{ 171, 0xFEF5, 24, 16, 0.03125, -273, "Ambient Air Temperature", "degC" },
+	{ 172, 0xFEF5, 40, 8, 1, -40, "Engine Air Inlet Temperature", "degC" },
+	{ 102, 0xFEF6, 8, 8, 2, 0, "Engine Intake Manifold #1 Pressure", "kPa" },
+	{ 105, 0xFEF6, 16, 8, 1, -40, "Engine Intake Manifold 1 Temperature", "degC" },
+	{ 106, 0xFEF6, 24, 8, 2, 0, "Engine Air Inlet Pressure", "kPa" },
+	{ 168, 0xFEF7, 32, 16, 0.05, 0, "Battery Potential / Power Input 1", "V" },
+	{ 158, 0xFEF7, 48, 16, 0.05, 0, "Keyswitch Battery Potential", "V" },
+	{ 96, 0xFEFC, 8, 8, 0.4, 0, "Fuel Level 1", "%" },
+};
+
+#define J1939_MAXPGSPN	8	/* most SPNs in one PGN of the table */
+
+static const struct {
+	uint32_t pgn;
+	const char *name;
+} j1939_pgnames[] = {
+	{ 0xE800, "ACKM" },
+	{ 0xEA00, "RQST" },
+	{ 0xEE00, "AC" },
+	{ 0xF003, "EEC2" },
+	{ 0xF004, "EEC1" },
+	{ 0xF005, "ETC2" },
+	{ 0xFECA, "DM1" },
+	{ 0xFECB, "DM2" },
+	{ 0xFEDA, "SOFT" },
+	{ 0xFEE0, "VD" },
+	{ 0xFEE5, "HOURS" },
+	{ 0xFEE9, "LFC" },
+	{ 0xFEEC, "VI" },
+	{ 0xFEEE, "ET1" },
+	{ 0xFEEF, "EFL/P1" },
+	{ 0xFEF1, "CCVS" },
+	{ 0xFEF2, "LFE" },
+	{ 0xFEF5, "AMB" },
+	{ 0xFEF6, "IC1" },
+	{ 0xFEF7, "VEP1" },
+	{ 0xFEFC, "DD" },
+};
+
+
+const struct diag_l3_j1939_spn *
+diag_l3_j1939_spntab(unsigned int *n) {
+	*n = ARRAY_SIZE(j1939_spns);
+	return j1939_spns;
+}
+
+const char *
+diag_l3_j1939_pgname(uint32_t pgn) {
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(j1939_pgnames); i++) {
+		if (j1939_pgnames[i].pgn == pgn) {
+			return j1939_pgnames[i].name;
+		}
+	}
+	return NULL;
+}
+
+/* Index of the first table entry for pgn, ARRAY_SIZE(j1939_spns) if none */
+static unsigned int
+j1939_spnfirst(uint32_t pgn) {
+	unsigned int lo = 0, hi = ARRAY_SIZE(j1939_spns);
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (j1939_spns[mid].pgn < pgn) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if ((lo < ARRAY_SIZE(j1939_spns)) && (j1939_spns[lo].pgn != pgn)) {
+		lo = ARRAY_SIZE(j1939_spns);
+	}
+	return lo;
+}
+
+/* Extract one SPN. Little-endian; sub-byte fields never cross a byte */
+static void
+j1939_spnget(const struct diag_l3_j1939_spn *sp, const uint8_t *data, unsigned int len,
+		struct diag_l3_j1939_val *val) {
+	unsigned int byte = sp->bitpos / 8;
+	uint32_t raw = 0, top;
+	unsigned int i;
+
+	val->spn = sp;
+	val->value = 0;
+	if (byte + (sp->bits + 7) / 8 > len) {
+		val->state = DIAG_L3_J1939_NA;
+		return;
+	}
+
+	if (sp->bits < 8) {
+		uint32_t mask = (1U << sp->bits) - 1;
+
+		raw = (data[byte] >> (sp->bitpos % 8)) & mask;
+		if (raw == mask) {
+			val->state = DIAG_L3_J1939_NA;
+			return;
+		}
+		if (raw == mask - 1) {
+			val->state = DIAG_L3_J1939_ERR;
+			return;
+		}
+	} else {
+		for (i = sp->bits / 8; i > 0; i--) {
+			raw = (raw << 8) | data[byte + i - 1];
+		}
+		/* J1939-71 ranges : most significant byte 0xFE error, above 0xFA n/a */
+		top = raw >> (sp->bits - 8);
+		if (top == 0xFE) {
+			val->state = DIAG_L3_J1939_ERR;
+			return;
+		}
+		if (top > 0xFA) {
+			val->state = DIAG_L3_J1939_NA;
+			return;
+		}
+	}
+	val->value = raw * sp->scale + sp->offset;
+	val->state = DIAG_L3_J1939_OK;
+	return;
+}
+
+unsigned int
+diag_l3_j1939_decode_pg(uint32_t pgn, const uint8_t *data, unsigned int len,
+		struct diag_l3_j1939_val *vals, unsigned int maxvals) {
+	unsigned int i, n;
+
+	for (i = j1939_spnfirst(pgn), n = 0;
+			(i < ARRAY_SIZE(j1939_spns)) && (j1939_spns[i].pgn == pgn); i++, n++) {
+		if (n < maxvals) {
+			j1939_spnget(&j1939_spns[i], data, len, &vals[n]);
+		}
+	}
+	return n;
+}
+
+/* snprintf at buf[*pos], *pos is kept within size */
+static void
+j1939_cat(char *buf, size_t size, size_t *pos, const char *fmt, ...) {
+	va_list ap;
+	int rv;
+
+	if (*pos >= size) {
+		return;
+	}
+	va_start(ap, fmt);
+	rv = vsnprintf(&buf[*pos], size - *pos, fmt, ap);
+	va_end(ap);
+	if (rv > 0) {
+		*pos += (size_t) rv;
+	}
+	if (*pos >= size) {
+		*pos = size - 1;
+	}
+	return;
+}
+
+/* DM1 / DM2 DTCs, after the two lamp bytes */
+static void
+j1939_catdtcs(char *buf, size_t size, size_t *pos, const uint8_t *data,
+		unsigned int len, bool verbose) {
+	unsigned int o;
+
+	for (o = 2; o + 4 <= len; o += 4) {
+		uint32_t spn = data[o] | (data[o + 1] << 8) | ((uint32_t) (data[o + 2] & 0xE0) << 11);
+		uint8_t fmi = data[o + 2] & 0x1F;
+
+		if (((spn == 0) && (fmi == 0)) || (spn == 0x7FFFF)) {
+			/* "no DTC" filler */
+			continue;
+		}
+		if (verbose) {
+			j1939_cat(buf, size, pos, " ; DTC SPN %lu FMI %u, %u occurrences",
+				(unsigned long) spn, fmi, data[o + 3] & 0x7F);
+		} else {
+			j1939_cat(buf, size, pos, " dtc=%lu/%u/%u", (unsigned long) spn, fmi,
+				data[o + 3] & 0x7F);
+		}
+	}
+	return;
+}
+
+/*
+ * Text for one L2 message : verbose (names, units) for diag_l3_decode(),
+ * or compact for the log.
+ */
+static void
+j1939_format(const struct diag_msg *msg, char *buf, size_t size, bool verbose) {
+	struct diag_l3_j1939_val vals[J1939_MAXPGSPN];
+	const uint8_t *data;
+	const char *pgname;
+	unsigned int len, n, i;
+	uint32_t pgn;
+	size_t pos = 0;
+
+	buf[0] = 0;
+	if (msg->len < DL2P_J1939_HDRLEN) {
+		return;
+	}
+	pgn = DL2P_J1939_GETPGN(msg->data);
+	data = &msg->data[DL2P_J1939_HDRLEN];
+	len = msg->len - DL2P_J1939_HDRLEN;
+	pgname = diag_l3_j1939_pgname(pgn);
+
+	if (verbose) {
+		if (pgname) {
+			j1939_cat(buf, size, &pos, "%s ", pgname);
+		}
+		j1939_cat(buf, size, &pos, "PGN %lu, %02X -> %02X :", (unsigned long) pgn,
+			msg->src, msg->dest);
+	}
+
+	n = diag_l3_j1939_decode_pg(pgn, data, len, vals, ARRAY_SIZE(vals));
+	n = MIN(n, ARRAY_SIZE(vals));
+	for (i = 0; i < n; i++) {
+		const struct diag_l3_j1939_val *v = &vals[i];
+
+		if (verbose) {
+			j1939_cat(buf, size, &pos, "%s %s", i? " ;":"", v->spn->name);
+			if (v->state == DIAG_L3_J1939_OK) {
+				j1939_cat(buf, size, &pos, " %.2f %s", v->value, v->spn->unit);
+			} else {
+				j1939_cat(buf, size, &pos, " %s",
+					(v->state == DIAG_L3_J1939_ERR)? "error":"n/a");
+			}
+		} else {
+			if (v->state == DIAG_L3_J1939_OK) {
+				j1939_cat(buf, size, &pos, " %u=%g", v->spn->spn, v->value);
+			} else {
+				j1939_cat(buf, size, &pos, " %u=%s", v->spn->spn,
+					(v->state == DIAG_L3_J1939_ERR)? "ERR":"NA");
+			}
+		}
+	}
+	if ((pgn == DL2P_J1939_PGN_DM1) || (pgn == DL2P_J1939_PGN_DM2)) {
+		j1939_catdtcs(buf, size, &pos, data, len, verbose);
+	}
+	if (n == 0) {
+		/* unknown : data as is */
+		if (verbose) {
+			j1939_cat(buf, size, &pos, " %u bytes", len);
+		}
+		for (i = 0; i < len; i++) {
+			j1939_cat(buf, size, &pos, " %02X", data[i]);
+		}
+	}
+	return;
+}
+
+
+/**************** L3 protocol : messages pass through as L2 made them */
+
+static int
+diag_l3_j1939_start(struct diag_l3_conn *d_l3_conn) {
+	if (d_l3_conn->d_l3l2_conn->l2proto->diag_l2_protocol != DIAG_L2_PROT_J1939) {
+		fprintf(stderr, FLFMT "J1939 L3 needs the J1939 L2 !\n", FL);
+		return diag_iseterr(DIAG_ERR_PROTO_NOTSUPP);
+	}
+	return 0;
+}
+
+static int
+diag_l3_j1939_send(struct diag_l3_conn *d_l3_conn, struct diag_msg *msg) {
+	int rv;
+
+	rv = diag_l2_send(d_l3_conn->d_l3l2_conn, msg);
+	d_l3_conn->timer = diag_os_getms();
+	return rv? diag_iseterr(rv):0;
+}
+
+static int
+diag_l3_j1939_recv(struct diag_l3_conn *d_l3_conn, unsigned int timeout,
+		void (* rcv_call_back)(void *handle ,struct diag_msg *) , void *handle) {
+	int rv;
+
+	rv = diag_l2_recv(d_l3_conn->d_l3l2_conn, timeout, rcv_call_back, handle);
+	if (rv == 0) {
+		d_l3_conn->timer = diag_os_getms();
+	}
+	return rv;
+}
+
+static void
+diag_l3_j1939_decode(UNUSED(struct diag_l3_conn *d_l3_conn),
+		struct diag_msg *msg, char *buf, const size_t bufsize) {
+	j1939_format(msg, buf, bufsize, 1);
+	return;
+}
+
+const struct diag_l3_proto diag_l3_j1939 = {
+	"J1939",
+	diag_l3_j1939_start,
+	diag_l3_base_stop,
+	diag_l3_j1939_send,
+	diag_l3_j1939_recv,
+	NULL,	//ioctl
+	diag_l3_base_request,
+	diag_l3_j1939_decode,
+	NULL	//timer
+};
+
+
+/**************** Monitor */
+
+/* ring records : u32 rxtime - tstart ; u16 len ; u8 src ; u8 dest ; len bytes of L2 data */
+#define MON_RECHDR	8
+#define MON_MAXREC	(MON_RECHDR + DL2P_J1939_HDRLEN + DL2P_J1939_MAXLEN)
+#define MON_MAXSRC	32	/* source addresses with latest values */
+#define MON_FLUSH_MS	100	/* decoder runs at least this often */
+#define MON_LOGLINE	512
+
+/*
+ * recv callbacks are the only producer, the ring worker decodes; ring.mtx
+ * also protects the receive counters. "vmtx" protects the latest values,
+ * for snapshots.
+ */
+struct diag_l3_j1939_mon {
+	FILE *logfp;
+	unsigned long tstart;
+
+	struct diag_ring ring;
+	unsigned long msgs;
+	unsigned long dropped;
+
+	diag_mtx *vmtx;
+	int srcidx[256];	/* index in vals of each source address, -1 : none */
+	unsigned int nsrc;
+	unsigned int nspn;
+	struct diag_l3_j1939_monval *vals;	/* [MON_MAXSRC][nspn] */
+	unsigned long decoded;
+
+	/* ring worker only */
+	uint8_t rec[MON_MAXREC];
+	char line[MON_LOGLINE];
+};
+
+void
+diag_l3_j1939_mon_rcv(void *handle, struct diag_msg *msg) {
+	struct diag_l3_j1939_mon *mon = handle;
+	struct diag_msg *tmsg;
+	uint8_t hdr[MON_RECHDR];
+	unsigned long t;
+
+	diag_ring_lock(&mon->ring);
+	LL_FOREACH(msg, tmsg) {
+		mon->msgs++;
+		if ((tmsg->len < DL2P_J1939_HDRLEN) ||
+				(tmsg->len > DL2P_J1939_HDRLEN + DL2P_J1939_MAXLEN) ||
+				(diag_ring_room(&mon->ring) < (MON_RECHDR + tmsg->len))) {
+			mon->dropped++;
+			continue;
+		}
+		t = tmsg->rxtime - mon->tstart;
+		hdr[0] = (uint8_t) t;
+		hdr[1] = (uint8_t) (t >> 8);
+		hdr[2] = (uint8_t) (t >> 16);
+		hdr[3] = (uint8_t) (t >> 24);
+		hdr[4] = (uint8_t) tmsg->len;
+		hdr[5] = (uint8_t) (tmsg->len >> 8);
+		hdr[6] = tmsg->src;
+		hdr[7] = tmsg->dest;
+		diag_ring_put(&mon->ring, hdr, sizeof(hdr));
+		diag_ring_put(&mon->ring, tmsg->data, tmsg->len);
+	}
+	diag_ring_unlock(&mon->ring);
+	return;
+}
+
+/* Decode one record : update latest values, log */
+static void
+mon_decode(struct diag_l3_j1939_mon *mon, struct diag_msg *msg) {
+	struct diag_l3_j1939_val vals[J1939_MAXPGSPN];
+	unsigned int first, n, i;
+	uint32_t pgn;
+	int si;
+
+	pgn = DL2P_J1939_GETPGN(msg->data);
+	n = diag_l3_j1939_decode_pg(pgn, &msg->data[DL2P_J1939_HDRLEN],
+			msg->len - DL2P_J1939_HDRLEN, vals, ARRAY_SIZE(vals));
+	n = MIN(n, ARRAY_SIZE(vals));
+
+	diag_os_lock(mon->vmtx);
+	mon->decoded++;
+	si = mon->srcidx[msg->src];
+	if ((n > 0) && (si < 0) && (mon->nsrc < MON_MAXSRC)) {
+		si = (int) mon->nsrc++;
+		mon->srcidx[msg->src] = si;
+	}
+	if ((n > 0) && (si >= 0)) {
+		first = (unsigned int) (vals[0].spn - j1939_spns);
+		for (i = 0; i < n; i++) {
+			struct diag_l3_j1939_monval *mv;
+
+			mv = &mon->vals[(unsigned int) si * mon->nspn + first + i];
+			mv->src = msg->src;
+			mv->val = vals[i];
+			mv->rxtime = msg->rxtime;
+		}
+	}
+	diag_os_unlock(mon->vmtx);
+
+	if (mon->logfp) {
+		unsigned long tv = msg->rxtime - mon->tstart;
+
+		j1939_format(msg, mon->line, sizeof(mon->line), 0);
+		fprintf(mon->logfp, "J %04lu.%03lu %02X %05lX%s\n", tv / 1000, tv % 1000,
+			msg->src, (unsigned long) pgn, mon->line);
+	}
+	return;
+}
+
+/* ring worker : decode every record; the producer doesn't touch
+ * [pos, pos + len) meanwhile */
+static size_t
+mon_decoder(void *handle, size_t pos, size_t len) {
+	struct diag_l3_j1939_mon *mon = handle;
+	struct diag_msg msg;
+	size_t done, rlen;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.data = &mon->rec[MON_RECHDR];
+
+	for (done = 0; done < len; done += MON_RECHDR + rlen) {
+		diag_ring_get(&mon->ring, (pos + done) % mon->ring.size, mon->rec, MON_RECHDR);
+		rlen = mon->rec[4] | (mon->rec[5] << 8);
+		diag_ring_get(&mon->ring, (pos + done + MON_RECHDR) % mon->ring.size,
+			&mon->rec[MON_RECHDR], rlen);
+		msg.rxtime = mon->tstart + (mon->rec[0] | ((unsigned long) mon->rec[1] << 8) |
+			((unsigned long) mon->rec[2] << 16) | ((unsigned long) mon->rec[3] << 24));
+		msg.len = (unsigned int) rlen;
+		msg.src = mon->rec[6];
+		msg.dest = mon->rec[7];
+		mon_decode(mon, &msg);
+	}
+	return len;
+}
+
+/* ring worker, nothing to decode : flush the log */
+static void
+mon_idle(void *handle) {
+	struct diag_l3_j1939_mon *mon = handle;
+
+	if (mon->logfp) {
+		fflush(mon->logfp);
+	}
+	return;
+}
+
+static void
+mon_free(struct diag_l3_j1939_mon *mon) {
+	if (mon->vmtx) {
+		diag_os_delmtx(mon->vmtx);
+	}
+	free(mon->vals);
+	free(mon);
+	return;
+}
+
+struct diag_l3_j1939_mon *
+diag_l3_j1939_mon_new(FILE *logfp, unsigned long tstart, size_t ringsize) {
+	struct diag_l3_j1939_mon *mon;
+	unsigned int i;
+	int rv;
+
+	if (ringsize == 0) {
+		ringsize = DIAG_L3_J1939_DEFRING;
+	}
+	if (ringsize < MON_MAXREC) {
+		ringsize = MON_MAXREC;
+	}
+
+	rv = diag_calloc(&mon, 1);
+	if (rv != 0) {
+		return diag_pseterr(rv);
+	}
+	mon->nspn = ARRAY_SIZE(j1939_spns);
+	rv = diag_calloc(&mon->vals, MON_MAXSRC * mon->nspn);
+	if (rv != 0) {
+		mon_free(mon);
+		return diag_pseterr(rv);
+	}
+	mon->logfp = logfp;
+	mon->tstart = tstart;
+	for (i = 0; i < ARRAY_SIZE(mon->srcidx); i++) {
+		mon->srcidx[i] = -1;
+	}
+
+	mon->vmtx = diag_os_newmtx();
+	if (!mon->vmtx) {
+		mon_free(mon);
+		return diag_pseterr(DIAG_ERR_GENERAL);
+	}
+	rv = diag_ring_start(&mon->ring, ringsize, MON_FLUSH_MS,
+			mon_decoder, mon_idle, mon);
+	if (rv != 0) {
+		mon_free(mon);
+		return diag_pseterr(rv);
+	}
+	return mon;
+}
+
+unsigned int
+diag_l3_j1939_mon_snapshot(struct diag_l3_j1939_mon *mon,
+		struct diag_l3_j1939_monval *vals, unsigned int max,
+		struct diag_l3_j1939_monstats *st) {
+	unsigned int sa, i, n = 0;
+
+	if (st) {
+		diag_os_lock(mon->ring.mtx);
+		st->msgs = mon->msgs;
+		st->dropped = mon->dropped;
+		diag_os_unlock(mon->ring.mtx);
+	}
+
+	diag_os_lock(mon->vmtx);
+	for (sa = 0; sa < ARRAY_SIZE(mon->srcidx); sa++) {
+		const struct diag_l3_j1939_monval *mv;
+
+		if (mon->srcidx[sa] < 0) {
+			continue;
+		}
+		mv = &mon->vals[(unsigned int) mon->srcidx[sa] * mon->nspn];
+		for (i = 0; (i < mon->nspn) && (n < max); i++) {
+			if (mv[i].val.spn != NULL) {
+				vals[n++] = mv[i];
+			}
+		}
+	}
+	if (st) {
+		st->decoded = mon->decoded;
+		st->sources = mon->nsrc;
+	}
+	diag_os_unlock(mon->vmtx);
+	return n;
+}
+
+void
+diag_l3_j1939_mon_del(struct diag_l3_j1939_mon *mon,
+		struct diag_l3_j1939_monstats *st) {
+	diag_ring_stop(&mon->ring);
+
+	/* the worker and the ring mutex are gone, nothing else touches mon */
+	if (st) {
+		st->msgs = mon->msgs;
+		st->dropped = mon->dropped;
+		st->decoded = mon->decoded;
+		st->sources = mon->nsrc;
+	}
+	mon_free(mon);
+	return;
+}
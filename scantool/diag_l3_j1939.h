@@ -0,0 +1,141 @@
+#ifndef _DIAG_L3_J1939_H_
+#define _DIAG_L3_J1939_H_
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * L3 for SAE J1939 (on the J1939 L2, see diag_l2_j1939.h) :
+ *	- SPN decoding (J1939-71, J1939-73 DM1), driven by a table of common
+ *	engine and vehicle parameters;
+ *	- a monitor, to keep up with a fully loaded bus : the recv callback
+ *	only copies messages into a ring, and a decoder thread decodes them,
+ *	keeps the latest value of every parameter of every source address, and
+ *	writes a log.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+struct diag_msg;
+
+/** SPN descriptor */
+struct diag_l3_j1939_spn {
+	uint16_t spn;
+	uint32_t pgn;
+	uint8_t bitpos;	/** first bit in the parameter group data; 0 : byte 1, bit 1 */
+	uint8_t bits;	/** 2, 4, 8, 16 or 32 */
+	double scale;
+	double offset;	/** value = raw * scale + offset */
+	const char *name;
+	const char *unit;
+};
+
+/** Value states */
+#define DIAG_L3_J1939_OK	0
+#define DIAG_L3_J1939_ERR	1	/** error indicator */
+#define DIAG_L3_J1939_NA	2	/** not available, or not in the data */
+
+struct diag_l3_j1939_val {
+	const struct diag_l3_j1939_spn *spn;
+	double value;	/** only if state is DIAG_L3_J1939_OK */
+	uint8_t state;
+};
+
+/** Decode all known SPNs of a parameter group.
+ * @param data, len : parameter group data (after the PGN header of L2)
+ * @param vals : filled with up to maxvals values, in table order
+ * @return number of SPNs known for pgn (can be > maxvals)
+ */
+unsigned int diag_l3_j1939_decode_pg(uint32_t pgn, const uint8_t *data, unsigned int len,
+	struct diag_l3_j1939_val *vals, unsigned int maxvals);
+
+/** Acronym of a parameter group (e.g. "EEC1"), NULL if unknown */
+const char *diag_l3_j1939_pgname(uint32_t pgn);
+
+/** SPN table
+ * @param n : set to the number of entries
+ */
+const struct diag_l3_j1939_spn *diag_l3_j1939_spntab(unsigned int *n);
+
+
+/*
+ * Monitor. Typical use : diag_l3_j1939_mon_new(), then diag_l2_recv() or
+ * diag_l3_recv() in a loop with diag_l3_j1939_mon_rcv() as callback, and
+ * diag_l3_j1939_mon_snapshot() whenever values need to be shown.
+ *
+ * The recv callback never waits for the decoder : if the ring is full,
+ * messages are dropped and counted. The lock on the ring indexes is never
+ * held while decoding or logging.
+ *
+ * Log lines : "J <s.ms> <SA> <PGN> <spn>=<value> ...", time since tstart;
+ * values are "NA" or "ERR" if so, DM1 DTCs are "dtc=<spn>/<fmi>/<oc>".
+ * Parameter groups without known SPNs are logged as hex data.
+ */
+#define DIAG_L3_J1939_DEFRING	(256 * 1024)	/* default ring size, bytes */
+
+struct diag_l3_j1939_mon;
+
+struct diag_l3_j1939_monstats {
+	unsigned long msgs;	/** received, incl. dropped */
+	unsigned long dropped;	/** ring was full */
+	unsigned long decoded;	/** processed by the decoder thread */
+	unsigned int sources;	/** source addresses seen with known SPNs */
+};
+
+/** Latest value of one SPN from one source */
+struct diag_l3_j1939_monval {
+	uint8_t src;
+	struct diag_l3_j1939_val val;
+	unsigned long rxtime;	/** diag_os_getms() when received */
+};
+
+/** Start a monitor and its decoder thread.
+ * @param logfp : log file, or NULL
+ * @param tstart : diag_os_getms() reference for log timestamps
+ * @param ringsize : bytes, 0 for DIAG_L3_J1939_DEFRING
+ * @return NULL if failed
+ */
+struct diag_l3_j1939_mon *diag_l3_j1939_mon_new(FILE *logfp, unsigned long tstart,
+	size_t ringsize);
+
+/** recv callback, handle is the monitor. Never blocks on the decoder */
+void diag_l3_j1939_mon_rcv(void *handle, struct diag_msg *msg);
+
+/** Copy the latest values, sorted by source address then SPN table order.
+ * @param st : counters, if not NULL
+ * @return number of values copied to vals (at most max)
+ */
+unsigned int diag_l3_j1939_mon_snapshot(struct diag_l3_j1939_mon *mon,
+	struct diag_l3_j1939_monval *vals, unsigned int max,
+	struct diag_l3_j1939_monstats *st);
+
+/** Stop the decoder once it has processed what was received, and free
+ * everything. Final counters copied to *st if not NULL.
+ */
+void diag_l3_j1939_mon_del(struct diag_l3_j1939_mon *mon,
+	struct diag_l3_j1939_monstats *st);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _DIAG_L3_J1939_H_ */
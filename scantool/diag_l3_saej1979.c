@@ -37,13 +37,35 @@
 #include "utlist.h"
 
 
+#define J1979_MAXLEN	7	/* longest message diag_l3_j1979_getlen() knows */
+#define J1979_RXRING	MAXRBUF	/* unframed rx bytes; must be a power of 2 */
+#define J1979_POOLSZ	16	/* preallocated rx messages */
+
+/* rx message from the pool */
+struct j1979_pmsg {
+	struct diag_msg msg;
+	uint8_t data[J1979_MAXLEN];
+};
+
 /* internal data used by each connection */
 struct l3_j1979_int {
 	uint8_t src;	//source address ("tester ID")
 
-	/* Received data buffer, and offset into it */
-	uint8_t rxbuf[MAXRBUF];
-	int	rxoffset;
+	/*
+	 * Unframed L2s : received bytes not framed into messages yet. rxhead
+	 * and rxtail run freely, the index in rxbuf is (x % J1979_RXRING).
+	 * Messages are copied out and rxhead moves on; nothing is ever
+	 * moved inside rxbuf.
+	 */
+	uint8_t rxbuf[J1979_RXRING];
+	unsigned int rxhead;	/* next byte to frame */
+	unsigned int rxtail;	/* next byte from L2 */
+	unsigned long rxtime;	/* when the last bytes arrived */
+	unsigned long rxdropped;	/* bytes that didn't fit in rxbuf */
+
+	/* messages built by process_data(), see j1979_msgget() */
+	struct j1979_pmsg pool[J1979_POOLSZ];
+	struct diag_msg *pfree;
 };
 
 /*
@@ -68,6 +90,12 @@ static int diag_l3_j1979_getlen(uint8_t *data, int len) {
 
 	mode = data[0];
 
+	/* responses need the PID / TID too (except 0x44 : only one byte).
+	 * Normal when framing a byte stream : no error set. */
+	if ((mode > 0x40) && (mode != 0x44) && (len < 2)) {
+		return DIAG_ERR_INCDATA;
+	}
+
 	//J1979 specifies 9 modes (0x01 - 0x09) except with iso15765 (CAN) which has 0x0A modes.
 
 	if (mode > 0x49) {
@@ -273,11 +301,13 @@ diag_l3_rcv_callback(void *handle, struct diag_msg *msg) {
 	struct diag_l3_conn *d_l3_conn = (struct diag_l3_conn *)handle;
 	struct l3_j1979_int *l3i = d_l3_conn->l3_int;
 
+	unsigned int room, len, pos, n;
+
 	if (diag_l3_debug & DIAG_DEBUG_READ) {
 		fprintf(stderr,
 			FLFMT
-			"rcv_callback for %d bytes fmt 0x%X conn rxoffset %d\n",
-			FL, msg->len, msg->fmt, l3i->rxoffset);
+			"rcv_callback for %u bytes fmt 0x%X conn rx queue %u\n",
+			FL, msg->len, msg->fmt, l3i->rxtail - l3i->rxhead);
 	}
 
 	if (msg->fmt & DIAG_FMT_FRAMED) {
@@ -285,119 +315,139 @@ diag_l3_rcv_callback(void *handle, struct diag_msg *msg) {
 		if (d_l3_conn->callback) {
 			d_l3_conn->callback(d_l3_conn->handle, msg);
 		}
-	} else {
-		/* Add data to the receive buffer on the L3 connection */
-		memcpy(&l3i->rxbuf[l3i->rxoffset],
-			msg->data, msg->len);		//XXX possible buffer overflow !
-		l3i->rxoffset += msg->len;
+		return;
+	}
+
+	/* Add data to the receive ring on the L3 connection, in at most 2 pieces */
+	room = J1979_RXRING - (l3i->rxtail - l3i->rxhead);
+	len = msg->len;
+	if (len > room) {
+		l3i->rxdropped += len - room;
+		if (diag_l3_debug & DIAG_DEBUG_READ) {
+			fprintf(stderr, FLFMT "rx ring full, dropping %u bytes\n",
+				FL, len - room);
+		}
+		len = room;
+	}
+	pos = l3i->rxtail % J1979_RXRING;
+	n = MIN(len, J1979_RXRING - pos);
+	memcpy(&l3i->rxbuf[pos], msg->data, n);
+	memcpy(l3i->rxbuf, &msg->data[n], len - n);
+	l3i->rxtail += len;
+	l3i->rxtime = msg->rxtime;
+}
+
+/*
+ * Rx message for process_data(), from the pool if there's one left, else
+ * from diag_allocmsg(). Give it back with j1979_msgput(), never diag_freemsg().
+ */
+static struct diag_msg *
+j1979_msgget(struct l3_j1979_int *l3i, unsigned int len) {
+	struct diag_msg *msg = l3i->pfree;
+	uint8_t *idata;
+
+	if (msg == NULL) {
+		return diag_allocmsg(len);
+	}
+	l3i->pfree = msg->next;
+	idata = msg->idata;
+	memset(msg, 0, sizeof(*msg));
+	msg->idata = idata;
+	msg->data = idata;
+	msg->len = len;
+	return msg;
+}
+
+/* Give back a chain of messages from j1979_msgget() */
+static void
+j1979_msgput(struct l3_j1979_int *l3i, struct diag_msg *msg) {
+	struct diag_msg *next;
+
+	for (; msg != NULL; msg = next) {
+		next = msg->next;
+		msg->next = NULL;
+		if (msg->iflags & DIAG_MSG_IFLAG_MALLOC) {
+			diag_freemsg(msg);
+		} else {
+			msg->next = l3i->pfree;
+			l3i->pfree = msg;
+		}
 	}
 }
 
 
 /*
  * Process_data() - this is the routine that works out the framing
- * of the data , if recv() was always called at the correct time and
- * in the correct way then we would have one and one complete message
- * received by the L2 code normally - however, we cant be sure of that
- * so we employ this algorithm
+ * of the data, for L2s that don't frame messages themselves.
  *
- * Look at the data and try and work out the length of the message based
- * on the J1979 protocol. Returns length (excluding headers & checksum !)
- * VVVVVVVV
- * Note: J1979 doesn't specify particular checksums beyond what 9141 and 14230 already provide,
- * i.e. a J1979 message is maximum 7 bytes long except on CANBUS.
- * headers, address and checksum are handled and stripped at the l2 level (9141, 14230, etc);
+ * Look at the data and work out the length of the message based on the
+ * J1979 protocol (headers, address and checksum are handled and stripped
+ * at the L2 level, so a J1979 message is at most 7 bytes long). Complete
+ * messages are copied out of the receive ring into messages from the pool
+ * and queued on d_l3_conn->msg; an incomplete one stays in the ring until
+ * more data arrives, possibly in a later recv() call.
  *
- * Another validity check is comparing message length (expected vs real); not implemented XXX?
- * Upper levels can also verify that the responses correspond to the requests (i.e. Service ID 0x02 -> 0x42 )
- * XXX Broken for the moment because I'm moving the header stuff completely out of L3
+ * Data that can't be framed is reported with a zero length message, and
+ * everything received so far is dropped : framing resumes with the next
+ * bytes from L2.
  *
+ * Upper levels can also verify that the responses correspond to the requests (i.e. Service ID 0x02 -> 0x42 )
  */
 static void
 diag_l3_j1979_process_data(struct diag_l3_conn *d_l3_conn) {
 	/* Process the received data into messages if complete */
 	struct diag_msg *msg;
-	int sae_msglen;
 	struct l3_j1979_int *l3i = d_l3_conn->l3_int;
+	unsigned int rxlen, pos, n;
+	uint8_t hdr[2];
+	int sae_msglen;
 
-	while (l3i->rxoffset) {
-		int badpacket=0;
-
-		sae_msglen = diag_l3_j1979_getlen(l3i->rxbuf,
-					l3i->rxoffset);	//set expected packet length based on SID + TID
+	while ((rxlen = l3i->rxtail - l3i->rxhead) != 0) {
+		hdr[0] = l3i->rxbuf[l3i->rxhead % J1979_RXRING];
+		hdr[1] = l3i->rxbuf[(l3i->rxhead + 1) % J1979_RXRING];
+		//set expected packet length based on SID + TID
+		sae_msglen = diag_l3_j1979_getlen(hdr, (int) MIN(rxlen, 2));
 
 		if (diag_l3_debug & DIAG_DEBUG_PROTO) {
-			fprintf(stderr,FLFMT "process_data rxoffset is %d sae_msglen is %ld\n",
-				FL, l3i->rxoffset, (long)sae_msglen);
-			fprintf(stderr,FLFMT "process_data hex data is ",
-				FL);
-			diag_data_dump(stderr, l3i->rxbuf, l3i->rxoffset -1);
-			fprintf(stderr,"\n");
+			fprintf(stderr,FLFMT "process_data rx queue %u sae_msglen %d, starts with %02X\n",
+				FL, rxlen, sae_msglen, hdr[0]);
 		}
 
-		if (sae_msglen < 0 || sae_msglen > 255) {
-			if (sae_msglen == DIAG_ERR_INCDATA) {
-				/* Not enough data in this frame, this isn't catastrophic */
-				return;
-			}
-			/* Duff data received, bad news ! */
-			badpacket = 1;
+		if (sae_msglen == DIAG_ERR_INCDATA) {
+			/* Not enough data yet, this isn't catastrophic */
+			return;
 		}
-
-		if (badpacket || (sae_msglen <= l3i->rxoffset )) {
-
-			/* Bad packet, or full packet, need to tell user */
-			uint8_t *data = NULL;
-
-			if (diag_calloc(&msg, 1)) {
-				/* Stuffed, no memory, cant do anything */
+		if ((sae_msglen <= 0) || (sae_msglen > J1979_MAXLEN)) {
+			/* Duff data received, bad news ! Failure indicated by zero len msg */
+			l3i->rxhead = l3i->rxtail;
+			msg = j1979_msgget(l3i, 0);
+			if (msg == NULL) {
 				return;
 			}
+			msg->rxtime = l3i->rxtime;
+			LL_APPEND(d_l3_conn->msg, msg);
+			return;
+		}
+		if ((unsigned int) sae_msglen > rxlen) {
+			/* Need some more data */
+			return;
+		}
 
-			if (!badpacket) {
-				if (diag_malloc(&data, (size_t)sae_msglen)) {
-					free(msg);
-					return;
-				}
-			}
-
-			if (badpacket || (data == NULL)) {
-				/* Failure indicated by zero len msg */
-				msg->data = NULL;
-				msg->len = 0;
-			} else {
-				msg->fmt = DIAG_FMT_ISO_FUNCADDR;
-				// XXX This won't do at all !
-				//msg->type = l3i->rxbuf[0];	//nobody checks this
-				msg->dest = l3i->rxbuf[1];
-				msg->src = l3i->rxbuf[2];
-				/* Copy in J1979 part of message */
-				memcpy(data, &l3i->rxbuf[3], (size_t)(sae_msglen - 4));
-				/* remove whole message from rx buf */
-				memmove(l3i->rxbuf,
-					&l3i->rxbuf[sae_msglen],
-					(size_t)sae_msglen);
-
-				l3i->rxoffset -= sae_msglen;
-
-				msg->data = data;
-				msg->len = (uint8_t) sae_msglen - 4;
-			}
+		msg = j1979_msgget(l3i, (unsigned int) sae_msglen);
+		if (msg == NULL) {
+			/* Stuffed, no memory; try again on the next call */
+			return;
+		}
+		pos = l3i->rxhead % J1979_RXRING;
+		n = MIN((unsigned int) sae_msglen, J1979_RXRING - pos);
+		memcpy(msg->data, &l3i->rxbuf[pos], n);
+		memcpy(&msg->data[n], l3i->rxbuf, (size_t) sae_msglen - n);
+		l3i->rxhead += (unsigned int) sae_msglen;
 
-			msg->rxtime = diag_os_getms();
+		msg->fmt = DIAG_FMT_ISO_FUNCADDR;
+		msg->rxtime = l3i->rxtime;
 
-			/* Add it to the list */
-			LL_CONCAT(d_l3_conn->msg, msg);
-			free(data);
-			free(msg);	//we don't use diag_freemsg() since we alloc'ed it manually
-			if (badpacket) {
-				/* No point in continuing */
-				break;
-			}
-		} else {
-			/* Need some more data */
-			break;
-		}
+		LL_APPEND(d_l3_conn->msg, msg);
 	}
 }
 
@@ -407,17 +457,19 @@ diag_l3_j1979_process_data(struct diag_l3_conn *d_l3_conn) {
  * - timeout expiry will cause return before complete packet
  *
  * Successful packet receive will call the callback routine with the message
- * XXX currently broken because I'm halfway through modifying _process_data
+ * (one per call; with unframed L2s, other complete messages stay queued for
+ * the next calls, and so do partial ones).
  */
 static int
 diag_l3_j1979_recv(struct diag_l3_conn *d_l3_conn, unsigned int timeout,
 	void (* rcv_call_back)(void *handle ,struct diag_msg *) , void *handle) {
 	int rv;
 	struct diag_msg *msg;
+	struct l3_j1979_int *l3i = d_l3_conn->l3_int;
 	unsigned int tout;
 	int state;
 //State machine:
-#define ST_STATE1 1	// timeout=0 to get data already in buffer
+#define ST_STATE1 1	// short timeout to get data already in buffer
 #define ST_STATE2 2
 #define ST_STATE3 3
 #define ST_STATE4 4
@@ -436,8 +488,21 @@ diag_l3_j1979_recv(struct diag_l3_conn *d_l3_conn, unsigned int timeout,
 	d_l3_conn->callback = rcv_call_back;
 	d_l3_conn->handle = handle;
 
+	if (state == ST_STATE1) {
+		/* left over from the previous calls ? */
+		diag_l3_j1979_process_data(d_l3_conn);
+		msg = d_l3_conn->msg;
+		if (msg) {
+			d_l3_conn->msg = msg->next;
+			msg->next = NULL;
+			rcv_call_back(handle, msg);
+			j1979_msgput(l3i, msg);
+			return 0;
+		}
+	}
+
 	/*
-	 * This works by doing a read with a timeout of 0, to collect
+	 * This works by doing a read with a minimal timeout, to collect
 	 * any data that was present on the link, if no messages complete
 	 * then read with the normal timeout, then read with a timeout
 	 * of p4max ms until no more data is left (or timeout), then call
@@ -447,7 +512,7 @@ diag_l3_j1979_recv(struct diag_l3_conn *d_l3_conn, unsigned int timeout,
 		/* State machine for setting timeout values */
 		switch (state) {
 			case ST_STATE1:
-				tout = 0;
+				tout = 1;	/* L1 doesn't expect 0 */
 				break;
 			case ST_STATE2:
 				tout = timeout;
@@ -517,9 +582,10 @@ diag_l3_j1979_recv(struct diag_l3_conn *d_l3_conn, unsigned int timeout,
 			msg = d_l3_conn->msg;
 			if (msg) {
 				d_l3_conn->msg = msg->next;
+				msg->next = NULL;
 
 				rcv_call_back(handle, msg);
-				diag_freemsg(msg);
+				j1979_msgput(l3i, msg);
 				rv = 0;
 				/* And quit while we are ahead */
 				break;
@@ -768,6 +834,7 @@ static int diag_l3_j1979_keepalive(struct diag_l3_conn *d_l3_conn) {
 //That sounds like a sure-fire way to make sure we have a succesful connection to a J1979-compliant ECU.
 int diag_l3_j1979_start(struct diag_l3_conn *d_l3_conn) {
 	int rv;
+	unsigned int i;
 	struct l3_j1979_int *l3i;
 
 	assert(d_l3_conn != NULL);
@@ -777,6 +844,14 @@ int diag_l3_j1979_start(struct diag_l3_conn *d_l3_conn) {
 		return diag_iseterr(rv);
 	}
 
+	for (i = 0; i < J1979_POOLSZ; i++) {
+		struct diag_msg *msg = &l3i->pool[i].msg;
+
+		msg->idata = l3i->pool[i].data;	/* no DIAG_MSG_IFLAG_MALLOC */
+		msg->next = l3i->pfree;
+		l3i->pfree = msg;
+	}
+
 	d_l3_conn->l3_int = l3i;
 
 	rv=diag_l3_j1979_keepalive(d_l3_conn);
@@ -793,28 +868,34 @@ int diag_l3_j1979_start(struct diag_l3_conn *d_l3_conn) {
 
 /* Stop communications : nothing defined, other than letting the link timeout (L2 defined). */
 int dl3_j1979_stop(struct diag_l3_conn *d_l3_conn) {
+	struct l3_j1979_int *l3i;
+
 	assert(d_l3_conn != NULL);
-	free(d_l3_conn->l3_int);
+	l3i = d_l3_conn->l3_int;
+	if ((l3i->rxdropped != 0) && (diag_l3_debug & DIAG_DEBUG_READ)) {
+		fprintf(stderr, FLFMT "rx ring overflowed, %lu bytes dropped\n",
+			FL, l3i->rxdropped);
+	}
+	/* messages not picked up : some are in l3_int */
+	j1979_msgput(l3i, d_l3_conn->msg);
+	d_l3_conn->msg = NULL;
+	free(l3i);
 	return 0;
 }
 
 /*
- * Timer routine, called with time (in ms) since the "timer" value in
- * the L3 structure
+ * Keepalive, called by the L2 scheduler (or to force one) with time (in ms)
+ * since the "timer" value in the L3 structure
  * return 0 if ok
  */
 static int
 diag_l3_j1979_timer(struct diag_l3_conn *d_l3_conn, unsigned long ms) {
 	int rv;
-	int debug_l2_orig=diag_l2_debug;	//save debug flags; disable them for this procedure
-	int debug_l1_orig=diag_l1_debug;
 
-	/* J1979 needs keepalive at least every 5 seconds (P3), we use 3.5s */
+	/* J1979 needs keepalive at least every 5 seconds (P3); the L2
+	 * scheduler only calls us when that's about to expire. */
 
 	assert(d_l3_conn != NULL);
-	if (ms < J1979_KEEPALIVE) {
-		return 0;
-	}
 
 	/* Does L2 do keepalive for us ? */
 	if (d_l3_conn->d_l3l2_flags & DIAG_L2_FLAG_KEEPALIVE) {
@@ -828,18 +909,15 @@ diag_l3_j1979_timer(struct diag_l3_conn *d_l3_conn, unsigned long ms) {
 		fprintf(stderr, FLFMT "\nP3 timeout impending for %p %lu ms\n",
 				FL, (void *)d_l3_conn, ms);
 	}
-	diag_l2_debug=0;	//disable
-	diag_l1_debug=0;
-
+	/* This runs in the periodic callback thread while the main thread
+	 * reads the debug flags, so leave them alone : with L1/L2 debug
+	 * enabled, the keepalive shows up like any other traffic. */
 	rv=diag_l3_j1979_keepalive(d_l3_conn);
 
 	if (rv<0) {
 		fprintf(stderr, FLFMT "J1979 Keepalive failed ! Try to disconnect and reconnect.\n", FL);
 	}
 
-	diag_l2_debug=debug_l2_orig;	//restore debug flags
-	diag_l1_debug=debug_l1_orig;
-
 	return rv;
 }
 
@@ -126,6 +126,11 @@ typedef void diag_mtx;
  */
 diag_mtx *diag_os_newmtx(void);
 
+/** Same as diag_os_newmtx(), but the owning thread may lock it again
+ * (recursive); it must then be unlocked as many times.
+ */
+diag_mtx *diag_os_newrmtx(void);
+
 /** delete unused mutex
  */
 void diag_os_delmtx(diag_mtx *mtx);
@@ -139,6 +144,40 @@ bool diag_os_trylock(diag_mtx *mtx);
 /** unlock mutex */
 void diag_os_unlock(diag_mtx *mtx);
 
+/* thread wrapper stuff : only what's needed to run one
+ * session per adapter in parallel (see scantool "diag multi").
+ */
+typedef void diag_thread;
+
+/** start a new thread running fn(arg).
+ * @return new thread handle, to be passed to diag_os_jointhread(); NULL if failed
+ */
+diag_thread *diag_os_newthread(void (*fn)(void *arg), void *arg);
+
+/** wait until the thread has finished, and free its handle */
+void diag_os_jointhread(diag_thread *thr);
+
+/* event wrapper : auto-reset event, to hand work between threads
+ * (see the L2 request pipeline).
+ */
+typedef void diag_evt;
+
+/** return a ptr to a new event, initially not set.
+ * must be deleted with diag_os_delevt() after use
+ */
+diag_evt *diag_os_newevt(void);
+
+/** delete unused event */
+void diag_os_delevt(diag_evt *evt);
+
+/** set event, waking up a waiting thread */
+void diag_os_setevt(diag_evt *evt);
+
+/** wait up to ms milliseconds for the event to be set.
+ * @return 1 if the event was set (it is then reset), 0 if timed out
+ */
+bool diag_os_waitevt(diag_evt *evt, unsigned int ms);
+
 
 #if defined(__cplusplus)
 }
@@ -127,7 +127,6 @@ diag_os_periodic(UNUSED(int unused)) {
 	if (pthread_mutex_trylock(&periodic_lock)) {
 		return;
 	}
-	diag_l3_timer();	/* Call L3 Timers */
 	diag_l2_timer();	/* Call L2 timers */
 	pthread_mutex_unlock(&periodic_lock);
 }
@@ -680,6 +679,22 @@ diag_mtx *diag_os_newmtx(void) {
 	return (diag_mtx *) pmt;
 }
 
+diag_mtx *diag_os_newrmtx(void) {
+	pthread_mutex_t *pmt;
+	pthread_mutexattr_t attr;
+
+	diag_calloc(&pmt, 1);
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	if (pthread_mutex_init(pmt, &attr)) {
+		pthread_mutexattr_destroy(&attr);
+		free(pmt);
+		return NULL;
+	}
+	pthread_mutexattr_destroy(&attr);
+	return (diag_mtx *) pmt;
+}
+
 void diag_os_delmtx(diag_mtx *mtx) {
 	pthread_mutex_t *pmt = (pthread_mutex_t *) mtx;
 	pthread_mutex_destroy(pmt);
@@ -710,3 +725,117 @@ void diag_os_unlock(diag_mtx *mtx) {
 	return;
 }
 
+
+/* thread handle; the start routine must be wrapped for pthread_create */
+struct unix_thread {
+	pthread_t tid;
+	void (*fn)(void *arg);
+	void *arg;
+};
+
+static void *diag_os_threadstart(void *p) {
+	struct unix_thread *ut = (struct unix_thread *) p;
+	ut->fn(ut->arg);
+	return NULL;
+}
+
+diag_thread *diag_os_newthread(void (*fn)(void *arg), void *arg) {
+	struct unix_thread *ut;
+
+	if (diag_calloc(&ut, 1)) {
+		return NULL;
+	}
+	ut->fn = fn;
+	ut->arg = arg;
+	if (pthread_create(&ut->tid, NULL, diag_os_threadstart, ut)) {
+		free(ut);
+		return NULL;
+	}
+	return (diag_thread *) ut;
+}
+
+void diag_os_jointhread(diag_thread *thr) {
+	struct unix_thread *ut = (struct unix_thread *) thr;
+	pthread_join(ut->tid, NULL);
+	free(ut);
+	return;
+}
+
+
+/* auto-reset event : flag protected by a mutex + condition variable */
+struct unix_evt {
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	bool set;
+};
+
+diag_evt *diag_os_newevt(void) {
+	struct unix_evt *ue;
+
+	if (diag_calloc(&ue, 1)) {
+		return NULL;
+	}
+	if (pthread_mutex_init(&ue->mtx, NULL)) {
+		free(ue);
+		return NULL;
+	}
+	if (pthread_cond_init(&ue->cond, NULL)) {
+		pthread_mutex_destroy(&ue->mtx);
+		free(ue);
+		return NULL;
+	}
+	return (diag_evt *) ue;
+}
+
+void diag_os_delevt(diag_evt *evt) {
+	struct unix_evt *ue = (struct unix_evt *) evt;
+	pthread_cond_destroy(&ue->cond);
+	pthread_mutex_destroy(&ue->mtx);
+	free(ue);
+	return;
+}
+
+void diag_os_setevt(diag_evt *evt) {
+	struct unix_evt *ue = (struct unix_evt *) evt;
+	pthread_mutex_lock(&ue->mtx);
+	ue->set = 1;
+	pthread_cond_signal(&ue->cond);
+	pthread_mutex_unlock(&ue->mtx);
+	return;
+}
+
+bool diag_os_waitevt(diag_evt *evt, unsigned int ms) {
+	struct unix_evt *ue = (struct unix_evt *) evt;
+	struct timespec abstime;
+	bool rv;
+
+	//pthread_cond_timedwait() wants an absolute CLOCK_REALTIME time
+#ifdef _POSIX_TIMERS
+	clock_gettime(CLOCK_REALTIME, &abstime);
+#elif defined(HAVE_GETTIMEOFDAY)
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	abstime.tv_sec = tv.tv_sec;
+	abstime.tv_nsec = tv.tv_usec * 1000;
+#else
+	abstime.tv_sec = time(NULL);
+	abstime.tv_nsec = 0;
+#endif
+	abstime.tv_sec += ms / 1000;
+	abstime.tv_nsec += (long) (ms % 1000) * 1000000L;
+	if (abstime.tv_nsec >= 1000000000L) {
+		abstime.tv_sec += 1;
+		abstime.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&ue->mtx);
+	while (!ue->set) {
+		if (pthread_cond_timedwait(&ue->cond, &ue->mtx, &abstime) == ETIMEDOUT) {
+			break;
+		}
+	}
+	rv = ue->set;
+	ue->set = 0;
+	pthread_mutex_unlock(&ue->mtx);
+	return rv;
+}
@@ -60,7 +60,6 @@ VOID CALLBACK timercallback(UNUSED(PVOID lpParam), BOOLEAN timedout) {
 		//this should never happen.
 		fprintf(stderr, FLFMT "Problem with OS timer callback! Report this !\n", FL);
 	} else {
-		diag_l3_timer();	/* Call L3 Timer */
 		diag_l2_timer();	/* Call L2 timer */
 	}
 	LeaveCriticalSection(&periodic_lock);
@@ -69,7 +68,7 @@ VOID CALLBACK timercallback(UNUSED(PVOID lpParam), BOOLEAN timedout) {
 }
 
 //diag_os_init : a bit of a misnomer. This sets up a periodic callback
-//to call diag_l3_timer and diag_l2_timer; that would sound like a job
+//to call diag_l2_timer (the keepalive scheduler); that would sound like a job
 //for "diag_os_sched". The WIN32 version of diag_os_init also
 //calls diag_os_sched to increase thread priority.
 //return 0 if ok
@@ -405,6 +404,11 @@ diag_mtx *diag_os_newmtx(void) {
 	return (diag_mtx *) lpc;
 }
 
+/* critical sections are always recursive */
+diag_mtx *diag_os_newrmtx(void) {
+	return diag_os_newmtx();
+}
+
 void diag_os_delmtx(diag_mtx *mtx) {
 	CRITICAL_SECTION *lpc = (CRITICAL_SECTION *) mtx;
 	DeleteCriticalSection(lpc);
@@ -430,3 +434,65 @@ void diag_os_unlock(diag_mtx *mtx) {
 	return;
 }
 
+
+/* thread handle; the start routine must be wrapped for CreateThread */
+struct win_thread {
+	HANDLE th;
+	void (*fn)(void *arg);
+	void *arg;
+};
+
+static DWORD WINAPI diag_os_threadstart(LPVOID p) {
+	struct win_thread *wt = (struct win_thread *) p;
+	wt->fn(wt->arg);
+	return 0;
+}
+
+diag_thread *diag_os_newthread(void (*fn)(void *arg), void *arg) {
+	struct win_thread *wt;
+
+	if (diag_calloc(&wt, 1)) {
+		return NULL;
+	}
+	wt->fn = fn;
+	wt->arg = arg;
+	wt->th = CreateThread(NULL, 0, diag_os_threadstart, wt, 0, NULL);
+	if (wt->th == NULL) {
+		free(wt);
+		return NULL;
+	}
+	return (diag_thread *) wt;
+}
+
+void diag_os_jointhread(diag_thread *thr) {
+	struct win_thread *wt = (struct win_thread *) thr;
+	WaitForSingleObject(wt->th, INFINITE);
+	CloseHandle(wt->th);
+	free(wt);
+	return;
+}
+
+
+diag_evt *diag_os_newevt(void) {
+	HANDLE evt;
+	//auto-reset, initially not signaled
+	evt = CreateEvent(NULL, FALSE, FALSE, NULL);
+	return (diag_evt *) evt;
+}
+
+void diag_os_delevt(diag_evt *evt) {
+	CloseHandle((HANDLE) evt);
+	return;
+}
+
+void diag_os_setevt(diag_evt *evt) {
+	SetEvent((HANDLE) evt);
+	return;
+}
+
+bool diag_os_waitevt(diag_evt *evt, unsigned int ms) {
+	if (WaitForSingleObject((HANDLE) evt, ms) == WAIT_OBJECT_0) {
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,161 @@
+/* freediag
+ *
+ * Byte ring with a worker thread, see diag_ring.h
+ *
+ * GPLv3
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "diag.h"
+#include "diag_err.h"
+#include "diag_os.h"
+#include "diag_ring.h"
+
+/* worker : consume the ring until stopped, then drain it */
+static void
+diag_ring_worker(void *arg) {
+	struct diag_ring *r = arg;
+	size_t tail, avail, done;
+	bool stop;
+
+	while (1) {
+		diag_os_lock(r->mtx);
+		tail = r->tail;
+		avail = r->used;
+		stop = r->stop;
+		diag_os_unlock(r->mtx);
+
+		if (avail == 0) {
+			if (r->idle) {
+				r->idle(r->handle);
+			}
+			if (stop) {
+				break;
+			}
+			(void) diag_os_waitevt(r->evt, r->idlems);
+			continue;
+		}
+
+		done = r->consume(r->handle, tail, avail);
+		if (done > avail) {
+			done = avail;
+		}
+
+		diag_os_lock(r->mtx);
+		r->tail = (tail + done) % r->size;
+		r->used -= done;
+		diag_os_unlock(r->mtx);
+	}
+	return;
+}
+
+static void
+diag_ring_free(struct diag_ring *r) {
+	if (r->mtx) {
+		diag_os_delmtx(r->mtx);
+		r->mtx = NULL;
+	}
+	if (r->evt) {
+		diag_os_delevt(r->evt);
+		r->evt = NULL;
+	}
+	free(r->buf);
+	r->buf = NULL;
+	return;
+}
+
+int
+diag_ring_start(struct diag_ring *r, size_t size, unsigned int idlems,
+		diag_ring_consume *consume, diag_ring_idle *idle, void *handle) {
+	int rv;
+
+	memset(r, 0, sizeof(*r));
+	rv = diag_calloc(&r->buf, size);
+	if (rv != 0) {
+		return diag_iseterr(rv);
+	}
+	r->size = size;
+	r->idlems = idlems;
+	r->consume = consume;
+	r->idle = idle;
+	r->handle = handle;
+
+	r->mtx = diag_os_newmtx();
+	r->evt = diag_os_newevt();
+	if (!r->mtx || !r->evt) {
+		diag_ring_free(r);
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	r->thr = diag_os_newthread(diag_ring_worker, r);
+	if (r->thr == NULL) {
+		diag_ring_free(r);
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	return 0;
+}
+
+void
+diag_ring_stop(struct diag_ring *r) {
+	diag_os_lock(r->mtx);
+	r->stop = 1;
+	diag_os_unlock(r->mtx);
+	diag_os_setevt(r->evt);
+	diag_os_jointhread(r->thr);
+	r->thr = NULL;
+
+	diag_ring_free(r);
+	return;
+}
+
+void
+diag_ring_lock(struct diag_ring *r) {
+	diag_os_lock(r->mtx);
+	return;
+}
+
+void
+diag_ring_unlock(struct diag_ring *r) {
+	bool wake = (r->used >= (r->size / 4));
+
+	diag_os_unlock(r->mtx);
+	if (wake) {
+		diag_os_setevt(r->evt);
+	}
+	return;
+}
+
+size_t
+diag_ring_room(const struct diag_ring *r) {
+	return r->size - r->used;
+}
+
+void
+diag_ring_put(struct diag_ring *r, const void *src, size_t len) {
+	const uint8_t *sp = src;
+	size_t first = r->size - r->head;
+
+	if (first > len) {
+		first = len;
+	}
+	memcpy(&r->buf[r->head], sp, first);
+	memcpy(r->buf, &sp[first], len - first);
+	r->head = (r->head + len) % r->size;
+	r->used += len;
+	return;
+}
+
+void
+diag_ring_get(const struct diag_ring *r, size_t pos, void *dst, size_t len) {
+	uint8_t *dp = dst;
+	size_t first = r->size - pos;
+
+	if (first > len) {
+		first = len;
+	}
+	memcpy(dp, &r->buf[pos], first);
+	memcpy(&dp[first], r->buf, len - first);
+	return;
+}
@@ -0,0 +1,94 @@
+#ifndef _DIAG_RING_H_
+#define _DIAG_RING_H_
+
+/* freediag
+ * Byte ring with a worker thread, for capture-style consumers
+ *
+ * GPLv3
+ *
+ *
+ * One producer (typically an L2 recv callback) copies records into a
+ * preallocated ring, never waiting; a worker thread empties it (writes a
+ * file, decodes...) so the producer's thread never waits on the
+ * consumer. If the consumer falls behind, the producer finds no room and
+ * drops; counting that is up to the owner.
+ *
+ * Producer :
+ *	diag_ring_lock(r);
+ *	if (diag_ring_room(r) >= needed) {
+ *		diag_ring_put(r, ...); ...
+ *	}
+ *	diag_ring_unlock(r);	(wakes the worker if the ring is filling up)
+ *
+ * The owner may keep its own counters under r->mtx, with the indexes; out
+ * of the producer, diag_os_lock() it directly.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "diag_os.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/* Worker callback : consume up to len bytes stored at pos (they may wrap,
+ * see diag_ring_get()). Called without mtx held (it may take it, e.g. for
+ * its counters); the producer doesn't touch [pos, pos + len) meanwhile.
+ * ret number of bytes consumed; the rest is offered again. */
+typedef size_t (diag_ring_consume)(void *handle, size_t pos, size_t len);
+
+/* Optional worker callback, when the ring is empty : before waiting, and
+ * once more before the worker exits. */
+typedef void (diag_ring_idle)(void *handle);
+
+struct diag_ring {
+	uint8_t *buf;
+	size_t size;
+	size_t head;	/* next byte written by the producer */
+	size_t tail;	/* next byte consumed by the worker */
+	size_t used;
+
+	diag_mtx *mtx;		/* indexes, "stop", and owner counters */
+	diag_evt *evt;		/* wakes the worker : ring filling up, or stopping */
+	bool stop;
+	diag_thread *thr;
+
+	unsigned int idlems;	/* worker runs at least this often */
+	diag_ring_consume *consume;
+	diag_ring_idle *idle;
+	void *handle;
+};
+
+/** Alloc a ring of "size" bytes and start its worker.
+ * @param idlems : the worker checks the ring at least this often (ms)
+ * @param idle : may be NULL
+ * ret 0 if ok; on error nothing is left to free.
+ */
+int diag_ring_start(struct diag_ring *r, size_t size, unsigned int idlems,
+	diag_ring_consume *consume, diag_ring_idle *idle, void *handle);
+
+/** Stop the worker once it has consumed everything, and free the ring.
+ * No producer may run during or after this. */
+void diag_ring_stop(struct diag_ring *r);
+
+void diag_ring_lock(struct diag_ring *r);
+
+/** Unlock; wake the worker if the ring is at least a quarter full */
+void diag_ring_unlock(struct diag_ring *r);
+
+/** Free space; mtx held */
+size_t diag_ring_room(const struct diag_ring *r);
+
+/** Copy len bytes in at head; mtx held, caller checked diag_ring_room() */
+void diag_ring_put(struct diag_ring *r, const void *src, size_t len);
+
+/** Copy len bytes out from pos, unwrapping; for the consume callback */
+void diag_ring_get(const struct diag_ring *r, size_t pos, void *dst, size_t len);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _DIAG_RING_H_ */
@@ -35,6 +35,13 @@
 #include "diag_l0.h"
 #include "diag_l1.h"
 #include "diag_l2.h"
+#include "diag_l2_can.h"
+#include "diag_l3.h"
+#include "diag_l2_j1939.h"
+#include "diag_l2_raw.h"
+#include "diag_l2_test.h"
+#include "diag_l3_j1939.h"
+#include "utlist.h"
 
 struct test_item {
 	const char *name;
@@ -43,10 +50,28 @@ struct test_item {
 
 bool test_dupmsg(void);
 bool test_periodic(void);
+bool test_l2load(void);
+bool test_l2share(void);
+bool test_l2shareka(void);
+bool test_rawcap(void);
+bool test_socketcan(void);
+bool test_cankernel(void);
+bool test_j1939(void);
+bool test_canreplay(void);
+bool test_j1979stream(void);
 
 static struct test_item test_list[] = {
 	{"msg duplication", test_dupmsg},
-	{"periodic timers", test_periodic}
+	{"periodic timers", test_periodic},
+	{"J1979 L3 throughput", test_l2load},
+	{"shared link demux", test_l2share},
+	{"shared link keepalive", test_l2shareka},
+	{"raw capture", test_rawcap},
+	{"socketcan loopback", test_socketcan},
+	{"CAN kernel ISO-TP", test_cankernel},
+	{"J1939 monitor", test_j1939},
+	{"CAN log replay", test_canreplay},
+	{"J1979 unframed rx", test_j1979stream}
 };
 
 bool test_dupmsg(void) {
@@ -147,6 +172,100 @@ static struct diag_l0 dummy_dl0 = {
 	._ioctl = d0_ioctl
 };
 
+/********** stub L0 with a pluggable data source : each recv() returns
+ * what the test's stub_recvfn puts in the buffer (nothing if NULL) */
+typedef int (stub_recvfn)(void *payload, uint8_t *data, size_t len);
+
+struct stub_src {
+	stub_recvfn *recv;
+	void *payload;
+};
+
+int	d0stub_recv(struct diag_l0_device *dl0d,
+	const char *subinterface, void *data, size_t len, unsigned int timeout) {
+	struct stub_src *src = dl0d->l0_int;
+
+	(void) subinterface;
+	(void) timeout;
+	if (src->recv == NULL) {
+		return 0;
+	}
+	return src->recv(src->payload, data, len);
+}
+
+static struct diag_l0 stub_dl0 = {
+	.longname = "stub L0",
+	.shortname = "stub L0",
+	.l1proto_mask = -1,
+	.init = d0_init,
+	._new = d0_new,
+	._getcfg = d0_getcfg,
+	._del = d0_del,
+	._open = d0_open,
+	._close = d0_close,
+	._getflags = d0_getflags,
+	._recv = d0stub_recv,
+	._send = d0_send,
+	._ioctl = d0_ioctl
+};
+
+/* L2 (and optionally L3) on a stub L0, see stub_start() */
+struct stub_session {
+	struct stub_src src;
+	struct diag_l0_device dl0d;
+	struct diag_l2_conn *dl2c;
+	struct diag_l3_conn *dl3c;
+	unsigned long t0;	/* diag_os_getms() once started */
+};
+
+/** Start L2 "l2proto" (see diag_l2_StartCommunications()) on a stub L0 fed
+ * by recv(payload), and L3 "l3name" over it unless NULL. Prints what failed.
+ * ret 1 if ok
+ */
+static bool stub_start(struct stub_session *ss, stub_recvfn *recv, void *payload,
+		int l1proto, int l2proto, unsigned int bitrate,
+		target_type target, source_type source, const char *l3name) {
+	memset(ss, 0, sizeof(*ss));
+	ss->src.recv = recv;
+	ss->src.payload = payload;
+	ss->dl0d.dl0 = &stub_dl0;
+	ss->dl0d.l0_int = &ss->src;
+
+	if (diag_l2_open(&ss->dl0d, l1proto)) {
+		printf("dl2open err\n");
+		return 0;
+	}
+	ss->dl2c = diag_l2_StartCommunications(&ss->dl0d, l2proto, 0, bitrate, target, source);
+	if (ss->dl2c == NULL) {
+		printf("startcomm err\n");
+		diag_l2_close(&ss->dl0d);
+		return 0;
+	}
+	if (l3name != NULL) {
+		ss->dl3c = diag_l3_start(l3name, ss->dl2c);
+		if (ss->dl3c == NULL) {
+			printf("l3 start err\n");
+			diag_l2_StopCommunications(ss->dl2c);
+			diag_l2_close(&ss->dl0d);
+			return 0;
+		}
+	}
+	ss->t0 = diag_os_getms();
+	return 1;
+}
+
+/** Stop what stub_start() started. ret ms since it started (at least 1) */
+static unsigned long stub_stop(struct stub_session *ss) {
+	unsigned long elapsed = diag_os_getms() - ss->t0;
+
+	if (ss->dl3c != NULL) {
+		diag_l3_stop(ss->dl3c);
+	}
+	diag_l2_StopCommunications(ss->dl2c);
+	diag_l2_close(&ss->dl0d);
+	return elapsed ? elapsed : 1;
+}
+
 #define TEST_PERIODIC_DURATION	800	//in ms
 /** periodic callback test
  * Start an L2, let the periodic timer run a few times, then stop
@@ -171,7 +290,9 @@ bool test_periodic(void) {
 		diag_l2_close(&dl0d);
 		return 0;
 	}
-	dl2c->tinterval = 0;	//force timer expiry on every timer callback
+	/* force timer expiry on every timer callback. 0 would mean
+	 * "derive from P3max", see diag_l2_ka_due() */
+	dl2c->tinterval = 1;
 	while (diag_os_getms() < ts) {}
 
 	diag_l2_StopCommunications(dl2c);
@@ -179,6 +300,1022 @@ bool test_periodic(void) {
 	return 1;
 }
 
+#define TEST_L2LOAD_DURATION	500	//in ms
+
+struct l2load_count {
+	unsigned long frames;
+	unsigned long bad;
+};
+
+static void l2load_rcv(void *handle, struct diag_msg *msg) {
+	struct l2load_count *cnt = handle;
+	struct diag_msg *tmsg;
+
+	LL_FOREACH(msg, tmsg) {
+		cnt->frames++;
+		if ((tmsg->len < 2) || (tmsg->fmt & DIAG_FMT_BADCS)) {
+			cnt->bad++;
+		}
+	}
+	return;
+}
+
+/** L3 throughput benchmark
+ * Pull synthetic J1979 frames (4 ECUs, 1 in 100 malformed) through
+ * diag_l3_recv() as fast as possible, and check nothing got lost.
+ */
+bool test_l2load(void) {
+	struct diag_l2_test_cfg cfg = DL2P_TEST_DEFAULT_CFG;
+	struct diag_l2_test_stats stats;
+	struct l2load_count cnt = {0, 0};
+	struct stub_session ss;
+	unsigned long elapsed;
+	bool rv = 1;
+
+	cfg.necus = 4;
+	cfg.badevery = 100;
+	dl2p_test_setcfg(&cfg);
+
+	if (!stub_start(&ss, NULL, NULL, DIAG_L1_RAW, DIAG_L2_PROT_TEST, 0, 0, 0, "SAEJ1979")) {
+		return 0;
+	}
+
+	do {
+		if (diag_l3_recv(ss.dl3c, 100, l2load_rcv, &cnt)) {
+			printf("recv err\n");
+			rv = 0;
+			break;
+		}
+	} while (diag_os_getms() - ss.t0 < TEST_L2LOAD_DURATION);
+
+	(void) dl2p_test_getstats(ss.dl2c, &stats);
+	elapsed = stub_stop(&ss);
+
+	/* the J1979 startup request was answered by every ECU too */
+	if ((cnt.frames + cfg.necus != stats.frames) || (cnt.bad != stats.bad)) {
+		printf("got %lu frames (%lu bad), sent %lu (%lu bad)\n",
+			cnt.frames, cnt.bad, stats.frames, stats.bad);
+		return 0;
+	}
+	if (rv) {
+		printf("%lu frames/s ", cnt.frames * 1000 / elapsed);
+	}
+	return rv;
+}
+
+static void l2share_rcv(void *handle, struct diag_msg *msg) {
+	struct diag_msg **out = handle;
+
+	*out = diag_dupmsg(msg);
+	return;
+}
+
+/** Two connections on one link : 3 ECUs answer a request sent by the
+ * first; it must only get its own response, the second one gets its own
+ * without any bus read, the third one is dropped.
+ */
+bool test_l2share(void) {
+	struct diag_l0_device dl0d = {
+		.dl0 = &dummy_dl0
+	};
+	struct diag_l2_test_cfg cfg = DL2P_TEST_DEFAULT_CFG;
+	struct diag_l2_test_stats stats;
+	struct diag_l2_conn *dl2c, *dl2c2;
+	struct diag_msg *rxmsg = NULL;
+	uint8_t data[2] = {0x01, 0x0C};
+	struct diag_msg msg = {0};
+	int errval;
+	bool rv = 1;
+
+	cfg.necus = 3;
+	dl2p_test_setcfg(&cfg);
+
+	if (diag_l2_open(&dl0d, DIAG_L1_RAW)) {
+		printf("dl2open err\n");
+		return 0;
+	}
+	dl2c = diag_l2_StartCommunications(&dl0d, DIAG_L2_PROT_TEST, 0, 0, 0x10, 0xF1);
+	if (dl2c == NULL) {
+		printf("startcomm err\n");
+		diag_l2_close(&dl0d);
+		return 0;
+	}
+	dl2c2 = diag_l2_AttachCommunications(dl2c, 0x11);
+	if (dl2c2 == NULL) {
+		printf("attach err\n");
+		diag_l2_StopCommunications(dl2c);
+		diag_l2_close(&dl0d);
+		return 0;
+	}
+
+	msg.data = data;
+	msg.len = sizeof(data);
+	rxmsg = diag_l2_request(dl2c, &msg, &errval);
+	if ((rxmsg == NULL) || (rxmsg->next != NULL) || (rxmsg->src != 0x10)) {
+		printf("bad response to first conn\n");
+		rv = 0;
+	}
+	diag_freemsg(rxmsg);
+	rxmsg = NULL;
+
+	if ((diag_l2_recv(dl2c2, 0, l2share_rcv, &rxmsg) != 0) ||
+			(rxmsg == NULL) || (rxmsg->next != NULL) || (rxmsg->src != 0x11)) {
+		printf("bad queued frame for second conn\n");
+		rv = 0;
+	}
+	diag_freemsg(rxmsg);
+
+	/* the queued frame didn't come from the bus */
+	(void) dl2p_test_getstats(dl2c2, &stats);
+	if (stats.frames != 0) {
+		printf("second conn read the bus\n");
+		rv = 0;
+	}
+
+	diag_l2_StopCommunications(dl2c2);
+	diag_l2_StopCommunications(dl2c);
+	diag_l2_close(&dl0d);
+	return rv;
+}
+
+#define TEST_L2SHAREKA_TIMEOUT	2000	//in ms
+#define TEST_L2SHAREKA_COUNT	3
+
+struct l2shareka_ctx {
+	struct diag_l2_conn *dl2c;
+	diag_mtx *mtx;
+	unsigned int sent;	/* keepalives that got the right response */
+	unsigned int bad;
+};
+
+/* keepalive of the attached connection : a request, as J1979 does */
+static int l2shareka_fn(void *handle) {
+	struct l2shareka_ctx *ka = handle;
+	uint8_t data[2] = {0x01, 0x00};
+	struct diag_msg msg = {0};
+	struct diag_msg *rxmsg;
+	int errval;
+	bool ok;
+
+	msg.data = data;
+	msg.len = sizeof(data);
+	rxmsg = diag_l2_request(ka->dl2c, &msg, &errval);
+	ok = (rxmsg != NULL) && (rxmsg->next == NULL) &&
+		(rxmsg->src == ka->dl2c->diag_l2_destaddr);
+	diag_freemsg(rxmsg);
+
+	diag_os_lock(ka->mtx);
+	if (ok) {
+		ka->sent++;
+	} else {
+		ka->bad++;
+	}
+	diag_os_unlock(ka->mtx);
+	return ok ? 0 : DIAG_ERR_GENERAL;
+}
+
+/** Keepalives on an attached connection : they go through the shared link
+ * demux, from the timer thread. Each must get its own ECU's response, and
+ * not hang the timer.
+ */
+bool test_l2shareka(void) {
+	struct diag_l0_device dl0d = {
+		.dl0 = &dummy_dl0
+	};
+	struct diag_l2_test_cfg cfg = DL2P_TEST_DEFAULT_CFG;
+	struct diag_l2_conn *dl2c;
+	struct l2shareka_ctx ka = {0};
+	unsigned long ts;
+	unsigned int sent = 0, bad = 0;
+
+	cfg.necus = 2;
+	dl2p_test_setcfg(&cfg);
+
+	ka.mtx = diag_os_newmtx();
+	if (ka.mtx == NULL) {
+		printf("mutex err\n");
+		return 0;
+	}
+	if (diag_l2_open(&dl0d, DIAG_L1_RAW)) {
+		printf("dl2open err\n");
+		diag_os_delmtx(ka.mtx);
+		return 0;
+	}
+	dl2c = diag_l2_StartCommunications(&dl0d, DIAG_L2_PROT_TEST, 0, 0, 0x10, 0xF1);
+	if (dl2c == NULL) {
+		printf("startcomm err\n");
+		diag_l2_close(&dl0d);
+		diag_os_delmtx(ka.mtx);
+		return 0;
+	}
+	ka.dl2c = diag_l2_AttachCommunications(dl2c, 0x11);
+	if (ka.dl2c == NULL) {
+		printf("attach err\n");
+		diag_l2_StopCommunications(dl2c);
+		diag_l2_close(&dl0d);
+		diag_os_delmtx(ka.mtx);
+		return 0;
+	}
+	diag_l2_set_keepalive(ka.dl2c, l2shareka_fn, &ka);
+	ka.dl2c->tinterval = 1;	//due on every timer callback
+
+	ts = diag_os_getms() + TEST_L2SHAREKA_TIMEOUT;
+	while ((sent < TEST_L2SHAREKA_COUNT) && (bad == 0) &&
+			(diag_os_getms() < ts)) {
+		diag_os_lock(ka.mtx);
+		sent = ka.sent;
+		bad = ka.bad;
+		diag_os_unlock(ka.mtx);
+	}
+
+	diag_l2_StopCommunications(ka.dl2c);
+	diag_l2_StopCommunications(dl2c);
+	diag_l2_close(&dl0d);
+	diag_os_delmtx(ka.mtx);
+
+	if ((sent < TEST_L2SHAREKA_COUNT) || (bad != 0)) {
+		printf("%u keepalives ok, %u bad\n", sent, bad);
+		return 0;
+	}
+	return 1;
+}
+
+/********** raw source : chunk n is n%16 + 1 bytes of (n + i); payload
+ * is the chunk counter */
+static uint8_t rawsrc_byte(unsigned long n, unsigned int i) {
+	return (uint8_t) (n + i);
+}
+
+static int rawsrc_recv(void *payload, uint8_t *data, size_t len) {
+	unsigned long *chunk = payload;
+	unsigned int i, n;
+
+	n = (*chunk % 16) + 1;
+	if (n > len) {
+		n = (unsigned int) len;
+	}
+	for (i = 0; i < n; i++) {
+		data[i] = rawsrc_byte(*chunk, i);
+	}
+	(*chunk)++;
+	return (int) n;
+}
+
+#define TEST_RAWCAP_CHUNKS	20000
+#define TEST_RAWCAP_FILE	"diag_test_rawcap.bin"
+
+/* Read back a capture file : every record must hold the chunk it claims
+ * to (counting the drops it reports), in order. *total gets the chunks
+ * accounted for, recorded or dropped. ret number of records, <0 if bad */
+static long rawcap_check(FILE *fp, unsigned long long *filelen, unsigned long *total) {
+	uint8_t hdr[DL2P_RAWCAP_RECHDR];
+	uint8_t data[16];
+	unsigned long long t, tprev = 0;
+	unsigned long n = 0;
+	long records = 0;
+	unsigned int len, drops, i;
+
+	if ((fread(data, 1, DL2P_RAWCAP_FILEHDR, fp) != DL2P_RAWCAP_FILEHDR) ||
+			memcmp(data, DL2P_RAWCAP_MAGIC, 8) || (data[8] != DL2P_RAWCAP_VERSION)) {
+		printf("bad file header\n");
+		return -1;
+	}
+	*filelen = DL2P_RAWCAP_FILEHDR;
+
+	while (fread(hdr, 1, sizeof(hdr), fp) == sizeof(hdr)) {
+		for (i = 0, t = 0; i < 8; i++) {
+			t |= (unsigned long long) hdr[i] << (8 * i);
+		}
+		len = hdr[8] | (hdr[9] << 8);
+		drops = hdr[10] | (hdr[11] << 8);
+		n += drops;
+		if (len == 0) {
+			/* final drop count; must be the last record */
+			*filelen += sizeof(hdr);
+			if ((t < tprev) || (fread(hdr, 1, 1, fp) != 0)) {
+				printf("bad final record\n");
+				return -1;
+			}
+			break;
+		}
+		if ((t < tprev) || (len != (n % 16) + 1) ||
+				(fread(data, 1, len, fp) != len)) {
+			printf("bad record %ld\n", records);
+			return -1;
+		}
+		for (i = 0; i < len; i++) {
+			if (data[i] != rawsrc_byte(n, i)) {
+				printf("bad data in record %ld\n", records);
+				return -1;
+			}
+		}
+		*filelen += sizeof(hdr) + len;
+		tprev = t;
+		n++;
+		records++;
+	}
+	*total = n;
+	return records;
+}
+
+/** Raw capture : receive chunks as fast as L0 gives them, with a ring small
+ * enough that the writer thread falls behind; what was written and what
+ * was dropped must add up.
+ */
+bool test_rawcap(void) {
+	struct dl2p_raw_capstats st;
+	struct stub_session ss;
+	unsigned long long filelen;
+	unsigned long chunk = 0;
+	unsigned long i, total;
+	long records;
+	FILE *fp;
+	bool rv = 1;
+
+	if (!stub_start(&ss, rawsrc_recv, &chunk, DIAG_L1_RAW, DIAG_L2_PROT_RAW, 10400, 0, 0, NULL)) {
+		return 0;
+	}
+	if (dl2p_raw_capture_start(ss.dl2c, TEST_RAWCAP_FILE, 4096)) {
+		printf("capture start err\n");
+		(void) stub_stop(&ss);
+		return 0;
+	}
+
+	for (i = 0; i < TEST_RAWCAP_CHUNKS; i++) {
+		if (diag_l2_recv(ss.dl2c, 1, NULL, NULL)) {
+			printf("recv err\n");
+			rv = 0;
+			break;
+		}
+	}
+
+	if (dl2p_raw_capture_stop(ss.dl2c, &st)) {
+		printf("capture stop err\n");
+		rv = 0;
+	}
+	(void) stub_stop(&ss);
+
+	fp = fopen(TEST_RAWCAP_FILE, "rb");
+	if (fp == NULL) {
+		printf("no capture file\n");
+		return 0;
+	}
+	records = rawcap_check(fp, &filelen, &total);
+	fclose(fp);
+	(void) remove(TEST_RAWCAP_FILE);
+
+	if ((records < 0) || (st.chunks != i) ||
+			((unsigned long long) records + st.dropped_chunks != st.chunks) ||
+			(total != st.chunks) || (filelen != st.written)) {
+		printf("%ld records, stats : %llu chunks, %llu dropped, %llu written\n",
+			records, st.chunks, st.dropped_chunks, st.written);
+		return 0;
+	}
+	printf("%llu chunks, %llu dropped ", st.chunks, st.dropped_chunks);
+	return rv;
+}
+
+/** new SocketCAN L0 on vcan0, with or without the OBD rx filter */
+static struct diag_l0_device *sc_dl0d(bool obdfilter) {
+	struct diag_l0_device *dl0d;
+	struct cfgi *cfgp;
+
+	dl0d = diag_l0_new("SOCKETCAN");
+	if (dl0d == NULL) {
+		return NULL;
+	}
+	LL_FOREACH(diag_l0_getcfg(dl0d), cfgp) {
+		if (strcmp(cfgp->shortname, "obdfilter") == 0) {
+			diag_cfg_setbool(cfgp, obdfilter);
+		}
+	}
+	if (diag_l0_open(dl0d, DIAG_L1_CAN)) {
+		diag_l0_del(dl0d);
+		return NULL;
+	}
+	return dl0d;
+}
+
+/** SocketCAN : a second socket on vcan0 plays the ECU. Its three frames go out
+ * in one send(); the tester must only see the two OBD response IDs, each with
+ * a plausible rx timestamp. Skipped without SocketCAN / vcan0.
+ */
+bool test_socketcan(void) {
+	static const uint8_t rq[] = {0x00, 0x00, 0x07, 0xDF, 8, 0x02, 0x01, 0x00, 0, 0, 0, 0, 0};
+	static const uint8_t rsp[] = {
+		0x00, 0x00, 0x01, 0x23, 2, 0xAA, 0x55,	/* not OBD, filtered */
+		0x00, 0x00, 0x07, 0xE8, 8, 0x06, 0x41, 0x00, 0xBE, 0x1F, 0xA8, 0x13, 0x00,
+		0x98, 0xDA, 0xF1, 0x10, 3, 0x02, 0x41, 0x0D };
+	struct diag_l0_device *tester, *ecu;
+	uint8_t buf[DIAG_L1_CAN_HDRLEN + DIAG_L1_CAN_MAXDLC];
+	unsigned long long ts, prev = 0;
+	int len;
+	bool rv = 1;
+
+	tester = sc_dl0d(1);
+	if (tester == NULL) {
+		printf("no SocketCAN / vcan0, skipped ");
+		return 1;
+	}
+	ecu = sc_dl0d(0);
+	if (ecu == NULL) {
+		printf("second socket err\n");
+		diag_l0_close(tester);
+		diag_l0_del(tester);
+		return 0;
+	}
+
+	if (diag_l0_send(tester, NULL, rq, sizeof(rq)) ||
+			(diag_l0_recv(ecu, NULL, buf, sizeof(buf), 100) != (int) sizeof(rq)) ||
+			memcmp(buf, rq, sizeof(rq))) {
+		printf("request not seen by ecu\n");
+		rv = 0;
+		goto done;
+	}
+
+	if (diag_l0_send(ecu, NULL, rsp, sizeof(rsp))) {
+		printf("batch send err\n");
+		rv = 0;
+		goto done;
+	}
+
+	/* 0x123 must have been filtered; 7E8 then 18DAF110 */
+	len = diag_l0_recv(tester, NULL, buf, sizeof(buf), 100);
+	if ((len != 13) || memcmp(buf, &rsp[7], 13)) {
+		printf("bad first response\n");
+		rv = 0;
+		goto done;
+	}
+	if (diag_l0_ioctl(tester, DIAG_IOCTL_GETRXTIME, &prev) || (prev == 0)) {
+		printf("no rx timestamp\n");
+		rv = 0;
+		goto done;
+	}
+	len = diag_l0_recv(tester, NULL, buf, sizeof(buf), 100);
+	if ((len != 8) || memcmp(buf, &rsp[20], 8)) {
+		printf("bad second response\n");
+		rv = 0;
+		goto done;
+	}
+	if (diag_l0_ioctl(tester, DIAG_IOCTL_GETRXTIME, &ts) || (ts < prev) ||
+			(ts > diag_os_hrtus(diag_os_gethrt()))) {
+		printf("bad rx timestamps %llu %llu\n", prev, ts);
+		rv = 0;
+		goto done;
+	}
+	if (diag_l0_recv(tester, NULL, buf, sizeof(buf), 20) != DIAG_ERR_TIMEOUT) {
+		printf("unfiltered frame\n");
+		rv = 0;
+	}
+
+done:
+	diag_l0_close(ecu);
+	diag_l0_del(ecu);
+	diag_l0_close(tester);
+	diag_l0_del(tester);
+	return rv;
+}
+
+/** CAN L2 with kernel ISO-TP (DIAG_L2_TYPE_CANKERNEL) : a CAN_ISOTP channel
+ * on a second socket plays the ECU. A multi-frame request and response must
+ * go through both unchanged. Skipped without vcan0 or CAN_ISOTP.
+ */
+bool test_cankernel(void) {
+	struct diag_isotp_chan ch = {
+		.txid = 0x7E8,
+		.rxid = 0x7E0,
+		.pad = 1
+	};
+	struct diag_l0_device *tester, *ecu;
+	struct diag_l2_conn *dl2c;
+	struct diag_isotp_xfer x;
+	struct diag_msg msg = {0};
+	struct diag_msg *rxmsg = NULL;
+	uint8_t rq[20], rsp[40], buf[64];
+	unsigned int i;
+	bool rv = 1;
+
+	ecu = sc_dl0d(0);
+	if (ecu == NULL) {
+		printf("no SocketCAN / vcan0, skipped ");
+		return 1;
+	}
+	if (diag_l0_ioctl(ecu, DIAG_IOCTL_ISOTP_OPEN, &ch) != 0) {
+		printf("no CAN_ISOTP, skipped ");
+		diag_l0_close(ecu);
+		diag_l0_del(ecu);
+		return 1;
+	}
+
+	tester = diag_l0_new("SOCKETCAN");
+	if ((tester == NULL) || diag_l2_open(tester, DIAG_L1_CAN)) {
+		printf("tester open err\n");
+		rv = 0;
+		goto del;
+	}
+	dl2c = diag_l2_StartCommunications(tester, DIAG_L2_PROT_CAN,
+		DIAG_L2_TYPE_CANKERNEL, 500000, 0xE8, 0xF1);
+	if (dl2c == NULL) {
+		printf("startcomm err\n");
+		diag_l2_close(tester);
+		rv = 0;
+		goto del;
+	}
+	if (dl2p_can_kernel(dl2c) != 1) {
+		printf("kernel transport not used\n");
+		rv = 0;
+		goto stop;
+	}
+
+	for (i = 0; i < sizeof(rq); i++) {
+		rq[i] = (uint8_t) (0x10 + i);
+	}
+	for (i = 0; i < sizeof(rsp); i++) {
+		rsp[i] = (uint8_t) (0x80 + i);
+	}
+
+	msg.data = rq;
+	msg.len = sizeof(rq);
+	if (diag_l2_send(dl2c, &msg)) {
+		printf("send err\n");
+		rv = 0;
+		goto stop;
+	}
+	x.handle = ch.handle;
+	x.data = buf;
+	x.len = sizeof(buf);
+	x.timeout = 500;
+	if ((diag_l0_ioctl(ecu, DIAG_IOCTL_ISOTP_RECV, &x) != 0) ||
+			(x.len != sizeof(rq)) || memcmp(buf, rq, sizeof(rq))) {
+		printf("request not seen by ecu\n");
+		rv = 0;
+		goto stop;
+	}
+
+	x.handle = ch.handle;
+	x.data = rsp;
+	x.len = sizeof(rsp);
+	if (diag_l0_ioctl(ecu, DIAG_IOCTL_ISOTP_SEND, &x) != 0) {
+		printf("ecu send err\n");
+		rv = 0;
+		goto stop;
+	}
+	if ((diag_l2_recv(dl2c, 500, l2share_rcv, &rxmsg) != 0) || (rxmsg == NULL) ||
+			(rxmsg->len != sizeof(rsp)) || (rxmsg->src != 0xE8) ||
+			memcmp(rxmsg->data, rsp, sizeof(rsp))) {
+		printf("bad response\n");
+		rv = 0;
+	}
+	diag_freemsg(rxmsg);
+
+stop:
+	diag_l2_StopCommunications(dl2c);
+	diag_l2_close(tester);
+del:
+	if (tester != NULL) {
+		diag_l0_del(tester);
+	}
+	(void) diag_l0_ioctl(ecu, DIAG_IOCTL_ISOTP_CLOSE, &ch);
+	diag_l0_close(ecu);
+	diag_l0_del(ecu);
+	return rv;
+}
+
+/********** J1939 source : replays a bus cycle, up to "left" frames */
+static const uint8_t j1939src_frames[][DIAG_L1_CAN_HDRLEN + DIAG_L1_CAN_MAXDLC] = {
+	/* EEC1 from 00 : 1500 rpm */
+	{0x8C, 0xF0, 0x04, 0x00, 8, 0xFF, 0x7D, 0xA0, 0xE0, 0x2E, 0xFF, 0xFF, 0xFF},
+	/* ET1 from 00 : coolant 90 degC, fuel temp n/a, oil temp error */
+	{0x98, 0xFE, 0xEE, 0x00, 8, 0x82, 0xFF, 0x00, 0xFE, 0xFF, 0xFF, 0xFF, 0xFF},
+	/* 11-bit, ignored */
+	{0x00, 0x00, 0x07, 0xE8, 8, 0x02, 0x41, 0x00, 0, 0, 0, 0, 0},
+	/* DM1 from 00 by BAM : MIL and amber lamp on, 2 DTCs */
+	{0x9C, 0xEC, 0xFF, 0x00, 8, 0x20, 0x0A, 0x00, 0x02, 0xFF, 0xCA, 0xFE, 0x00},
+	{0x9C, 0xEB, 0xFF, 0x00, 8, 0x01, 0x44, 0xFF, 0x64, 0x00, 0x01, 0x03, 0x6E},
+	{0x9C, 0xEB, 0xFF, 0x00, 8, 0x02, 0x00, 0x00, 0x05, 0xFF, 0xFF, 0xFF, 0xFF},
+	/* SOFT from 03 to F9 : RTS, CTS, DT 1 2 2 3, EoMA */
+	{0x9C, 0xEC, 0xF9, 0x03, 8, 0x10, 0x10, 0x00, 0x03, 0xFF, 0xDA, 0xFE, 0x00},
+	{0x9C, 0xEC, 0x03, 0xF9, 8, 0x11, 0x03, 0x01, 0xFF, 0xFF, 0xDA, 0xFE, 0x00},
+	{0x9C, 0xEB, 0xF9, 0x03, 8, 0x01, 'F', 'R', 'E', 'E', 'D', 'I', 'A'},
+	{0x9C, 0xEB, 0xF9, 0x03, 8, 0x02, 'G', ' ', '1', '.', '0', '*', 'A'},
+	{0x9C, 0xEB, 0xF9, 0x03, 8, 0x02, 'G', ' ', '1', '.', '0', '*', 'A'},
+	{0x9C, 0xEB, 0xF9, 0x03, 8, 0x03, 'B', 'C', 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
+	{0x9C, 0xEC, 0x03, 0xF9, 8, 0x13, 0x10, 0x00, 0x03, 0xFF, 0xDA, 0xFE, 0x00},
+	/* from 05 to F9 : RTS, DT 1, aborted by F9 */
+	{0x9C, 0xEC, 0xF9, 0x05, 8, 0x10, 0x14, 0x00, 0x03, 0xFF, 0xDA, 0xFE, 0x00},
+	{0x9C, 0xEB, 0xF9, 0x05, 8, 0x01, 0, 1, 2, 3, 4, 5, 6},
+	{0x9C, 0xEC, 0x05, 0xF9, 8, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xDA, 0xFE, 0x00},
+};
+#define J1939SRC_NFRAMES	ARRAY_SIZE(j1939src_frames)
+#define J1939SRC_NMSGS	4	/* messages per cycle : EEC1, ET1, DM1, SOFT */
+
+struct j1939src {
+	unsigned long n;	/* frames sent */
+	unsigned long left;	/* frames still to send */
+};
+
+static int j1939src_recv(void *payload, uint8_t *data, size_t len) {
+	struct j1939src *src = payload;
+
+	if (src->left == 0) {
+		return DIAG_ERR_TIMEOUT;
+	}
+	if (len < sizeof(j1939src_frames[0])) {
+		return diag_iseterr(DIAG_ERR_BADLEN);
+	}
+	memcpy(data, j1939src_frames[src->n % J1939SRC_NFRAMES], sizeof(j1939src_frames[0]));
+	src->n++;
+	src->left--;
+	return (int) sizeof(j1939src_frames[0]);
+}
+
+#define TEST_J1939_CYCLES	5000
+
+struct j1939_count {
+	struct diag_l3_j1939_mon *mon;
+	unsigned long msgs;
+	unsigned long bad;
+};
+
+/* check reassembled messages, then hand the chain to the monitor */
+static void j1939_rcv(void *handle, struct diag_msg *msg) {
+	static const uint8_t dm1[] = {0xCA, 0xFE, 0x00, 0x44, 0xFF,
+		0x64, 0x00, 0x01, 0x03, 0x6E, 0x00, 0x00, 0x05};
+	static const uint8_t soft[] = {0xDA, 0xFE, 0x00,
+		'F', 'R', 'E', 'E', 'D', 'I', 'A', 'G', ' ', '1', '.', '0', '*', 'A', 'B', 'C'};
+	struct j1939_count *cnt = handle;
+	struct diag_msg *tmsg;
+
+	LL_FOREACH(msg, tmsg) {
+		cnt->msgs++;
+		switch (DL2P_J1939_GETPGN(tmsg->data)) {
+		case DL2P_J1939_PGN_DM1:
+			if ((tmsg->len != sizeof(dm1)) || memcmp(tmsg->data, dm1, sizeof(dm1)) ||
+					(tmsg->src != 0x00) || (tmsg->dest != 0xFF)) {
+				cnt->bad++;
+			}
+			break;
+		case 0xFEDA:
+			if ((tmsg->len != sizeof(soft)) || memcmp(tmsg->data, soft, sizeof(soft)) ||
+					(tmsg->src != 0x03) || (tmsg->dest != 0xF9)) {
+				cnt->bad++;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	diag_l3_j1939_mon_rcv(cnt->mon, msg);
+	return;
+}
+
+/** J1939 monitor : replay a bus cycle with single frames, a BAM, an RTS/CTS
+ * transfer with a repeated packet, an aborted transfer and an 11-bit frame.
+ * L2 counters, reassembled messages and the latest decoded values must match.
+ */
+bool test_j1939(void) {
+	struct j1939src src = {0, TEST_J1939_CYCLES * J1939SRC_NFRAMES};
+	struct j1939_count cnt = {NULL, 0, 0};
+	struct diag_l3_j1939_monval vals[32];
+	struct diag_l3_j1939_monstats mst;
+	struct dl2p_j1939_stats st;
+	struct stub_session ss;
+	unsigned long elapsed;
+	unsigned int n, i, found = 0;
+	bool rv = 1;
+
+	cnt.mon = diag_l3_j1939_mon_new(NULL, 0, 0);
+	if (cnt.mon == NULL) {
+		printf("monitor err\n");
+		return 0;
+	}
+	if (!stub_start(&ss, j1939src_recv, &src, DIAG_L1_CAN, DIAG_L2_PROT_J1939, 0, 0xF9, 0xF9, NULL)) {
+		diag_l3_j1939_mon_del(cnt.mon, NULL);
+		return 0;
+	}
+
+	while (diag_l2_recv(ss.dl2c, 10, j1939_rcv, &cnt) == 0) {}
+
+	n = diag_l3_j1939_mon_snapshot(cnt.mon, vals, ARRAY_SIZE(vals), NULL);
+	diag_l3_j1939_mon_del(cnt.mon, &mst);
+	(void) dl2p_j1939_getstats(ss.dl2c, &st);
+	elapsed = stub_stop(&ss);
+
+	if ((st.frames != TEST_J1939_CYCLES * J1939SRC_NFRAMES) ||
+			(st.ignored != TEST_J1939_CYCLES) ||
+			(st.msgs != TEST_J1939_CYCLES * J1939SRC_NMSGS) ||
+			(st.tp_done != TEST_J1939_CYCLES * 2) || (st.tp_lost != TEST_J1939_CYCLES) ||
+			(cnt.msgs != st.msgs) || cnt.bad) {
+		printf("L2 : %lu frames, %lu ignored, %lu msgs, TP %lu done %lu lost; %lu bad\n",
+			st.frames, st.ignored, st.msgs, st.tp_done, st.tp_lost, cnt.bad);
+		return 0;
+	}
+	if ((mst.msgs != st.msgs) || (mst.decoded + mst.dropped != mst.msgs) ||
+			(mst.sources != 1)) {
+		printf("monitor : %lu msgs, %lu decoded, %lu dropped, %u sources\n",
+			mst.msgs, mst.decoded, mst.dropped, mst.sources);
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		const struct diag_l3_j1939_val *v = &vals[i].val;
+
+		if (vals[i].src != 0x00) {
+			rv = 0;
+			break;
+		}
+		switch (v->spn->spn) {
+		case 190:
+			found++;
+			rv &= (v->state == DIAG_L3_J1939_OK) && (v->value == 1500);
+			break;
+		case 110:
+			found++;
+			rv &= (v->state == DIAG_L3_J1939_OK) && (v->value == 90);
+			break;
+		case 174:
+			found++;
+			rv &= (v->state == DIAG_L3_J1939_NA);
+			break;
+		case 175:
+			found++;
+			rv &= (v->state == DIAG_L3_J1939_ERR);
+			break;
+		case 624:
+		case 1213:
+			found++;
+			rv &= (v->state == DIAG_L3_J1939_OK) && (v->value == 1);
+			break;
+		default:
+			break;
+		}
+	}
+	if (!rv || (found != 6)) {
+		printf("bad decoded values (%u of 6 found)\n", found);
+		return 0;
+	}
+	printf("%lu msgs/s, %lu dropped ", st.msgs * 1000 / elapsed, mst.dropped);
+	return rv;
+}
+
+#define TEST_REPLAY_FILE	"diag_test_replay.log"
+
+/** new CAN replay L0 on fname, open */
+static struct diag_l0_device *cr_dl0d(const char *fname, bool realtime, bool loop) {
+	struct diag_l0_device *dl0d;
+	struct cfgi *cfgp;
+
+	dl0d = diag_l0_new("CANREPLAY");
+	if (dl0d == NULL) {
+		return NULL;
+	}
+	LL_FOREACH(diag_l0_getcfg(dl0d), cfgp) {
+		if (strcmp(cfgp->shortname, "replayfile") == 0) {
+			diag_cfg_setstr(cfgp, fname);
+		} else if (strcmp(cfgp->shortname, "realtime") == 0) {
+			diag_cfg_setbool(cfgp, realtime);
+		} else if (strcmp(cfgp->shortname, "loop") == 0) {
+			diag_cfg_setbool(cfgp, loop);
+		}
+	}
+	if (diag_l0_open(dl0d, DIAG_L1_CAN)) {
+		diag_l0_del(dl0d);
+		return NULL;
+	}
+	return dl0d;
+}
+
+/* write a log, replay it as fast as possible npass times (loop if > 1),
+ * and compare with the expected frames. ret 1 if ok */
+static bool replay_check(const char *log, const uint8_t *expect, size_t explen,
+		unsigned int npass) {
+	struct diag_l0_device *dl0d;
+	uint8_t buf[DIAG_L1_CAN_HDRLEN + DIAG_L1_CAN_MAXDLC];
+	unsigned int pass;
+	size_t pos;
+	FILE *fp;
+	int len;
+	bool rv = 1;
+
+	fp = fopen(TEST_REPLAY_FILE, "wb");
+	if (fp == NULL) {
+		printf("can't write %s\n", TEST_REPLAY_FILE);
+		return 0;
+	}
+	fputs(log, fp);
+	fclose(fp);
+
+	dl0d = cr_dl0d(TEST_REPLAY_FILE, 0, npass > 1);
+	if (dl0d == NULL) {
+		printf("open err\n");
+		(void) remove(TEST_REPLAY_FILE);
+		return 0;
+	}
+	for (pass = 0; rv && (pass < npass); pass++) {
+		for (pos = 0; pos < explen; pos += (size_t) len) {
+			len = diag_l0_recv(dl0d, NULL, buf, sizeof(buf), 10);
+			if ((len < DIAG_L1_CAN_HDRLEN) || (pos + (size_t) len > explen) ||
+					memcmp(buf, &expect[pos], (size_t) len)) {
+				printf("bad frame at offset %u, pass %u\n", (unsigned) pos, pass);
+				rv = 0;
+				break;
+			}
+		}
+	}
+	if (rv && (npass == 1) && (diag_l0_recv(dl0d, NULL, buf, sizeof(buf), 10) != DIAG_ERR_TIMEOUT)) {
+		printf("frames past the end\n");
+		rv = 0;
+	}
+	diag_l0_close(dl0d);
+	diag_l0_del(dl0d);
+	(void) remove(TEST_REPLAY_FILE);
+	return rv;
+}
+
+/** CAN replay : candump and ASC logs with frames to skip (remote, error,
+ * CAN FD, events) must come out as the expected frames, a looped log must
+ * start over, and realtime replay must keep the original spacing.
+ */
+bool test_canreplay(void) {
+	static const char candump[] =
+		"(1436509052.249713) vcan0 7DF#0201000000000000\n"
+		"(1436509052.250100) vcan0 18DAF110#064100BE1FA813\r\n"
+		"\n"
+		"(1436509052.250200) vcan0 7E8#R\n"
+		"(1436509052.250300) vcan0 20000004#0000000000000000\n"
+		"(1436509052.250400) vcan0 7E9##10011223344\n"
+		"(1436509052.250500) can1 123#\n"
+		"(1436509052.250600) can1 7E8#03410D32";
+	static const uint8_t candump_exp[] = {
+		0x00, 0x00, 0x07, 0xDF, 8, 0x02, 0x01, 0x00, 0, 0, 0, 0, 0,
+		0x98, 0xDA, 0xF1, 0x10, 7, 0x06, 0x41, 0x00, 0xBE, 0x1F, 0xA8, 0x13,
+		0x00, 0x00, 0x01, 0x23, 0,
+		0x00, 0x00, 0x07, 0xE8, 4, 0x03, 0x41, 0x0D, 0x32 };
+	static const char asc[] =
+		"date Mon Jan 5 10:00:00 am 2026\n"
+		"base hex  timestamps absolute\n"
+		"internal events logged\n"
+		"// version 9.0.0\n"
+		"Begin Triggerblock Mon Jan 5 10:00:00 am 2026\n"
+		"   0.000000 Start of measurement\n"
+		"   0.001000 1  7DF             Tx   d 8 02 01 0C 00 00 00 00 00  Length = 0 BitCount = 0 ID = 2015\n"
+		"   0.002000 1  ErrorFrame\n"
+		"   0.003000 1  7E8             Rx   r\n"
+		"   0.004000 1  18FEEE00x       Rx   d 8 82 FF 00 FE FF FF FF FF\n"
+		"   0.005000 CANFD   1 Rx        7e8    1 0 8  8 04 41 0C 1A F8 00 00 00\n"
+		"   0.006000 2  7E8             Rx   d 4 03 41 0D 32\n"
+		"End TriggerBlock\n";
+	static const uint8_t asc_exp[] = {
+		0x00, 0x00, 0x07, 0xDF, 8, 0x02, 0x01, 0x0C, 0, 0, 0, 0, 0,
+		0x98, 0xFE, 0xEE, 0x00, 8, 0x82, 0xFF, 0x00, 0xFE, 0xFF, 0xFF, 0xFF, 0xFF,
+		0x00, 0x00, 0x07, 0xE8, 4, 0x03, 0x41, 0x0D, 0x32 };
+	static const char timed[] =
+		"(100.000000) vcan0 7E8#01\n"
+		"(100.050000) vcan0 7E8#02\n";
+	struct diag_l0_device *dl0d;
+	uint8_t buf[DIAG_L1_CAN_HDRLEN + DIAG_L1_CAN_MAXDLC];
+	unsigned long t0, dt;
+	FILE *fp;
+
+	if (!replay_check(candump, candump_exp, sizeof(candump_exp), 1)) {
+		printf("candump\n");
+		return 0;
+	}
+	if (!replay_check(asc, asc_exp, sizeof(asc_exp), 1)) {
+		printf("ASC\n");
+		return 0;
+	}
+	if (!replay_check(candump, candump_exp, sizeof(candump_exp), 3)) {
+		printf("loop\n");
+		return 0;
+	}
+
+	/* realtime : the second frame comes 50 ms after the first */
+	fp = fopen(TEST_REPLAY_FILE, "wb");
+	if (fp == NULL) {
+		printf("can't write %s\n", TEST_REPLAY_FILE);
+		return 0;
+	}
+	fputs(timed, fp);
+	fclose(fp);
+	dl0d = cr_dl0d(TEST_REPLAY_FILE, 1, 0);
+	if (dl0d == NULL) {
+		printf("open err\n");
+		(void) remove(TEST_REPLAY_FILE);
+		return 0;
+	}
+	(void) diag_l0_recv(dl0d, NULL, buf, sizeof(buf), 100);
+	t0 = diag_os_getms();
+	/* too short a timeout : the frame must stay queued */
+	if ((diag_l0_recv(dl0d, NULL, buf, sizeof(buf), 5) != DIAG_ERR_TIMEOUT) ||
+			(diag_l0_recv(dl0d, NULL, buf, sizeof(buf), 200) != 6) || (buf[5] != 0x02)) {
+		printf("realtime : bad frame\n");
+		dt = 0;
+	} else {
+		dt = diag_os_getms() - t0;
+	}
+	diag_l0_close(dl0d);
+	diag_l0_del(dl0d);
+	(void) remove(TEST_REPLAY_FILE);
+	if ((dt < 45) || (dt > 150)) {
+		printf("realtime : second frame after %lu ms\n", dt);
+		return 0;
+	}
+	return 1;
+}
+
+/********** J1979 stream for an unframed L2 : answers the first request
+ * with 41 00 ..., then streams j1979str_msgs in chunks of 1 to 7 bytes that
+ * don't follow message boundaries */
+static const uint8_t j1979str_msgs[] = {
+	0x41, 0x0C, 0x1A, 0xF8,
+	0x41, 0x0D, 0x32,
+	0x41, 0x05, 0x7B,
+	0x43, 0x01, 0x33, 0x00, 0x00, 0x00, 0x00,
+	0x44,
+	0x41, 0x00, 0xBE, 0x1F, 0xA8, 0x13,
+	0x42, 0x0C, 0x00, 0x1A, 0xF8 };
+static const unsigned int j1979str_lens[] = {4, 3, 3, 7, 1, 6, 5};
+
+struct j1979str {
+	unsigned long calls;
+	unsigned long pos;	/* bytes of j1979str_msgs sent */
+};
+
+static int j1979str_recv(void *payload, uint8_t *data, size_t len) {
+	static const uint8_t ka[] = {0x41, 0x00, 0xBE, 0x1F, 0xA8, 0x13};
+	struct j1979str *src = payload;
+	unsigned int i, n;
+
+	if (src->calls++ == 0) {
+		memcpy(data, ka, sizeof(ka));
+		return (int) sizeof(ka);
+	}
+	n = (unsigned int) (src->calls % 7) + 1;
+	if (n > len) {
+		n = (unsigned int) len;
+	}
+	for (i = 0; i < n; i++) {
+		data[i] = j1979str_msgs[src->pos % sizeof(j1979str_msgs)];
+		src->pos++;
+	}
+	return (int) n;
+}
+
+#define TEST_J1979STR_MSGS	50000
+
+struct j1979str_count {
+	unsigned long msgs;
+	unsigned long pos;	/* offset of the next expected message in j1979str_msgs */
+	unsigned long bad;
+};
+
+static void j1979str_rcv(void *handle, struct diag_msg *msg) {
+	struct j1979str_count *cnt = handle;
+	unsigned int len = j1979str_lens[cnt->msgs % ARRAY_SIZE(j1979str_lens)];
+
+	if ((msg->next != NULL) || (msg->len != len) ||
+			memcmp(msg->data, &j1979str_msgs[cnt->pos], len)) {
+		cnt->bad++;
+	}
+	cnt->msgs++;
+	cnt->pos = (cnt->pos + len) % sizeof(j1979str_msgs);
+	return;
+}
+
+/** J1979 over the raw L2 : L3 must frame a byte stream cut anywhere,
+ * one message per recv(), in order and intact.
+ */
+bool test_j1979stream(void) {
+	struct j1979str src = {0, 0};
+	struct j1979str_count cnt = {0, 0, 0};
+	struct stub_session ss;
+	unsigned long elapsed;
+	bool rv = 1;
+
+	if (!stub_start(&ss, j1979str_recv, &src, DIAG_L1_RAW, DIAG_L2_PROT_RAW, 10400, 0, 0, "SAEJ1979")) {
+		return 0;
+	}
+
+	while (cnt.msgs < TEST_J1979STR_MSGS) {
+		if (diag_l3_recv(ss.dl3c, 100, j1979str_rcv, &cnt)) {
+			printf("recv err\n");
+			rv = 0;
+			break;
+		}
+	}
+	elapsed = stub_stop(&ss);
+
+	if (cnt.bad) {
+		printf("%lu bad of %lu msgs\n", cnt.bad, cnt.msgs);
+		return 0;
+	}
+	if (rv) {
+		printf("%lu msgs/s ", cnt.msgs * 1000 / elapsed);
+	}
+	return rv;
+}
+
 /** ret 1 if success */
 static bool run_tests(void) {
 	bool rv = 1;
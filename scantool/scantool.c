@@ -101,6 +101,31 @@ uint8_t	merged_mode1_info[0x100];
 uint8_t	merged_mode5_info[0x100];
 
 
+/*
+ * Parameters of the last session ecu_connect() established, so
+ * ecu_recover() can restart exactly that session instead of trying
+ * every protocol again.
+ */
+static struct {
+	bool valid;
+	const char *desc;
+	int L1proto;
+	int L2proto;
+	flag_type type;		/* StartComms flags, incl. init type */
+	unsigned int speed;
+	target_type tgt;
+	source_type src;
+	uint8_t kb1;		/* keybytes, to check we're talking to the same ECU */
+	uint8_t kb2;
+	bool nofast;		/* ISO14230 slow init session : ECU ignored fast init */
+	const struct diag_l2_conn *conn;	/* session we're caching; may have been replaced since */
+} last_session;
+
+static bool session_lost;	/* a request found the ECU gone; see ecu_recover() */
+
+#define RECOVER_TRIES	2	/* restart attempts before giving up */
+
+
 /* Prototypes */
 int print_single_dtc(databyte_type d0, databyte_type d1) ;
 void do_j1979_getmodeinfo(uint8_t mode, int response_offset) ;
@@ -471,19 +496,223 @@ l2_check_pid_bits(uint8_t *data, int pid) {
 	return 0;
 }
 
+/*
+ * Go thru the ecu_data and store what was received (by j1979_data_rcv())
+ * in response to a mode 1 or 2 request.
+ * @return 0 if ok
+ */
+static int
+j1979_store_rxdata(struct diag_l3_conn *d_conn, uint8_t mode, uint8_t p1) {
+	ecu_data *ep;
+	unsigned int i, len;
+	uint8_t *rxdata;
+	struct diag_msg *rxmsg;
+
+	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
+		if (ep->rxmsg) {
+			/* Some data arrived from this ecu */
+			rxmsg = ep->rxmsg;
+			rxdata = ep->rxmsg->data;
+
+			/* no PID we decode needs more; anything past it
+			 * would be padding, or a PID we can't store anyway */
+			len = rxmsg->len;
+			if (len > sizeof(ep->mode1_data[0].data)) {
+				if (diag_cli_debug & DIAG_DEBUG_DATA) {
+					fprintf(stderr, "ECU 0x%02X : mode %u PID 0x%02X response "
+						"truncated from %u bytes\n", ep->ecu_addr,
+						mode, p1, len);
+				}
+				len = sizeof(ep->mode1_data[0].data);
+			}
+
+			/* A bit of ugliness is required to bail out on NegativeResponse messages when using
+			 * an iso14230 L2.
+			 */
+			if (d_conn->d_l3l2_conn->l2proto->diag_l2_protocol == DIAG_L2_PROT_ISO14230) {
+				if (rxdata[0] == 0x7f) {
+					return DIAG_ERR_ECUSAIDNO;
+				}
+			}
+			switch (mode) {
+				case 1:
+					ep->values_stale |= ECU_VALUES_MODE1;
+					if (rxdata[0] != 0x41) {
+						ep->mode1_data[p1].type = TYPE_FAILED;
+						break;
+					}
+					memcpy(ep->mode1_data[p1].data, rxdata, len);
+					ep->mode1_data[p1].len = (uint8_t) len;
+					ep->mode1_data[p1].type = TYPE_GOOD;
+					break;
+				case 2:
+					ep->values_stale |= ECU_VALUES_MODE2;
+					if (rxdata[0] != 0x42) {
+						ep->mode2_data[p1].type = TYPE_FAILED;
+						break;
+					}
+					memcpy(ep->mode2_data[p1].data, rxdata, len);
+					ep->mode2_data[p1].len = (uint8_t) len;
+					ep->mode2_data[p1].type = TYPE_GOOD;
+					break;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Number of data bytes after the PID in a mode 1 / 2 response (incl. the
+ * frame # for mode 2), from the PID descriptors (see get_pid()). 0 if
+ * unknown, variable (e.g. fuel trims have a second byte if there are 4 O2
+ * sensor banks), or too long for ecu_data.modeX_data. Only used to split the
+ * responses to multi-PID requests, see j1979_store_multi().
+ */
+static unsigned int
+j1979_pid_datalen(uint8_t mode, uint8_t pid) {
+	const struct pid *p;
+	unsigned int len;
+
+	if ((pid & 0x1F) == 0) {
+		len = 4;	/* supported PIDs */
+	} else if (pid == 0x02) {
+		len = 2;	/* DTC that caused the freeze frame */
+	} else if ((p = get_pid(pid)) != NULL) {
+		len = (unsigned int) p->len;
+	} else {
+		return 0;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	if (mode == 2) {
+		len++;
+	}
+	/* mode byte, PID, data */
+	if (2 + len > sizeof(ecu_info[0].mode1_data[0].data)) {
+		return 0;
+	}
+	return len;
+}
+
+/*
+ * Split the responses to a multi-PID mode 1/2 request (see
+ * l3_do_j1979_pidbatch()) : each ECU answers with one message,
+ * "41 pid data pid data ...", holding only the PIDs it supports, in request
+ * order. Each PID is stored as if it had been requested alone, and marked
+ * in got[] (same order as pids[]). Parsing of a response stops at the first
+ * PID that wasn't requested or is truncated.
+ */
+static void
+j1979_store_multi(uint8_t mode, const uint8_t *pids, unsigned int npids,
+	bool *got) {
+	ecu_data *ep;
+	unsigned int i;
+
+	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
+		const uint8_t *rxdata;
+		unsigned int len, pos, k;
+
+		if (ep->rxmsg == NULL) {
+			continue;
+		}
+		rxdata = ep->rxmsg->data;
+		len = ep->rxmsg->len;
+		if ((len < 1) || (rxdata[0] != (0x40 | mode))) {
+			continue;
+		}
+
+		for (pos = 1, k = 0; pos < len; ) {
+			response *rp;
+			unsigned int dlen;
+			uint8_t pid = rxdata[pos];
+
+			while ((k < npids) && (pids[k] != pid)) {
+				k++;
+			}
+			if (k == npids) {
+				break;
+			}
+			dlen = j1979_pid_datalen(mode, pid);
+			if ((dlen == 0) || (pos + 1 + dlen > len)) {
+				break;
+			}
+			rp = (mode == 1)? &ep->mode1_data[pid] : &ep->mode2_data[pid];
+			rp->data[0] = rxdata[0];
+			memcpy(&rp->data[1], &rxdata[pos], 1 + dlen);
+			rp->len = (uint8_t) (2 + dlen);
+			rp->type = TYPE_GOOD;
+			ep->values_stale |= (mode == 1)? ECU_VALUES_MODE1 : ECU_VALUES_MODE2;
+			got[k] = 1;
+			pos += 1 + dlen;
+		}
+	}
+	return;
+}
+
+/*
+ * Fill "de" with the ECUs that reported support for any of the mode 1/2
+ * "pids" during the scan, i.e. those that will answer a request for them.
+ * @return number of expected ECUs; 0 if unknown (or not mode 1/2).
+ */
+static unsigned int
+j1979_get_expect(uint8_t mode, const uint8_t *pids, unsigned int npids,
+	struct diag_l2_expect *de) {
+	unsigned int i, j;
+	ecu_data *ep;
+
+	de->count = 0;
+	if ((mode != 1) && (mode != 2)) {
+		return 0;
+	}
+
+	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
+		const uint8_t *info = (mode == 1)? ep->mode1_info : ep->mode2_info;
+		for (j = 0; j < npids; j++) {
+			if (info[pids[j]]) {
+				break;
+			}
+		}
+		if ((j < npids) && (de->count < DIAG_L2_MAXEXPECT)) {
+			de->addr[de->count++] = ep->ecu_addr;
+		}
+	}
+	return de->count;
+}
+
+/*
+ * If only one ECU will answer (see j1979_get_expect()), and L2 can do it,
+ * send the request to that ECU's physical address instead of the
+ * functional address : the response is then known to be unique.
+ */
+static void
+j1979_set_addressing(struct diag_l3_conn *d_conn, struct diag_msg *msg,
+	const struct diag_l2_expect *de) {
+	if (de->count != 1) {
+		return;
+	}
+	if (!(d_conn->d_l3l2_flags & DIAG_L2_FLAG_PHYSADDR) ||
+		(d_conn->d_l3l1_flags & DIAG_L1_DATAONLY)) {
+		return;
+	}
+
+	msg->fmt |= DIAG_FMT_ISO_PHYSADDR;
+	msg->dest = de->addr[0];
+	return;
+}
+
 int
 l3_do_j1979_rqst(struct diag_l3_conn *d_conn, uint8_t mode, uint8_t p1, uint8_t p2,
 	uint8_t p3, uint8_t p4, uint8_t p5, uint8_t p6, void *handle) {
 	assert(d_conn != NULL);
 	struct diag_msg msg = {0};
+	struct diag_l2_expect expect;
 	uint8_t data[7];
 	int ihandle;
 	int rv;
-	ecu_data *ep;
-	unsigned int i;
-
-	uint8_t *rxdata;
-	struct diag_msg *rxmsg;
+	int expecting;
+	int retry_failed = 0;
 
 	if (handle != NULL) {
 		ihandle= * (int *) handle;
@@ -523,29 +752,51 @@ l3_do_j1979_rqst(struct diag_l3_conn *d_conn, uint8_t mode, uint8_t p1, uint8_t
 	data[4] = p4;
 	data[5] = p5;
 	data[6] = p6;
-	if ((rv = diag_l3_send(d_conn, &msg))) {
-		return diag_iseterr(rv);
-	}
-
-	/* And get response(s) within a short while */
-	rv = diag_l3_recv(d_conn, 300, j1979_data_rcv, handle);
-	if (rv < 0) {
-		fprintf(stderr, "Request failed, retrying...\n");
-		if ((rv = diag_l3_send(d_conn, &msg))) {
-			return diag_iseterr(rv);
-		}
+	/* For mode 1/2 we may know which ECUs will answer; if it's only one,
+	 * address it directly */
+	expecting = (j1979_get_expect(mode, &p1, 1, &expect) > 0);
+	if (expecting) {
+		(void) diag_l3_ioctl(d_conn, DIAG_IOCTL_SET_EXPECT, &expect);
+		j1979_set_addressing(d_conn, &msg, &expect);
+	}
+
+	/* no keepalive between the request and its response */
+	diag_l2_xfer_begin(d_conn->d_l3l2_conn);
+	rv = diag_l3_send(d_conn, &msg);
+	if (rv == 0) {
+		/* And get response(s) within a short while */
 		rv = diag_l3_recv(d_conn, 300, j1979_data_rcv, handle);
 		if (rv < 0) {
-			fprintf(stderr, "Retry failed, resynching...\n");
-			rv= d_conn->d_l3_proto->diag_l3_proto_timer(d_conn, 6000);	//force keepalive
-			if (rv < 0) {
-				fprintf(stderr, "\tfailed, connection to ECU may be lost!\n");
-				return diag_iseterr(rv);
+			fprintf(stderr, "Request failed, retrying...\n");
+			rv = diag_l3_send(d_conn, &msg);
+			if (rv == 0) {
+				rv = diag_l3_recv(d_conn, 300, j1979_data_rcv, handle);
+				retry_failed = (rv < 0);
 			}
-			fprintf(stderr, "\tOK.\n");
-			return DIAG_ERR_TIMEOUT;
+		}
+	}
+	diag_l2_xfer_end(d_conn->d_l3l2_conn);
 
+	if (expecting) {
+		expect.count = 0;
+		(void) diag_l3_ioctl(d_conn, DIAG_IOCTL_SET_EXPECT, &expect);
+	}
+
+	if (retry_failed) {
+		fprintf(stderr, "Retry failed, resynching...\n");
+		rv= d_conn->d_l3_proto->diag_l3_proto_timer(d_conn, 6000);	//force keepalive
+		if (rv < 0) {
+			fprintf(stderr, "\tfailed, connection to ECU may be lost!\n");
+			session_lost = 1;
+			return diag_iseterr(rv);
 		}
+		fprintf(stderr, "\tOK.\n");
+		return DIAG_ERR_TIMEOUT;
+	}
+	if (rv < 0) {
+		/* send failed : bus error, or the interface lost the session */
+		session_lost = 1;
+		return diag_iseterr(rv);
 	}
 
 	//This part is super confusing: ihandle comes from the handle from a callback passed
@@ -560,49 +811,279 @@ l3_do_j1979_rqst(struct diag_l3_conn *d_conn, uint8_t mode, uint8_t p1, uint8_t
 			break;
 	}
 
-	/*
-	 * Go thru the ecu_data and see what was received.
-	 */
-	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-		if (ep->rxmsg) {
-			/* Some data arrived from this ecu */
-			rxmsg = ep->rxmsg;
-			rxdata = ep->rxmsg->data;
+	return j1979_store_rxdata(d_conn, mode, p1);
+}
 
-			/* A bit of ugliness is required to bail out on NegativeResponse messages when using
-			 * an iso14230 L2.
-			 */
-			if (d_conn->d_l3l2_conn->l2proto->diag_l2_protocol == DIAG_L2_PROT_ISO14230) {
-				if (rxdata[0] == 0x7f) {
-					return DIAG_ERR_ECUSAIDNO;
-				}
+/*
+ * Process the responses to a batched mode 1/2 request (see
+ * l3_do_j1979_pidbatch()) : store them like l3_do_j1979_rqst() does, or
+ * split them with j1979_store_multi() if several PIDs were requested,
+ * then free rxmsg.
+ */
+static int
+j1979_pid_store(struct diag_l3_conn *d_conn, uint8_t mode, const uint8_t *pids,
+	unsigned int npids, struct diag_msg *rxmsg, bool *got) {
+	int rv = 0;
+
+	j1979_data_rcv((void *)&_RQST_HANDLE_NORMAL, rxmsg);
+	if (npids == 1) {
+		rv = j1979_store_rxdata(d_conn, mode, pids[0]);
+	} else {
+		j1979_store_multi(mode, pids, npids, got);
+	}
+	diag_freemsg(rxmsg);
+	return rv;
+}
+
+/* Report the outcome of a mode 1/2 PID request, ret 0 if we got data */
+static int
+j1979_pid_report(uint8_t mode, uint8_t pid, int rv) {
+	if (rv < 0) {
+		fprintf(stderr, "Mode 0x%02X Pid 0x%02X request failed (%d)\n",
+			mode, pid, rv);
+		return DIAG_ERR_GENERAL;
+	}
+	if (find_ecu_msg(0, 0x40 | mode) == NULL) {
+		fprintf(stderr, "Mode 0x%02X Pid 0x%02X request no-data (%d)\n",
+			mode, pid, rv);
+		return DIAG_ERR_GENERAL;
+	}
+	return 0;
+}
+
+#define J1979_PIPE_TIMEOUT	5000	/* ms; max wait for one pipelined result */
+#define J1979_MULTIPID_MODE1	6	/* max PIDs per mode 1 request (CAN only) */
+#define J1979_MULTIPID_MODE2	3	/* max PID + frame # pairs per mode 2 request */
+#define J1979_PIDRQST_MAXLEN	7
+
+/* One request of l3_do_j1979_pidbatch() : PIDs pids[first .. first + n - 1] */
+struct j1979_pidrqst {
+	struct diag_msg txmsg;
+	struct diag_l2_expect expect;
+	uint8_t txdata[J1979_PIDRQST_MAXLEN];
+	unsigned int first;
+	unsigned int n;
+	bool done;	/* responses processed */
+};
+
+/*
+ * Max PIDs per mode 1/2 request : SAE J1979 only allows several on ISO15765
+ * (CAN), where each ECU answers with a single message.
+ */
+unsigned int
+j1979_multipid_max(struct diag_l3_conn *d_conn, uint8_t mode) {
+	if (d_conn->d_l3l2_conn->l2proto->diag_l2_protocol != DIAG_L2_PROT_CAN) {
+		return 1;
+	}
+	return (mode == 1)? J1979_MULTIPID_MODE1 : J1979_MULTIPID_MODE2;
+}
+
+/* abort callback for diag_l3_request_batch() : stop if a key was pressed,
+ * and remember it in *handle */
+static bool
+j1979_batch_abort(void *handle) {
+	bool *aborted = handle;
+
+	if (!*aborted && diag_os_ipending()) {
+		*aborted = 1;
+	}
+	return *aborted;
+}
+
+/*
+ * Request a list of mode 1 or 2 PIDs back-to-back.
+ * On CAN, up to 6 PIDs (3 for mode 2) of known response length (see
+ * j1979_pid_datalen()) go in each request, so a full sweep takes up to
+ * 6 times fewer transactions.
+ * If there are several requests and L2 frames the responses (J1979 then
+ * passes them up as-is), they go through an L3 request pipeline
+ * (diag_l3_pipe_new()) : each request is sent at P3min after the previous
+ * response, while we process the results as they come out of the pipeline.
+ * Otherwise, use diag_l3_request_batch() and process all the results at the
+ * end; a single request has nothing to overlap with, and isn't worth the
+ * pipeline's worker thread (e.g. each poll of the "monitor" scheduler).
+ * Requests that failed, and PIDs of a multi-PID request that got no answer,
+ * are retried individually with l3_do_j1979_rqst(), once the bus is idle.
+ * If interruptible, a keypress is checked for between requests (like the
+ * per-PID loop this replaced did) : the rest is then neither sent nor
+ * retried.
+ * @param verbose : print each request
+ * @return 0 if every PID got data, 1 if interrupted, DIAG_ERR_GENERAL otherwise.
+ */
+int
+l3_do_j1979_pidbatch(struct diag_l3_conn *d_conn, uint8_t mode,
+	const uint8_t *pids, unsigned int npids, bool verbose, bool interruptible) {
+	struct diag_l3_batch_req *reqs;
+	struct j1979_pidrqst *prq;
+	struct diag_l3_pipe *pipe = NULL;
+	bool *got;
+	bool aborted = 0;
+	unsigned int i, j, nrq, npushed, maxpids;
+	int rv;
+	int ret = 0;
+
+	assert((mode == 1) || (mode == 2));
+
+	if (npids == 0) {
+		return 0;
+	}
+
+	if ((rv = diag_calloc(&reqs, npids))) {
+		return diag_iseterr(rv);
+	}
+	if ((rv = diag_calloc(&prq, npids))) {
+		free(reqs);
+		return diag_iseterr(rv);
+	}
+	if ((rv = diag_calloc(&got, npids))) {
+		free(prq);
+		free(reqs);
+		return diag_iseterr(rv);
+	}
+
+	/* Pack the PIDs into requests; those of unknown length go alone, since
+	 * a multi-PID response couldn't be split past them. */
+	maxpids = j1979_multipid_max(d_conn, mode);
+	for (i = 0, nrq = 0; i < npids; nrq++) {
+		struct j1979_pidrqst *p = &prq[nrq];
+
+		p->first = i;
+		p->n = 1;
+		if (j1979_pid_datalen(mode, pids[i++]) == 0) {
+			continue;
+		}
+		while ((i < npids) && (p->n < maxpids) &&
+				j1979_pid_datalen(mode, pids[i])) {
+			p->n++;
+			i++;
+		}
+	}
+
+	for (i = 0; i < nrq; i++) {
+		struct j1979_pidrqst *p = &prq[i];
+		uint8_t *data = p->txdata;
+		unsigned int len = 1;
+
+		if (!verbose) {
+			/* nothing to print */
+		} else if (p->n == 1) {
+			fprintf(stderr, "Requesting Mode 0x%02X Pid 0x%02X...\n",
+				mode, pids[p->first]);
+		} else {
+			fprintf(stderr, "Requesting Mode 0x%02X Pids", mode);
+			for (j = p->first; j < p->first + p->n; j++) {
+				fprintf(stderr, " 0x%02X", pids[j]);
 			}
-			switch (mode) {
-				case 1:
-					if (rxdata[0] != 0x41) {
-						ep->mode1_data[p1].type = TYPE_FAILED;
-						break;
-					}
-					memcpy(ep->mode1_data[p1].data, rxdata,
-						rxmsg->len);
-					ep->mode1_data[p1].len = rxmsg->len;
-					ep->mode1_data[p1].type = TYPE_GOOD;
+			fprintf(stderr, "...\n");
+		}
+		data[0] = mode;
+		for (j = p->first; j < p->first + p->n; j++) {
+			data[len++] = pids[j];
+			if (mode == 2) {
+				data[len++] = 0;	/* frame # */
+			}
+		}
+		p->txmsg.src = global_cfg.src;
+		p->txmsg.dest = global_cfg.tgt;
+		p->txmsg.data = data;
+		p->txmsg.len = len;
+		reqs[i].txmsg = &p->txmsg;
+		reqs[i].errval = DIAG_ERR_TIMEOUT;
+		if (j1979_get_expect(mode, &pids[p->first], p->n, &p->expect)) {
+			reqs[i].expect = &p->expect;
+			j1979_set_addressing(d_conn, &p->txmsg, &p->expect);
+		}
+	}
+	if (verbose && (nrq < npids)) {
+		fprintf(stderr, "Mode 0x%02X : %u Pids, %u requests\n",
+			mode, npids, nrq);
+	}
 
-					break;
-				case 2:
-					if (rxdata[0] != 0x42) {
-						ep->mode2_data[p1].type = TYPE_FAILED;
-						break;
-					}
-					memcpy(ep->mode2_data[p1].data, rxdata,
-						rxmsg->len);
-					ep->mode2_data[p1].len = rxmsg->len;
-					ep->mode2_data[p1].type = TYPE_GOOD;
-					break;
+	if ((nrq > 1) && (d_conn->d_l3l2_flags & DIAG_L2_FLAG_FRAMED)) {
+		pipe = diag_l3_pipe_new(d_conn);
+	}
+
+	if (pipe != NULL) {
+		for (npushed = 0; npushed < nrq; npushed++) {
+			if (diag_l3_pipe_push(pipe, reqs[npushed].txmsg,
+					reqs[npushed].expect, &reqs[npushed])) {
+				break;
+			}
+		}
+		/* process each result while the next requests are on the bus */
+		for (i = 0; i < npushed; i++) {
+			struct diag_l3_batch_req *req;
+			struct j1979_pidrqst *p;
+			struct diag_msg *rxmsg;
+			void *handle;
+			int errval;
+
+			if (interruptible && j1979_batch_abort(&aborted)) {
+				break;
+			}
+			if (diag_l3_pipe_pop(pipe, J1979_PIPE_TIMEOUT, &rxmsg,
+					&errval, &handle)) {
+				break;
+			}
+			req = (struct diag_l3_batch_req *) handle;
+			p = &prq[req - reqs];
+			req->errval = errval;
+			if (errval != 0) {
+				diag_freemsg(rxmsg);
+				continue;
+			}
+			rv = j1979_pid_store(d_conn, mode, &pids[p->first], p->n,
+				rxmsg, &got[p->first]);
+			if ((p->n == 1) && j1979_pid_report(mode, pids[p->first], rv)) {
+				ret = DIAG_ERR_GENERAL;
 			}
+			p->done = 1;
 		}
+		diag_l3_pipe_del(pipe);
+	} else {
+		(void) diag_l3_request_batch(d_conn, reqs, nrq, 300,
+			interruptible? j1979_batch_abort : NULL, &aborted);
 	}
-	return 0;
+
+	/* Bus is idle again : now process the remaining results */
+	for (i = 0; i < nrq; i++) {
+		struct j1979_pidrqst *p = &prq[i];
+
+		if (!p->done && (reqs[i].errval == 0)) {
+			rv = j1979_pid_store(d_conn, mode, &pids[p->first], p->n,
+				reqs[i].rxmsg, &got[p->first]);
+			if ((p->n == 1) && j1979_pid_report(mode, pids[p->first], rv)) {
+				ret = DIAG_ERR_GENERAL;
+			}
+			p->done = 1;
+		} else if (!p->done) {
+			diag_freemsg(reqs[i].rxmsg);
+		}
+
+		for (j = p->first; j < p->first + p->n; j++) {
+			if (got[j] || (p->done && (p->n == 1)) || aborted) {
+				continue;
+			}
+			if (interruptible && j1979_batch_abort(&aborted)) {
+				continue;
+			}
+			if (session_lost) {
+				/* no point retrying each PID on a dead session */
+				rv = DIAG_ERR_GENERAL;
+			} else {
+				rv = l3_do_j1979_rqst(d_conn, mode, pids[j], 0x00,
+					0x00, 0x00, 0x00, 0x00, (void *)&_RQST_HANDLE_NORMAL);
+			}
+			if (j1979_pid_report(mode, pids[j], rv)) {
+				ret = DIAG_ERR_GENERAL;
+			}
+		}
+	}
+
+	free(got);
+	free(prq);
+	free(reqs);
+	return aborted? 1 : ret;
 }
 
 
@@ -818,6 +1299,34 @@ do_l2_j1850_start(int l1_type) {
 	return 0;
 }
 
+/*
+ * ISO15765 (CAN) init, DIAG_L2_TYPE_CAN29 passed in flags for 29-bit IDs;
+ * kernel ISO-TP if "set isotp kernel".
+ * Nothing goes on the bus until L3 sends its first request.
+ */
+static int
+do_l2_can_start(int flags) {
+	struct diag_l2_conn *d_conn;
+
+	if (global_cfg.addrtype) {
+		flags |= DIAG_L2_TYPE_FUNCADDR;
+	}
+	if (global_cfg.cankernel) {
+		flags |= DIAG_L2_TYPE_CANKERNEL;
+	}
+
+	d_conn = do_l2_common_start(DIAG_L1_CAN, DIAG_L2_PROT_CAN,
+		(flag_type) flags, 500000, global_cfg.tgt, global_cfg.src);
+
+	if (d_conn == NULL) {
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+
+	/* Connected ! */
+	global_l2_conn = d_conn;
+
+	return 0;
+}
 
 /*
  * Gets the data for every supported test using global L3 connection
@@ -831,11 +1340,11 @@ do_l2_j1850_start(int l1_type) {
  */
 int
 do_j1979_getdata(int interruptible) {
-	unsigned int i,j;
+	unsigned int i;
+	uint8_t pids[0x100];
+	unsigned int npids;
 	int rv;
 	struct diag_l3_conn *d_conn;
-	ecu_data *ep;
-	struct diag_msg *msg;
 
 	d_conn = global_l3_conn;
 	if (d_conn == NULL) {
@@ -847,34 +1356,51 @@ do_j1979_getdata(int interruptible) {
 	/*
 	 * Now get all the data supported
 	 */
-	for (i=3; i<0x100; i++) {
+	for (i=3, npids=0; i<0x100; i++) {
 		if (merged_mode1_info[i]) {
-			fprintf(stderr, "Requesting Mode 1 Pid 0x%02X...\n", i);
-			rv = l3_do_j1979_rqst(d_conn, 0x1, (uint8_t) i, 0x00,
-				0x00, 0x00, 0x00, 0x00, (void *)&_RQST_HANDLE_NORMAL);
-			if (rv < 0) {
-				fprintf(stderr, "Mode 1 Pid 0x%02X request failed (%d)\n",
-					i, rv);
-			} else {
-				msg = find_ecu_msg(0, 0x41);
-				if (msg == NULL) {
-					fprintf(stderr,
-						"Mode 1 Pid 0x%02X request "
-						"no-data (%d)\n",
-						i, rv);
-				}
-			}
+			pids[npids++] = (uint8_t) i;
+		}
+	}
+	rv = l3_do_j1979_pidbatch(d_conn, 0x1, pids, npids, 1, interruptible);
+	if (session_lost) {
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
 
-			if (interruptible) {
-				if (diag_os_ipending()) {
-					return 1;
-				}
-			}
+	if (interruptible) {
+		if ((rv == 1) || diag_os_ipending()) {
+			return 1;
 		}
 	}
 
+	return do_j1979_getfreeze(interruptible, 1);
+}
+
+/*
+ * Gets the freeze frame data : mode 2 PID 2 (DTC that caused the freeze
+ * frame), then every mode 2 PID of the ECUs that have a freeze frame.
+ *
+ * Returns <0 on failure, 0 on good and 1 on interrupted (see
+ * do_j1979_getdata())
+ */
+int
+do_j1979_getfreeze(int interruptible, bool verbose) {
+	unsigned int i,j;
+	uint8_t pids[0x100];
+	unsigned int npids;
+	int rv;
+	struct diag_l3_conn *d_conn;
+	ecu_data *ep;
+	struct diag_msg *msg;
+
+	d_conn = global_l3_conn;
+	if (d_conn == NULL) {
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+
 	/* Get mode2/pid2 (DTC that caused freezeframe) */
-	fprintf(stderr, "Requesting Mode 0x02 Pid 0x02 (Freeze frame DTCs)...\n");
+	if (verbose) {
+		fprintf(stderr, "Requesting Mode 0x02 Pid 0x02 (Freeze frame DTCs)...\n");
+	}
 	rv = l3_do_j1979_rqst(d_conn, 0x2, 2, 0x00,
 		0x00, 0x00, 0x00, 0x00, (void *)&_RQST_HANDLE_NORMAL);
 
@@ -893,29 +1419,22 @@ do_j1979_getdata(int interruptible) {
 		if ( (ep->mode2_data[2].type == TYPE_GOOD) &&
 			(ep->mode2_data[2].data[2] |
 				ep->mode2_data[2].data[3]) ) {
-			for (i=3; i<0x100; i++) {
+			for (i=3, npids=0; i<0x100; i++) {
 				if (ep->mode2_info[i]) {
-					fprintf(stderr, "Requesting Mode 0x02 Pid 0x%02X...\n", i);
-					rv = l3_do_j1979_rqst(d_conn, 0x2, (uint8_t)i, 0x00,
-						0x00, 0x00, 0x00, 0x00, (void *)&_RQST_HANDLE_NORMAL);
-					if (rv < 0) {
-						fprintf(stderr, "Mode 0x02 Pid 0x%02X request failed (%d)\n", i, rv);
-					} else {
-						msg = find_ecu_msg(0, 0x42);
-						if (msg == NULL) {
-							fprintf(stderr, "Mode 0x02 Pid 0x%02X request no-data (%d)\n", i, rv);
-							return DIAG_ERR_GENERAL;
-						}
-					}
-
+					pids[npids++] = (uint8_t) i;
 				}
-				if (interruptible) {
-					if (diag_os_ipending()) { // was Enter
-								  // pressed
-						return 1;
-					}
+			}
+			rv = l3_do_j1979_pidbatch(d_conn, 0x2, pids, npids, verbose,
+				interruptible);
+			if (interruptible) {
+				if ((rv == 1) || diag_os_ipending()) { // was Enter
+							  // pressed
+					return 1;
 				}
 			}
+			if (rv < 0) {
+				return DIAG_ERR_GENERAL;
+			}
 		}
 	}
 	return 0;
@@ -1483,8 +2002,30 @@ const struct protocol protocols[] = {
 	{"ISO14230_FAST", do_l2_14230_start, DIAG_L2_TYPE_FASTINIT},
 	{"ISO9141", do_l2_9141_start, 0x33},
 	{"ISO14230_SLOW", do_l2_14230_start, DIAG_L2_TYPE_SLOWINIT},
+	{"ISO15765-11BIT", do_l2_can_start, 0},
+	{"ISO15765-29BIT", do_l2_can_start, DIAG_L2_TYPE_CAN29},
 };
 
+/* Remember how the current global_l2_conn was started */
+static void
+session_save(const char *desc) {
+	const struct diag_l2_conn *d_l2_conn = global_l2_conn;
+
+	last_session.desc = desc;
+	last_session.L1proto = d_l2_conn->diag_link->l1proto;
+	last_session.L2proto = d_l2_conn->l2proto->diag_l2_protocol;
+	last_session.type = d_l2_conn->diag_l2_type;
+	last_session.speed = d_l2_conn->diag_l2_speed;
+	last_session.tgt = d_l2_conn->diag_l2_destaddr;
+	last_session.src = d_l2_conn->diag_l2_srcaddr;
+	last_session.kb1 = d_l2_conn->diag_l2_kb1;
+	last_session.kb2 = d_l2_conn->diag_l2_kb2;
+	last_session.nofast = 0;
+	last_session.conn = d_l2_conn;
+	last_session.valid = 1;
+	session_lost = 0;
+}
+
 /*
  * Connect to ECU by trying all protocols
  * - We do the fast initialising protocols before the slow ones
@@ -1533,6 +2074,7 @@ ecu_connect(void) {
 		global_state = STATE_L3ADDED;
 
 		fprintf(stderr, "%s Connected.\n", p->desc);
+		session_save(p->desc);
 		break;
 	}
 
@@ -1544,6 +2086,129 @@ ecu_connect(void) {
 	return rv ? diag_iseterr(rv) : 0;
 }
 
+bool
+ecu_session_lost(void) {
+	return session_lost;
+}
+
+/* Close global L3 + L2 connections, like ecu_connect() does on failure */
+static void
+session_close(void) {
+	if (global_l3_conn != NULL) {
+		diag_l3_stop(global_l3_conn);
+		global_l3_conn = NULL;
+	}
+	if (global_l2_conn != NULL) {
+		diag_l2_StopCommunications(global_l2_conn);
+		diag_l2_close(global_dl0d);
+		global_l2_conn = NULL;
+	}
+}
+
+/*
+ * Start the cached session again, with init flags "type".
+ * Unlike do_l2_common_start(), this keeps the ECU data (supported PIDs etc).
+ * Ret 0 if ok, global_l2_conn and global_l3_conn are then set.
+ */
+static int
+session_restart(flag_type type) {
+	struct diag_l2_conn *d_l2_conn;
+	struct diag_l3_conn *d_l3_conn;
+	int rv;
+
+	rv = diag_l2_open(global_dl0d, last_session.L1proto);
+	if (rv) {
+		return diag_iseterr(rv);
+	}
+
+	d_l2_conn = diag_l2_StartCommunications(global_dl0d, last_session.L2proto,
+		type, last_session.speed, last_session.tgt, last_session.src);
+	if (d_l2_conn == NULL) {
+		diag_l2_close(global_dl0d);
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+
+	/* Different keybytes : not the ECU (or config) we know about */
+	if ((d_l2_conn->diag_l2_kb1 != last_session.kb1) ||
+			(d_l2_conn->diag_l2_kb2 != last_session.kb2)) {
+		fprintf(stderr, "Keybytes changed : %02X %02X, were %02X %02X\n",
+			d_l2_conn->diag_l2_kb1, d_l2_conn->diag_l2_kb2,
+			last_session.kb1, last_session.kb2);
+		diag_l2_StopCommunications(d_l2_conn);
+		diag_l2_close(global_dl0d);
+		last_session.valid = 0;
+		return diag_iseterr(DIAG_ERR_WRONGKB);
+	}
+
+	d_l3_conn = diag_l3_start("SAEJ1979", d_l2_conn);
+	if (d_l3_conn == NULL) {
+		diag_l2_StopCommunications(d_l2_conn);
+		diag_l2_close(global_dl0d);
+		return diag_iseterr(DIAG_ERR_ECUSAIDNO);
+	}
+
+	global_l2_conn = d_l2_conn;
+	global_l3_conn = d_l3_conn;
+	last_session.conn = d_l2_conn;
+	return 0;
+}
+
+/*
+ * Restart a lost session (P3max expired, bus error, ECU reset...) with the
+ * parameters of the last one ecu_connect() established. An ISO14230 session
+ * that needed a 5 baud init is first tried with a fast init, which most of
+ * those ECUs also accept. ECU data is kept, so polling can carry on.
+ * If this fails, we're disconnected (STATE_IDLE). Ret 0 if ok.
+ */
+int
+ecu_recover(void) {
+	enum globstate state = global_state;
+	flag_type slowtype = last_session.type;
+	flag_type fasttype;
+	int rv = DIAG_ERR_GENERAL;
+	int i;
+
+	if (!last_session.valid || (global_state < STATE_L3ADDED) ||
+			(global_l2_conn != last_session.conn)) {
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+
+	fprintf(stderr, "Restarting %s session...\n", last_session.desc);
+	session_close();
+
+	fasttype = (slowtype & ~DIAG_L2_TYPE_INITMASK) | DIAG_L2_TYPE_FASTINIT;
+	for (i = 0; (i < RECOVER_TRIES) && last_session.valid; i++) {
+		if ((last_session.L2proto == DIAG_L2_PROT_ISO14230) &&
+				((slowtype & DIAG_L2_TYPE_INITMASK) == DIAG_L2_TYPE_SLOWINIT) &&
+				!last_session.nofast) {
+			rv = session_restart(fasttype);
+			if (rv == 0) {
+				last_session.type = fasttype;
+				break;
+			}
+			last_session.nofast = 1;
+			if (!last_session.valid) {
+				break;
+			}
+		}
+		rv = session_restart(last_session.type);
+		if (rv == 0) {
+			break;
+		}
+	}
+
+	if (rv) {
+		fprintf(stderr, "Could not restart session; please reconnect.\n");
+		global_state = STATE_IDLE;
+		return diag_iseterr(rv);
+	}
+
+	session_lost = 0;
+	global_state = state;
+	fprintf(stderr, "%s session restarted.\n", last_session.desc);
+	return 0;
+}
+
 
 /*
  * Initialise. ret 0 if ok
@@ -1582,63 +2247,146 @@ static void do_usage (void) {
 
 
 static void format_o2(char *buf, int maxlen, UNUSED(int english),
-	const struct pid *p, response *data, int n) {
-		double v = DATA_SCALED(p, DATA_1(p, n, data));
-		int t = DATA_1(p, n + 1, data);
+	const struct pid *p, const struct pid_values *pv) {
+		double v = pv->v[p->pidID];
 
-		if (t == 0xff) {
+		if (!(pv->valid[p->pidID] & PIDV_VALID2)) {
 			snprintf(buf, maxlen, p->fmt1, v);
 		} else {
-			snprintf(buf, maxlen, p->fmt2, v,
-				 t * p->scale2 + p->offset2);
+			snprintf(buf, maxlen, p->fmt2, v, pv->v2[p->pidID]);
 		}
 }
 
 
 static void
 format_aux(char *buf, int maxlen, UNUSED(int english), const struct pid *p,
-	response *data, int n) {
-		snprintf(buf, maxlen, (DATA_RAW(p, n, data) & 1) ? "PTO Active" : "----");
+	const struct pid_values *pv) {
+		snprintf(buf, maxlen, ((unsigned int) pv->v[p->pidID] & 1) ? "PTO Active" : "----");
 }
 
 
+static const char *
+fuel_status(unsigned int s) {
+		switch (s) {
+		case 1 << 0:
+			return "Open";
+		case 1 << 1:
+			return "Closed";
+		case 1 << 2:
+			return "Open-Driving";
+		case 1 << 3:
+			return "Open-Fault";
+		case 1 << 4:
+			return "Closed-Fault";
+		default:
+			return "Open(rsvd)";
+		}
+}
+
 
 static void
 format_fuel(char *buf, int maxlen, UNUSED(int english), const struct pid *p,
-	response *data, int n) {
-		int s = DATA_1(p, n, data);
+	const struct pid_values *pv) {
+		unsigned int s2 = (unsigned int) pv->v2[p->pidID];
 
-		switch (s) {
+		/* fuel system 2 : 0 if there's none */
+		if ((pv->valid[p->pidID] & PIDV_VALID2) && s2) {
+			snprintf(buf, maxlen, "%s/%s",
+				fuel_status((unsigned int) pv->v[p->pidID]), fuel_status(s2));
+		} else {
+			snprintf(buf, maxlen, "%s", fuel_status((unsigned int) pv->v[p->pidID]));
+		}
+}
+
+
+/* PID 1 : MIL status and DTC count in the first byte */
+static void
+format_status(char *buf, int maxlen, UNUSED(int english), const struct pid *p,
+	const struct pid_values *pv) {
+		unsigned long s = (unsigned long) pv->v[p->pidID];
+
+		snprintf(buf, maxlen, "MIL %s, %lu DTCs",
+			(s & 0x80000000UL) ? "ON" : "off", (s >> 24) & 0x7F);
+}
+
+
+static void
+format_secair(char *buf, int maxlen, UNUSED(int english), const struct pid *p,
+	const struct pid_values *pv) {
+		switch ((unsigned int) pv->v[p->pidID]) {
 		case 1 << 0:
-			snprintf(buf, maxlen, "Open");
+			snprintf(buf, maxlen, "Upstream");
 			break;
 		case 1 << 1:
-			snprintf(buf, maxlen, "Closed");
+			snprintf(buf, maxlen, "Downstream");
 			break;
 		case 1 << 2:
-			snprintf(buf, maxlen, "Open-Driving");
+			snprintf(buf, maxlen, "Off");
 			break;
 		case 1 << 3:
-			snprintf(buf, maxlen, "Open-Fault");
-			break;
-		case 1 << 4:
-			snprintf(buf, maxlen, "Closed-Fault");
+			snprintf(buf, maxlen, "On for diags");
 			break;
 		default:
-			snprintf(buf, maxlen, "Open(rsvd)");
+			snprintf(buf, maxlen, "----");
 			break;
 		}
+}
+
+
+static void
+format_obdstd(char *buf, int maxlen, UNUSED(int english), const struct pid *p,
+	const struct pid_values *pv) {
+		static const char *const stds[] = {
+			NULL, "OBD II (CARB)", "OBD (EPA)", "OBD and OBD II", "OBD I",
+			"not OBD", "EOBD", "EOBD and OBD II", "EOBD and OBD",
+			"EOBD, OBD, OBD II", "JOBD", "JOBD and OBD II", "JOBD and EOBD",
+			"JOBD, EOBD, OBD II" };
+		unsigned int s = (unsigned int) pv->v[p->pidID];
+
+		if ((s < ARRAY_SIZE(stds)) && stds[s]) {
+			snprintf(buf, maxlen, "%s", stds[s]);
+		} else {
+			snprintf(buf, maxlen, "unknown (%u)", s);
+		}
+}
+
+
+static void
+format_fueltype(char *buf, int maxlen, UNUSED(int english), const struct pid *p,
+	const struct pid_values *pv) {
+		static const char *const types[] = {
+			"----", "Gasoline", "Methanol", "Ethanol", "Diesel", "LPG",
+			"CNG", "Propane", "Electric", "Bifuel Gasoline",
+			"Bifuel Methanol", "Bifuel Ethanol", "Bifuel LPG",
+			"Bifuel CNG", "Bifuel Propane", "Bifuel Electric",
+			"Bifuel Elec/Comb", "Hybrid Gasoline", "Hybrid Ethanol",
+			"Hybrid Diesel", "Hybrid Electric", "Hybrid Elec/Comb",
+			"Hybrid Regen", "Bifuel Diesel" };
+		unsigned int s = (unsigned int) pv->v[p->pidID];
+
+		if (s < ARRAY_SIZE(types)) {
+			snprintf(buf, maxlen, "%s", types[s]);
+		} else {
+			snprintf(buf, maxlen, "unknown (%u)", s);
+		}
+}
+
 
-		/* XXX Fuel system 2 status */
+/* bit fields there's no more to say about, e.g. O2 sensor locations */
+static void
+format_hex(char *buf, int maxlen, UNUSED(int english), const struct pid *p,
+	const struct pid_values *pv) {
+		snprintf(buf, maxlen, "0x%0*lX", 2 * p->bytes,
+			(unsigned long) pv->v[p->pidID]);
 }
 
 
 static void
-format_data(char *buf, int maxlen, int english, const struct pid *p, response *data, int n) {
-		double v;
+format_data(char *buf, int maxlen, int english, const struct pid *p,
+	const struct pid_values *pv) {
+		double v = pv->v[p->pidID];
 
-		v = DATA_SCALED(p, DATA_RAW(p, n, data));
-		if (english && p->fmt2) {
+		if (english && p->fmt2 && *p->fmt2) {
 			snprintf(buf, maxlen, p->fmt2, DATA_ENGLISH(p, v));
 		} else {
 			snprintf(buf, maxlen, p->fmt1, v);
@@ -1647,91 +2395,215 @@ format_data(char *buf, int maxlen, int english, const struct pid *p, response *d
 
 
 /* conversion factors from the "units" package */
+#define KPA_PSI	0.14503774
+#define KPA_INHG	0.29529983
+#define KM_MILE	0.62137119
+
+/* Table entry for common PID kinds */
+#define PID_PCT(id, desc)	[id] = {id, desc, format_data, 1, 1, 0, \
+		"%5.1f%%", (100.0/255), 0.0, "", 0.0, 0.0}
+/* trims : second byte for banks 3 / 4, if there are 4 banks */
+#define PID_TRIM(id, desc)	[id] = {id, desc, format_data, 1, 0, 0, \
+		"%5.1f%%", (100.0/128), -100.0, "", 0.0, 0.0}
+#define PID_TEMP(id, desc)	[id] = {id, desc, format_data, 1, 1, 0, \
+		"%3.0fC", 1.0, -40.0, "%3.0fF", 1.8, 32.0}
+#define PID_HEX(id, desc, n)	[id] = {id, desc, format_hex, n, n, PID_BITS, \
+		"", 0.0, 0.0, "", 0.0, 0.0}
+/* O2 sensor : voltage and short term fuel trim */
+#define PID_O2(id, desc)	[id] = {id, desc, format_o2, 1, 2, PID_VAL2, \
+		"%5.3fV", 0.005, 0.0, "%5.3fV/%5.1f%%", (100.0/128), -100.0}
+/* wide range O2 sensor : equivalence ratio, and voltage */
+#define PID_O2WV(id, desc)	[id] = {id, desc, format_o2, 2, 4, PID_VAL2, \
+		"%5.3f", (2.0/65536), 0.0, "%5.3f/%5.3fV", (8.0/65536), 0.0}
+/* wide range O2 sensor : equivalence ratio, and current */
+#define PID_O2WC(id, desc)	[id] = {id, desc, format_o2, 2, 4, PID_VAL2, \
+		"%5.3f", (2.0/65536), 0.0, "%5.3f/%6.2fmA", (1.0/256), -128.0}
+#define PID_CATT(id, desc)	[id] = {id, desc, format_data, 2, 2, 0, \
+		"%5.1fC", 0.1, -40.0, "%5.0fF", 1.8, 32.0}
 
-static const struct pid pids[] = {
-	{0x03, "Fuel System Status", format_fuel, 2,
+/*
+ * SAE J1979 mode 1 / 2 PIDs, indexed by PID; no entry for the "PIDs
+ * supported" bitmaps, nor for the DTC that caused the freeze frame (PID 2).
+ * The table stops at PID 0x64 : most PIDs after it (added in later editions
+ * of J1979) are multi-sensor records longer than the 5 data bytes
+ * response.data holds, so they can't be stored, let alone decoded, without
+ * widening ecu_data first.
+ */
+static const struct pid pids[0x100] = {
+	[0x01] = {0x01, "Monitor Status", format_status, 4, 4, PID_BITS,
 		"", 0.0, 0.0,
 		"", 0.0, 0.0},
-	{0x04, "Calculated Load Value", format_data, 1,
-		"%5.1f%%", (100.0/255), 0.0,
-		"", 0.0, 0.0},
-	{0x05, "Engine Coolant Temperature", format_data, 1,
-		"%3.0fC", 1, -40,
-		"%3.0fF", 1.8, 32},
-	{0x06, "Short term fuel trim Bank 1", format_data, 1,
-		"%5.1f%%", (100.0/128), -100,
-		"", 0.0, 0.0},
-	{0x07, "Long term fuel trim Bank 1", format_data, 1,
-		"%5.1f%%", (100.0/128), -100,
-		"", 0.0, 0.0},
-	{0x08, "Short term fuel trim Bank 2", format_data, 1,
-		"%5.1f%%", (100.0/128), -100,
-		"", 0.0, 0.0},
-	{0x09, "Long term fuel trim Bank 2", format_data, 1,
-		"%5.1f%%", (100.0/128), -100,
-		"", 0.0, 0.0},
-	{0x0a, "Fuel Pressure", format_data, 1,
+	[0x03] = {0x03, "Fuel System Status", format_fuel, 1, 2, PID_BITS | PID_VAL2,
+		"", 0.0, 0.0,
+		"", 1.0, 0.0},
+	PID_PCT(0x04, "Calculated Load Value"),
+	PID_TEMP(0x05, "Engine Coolant Temperature"),
+	PID_TRIM(0x06, "Short term fuel trim Bank 1"),
+	PID_TRIM(0x07, "Long term fuel trim Bank 1"),
+	PID_TRIM(0x08, "Short term fuel trim Bank 2"),
+	PID_TRIM(0x09, "Long term fuel trim Bank 2"),
+	[0x0a] = {0x0a, "Fuel Pressure", format_data, 1, 1, 0,
 		"%3.0fkPaG", 3.0, 0.0,
-		"%4.1fpsig", 0.14503774, 0.0},
-	{0x0b, "Intake Manifold Pressure", format_data, 1,
+		"%4.1fpsig", KPA_PSI, 0.0},
+	[0x0b] = {0x0b, "Intake Manifold Pressure", format_data, 1, 1, 0,
 		"%3.0fkPaA", 1.0, 0.0,
-		"%4.1finHg", 0.29529983, 0.0},
-	{0x0c, "Engine RPM", format_data, 2,
+		"%4.1finHg", KPA_INHG, 0.0},
+	[0x0c] = {0x0c, "Engine RPM", format_data, 2, 2, 0,
 		"%5.0fRPM", 0.25, 0.0,
 		"", 0.0, 0.0},
-	{0x0d, "Vehicle Speed", format_data, 1,
+	[0x0d] = {0x0d, "Vehicle Speed", format_data, 1, 1, 0,
 		"%3.0fkm/h", 1.0, 0.0,
-		"%3.0fmph", 0.62137119, 0.0},
-	{0x0e, "Ignition timing advance Cyl #1", format_data, 1,
-		"%4.1f deg", 0.5,	-64.0,
+		"%3.0fmph", KM_MILE, 0.0},
+	[0x0e] = {0x0e, "Ignition timing advance Cyl #1", format_data, 1, 1, 0,
+		"%4.1f deg", 0.5, -64.0,
 		"", 0.0, 0.0},
-	{0x0f, "Intake Air Temperature", format_data, 1,
-		"%3.0fC", 1.0, -40.0,
-		"%3.0fF", 1.8, 32.0},
-	{0x10, "Air Flow Rate", format_data, 2,
+	PID_TEMP(0x0f, "Intake Air Temperature"),
+	[0x10] = {0x10, "Air Flow Rate", format_data, 2, 2, 0,
 		"%6.2fgm/s", 0.01, 0.0,
 		"%6.1flb/min", 0.13227736, 0.0},
-	{0x11, "Absolute Throttle Position", format_data, 1,
+	PID_PCT(0x11, "Absolute Throttle Position"),
+	[0x12] = {0x12, "Commanded Secondary Air Status", format_secair, 1, 1, PID_BITS,
+		"", 0.0, 0.0,
+		"", 0.0, 0.0},
+	PID_HEX(0x13, "Location of Oxygen Sensors", 1),
+	PID_O2(0x14, "Bank 1 Sensor 1 Voltage/Trim"),
+	PID_O2(0x15, "Bank 1 Sensor 2 Voltage/Trim"),
+	PID_O2(0x16, "Bank 1 Sensor 3 Voltage/Trim"),
+	PID_O2(0x17, "Bank 1 Sensor 4 Voltage/Trim"),
+	PID_O2(0x18, "Bank 2 Sensor 1 Voltage/Trim"),
+	PID_O2(0x19, "Bank 2 Sensor 2 Voltage/Trim"),
+	PID_O2(0x1a, "Bank 2 Sensor 3 Voltage/Trim"),
+	PID_O2(0x1b, "Bank 2 Sensor 4 Voltage/Trim"),
+	[0x1c] = {0x1c, "OBD requirements", format_obdstd, 1, 1, PID_BITS,
+		"", 0.0, 0.0,
+		"", 0.0, 0.0},
+	PID_HEX(0x1d, "Location of O2 Sensors (4 banks)", 1),
+	[0x1e] = {0x1e, "Auxiliary Input Status", format_aux, 1, 1, PID_BITS,
+		"", 0.0, 0.0,
+		"", 0.0, 0.0},
+	[0x1f] = {0x1f, "Time since engine start", format_data, 2, 2, 0,
+		"%5.0fs", 1.0, 0.0,
+		"", 0.0, 0.0},
+	[0x21] = {0x21, "Distance with MIL on", format_data, 2, 2, 0,
+		"%5.0fkm", 1.0, 0.0,
+		"%5.0fmiles", KM_MILE, 0.0},
+	[0x22] = {0x22, "Fuel Rail Pressure (rel vacuum)", format_data, 2, 2, 0,
+		"%6.1fkPa", 0.079, 0.0,
+		"%5.1fpsi", KPA_PSI, 0.0},
+	[0x23] = {0x23, "Fuel Rail Pressure", format_data, 2, 2, 0,
+		"%6.0fkPaG", 10.0, 0.0,
+		"%5.0fpsig", KPA_PSI, 0.0},
+	PID_O2WV(0x24, "Bank 1 Sensor 1 Lambda/Voltage"),
+	PID_O2WV(0x25, "Bank 1 Sensor 2 Lambda/Voltage"),
+	PID_O2WV(0x26, "Bank 1 Sensor 3 Lambda/Voltage"),
+	PID_O2WV(0x27, "Bank 1 Sensor 4 Lambda/Voltage"),
+	PID_O2WV(0x28, "Bank 2 Sensor 1 Lambda/Voltage"),
+	PID_O2WV(0x29, "Bank 2 Sensor 2 Lambda/Voltage"),
+	PID_O2WV(0x2a, "Bank 2 Sensor 3 Lambda/Voltage"),
+	PID_O2WV(0x2b, "Bank 2 Sensor 4 Lambda/Voltage"),
+	PID_PCT(0x2c, "Commanded EGR"),
+	[0x2d] = {0x2d, "EGR Error", format_data, 1, 1, 0,
+		"%5.1f%%", (100.0/128), -100.0,
+		"", 0.0, 0.0},
+	PID_PCT(0x2e, "Commanded Evaporative Purge"),
+	PID_PCT(0x2f, "Fuel Level Input"),
+	[0x30] = {0x30, "Warm-ups since DTCs cleared", format_data, 1, 1, 0,
+		"%3.0f", 1.0, 0.0,
+		"", 0.0, 0.0},
+	[0x31] = {0x31, "Distance since DTCs cleared", format_data, 2, 2, 0,
+		"%5.0fkm", 1.0, 0.0,
+		"%5.0fmiles", KM_MILE, 0.0},
+	[0x32] = {0x32, "Evap System Vapor Pressure", format_data, 2, 2, PID_SIGNED,
+		"%7.2fPa", 0.25, 0.0,
+		"%6.3finH2O", 0.0040146309, 0.0},
+	[0x33] = {0x33, "Barometric Pressure", format_data, 1, 1, 0,
+		"%3.0fkPaA", 1.0, 0.0,
+		"%4.1finHg", KPA_INHG, 0.0},
+	PID_O2WC(0x34, "Bank 1 Sensor 1 Lambda/Current"),
+	PID_O2WC(0x35, "Bank 1 Sensor 2 Lambda/Current"),
+	PID_O2WC(0x36, "Bank 1 Sensor 3 Lambda/Current"),
+	PID_O2WC(0x37, "Bank 1 Sensor 4 Lambda/Current"),
+	PID_O2WC(0x38, "Bank 2 Sensor 1 Lambda/Current"),
+	PID_O2WC(0x39, "Bank 2 Sensor 2 Lambda/Current"),
+	PID_O2WC(0x3a, "Bank 2 Sensor 3 Lambda/Current"),
+	PID_O2WC(0x3b, "Bank 2 Sensor 4 Lambda/Current"),
+	PID_CATT(0x3c, "Catalyst Temp Bank 1 Sensor 1"),
+	PID_CATT(0x3d, "Catalyst Temp Bank 2 Sensor 1"),
+	PID_CATT(0x3e, "Catalyst Temp Bank 1 Sensor 2"),
+	PID_CATT(0x3f, "Catalyst Temp Bank 2 Sensor 2"),
+	PID_HEX(0x41, "Monitor Status this cycle", 4),
+	[0x42] = {0x42, "Control Module Voltage", format_data, 2, 2, 0,
+		"%6.3fV", 0.001, 0.0,
+		"", 0.0, 0.0},
+	[0x43] = {0x43, "Absolute Load Value", format_data, 2, 2, 0,
 		"%5.1f%%", (100.0/255), 0.0,
 		"", 0.0, 0.0},
-	{0x12, "Commanded Secondary Air Status", format_data, 1,
-		"", 0, 0,
-		"", 0, 0},	//can't format bit fields
-	{0x13, "Location of Oxygen Sensors", format_data, 1,
-		"", 0, 0,
-		"", 0, 0},	//can't format bit fields
-	{0x14, "Bank 1 Sensor 1 Voltage/Trim", format_o2, 2,
-		"%5.3fV", 0.005, 0.0,
-		"%5.3fV/%5.1f%%", (100.0/128), -100.0},
-	{0x15, "Bank 1 Sensor 2 Voltage/Trim", format_o2, 2,
-		"%5.3fV", 0.005, 0.0,
-		"%5.3fV/%5.1f%%", (100.0/128), -100.0},
-	{0x16, "Bank 1 Sensor 3 Voltage/Trim", format_o2, 2,
-		"%5.3fV", 0.005, 0.0,
-		"%5.3fV/%5.1f%%", (100.0/128), -100.0},
-	{0x17, "Bank 1 Sensor 4 Voltage/Trim", format_o2, 2,
-		"%5.3fV", 0.005, 0.0,
-		"%5.3fV/%5.1f%%", (100.0/128), -100.0},
-	{0x18, "Bank 2 Sensor 1 Voltage/Trim", format_o2, 2,
-		"%5.3fV", 0.005, 0.0,
-		"%5.3fV/%5.1f%%", (100.0/128), -100.0},
-	{0x19, "Bank 2 Sensor 2 Voltage/Trim", format_o2, 2,
-		"%5.3fV", 0.005, 0.0,
-		"%5.3fV/%5.1f%%", (100.0/128), -100.0},
-	{0x1a, "Bank 2 Sensor 3 Voltage/Trim", format_o2, 2,
-		"%5.3fV", 0.005, 0.0,
-		"%5.3fV/%5.1f%%", (100.0/128), -100.0},
-	{0x1b, "Bank 2 Sensor 4 Voltage/Trim", format_o2, 2,
-		"%5.3fV", 0.005, 0.0,
-		"%5.3fV/%5.1f%%", (100.0/128), -100.0},
-	{0x1e, "Auxiliary Input Status", format_aux, 1,
+	[0x44] = {0x44, "Commanded Equivalence Ratio", format_data, 2, 2, 0,
+		"%5.3f", (2.0/65536), 0.0,
+		"", 0.0, 0.0},
+	PID_PCT(0x45, "Relative Throttle Position"),
+	PID_TEMP(0x46, "Ambient Air Temperature"),
+	PID_PCT(0x47, "Absolute Throttle Position B"),
+	PID_PCT(0x48, "Absolute Throttle Position C"),
+	PID_PCT(0x49, "Accelerator Pedal Position D"),
+	PID_PCT(0x4a, "Accelerator Pedal Position E"),
+	PID_PCT(0x4b, "Accelerator Pedal Position F"),
+	PID_PCT(0x4c, "Commanded Throttle Actuator"),
+	[0x4d] = {0x4d, "Time run with MIL on", format_data, 2, 2, 0,
+		"%5.0fmin", 1.0, 0.0,
+		"", 0.0, 0.0},
+	[0x4e] = {0x4e, "Time since DTCs cleared", format_data, 2, 2, 0,
+		"%5.0fmin", 1.0, 0.0,
+		"", 0.0, 0.0},
+	PID_HEX(0x4f, "Max Lambda/Voltage/Current/MAP", 4),
+	[0x50] = {0x50, "Max Air Flow Rate", format_data, 1, 4, 0,
+		"%4.0fgm/s", 10.0, 0.0,
+		"%5.1flb/min", 0.13227736, 0.0},
+	[0x51] = {0x51, "Fuel Type", format_fueltype, 1, 1, PID_BITS,
 		"", 0.0, 0.0,
 		"", 0.0, 0.0},
+	PID_PCT(0x52, "Ethanol Fuel"),
+	[0x53] = {0x53, "Abs Evap System Vapor Pressure", format_data, 2, 2, 0,
+		"%7.3fkPa", 0.005, 0.0,
+		"%6.3fpsi", KPA_PSI, 0.0},
+	[0x54] = {0x54, "Evap System Vapor Pressure", format_data, 2, 2, PID_SIGNED,
+		"%6.0fPa", 1.0, 0.0,
+		"%6.2finH2O", 0.0040146309, 0.0},
+	PID_TRIM(0x55, "Short term O2 trim Bank 1"),
+	PID_TRIM(0x56, "Long term O2 trim Bank 1"),
+	PID_TRIM(0x57, "Short term O2 trim Bank 2"),
+	PID_TRIM(0x58, "Long term O2 trim Bank 2"),
+	[0x59] = {0x59, "Fuel Rail Absolute Pressure", format_data, 2, 2, 0,
+		"%6.0fkPa", 10.0, 0.0,
+		"%5.0fpsi", KPA_PSI, 0.0},
+	PID_PCT(0x5a, "Relative Accelerator Position"),
+	PID_PCT(0x5b, "Hybrid Battery Remaining Life"),
+	PID_TEMP(0x5c, "Engine Oil Temperature"),
+	[0x5d] = {0x5d, "Fuel Injection Timing", format_data, 2, 2, 0,
+		"%6.2f deg", (1.0/128), -210.0,
+		"", 0.0, 0.0},
+	[0x5e] = {0x5e, "Engine Fuel Rate", format_data, 2, 2, 0,
+		"%6.2fL/h", 0.05, 0.0,
+		"%5.2fgal/h", 0.26417205, 0.0},
+	PID_HEX(0x5f, "Emission Requirements", 1),
+	[0x61] = {0x61, "Driver's Demand Torque", format_data, 1, 1, 0,
+		"%4.0f%%", 1.0, -125.0,
+		"", 0.0, 0.0},
+	[0x62] = {0x62, "Actual Engine Torque", format_data, 1, 1, 0,
+		"%4.0f%%", 1.0, -125.0,
+		"", 0.0, 0.0},
+	[0x63] = {0x63, "Engine Reference Torque", format_data, 2, 2, 0,
+		"%5.0fNm", 1.0, 0.0,
+		"%5.0flb-ft", 0.73756215, 0.0},
+	/* also 4 torque points, not decoded */
+	[0x64] = {0x64, "Engine Percent Torque at idle", format_data, 1, 5, 0,
+		"%4.0f%%", 1.0, -125.0,
+		"", 0.0, 0.0},
 };
 
 
 const struct pid *get_pid ( unsigned int i ) {
-	if (i >= ARRAY_SIZE(pids)) {
+	if ((i >= ARRAY_SIZE(pids)) || (pids[i].desc == NULL)) {
 		return NULL;
 	}
 
@@ -1739,6 +2611,69 @@ const struct pid *get_pid ( unsigned int i ) {
 }
 
 
+void
+decode_pid_data(const response *data, unsigned int off, struct pid_values *pv) {
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(pids); i++) {
+		const struct pid *p = &pids[i];
+		const response *r = &data[i];
+		unsigned int n = (unsigned int) p->bytes;
+		unsigned long raw, raw2;
+		unsigned int k;
+
+		pv->valid[i] = 0;
+		if ((p->desc == NULL) || (r->type != TYPE_GOOD) ||
+				(r->len < off + n) || (off + n > sizeof(r->data))) {
+			continue;
+		}
+		for (k = 0, raw = 0; k < n; k++) {
+			raw = (raw << 8) | r->data[off + k];
+		}
+		if (p->flags & PID_BITS) {
+			pv->v[i] = raw;
+		} else if ((p->flags & PID_SIGNED) && (raw & (1UL << (8 * n - 1)))) {
+			pv->v[i] = ((double) raw - (double) (1UL << (8 * n))) * p->scale1 +
+					p->offset1;
+		} else {
+			pv->v[i] = raw * p->scale1 + p->offset1;
+		}
+		pv->valid[i] = PIDV_VALID;
+
+		if (!(p->flags & PID_VAL2) || (r->len < off + 2 * n) ||
+				(off + 2 * n > sizeof(r->data))) {
+			continue;
+		}
+		for (k = n, raw2 = 0; k < 2 * n; k++) {
+			raw2 = (raw2 << 8) | r->data[off + k];
+		}
+		if ((n == 1) && (raw2 == 0xFF)) {
+			continue;
+		}
+		pv->v2[i] = raw2 * p->scale2 + p->offset2;
+		pv->valid[i] |= PIDV_VALID2;
+	}
+	return;
+}
+
+
+const struct pid_values *
+ecu_values(ecu_data *ep, uint8_t mode) {
+	if (mode == 2) {
+		if (ep->values_stale & ECU_VALUES_MODE2) {
+			decode_pid_data(ep->mode2_data, 3, &ep->mode2_values);
+			ep->values_stale &= ~ECU_VALUES_MODE2;
+		}
+		return &ep->mode2_values;
+	}
+	if (ep->values_stale & ECU_VALUES_MODE1) {
+		decode_pid_data(ep->mode1_data, 2, &ep->mode1_values);
+		ep->values_stale &= ~ECU_VALUES_MODE1;
+	}
+	return &ep->mode1_values;
+}
+
+
 /*
  * Main
  */
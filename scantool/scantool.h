@@ -52,6 +52,59 @@ typedef struct {
 #define TYPE_FAILED	1	/* Got failure response */
 #define TYPE_GOOD	2	/* Valid info */
 
+/** J1979 PID structures + utils **/
+struct pid ;
+struct pid_values ;
+/* format the value(s) of PID p, decoded in pv, into buf, up to <maxlen> chars. */
+typedef void (formatter)(char *buf, int maxlen, int english, const struct pid *p,
+	const struct pid_values *pv);
+
+/*
+ * Mode 1 / 2 PID descriptor. The value is the first "bytes" data bytes after
+ * the PID (frame #), MSB first, as raw * scale1 + offset1 in the units of fmt1;
+ * fmt2 is for value * scale2 + offset2 (English units), if not "".
+ * PID_VAL2 : the next "bytes" bytes hold a second value, raw * scale2 +
+ * offset2, and fmt2 formats both (O2 sensors); a 1-byte second value of
+ * 0xFF means "not used".
+ */
+struct pid {
+	int pidID ;
+	const char *desc ;
+	formatter *cust_snprintf ;
+	int bytes ;	/* 1, 2 or 4 */
+	int len ;	/* data bytes after the PID in a mode 1 response; 0 : varies */
+	int flags ;
+	const char *fmt1 ; // SI
+	double scale1 ;
+	double offset1 ;
+	const char *fmt2 ; // English (typically)
+	double scale2 ;
+	double offset2 ;
+};
+
+#define PID_SIGNED	0x01	/* raw value is two's complement */
+#define PID_BITS	0x02	/* bit field / enumeration : raw value, not scaled; see cust_snprintf */
+#define PID_VAL2	0x04	/* second value, see above */
+
+#define DATA_SCALED(p, v)	(v * p->scale1 + p->offset1)
+#define DATA_ENGLISH(p, v)	(v * p->scale2 + p->offset2)
+
+/*
+ * Mode 1 or 2 data of an ECU, decoded in one pass by decode_pid_data() :
+ * one array per field, indexed by PID.
+ */
+struct pid_values {
+	double v[0x100];	/* value, scaled (SI units) or raw (PID_BITS) */
+	double v2[0x100];	/* second value (PID_VAL2) */
+	uint8_t valid[0x100];	/* PIDV_* */
+};
+
+#define PIDV_VALID	0x01	/* v[] holds data */
+#define PIDV_VALID2	0x02	/* v2[] holds data */
+
+/** Descriptor of mode 1/2 PID i; NULL if there's none */
+const struct pid *get_pid ( unsigned int i ) ;
+
 /*
  * This structure holds all the data/config info for a given ecu
  * - one request can result in more than one ECU responding, and so
@@ -77,6 +130,10 @@ typedef struct {
 	response	mode1_data[256]; /* Response data for all responses */
 	response	mode2_data[256]; /* Same, but for freeze frame */
 
+	struct pid_values	mode1_values;	/* mode1_data decoded, see ecu_values() */
+	struct pid_values	mode2_values;
+	uint8_t	values_stale;	/* ECU_VALUES_* : modeX_data changed since decoded */
+
 	struct diag_msg	*rxmsg;		/* Received message */
 } ecu_data;
 
@@ -87,9 +144,13 @@ typedef struct {
 #define ECU_DATA_MODE8	0x10
 #define ECU_DATA_MODE9	0x20
 
+#define ECU_VALUES_MODE1	0x01
+#define ECU_VALUES_MODE2	0x02
+
 #define MAX_ECU 8			/* Max 8 Ecus responding */
 extern ecu_data	ecu_info[MAX_ECU];
 extern unsigned int ecu_count;
+extern uint8_t	merged_mode1_info[0x100];	/* PIDs supported by any ECU */
 
 struct diag_l2_conn;
 struct diag_l3_conn;
@@ -116,6 +177,16 @@ int do_j1979_getO2sensors(void);
 int diag_cleardtc(void);
 int ecu_connect(void);
 
+/** Whether a request since the last (re)connection found the ECU gone */
+bool ecu_session_lost(void);
+
+/** Restart the session ecu_connect() established, with the same
+ * protocol, init, speed and addresses; ECU data is kept.
+ * On failure, we're disconnected.
+ * @return 0 if ok
+ */
+int ecu_recover(void);
+
 struct diag_msg *find_ecu_msg(int byte, databyte_type val);
 
 /*
@@ -140,6 +211,30 @@ extern const int _RQST_HANDLE_O2S;	//O2 sensor tests
 extern const int _RQST_HANDLE_READINESS;	//Readiness tests
 
 int do_j1979_getdata(int interruptible_flag);
+int do_j1979_getfreeze(int interruptible_flag, bool verbose);
+
+/** Request a list of mode 1 or 2 PIDs (several per request on CAN), and
+ * store the responses in ecu_info[].modeX_data.
+ * @param verbose : print each request
+ * @param interruptible : stop between requests if a key was pressed
+ *	(diag_os_ipending())
+ * @return 0 if every PID got data, 1 if interrupted
+ */
+int l3_do_j1979_pidbatch(struct diag_l3_conn *d_conn, uint8_t mode,
+	const uint8_t *pids, unsigned int npids, bool verbose, bool interruptible);
+
+/** Max PIDs l3_do_j1979_pidbatch() puts in one mode 1 or 2 request */
+unsigned int j1979_multipid_max(struct diag_l3_conn *d_conn, uint8_t mode);
+
+/** Decode every PID with a descriptor (see get_pid()) in a mode 1 or 2
+ * response array, in one pass.
+ * @param off : offset of the first value byte in response.data : 2 for mode
+ *	1, 3 for mode 2 (frame #)
+ */
+void decode_pid_data(const response *data, unsigned int off, struct pid_values *pv);
+/** Decoded mode 1 or 2 data of ECU ep; decoded again only if it changed
+ * since the last call */
+const struct pid_values *ecu_values(ecu_data *ep, uint8_t mode);
 void do_j1979_basics(void) ;
 void do_j1979_cms(void);
 void do_j1979_ncms(int);
@@ -156,34 +251,6 @@ void	l2raw_data_rcv(void *handle, struct diag_msg *msg);
 
 
 
-/** J1979 PID structures + utils **/
-struct pid ;
-/* format <numbytes> bytes of data into buf, up to <maxlen> chars. */
-typedef void (formatter)(char *buf, int maxlen, int units, const struct pid *, response *, int numbytes);
-
-struct pid {
-	int pidID ;
-	const char *desc ;
-	formatter *cust_snprintf ;
-	int bytes ;
-	const char *fmt1 ; // SI
-	double scale1 ;
-	double offset1 ;
-	const char *fmt2 ; // English (typically)
-	double scale2 ;
-	double offset2 ;
-};
-
-#define DATA_VALID(p, d)	(d[p->pidID].type == TYPE_GOOD)
-#define DATA_1(p, n, d)	(d[p->pidID].data[n])	/* extract 8bit value @offset n */
-#define DATA_2(p, n, d)	(DATA_1(p, n, d) * 256 + DATA_1(p, n+1, d))	/* extract 16bit value @offset n */
-#define DATA_RAW(p, n, d)	(p->bytes == 1 ? DATA_1(p, n, d) : DATA_2(p, n, d))
-
-#define DATA_SCALED(p, v)	(v * p->scale1 + p->offset1)
-#define DATA_ENGLISH(p, v)	(v * p->scale2 + p->offset2)
-
-
-const struct pid *get_pid ( unsigned int i ) ;
 
 
 #if defined(__cplusplus)
@@ -1464,6 +1464,29 @@ done:
 	return CMD_OK;
 }
 
+/*
+ * Talk to ECU "addr" over the D2 session of the current connection, without
+ * another init : on success, global_l2_conn is the new connection and the
+ * previous one is returned in *base. Returns false if the ECU didn't answer.
+ */
+static bool
+attach_d2(uint8_t addr, struct diag_l2_conn **base) {
+	struct diag_l2_conn *dl2c;
+
+	dl2c = diag_l2_AttachCommunications(global_l2_conn, addr);
+	if (dl2c == NULL) {
+		return false;
+	}
+	if (diag_l7_d2_ping(dl2c) != 0) {
+		diag_l2_StopCommunications(dl2c);
+		return false;
+	}
+	*base = global_l2_conn;
+	global_l2_conn = dl2c;
+	have_read_dtcs = false;
+	return true;
+}
+
 /*
  * Try to connect to each possible ECU. Print identification and DTCs for each
  * successfully connected ECU.
@@ -1472,10 +1495,15 @@ done:
  * because at least one ECU in our list will be missing from any given vehicle.
  * For example, MSA 15.7 and Motronic M4.4 will never both be present in the
  * same car.
+ *
+ * Once one D2 ECU is connected, the others are tried over the same session
+ * first (see diag_l2_AttachCommunications), which takes one request instead
+ * of a full init; a full init is only done for those that don't answer.
  */
 static int
 cmd_850_scan_all(int argc, UNUSED(char **argv)) {
 	struct ecu_info *ecu;
+	struct diag_l2_conn *base;
 	char *argvout[2];
 	char buf[4];
 
@@ -1494,14 +1522,29 @@ cmd_850_scan_all(int argc, UNUSED(char **argv)) {
 		sprintf(buf, "%d", ecu->addr);
 		if (ecu->addr == 0x10) {
 			/* Skip Motronic M4.4 old protocol */
-		} else if (cmd_850_connect(2, argvout) == CMD_OK) {
+			continue;
+		}
+		if ((get_connection_status() == CONNECTED_D2) && attach_d2(ecu->addr, &base)) {
+			printf("Connected to %s.\n", ecu->desc);
 			cmd_850_id(1, NULL);
 			cmd_850_dtc(1, NULL);
+			diag_l2_StopCommunications(global_l2_conn);
+			global_l2_conn = base;
+			continue;
+		}
+		if (get_connection_status() != NOT_CONNECTED) {
 			cmd_850_disconnect(1, NULL);
+		}
+		if (cmd_850_connect(2, argvout) == CMD_OK) {
+			cmd_850_id(1, NULL);
+			cmd_850_dtc(1, NULL);
 		} else {
 			printf("Couldn't connect to %s.\n", ecu->desc);
 		}
 	}
+	if (get_connection_status() != NOT_CONNECTED) {
+		cmd_850_disconnect(1, NULL);
+	}
 
 	printf("Scan-all done.\n");
 
@@ -40,6 +40,7 @@
 #include "scantool.h"
 #include "scantool_cli.h"
 #include "scantool_aif.h"
+#include "scantool_poll.h"
 #include "freediag_aif.h"
 #include "utlist.h"
 
@@ -68,112 +69,111 @@ static void aif_vw(void *data) { (void) data; BadToApp() ; }
 static void aif_dyno(void *data) { (void) data; BadToApp() ; }
 
 
+/* called by the poll scheduler : print the DTCs once it has read them */
+static void aif_poll_done (UNUSED(void *handle), uint8_t mode, UNUSED(uint8_t pid)) {
+	struct diag_msg *msg ;
+	unsigned int i ;
+
+	if (mode != 7) {
+		return ;
+	}
+
+	/* Currently monitored DTCs (see do_j1979_cms()) */
+	for (i = 0 ; i < ecu_count ; i++) {
+		LL_FOREACH(ecu_info[i].rxmsg, msg) {
+			unsigned int j ;
+
+			if ((msg->len < 1) || (msg->data[0] != 0x47)) {
+				continue;
+			}
+			for (j = 1 ; j + 1 < msg->len ; j += 2) {
+				char buf[256];
+
+				if ((msg->data[j] == 0) &&
+				    (msg->data[j + 1] == 0)) {
+					continue;
+				}
+
+				diag_dtc_decode(&msg->data[j], 2, NULL, NULL,
+					dtc_proto_j2012, buf, sizeof(buf)) ;
+				//what do we do with the decoded DTC ?
+				//maybe just print it for now...
+				fprintf(stderr, FLFMT "decoded DTC : %s\n", FL, buf);
+			}
+		}
+	}
+}
+
+
 static void aif_monitor (UNUSED(void *data)) {
+	struct poll_sched *ps ;
+	unsigned int i, j ;
+	int rv ;
+
 	if (global_state < STATE_CONNECTED) {
 		fprintf(stderr, "scantool: Can't monitor - car is not yet connected.\n");
 		BadToApp() ;
 		return ;
 	}
+	ps = poll_new(aif_poll_done, NULL) ;
+	if (ps == NULL) {
+		BadToApp() ;
+		return ;
+	}
 	OkToApp() ;
 
 	/*
-	* Now just receive data and send it to the application
-	* whenever it requests it.
+	* Now just receive data (the scheduler also reads the DTCs now and
+	* then), and send it to the application when it sends a new request;
+	* then go handle that request.
 	*/
 
-	while (1) {
-		unsigned int i ;
-		int rv = do_j1979_getdata(1) ;
-		struct diag_l3_conn *d_conn ;
-		struct diag_msg *msg ;
-
-		/* New request arrived. */
-
-		if (rv) {
-			unsigned int j ;
-
-			for (j = 0 ; get_pid(j) != NULL ; j++) {
-				const struct pid *p = get_pid(j) ;
-				ecu_data   *ep ;
-				char buf[24] ;
-
-				for (i = 0, ep = ecu_info ; i < ecu_count ; i++, ep++) {
-					if (DATA_VALID(p, ep->mode1_data) ||
-					DATA_VALID(p, ep->mode2_data)) {
-						if (DATA_VALID(
-							    p,
-							    ep->mode1_data)) {
-							p->cust_snprintf(
-								buf,
-								sizeof(buf),
-								global_cfg
-									.units,
-								p,
-								ep->mode1_data,
-								2);
-						}
-
-						printf("%-15.15s ", buf);
-
-						if (DATA_VALID(
-							    p,
-							    ep->mode2_data)) {
-							p->cust_snprintf(
-								buf,
-								sizeof(buf),
-								global_cfg
-									.units,
-								p,
-								ep->mode2_data,
-								3);
-						}
-
-						printf("%-15.15s\n", buf);
-					}
-				}
-			}
+	while ((rv = poll_step(ps, 1)) == 0) {
+		;
 	}
+	poll_del(ps) ;
 
-	d_conn = global_l3_conn ;
-
-	rv = l3_do_j1979_rqst(d_conn, 0x07, 0x00, 0x00,
-	0x00, 0x00, 0x00, 0x00, (void *)&_RQST_HANDLE_NORMAL) ;
-
-	if (rv == DIAG_ERR_TIMEOUT) {
-	/* Didn't get a response, this is valid if there are no DTCs */
-	} else if (rv != 0) {
-		fprintf(stderr, "Failed to get test results for"
-		" continuously monitored systems\n") ;
+	if (rv < 0) {
+		/* session lost */
+		fprintf(stderr, "scantool: Monitoring stopped, lost the ECU.\n");
 		BadToApp() ;
-	} else {
-		/* Currently monitored DTCs: */
-
-		for (i = 0 ; i < ecu_count ; i++) {
-			LL_FOREACH(ecu_info[i].rxmsg, msg) {
-				int i, j ;
+		return ;
+	}
 
-				for (i = 0, j = 1 ; i < 3 ; i++, j += 2) {
-					char buf[256];
-					uint8_t db[2];
+	/* New request arrived. */
+	for (j = 0 ; j < 0x100 ; j++) {
+		const struct pid *p = get_pid(j) ;
+		ecu_data   *ep ;
+		char buf[24] ;
 
-					if ((msg->data[j] == 0) &&
-					    (msg->data[j + 1] == 0)) {
-						continue;
-					}
+		if (p == NULL) {
+			continue;
+		}
+		for (i = 0, ep = ecu_info ; i < ecu_count ; i++, ep++) {
+			const struct pid_values *pv1 = ecu_values(ep, 1);
+			const struct pid_values *pv2 = ecu_values(ep, 2);
+
+			if (pv1->valid[j] || pv2->valid[j]) {
+				if (pv1->valid[j]) {
+					p->cust_snprintf(buf, sizeof(buf),
+						global_cfg.units, p, pv1);
+				} else {
+					snprintf(buf, sizeof(buf), "-----");
+				}
 
-					db[0] = msg->data[j];
-					db[1] = msg->data[j+1];
+				printf("%-15.15s ", buf);
 
-					diag_dtc_decode(db, 2, NULL, NULL,
-						dtc_proto_j2012, buf, sizeof(buf)) ;
-					//what do we do with the decoded DTC ?
-					//maybe just print it for now...
-					fprintf(stderr, FLFMT "decoded DTC : %s\n", FL, buf);
+				if (pv2->valid[j]) {
+					p->cust_snprintf(buf, sizeof(buf),
+						global_cfg.units, p, pv2);
+				} else {
+					snprintf(buf, sizeof(buf), "-----");
 				}
+
+				printf("%-15.15s\n", buf);
 			}
 		}
-	}	//if DIAG_ERR_TIMEOUT
-	}	//while 1
+	}
 
 	OkToApp() ;
 }
@@ -96,6 +96,7 @@ int cmd_exit(int argc, char **argv);
 
 extern int diag_cli_debug;	/* debug level */
 extern FILE		*global_logfp;		/* Monitor log output file pointer */
+extern unsigned long global_log_tstart;	/* diag_os_getms() when logging started */
 void log_timestamp(const char *prefix);
 
 
@@ -109,6 +110,8 @@ extern struct globcfg {
 	uint8_t	tgt;	/* u8; target address */
 	uint8_t	src;	/* u8: source addr / tester ID */
 	bool	addrtype;	/* Address type, 1 = functional */
+	bool	can29;	/* CAN IDs : 29-bit (1) or 11-bit (0) */
+	bool	cankernel;	/* ISO15765 transport : kernel CAN_ISOTP if L0 has it (1) or freediag's (0) */
 	unsigned int speed;	/* ECU comms speed */
 
 	int	initmode;	/* Type of bus init (ISO9141/14230 only) */
@@ -30,14 +30,22 @@
  *
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "diag.h"
+#include "diag_os.h"
+#include "diag_cfg.h"
+#include "diag_l0.h"
 #include "diag_l1.h"
 #include "diag_l2.h"
+#include "diag_l2_can.h"
 #include "diag_l3.h"
 #include "diag_err.h"
 
 #include "scantool.h"
 #include "scantool_cli.h"
+#include "utlist.h"
 
 
 static int cmd_diag_help(int argc, char **argv);
@@ -52,6 +60,7 @@ static int cmd_diag_reml3(UNUSED(int argc), UNUSED(char **argv));
 
 static int cmd_diag_probe(int argc, char **argv);
 static int cmd_diag_fastprobe(int argc, char **argv);
+static int cmd_diag_multi(int argc, char **argv);
 
 const struct cmd_tbl_entry diag_cmd_table[] = {
 	{ "help", "help [command]", "Gives help for a command",
@@ -81,6 +90,9 @@ const struct cmd_tbl_entry diag_cmd_table[] = {
 
 	{ "probe", "probe start_addr [stop_addr]", "Scan bus using ISO9141 5 baud init [slow!]", cmd_diag_probe, 0, NULL},
 	{ "fastprobe", "fastprobe start_addr [stop_addr [func]]", "Scan bus using ISO14230 fast init with physical or functional addressing", cmd_diag_fastprobe, 0, NULL},
+	{ "multi", "multi port1 [port2 [...]]",
+		"Connect on several ports in parallel (one session each, current settings) and read supported PIDs",
+		cmd_diag_multi, 0, NULL},
 	{ "up", "up", "Return to previous menu level",
 		cmd_up, 0, NULL},
 	{ "quit","quit", "Exit program",
@@ -186,9 +198,36 @@ static int cmd_diag_reml3(UNUSED(int argc), UNUSED(char **argv)) {
 }
 
 
+/* Rest of a fast probe, over the session of d_conn */
+static void
+probe_attached(struct diag_l2_conn *d_conn, unsigned int start, unsigned int end) {
+	struct diag_l2_conn *dl2c;
+	unsigned int i;
+
+	for (i=start; i<=end; i++) {
+		printf("\t0x%X ", i);
+		fflush(stdout);
+
+		dl2c = diag_l2_AttachCommunications(d_conn, (target_type) i);
+		if (dl2c == NULL) {
+			if (diag_geterr() == DIAG_ERR_PROTO_NOTSUPP) {
+				printf("- can't share this session, stopping here.\n");
+				return;
+			}
+			continue;
+		}
+		printf(" responded; keybytes: 0x%X 0x%X\n", dl2c->diag_l2_kb1, dl2c->diag_l2_kb2);
+		diag_l2_StopCommunications(dl2c);
+	}
+	printf("\n");
+	return;
+}
+
 //cmd_diag_prob_common [startaddr] [stopaddr]
-//This should stop searching at the first succesful init
-//and update the global connection
+//The first succesful init becomes the global connection. With fast init,
+//the remaining addresses are then tried over that session (see
+//diag_l2_AttachCommunications), which is much quicker than more inits;
+//5 baud inits are per-ECU, so the slow probe stops at the first one.
 static int
 cmd_diag_probe_common(int argc, char **argv, int fastflag) {
 	unsigned int start, end, i;
@@ -305,6 +344,9 @@ cmd_diag_probe_common(int argc, char **argv, int fastflag) {
 			printf("- read failed %d\n", rv);
 		}
 
+		if (fastflag) {
+			probe_attached(d_conn, i + 1, end);
+		}
 		return CMD_OK;
 	}	//for addresses
 	//Failed => clean up
@@ -355,6 +397,12 @@ do_l2_generic_start(void) {
 	}
 
 	flags |= (global_cfg.initmode & DIAG_L2_TYPE_INITMASK) ;
+	if (global_cfg.can29) {
+		flags |= DIAG_L2_TYPE_CAN29;
+	}
+	if (global_cfg.cankernel) {
+		flags |= DIAG_L2_TYPE_CANKERNEL;
+	}
 
 	d_conn = diag_l2_StartCommunications(dl0d, global_cfg.L2proto,
 		flags, global_cfg.speed, global_cfg.tgt, global_cfg.src);
@@ -392,6 +440,13 @@ cmd_diag_connect(UNUSED(int argc), UNUSED(char **argv)) {
 	rv = do_l2_generic_start();
 	if (rv==0) {
 		printf("Connection to ECU established!\n");
+		if ((global_cfg.L2proto == DIAG_L2_PROT_CAN) && global_cfg.cankernel) {
+			if (dl2p_can_kernel(global_l2_conn) > 0) {
+				printf("ISO15765 transport : kernel (CAN_ISOTP)\n");
+			} else {
+				printf("ISO15765 transport : freediag, no kernel ISO-TP on this interface\n");
+			}
+		}
 		global_state = STATE_CONNECTED;
 	} else {
 		printf("\nConnection to ECU failed\n");
@@ -513,3 +568,158 @@ cmd_diag_sendreq(int argc, char **argv) {
 	}
 	return CMD_OK;
 }
+
+
+/*
+ * "diag multi" : run one session per port, in parallel.
+ * Each session uses a private L0 device (same interface type as the
+ * global one), with its first config item (port / simfile) set to the
+ * given value. It connects with the current L1/L2 settings, starts a
+ * SAEJ1979 L3 and requests mode 1 PID 0. Results are printed once all
+ * sessions have finished.
+ */
+struct multi_session {
+	const char *port;	/* value for first L0 config item */
+	struct diag_l0_device *dl0d;
+	diag_thread *thr;
+	int rv;			/* 0 if ok */
+	unsigned int necus;	/* # of ECUs that answered */
+	uint8_t pids[4];	/* Mode 1 PID 0 response from first ECU */
+	unsigned long ms;	/* session duration */
+};
+
+static void
+multi_session_run(void *arg) {
+	struct multi_session *ms = arg;
+	struct diag_l2_conn *dl2c;
+	struct diag_l3_conn *dl3c;
+	struct diag_l3_batch_req req = {0};
+	struct diag_msg msg = {0};
+	struct diag_msg *tmsg;
+	uint8_t data[2] = {0x01, 0x00};
+	flag_type flags;
+	unsigned long t0 = diag_os_getms();
+
+	ms->rv = diag_l2_open(ms->dl0d, global_cfg.L1proto);
+	if (ms->rv) {
+		ms->ms = diag_os_getms() - t0;
+		return;
+	}
+
+	flags = (global_cfg.addrtype? DIAG_L2_TYPE_FUNCADDR:0) |
+		(global_cfg.initmode & DIAG_L2_TYPE_INITMASK);
+	dl2c = diag_l2_StartCommunications(ms->dl0d, global_cfg.L2proto,
+		flags, global_cfg.speed, global_cfg.tgt, global_cfg.src);
+	if (dl2c == NULL) {
+		ms->rv = diag_geterr();
+		if (ms->rv == 0) {
+			ms->rv = DIAG_ERR_GENERAL;
+		}
+		diag_l2_close(ms->dl0d);
+		ms->ms = diag_os_getms() - t0;
+		return;
+	}
+
+	dl3c = diag_l3_start("SAEJ1979", dl2c);
+	if (dl3c == NULL) {
+		ms->rv = diag_geterr();
+		if (ms->rv == 0) {
+			ms->rv = DIAG_ERR_GENERAL;
+		}
+	} else {
+		msg.src = global_cfg.src;
+		msg.dest = global_cfg.tgt;
+		msg.data = data;
+		msg.len = 2;
+		req.txmsg = &msg;
+		(void) diag_l3_request_batch(dl3c, &req, 1, 300, NULL, NULL);
+		ms->rv = req.errval;
+		LL_FOREACH(req.rxmsg, tmsg) {
+			if ((ms->necus == 0) && (tmsg->len >= 6) && (tmsg->data[0] == 0x41)) {
+				memcpy(ms->pids, &tmsg->data[2], sizeof(ms->pids));
+			}
+			ms->necus++;
+		}
+		if (req.rxmsg) {
+			diag_freemsg(req.rxmsg);
+		}
+		diag_l3_stop(dl3c);
+	}
+
+	diag_l2_StopCommunications(dl2c);
+	diag_l2_close(ms->dl0d);
+	ms->ms = diag_os_getms() - t0;
+	return;
+}
+
+static int
+cmd_diag_multi(int argc, char **argv) {
+	struct multi_session *sessions;
+	struct cfgi *cfgp;
+	int nsess, i;
+
+	if (argc < 2) {
+		return CMD_USAGE;
+	}
+	if (strcmp(argv[1], "?") == 0) {
+		return CMD_USAGE;
+	}
+
+	if (global_cfg.l0name == NULL) {
+		printf("No interface type selected. Use \"set interface NAME\" first.\n");
+		return CMD_FAILED;
+	}
+
+	nsess = argc - 1;
+	if (diag_calloc(&sessions, nsess)) {
+		return CMD_FAILED;
+	}
+
+	/* Create and configure the L0 devices here, not in the threads */
+	for (i = 0; i < nsess; i++) {
+		sessions[i].port = argv[i + 1];
+		sessions[i].dl0d = diag_l0_new(global_cfg.l0name);
+		if (sessions[i].dl0d == NULL) {
+			sessions[i].rv = DIAG_ERR_GENERAL;
+			continue;
+		}
+		cfgp = diag_l0_getcfg(sessions[i].dl0d);
+		if ((cfgp == NULL) || diag_cfg_setstr(cfgp, sessions[i].port)) {
+			sessions[i].rv = DIAG_ERR_BADCFG;
+		}
+	}
+
+	for (i = 0; i < nsess; i++) {
+		if (sessions[i].rv) {
+			continue;
+		}
+		sessions[i].thr = diag_os_newthread(multi_session_run, &sessions[i]);
+		if (sessions[i].thr == NULL) {
+			sessions[i].rv = DIAG_ERR_GENERAL;
+		}
+	}
+
+	for (i = 0; i < nsess; i++) {
+		if (sessions[i].thr) {
+			diag_os_jointhread(sessions[i].thr);
+		}
+	}
+
+	for (i = 0; i < nsess; i++) {
+		struct multi_session *ms = &sessions[i];
+
+		printf("Session %d (%s): ", i, ms->port);
+		if (ms->rv) {
+			printf("failed : %s (%lu ms)\n", diag_errlookup(ms->rv), ms->ms);
+		} else {
+			printf("%u ECU(s) responded, Mode 1 PIDs 0x%02X 0x%02X 0x%02X 0x%02X (%lu ms)\n",
+				ms->necus, ms->pids[0], ms->pids[1], ms->pids[2], ms->pids[3], ms->ms);
+		}
+		if (ms->dl0d) {
+			diag_l0_del(ms->dl0d);
+		}
+	}
+
+	free(sessions);
+	return CMD_OK;
+}
@@ -119,18 +119,17 @@ static int cmd_dyno_mass(int argc, char **argv) {
  * Functions to measure data                                                  *
  ******************************************************************************/
 
-#define DYNDATA_1(p, n, d)	(d[p].data[n])
-#define DYNDATA_2(p, n, d)	(DYNDATA_1(p, n, d) * 256 + DYNDATA_1(p, n+1, d))
 #define RPM_PID           (0x0c)
-#define RPM_DATA(d)       (DYNDATA_2(RPM_PID, 2, d)*0.25)
+#define RPM_DATA(pv)      ((pv)->v[RPM_PID])	/* decoded : RPM */
 #define SPEED_PID         (0x0d)
-#define SPEED_DATA(d)     (DYNDATA_1(SPEED_PID, 2, d) * 10000./36.) /* m/s * 1000 */
+#define SPEED_DATA(pv)    ((pv)->v[SPEED_PID] * 10000./36.) /* decoded : km/h; m/s * 1000 */
 
 #define SPEED_ISO_TO_KMH(_speed_) ((_speed_)*36/10000)
 
 /* measure speed */
 // return <0 if error
 static int measure_data(uint8_t data_pid, ecu_data *ep) {
+	const struct pid_values *pv;
 	int rv;
 
 	if (global_l3_conn == NULL) {
@@ -145,13 +144,17 @@ static int measure_data(uint8_t data_pid, ecu_data *ep) {
 	}
 
 	/* data extraction */
+	pv = ecu_values(ep, 1);
+	if (!(pv->valid[data_pid] & PIDV_VALID)) {
+		return DIAG_ERR_GENERAL;
+	}
 	if (data_pid == RPM_PID) {
-		return (int)(RPM_DATA(ep->mode1_data) + .50);
+		return (int)(RPM_DATA(pv) + .50);
 	}
 	if (data_pid == SPEED_PID) {
-		return (int)(SPEED_DATA(ep->mode1_data) + .50);
+		return (int)(SPEED_DATA(pv) + .50);
 	}
-	return DYNDATA_1(data_pid, 2, ep->mode1_data);
+	return (int)(pv->v[data_pid] + .50);
 }
 
 
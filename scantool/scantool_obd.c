@@ -11,14 +11,189 @@
 #include "diag_err.h"
 #include "diag_os.h"
 #include "diag_l2.h"
+#include "diag_l2_j1939.h"
+#include "diag_l2_raw.h"
 #include "diag_l3.h"
+#include "diag_l3_j1939.h"
 
 #include "scantool.h"
 #include "scantool_cli.h"
 #include "scantool_obd.h"
+#include "scantool_poll.h"
 
+#define WATCH_POLL	50	/* ms between keyboard checks while monitoring */
+#define WATCH_J1939_MAXVALS	256	/* values shown by "watch" on J1939 */
+#define MONITOR_PRINT	1000	/* ms between printouts while monitoring */
 
 
+struct watch_ctx {
+	struct diag_l2_pipe *pipe;
+	void (*rcv)(void *handle, struct diag_msg *msg);
+	void *handle;
+	diag_mtx *mtx;	/* for err : set by the worker, read by cmd_watch */
+	int err;
+};
+
+/* pipeline completion callback for cmd_watch : print what was heard */
+static void
+watch_done(void *handle, struct diag_msg *rxmsg, int errval) {
+	struct watch_ctx *wc = handle;
+
+	if (errval != 0) {
+		/* stop listening, cmd_watch will notice */
+		diag_l2_pipe_listen(wc->pipe, 0, NULL);
+		diag_os_lock(wc->mtx);
+		wc->err = errval;
+		diag_os_unlock(wc->mtx);
+	}
+	if (rxmsg != NULL) {
+		wc->rcv(wc->handle, rxmsg);
+		diag_freemsg(rxmsg);
+	}
+	return;
+}
+
+/*
+ * Print everything heard on the connection until Enter is pressed. A
+ * pipeline worker does the receiving, so we can react to the keyboard
+ * right away instead of between long recv timeouts.
+ */
+static int
+watch_async(struct diag_l2_conn *d_l2_conn, struct watch_ctx *wc) {
+	int err = 0;
+
+	wc->err = 0;
+	wc->mtx = diag_os_newmtx();
+	if (wc->mtx == NULL) {
+		return diag_iseterr(DIAG_ERR_NOMEM);
+	}
+	wc->pipe = diag_l2_pipe_new(d_l2_conn);
+	if (wc->pipe == NULL) {
+		diag_os_delmtx(wc->mtx);
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	diag_l2_pipe_setcb(wc->pipe, watch_done);
+	diag_l2_pipe_listen(wc->pipe, 1, wc);
+
+	printf("Monitoring started. Press Enter to end.\n");
+	while (!diag_os_ipending() && (err == 0)) {
+		diag_os_millisleep(WATCH_POLL);
+		diag_os_lock(wc->mtx);
+		err = wc->err;
+		diag_os_unlock(wc->mtx);
+	}
+	/* joins the worker : wc->err can't change any more */
+	diag_l2_pipe_del(wc->pipe);
+	diag_os_delmtx(wc->mtx);
+	return wc->err;
+}
+
+/*
+ * Record everything heard on a raw connection to a capture file until
+ * Enter is pressed (see dl2p_raw_capture_start()). Nothing is printed
+ * meanwhile except the counters, once per second.
+ */
+static int
+watch_capture(struct diag_l2_conn *d_l2_conn, const char *filename) {
+	struct dl2p_raw_capstats st;
+	unsigned long tprint;
+	int rv;
+
+	rv = dl2p_raw_capture_start(d_l2_conn, filename, DL2P_RAWCAP_DEFRING);
+	if (rv < 0) {
+		return rv;
+	}
+
+	printf("Capturing to %s. Press Enter to end.\n", filename);
+	tprint = diag_os_getms();
+	while (!diag_os_ipending()) {
+		rv = diag_l2_recv(d_l2_conn, WATCH_POLL, NULL, NULL);
+		if ((rv < 0) && (rv != DIAG_ERR_TIMEOUT)) {
+			break;
+		}
+		rv = 0;
+		if ((diag_os_getms() - tprint) >= 1000) {
+			tprint = diag_os_getms();
+			if (dl2p_raw_capture_getstats(d_l2_conn, &st) == 0) {
+				printf("\r%llu chunks, %llu bytes, %llu dropped   ",
+					st.chunks, st.bytes, st.dropped_chunks);
+				fflush(stdout);
+			}
+		}
+	}
+
+	if (dl2p_raw_capture_stop(d_l2_conn, &st) < 0) {
+		printf("\nCapture file incomplete !\n");
+	}
+	printf("\n%llu chunks (%llu bytes) received, %llu chunks (%llu bytes) dropped, "
+		"%llu bytes written\n", st.chunks, st.bytes, st.dropped_chunks,
+		st.dropped_bytes, st.written);
+	return rv;
+}
+
+/*
+ * J1939 : hand everything heard to a J1939 monitor (which decodes and logs
+ * in its own thread), and show the latest values once per second.
+ */
+static int
+watch_j1939(struct diag_l2_conn *d_l2_conn) {
+	struct diag_l3_j1939_monval *vals;
+	struct diag_l3_j1939_monstats st;
+	struct diag_l3_j1939_mon *mon;
+	struct dl2p_j1939_stats l2st;
+	unsigned long tprint;
+	unsigned int n, i;
+	int rv;
+
+	rv = diag_calloc(&vals, WATCH_J1939_MAXVALS);
+	if (rv != 0) {
+		return rv;
+	}
+	mon = diag_l3_j1939_mon_new(global_logfp, global_log_tstart, 0);
+	if (mon == NULL) {
+		free(vals);
+		return diag_geterr();
+	}
+
+	printf("Monitoring started. Press Enter to end.\n");
+	tprint = diag_os_getms();
+	rv = 0;
+	while (!diag_os_ipending()) {
+		rv = diag_l2_recv(d_l2_conn, WATCH_POLL, diag_l3_j1939_mon_rcv, mon);
+		if ((rv < 0) && (rv != DIAG_ERR_TIMEOUT)) {
+			break;
+		}
+		rv = 0;
+		if ((diag_os_getms() - tprint) < 1000) {
+			continue;
+		}
+		tprint = diag_os_getms();
+
+		n = diag_l3_j1939_mon_snapshot(mon, vals, WATCH_J1939_MAXVALS, &st);
+		printf("\n%-4s %-5s %-44.44s %s\n", "SA", "SPN", "Parameter", "Value");
+		for (i = 0; i < n; i++) {
+			const struct diag_l3_j1939_val *v = &vals[i].val;
+
+			printf("%02X   %-5u %-44.44s ", vals[i].src, v->spn->spn, v->spn->name);
+			if (v->state == DIAG_L3_J1939_OK) {
+				printf("%.2f %s\n", v->value, v->spn->unit);
+			} else {
+				printf("%s\n", (v->state == DIAG_L3_J1939_ERR)? "error":"n/a");
+			}
+		}
+		if (dl2p_j1939_getstats(d_l2_conn, &l2st) == 0) {
+			printf("%lu frames, %lu messages (%lu reassembled, %lu transfers lost), "
+				"%lu dropped by decoder\n", l2st.frames, l2st.msgs, l2st.tp_done,
+				l2st.tp_lost, st.dropped);
+		}
+	}
+
+	diag_l3_j1939_mon_del(mon, &st);
+	free(vals);
+	printf("%lu messages, %lu decoded, %lu dropped\n", st.msgs, st.decoded, st.dropped);
+	return rv;
+}
+
 //cmd_watch : this creates a diag_l3_conn
 static int
 cmd_watch(int argc, char **argv) {
@@ -26,13 +201,21 @@ cmd_watch(int argc, char **argv) {
 	struct diag_l2_conn *d_l2_conn;
 	struct diag_l3_conn *d_l3_conn=NULL;
 	struct diag_l0_device *dl0d = global_dl0d;
+	struct watch_ctx wc;
 	bool rawmode = 0;
 	bool nodecode = 0;
 	bool nol3 = 0;
+	const char *capfile = NULL;
 
 	if (argc > 1) {
 		if (strcasecmp(argv[1], "raw") == 0) {
 			rawmode = 1;
+		} else if (strcasecmp(argv[1], "capture") == 0) {
+			if (argc != 3) {
+				return CMD_USAGE;
+			}
+			rawmode = 1;
+			capfile = argv[2];
 		} else if (strcasecmp(argv[1], "nodecode") == 0) {
 			nodecode = 1;
 		} else if (strcasecmp(argv[1], "nol3") == 0) {
@@ -83,13 +266,18 @@ cmd_watch(int argc, char **argv) {
 	//here we have a valid d_l2_conn over dl0d.
 	(void) diag_os_ipending();
 
-	if (!rawmode) {
-		/* Put the SAE J1979 stack on top of the ISO device */
+	if (!rawmode && (global_cfg.L2proto == DIAG_L2_PROT_J1939) &&
+			!nodecode && !nol3) {
+		rv = watch_j1939(d_l2_conn);
+	} else if (!rawmode) {
+		/* Put the SAE J1979 (or J1939) stack on top of the ISO device */
+
+		const char *l3name = (global_cfg.L2proto == DIAG_L2_PROT_J1939)? "J1939":"SAEJ1979";
 
 		if (!nol3) {
-			d_l3_conn = diag_l3_start("SAEJ1979", d_l2_conn);
+			d_l3_conn = diag_l3_start(l3name, d_l2_conn);
 			if (d_l3_conn == NULL) {
-				printf("Failed to enable SAEJ1979 mode\n");
+				printf("Failed to enable %s mode\n", l3name);
 				diag_l2_StopCommunications(d_l2_conn);
 				diag_l2_close(dl0d);
 				return CMD_FAILED;
@@ -98,49 +286,33 @@ cmd_watch(int argc, char **argv) {
 			d_l3_conn = NULL;
 		}
 
-		printf("Monitoring started. Press Enter to end.\n");
-		while (1) {
-			if (diag_os_ipending()) {
-				break;
-			}
-
-			if (d_l3_conn != NULL) {
-				rv = diag_l3_recv(d_l3_conn, 10000,
+		if (d_l3_conn && !(d_l3_conn->d_l3l2_flags & DIAG_L2_FLAG_FRAMED)) {
+			/* L3 has to assemble frames itself */
+			printf("Monitoring started. Press Enter to end.\n");
+			while (!diag_os_ipending()) {
+				(void) diag_l3_recv(d_l3_conn, 10000,
 					j1979_watch_rcv,
 					(nodecode) ? NULL:(void *)d_l3_conn);
-			} else {
-				rv = diag_l2_recv(d_l2_conn, 10000,
-					j1979_watch_rcv, NULL);
-			}
-			if (rv == 0) {
-				continue;
-			}
-			if (rv == DIAG_ERR_TIMEOUT) {
-				continue;
 			}
+		} else {
+			/* L2 frames are complete J1979 messages */
+			wc.rcv = j1979_watch_rcv;
+			wc.handle = (nodecode || !d_l3_conn) ? NULL:(void *)d_l3_conn;
+			rv = watch_async(d_l2_conn, &wc);
 		}
+	} else if (capfile) {
+		rv = watch_capture(d_l2_conn, capfile);
 	} else {
 		//rawmode
 		/*
 		 * And just read stuff, callback routine will print out the data
 		 */
-		printf("Monitoring started. Press Enter to end.\n");
-		while (1) {
-			if (diag_os_ipending()) {
-				break;
-			}
-
-			rv = diag_l2_recv(d_l2_conn, 10000,
-				j1979_data_rcv, (void *)&_RQST_HANDLE_WATCH);
-			if (rv == 0) {
-				continue;
-			}
-			if (rv == DIAG_ERR_TIMEOUT) {
-				continue;
-			}
-			printf("recv returns %d\n", rv);
-			break;
-		}
+		wc.rcv = j1979_data_rcv;
+		wc.handle = (void *)&_RQST_HANDLE_WATCH;
+		rv = watch_async(d_l2_conn, &wc);
+	}
+	if (rv < 0) {
+		printf("Monitoring failed : %s\n", diag_errlookup(rv));
 	}
 	if (d_l3_conn != NULL) {
 		diag_l3_stop(d_l3_conn);
@@ -167,26 +339,29 @@ print_current_data(bool english) {
 	printf("%-30.30s %-15.15s FreezeFrame\n",
 		"Parameter", "Current");
 
-	for (j = 0 ; get_pid(j) != NULL ; j++) {
+	for (j = 0 ; j < 0x100 ; j++) {
 		const struct pid *p = get_pid(j) ;
 
+		if (p == NULL) {
+			continue;
+		}
 		for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-			if (DATA_VALID(p, ep->mode1_data) ||
-				DATA_VALID(p, ep->mode2_data)) {
+			const struct pid_values *pv1 = ecu_values(ep, 1);
+			const struct pid_values *pv2 = ecu_values(ep, 2);
+
+			if (pv1->valid[j] || pv2->valid[j]) {
 				printf("%-30.30s ", p->desc);
 
-				if (DATA_VALID(p, ep->mode1_data)) {
-					p->cust_snprintf(buf, sizeof(buf), english, p,
-						ep->mode1_data, 2);
+				if (pv1->valid[j]) {
+					p->cust_snprintf(buf, sizeof(buf), english, p, pv1);
 				} else {
 					snprintf(buf, sizeof(buf), "-----");
 				}
 
 				printf("%-15.15s ", buf);
 
-				if (DATA_VALID(p, ep->mode2_data)) {
-					p->cust_snprintf(buf, sizeof(buf), english, p,
-						ep->mode2_data, 3);
+				if (pv2->valid[j]) {
+					p->cust_snprintf(buf, sizeof(buf), english, p, pv2);
 				} else {
 					snprintf(buf, sizeof(buf), "-----");
 				}
@@ -197,8 +372,12 @@ print_current_data(bool english) {
 	}
 }
 
+/* log the raw response to "pid", and its value decoded in pv, if any */
 static void
-log_response(int ecu, response *r) {
+log_response(int ecu, response *r, unsigned int pid,
+	const struct pid_values *pv) {
+	const struct pid *p = get_pid(pid);
+
 	assert(global_logfp != NULL);
 
 	/* Only print good records */
@@ -206,14 +385,20 @@ log_response(int ecu, response *r) {
 		return;
 	}
 
-	printf("%d: ", ecu);
+	fprintf(global_logfp, "%d: ", ecu);
 	diag_data_dump(global_logfp, r->data,r->len);
+	if ((p != NULL) && pv->valid[pid]) {
+		char buf[24];
+
+		p->cust_snprintf(buf, sizeof(buf), 0, p, pv);
+		fprintf(global_logfp, "= %s", buf);
+	}
 	fprintf(global_logfp, "\n");
 }
 
+/* log what the poll scheduler just got : one mode 1 PID, or the freeze frame */
 static void
-log_current_data(void) {
-	response *r;
+log_poll_data(UNUSED(void *handle), uint8_t mode, uint8_t pid) {
 	ecu_data *ep;
 	unsigned int i;
 
@@ -221,27 +406,36 @@ log_current_data(void) {
 		return;
 	}
 
-	log_timestamp("D");
-	fprintf(global_logfp, "MODE 1 DATA\n");
-	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-		for (r = ep->mode1_data;
-			r < &ep->mode1_data[ARRAY_SIZE(ep->mode1_data)]; r++) {
-				log_response((int)i, r);
+	switch (mode) {
+	case 1:
+		log_timestamp("D");
+		fprintf(global_logfp, "MODE 1 DATA\n");
+		for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
+			log_response((int)i, &ep->mode1_data[pid], pid,
+				ecu_values(ep, 1));
 		}
-	}
+		break;
+	case 2:
+		log_timestamp("D");
+		fprintf(global_logfp, "MODE 2 DATA\n");
+		for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
+			const struct pid_values *pv = ecu_values(ep, 2);
+			unsigned int j;
 
-	log_timestamp("D");
-	fprintf(global_logfp, "MODE 2 DATA\n");
-	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-		for (r = ep->mode2_data;
-			r < &ep->mode2_data[ARRAY_SIZE(ep->mode2_data)]; r++) {
-			log_response((int)i, r);
+			for (j = 0; j < ARRAY_SIZE(ep->mode2_data); j++) {
+				log_response((int)i, &ep->mode2_data[j], j, pv);
+			}
 		}
+		break;
+	default:
+		break;
 	}
 }
 
 static int
 cmd_monitor(int argc, char **argv) {
+	struct poll_sched *ps;
+	unsigned long lastprint;
 	int rv;
 	bool english = 0;
 
@@ -267,14 +461,26 @@ cmd_monitor(int argc, char **argv) {
 		english = global_cfg.units;
 	}
 
+	ps = poll_new(log_poll_data, NULL);
+	if (ps == NULL) {
+		return CMD_FAILED;
+	}
+
 	printf("Monitoring. Press <enter> to stop.\n");
 
 	/*
-	 * Now just receive data and log it for ever
+	 * Now just receive data and log it for ever; the scheduler decides
+	 * what to request (and logs it), we print everything now and then.
 	 */
-
+	lastprint = diag_os_getms();
 	while (1) {
-		rv = do_j1979_getdata(1);
+		rv = poll_step(ps, 1);
+		if ((rv < 0) && ecu_session_lost()) {
+			/* ECU dropped the session : restart it and keep polling */
+			if (ecu_recover() == 0) {
+				continue;
+			}
+		}
 		/* Key pressed */
 		if (rv == 1 || rv<0) {
 			//enter was pressed to interrupt,
@@ -282,14 +488,13 @@ cmd_monitor(int argc, char **argv) {
 			break;
 		}
 		/* print the data */
-		print_current_data(english);
-
-		/* Save the data */
-		log_current_data();
-
-		/* Get/Print current DTCs */
-		do_j1979_cms();
+		if ((diag_os_getms() - lastprint) >= MONITOR_PRINT) {
+			lastprint = diag_os_getms();
+			print_current_data(english);
+		}
 	}
+	poll_report(ps, stdout);
+	poll_del(ps);
 	return CMD_OK;
 }
 
@@ -506,8 +711,9 @@ const struct cmd_tbl_entry scantool_cmd_table[] = {
 		cmd_monitor, 0, NULL},
 	{ "cleardtc", "cleardtc", "Clear DTCs from ECU", cmd_cleardtc, 0, NULL},
 	{ "ecus", "ecus", "Show ECU information", cmd_ecus, 0, NULL},
-	{ "watch", "watch [raw/nodecode/nol3]",
-		"Watch the diagnostic bus and, if not in raw/nol3 mode, decode data",
+	{ "watch", "watch [raw/nodecode/nol3] | watch capture <file>",
+		"Watch the diagnostic bus and, if not in raw/nol3 mode, decode data; "
+		"or record raw bus data to a binary file",
 		cmd_watch, 0, NULL},
 	{ "dumpdata", "dumpdata", "Show Mode1 Pid1/2 responses",
 		cmd_dumpdata, 0, NULL},
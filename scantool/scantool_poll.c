@@ -0,0 +1,351 @@
+/*
+ * PID polling scheduler (see scantool_poll.h)
+ *
+ * Weighted fair queuing, self-clocked (SCFQ) : every item has a virtual
+ * finish tag, advanced by 1 / weight each time it is polled, starting from
+ * the virtual time if the item was idle. The virtual time is the finish tag
+ * of the last item polled. Of the items that are due, the one with the
+ * smallest tag after this poll goes first.
+ *
+ * Licensed under GPLv3
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diag.h"
+#include "diag_err.h"
+#include "diag_l3.h"
+#include "diag_os.h"
+
+#include "scantool.h"
+#include "scantool_poll.h"
+
+/* target periods, ms */
+#define POLL_FAST	50	/* 20 Hz : RPM, speed */
+#define POLL_QUICK	100	/* 10 Hz : load, throttle, airflow, ... */
+#define POLL_MEDIUM	1000	/* fuel trims, O2 sensors, ... */
+#define POLL_SLOW	5000	/* temperatures, status, and the rest */
+#define POLL_FREEZE	30000
+#define POLL_DTC	30000
+
+#define POLL_WAIT	50	/* ms between keyboard checks while nothing is due */
+#define POLL_MAXBATCH	6	/* PIDs per request, at most */
+
+#define POLL_MODE_FREEZE	2
+#define POLL_MODE_DTC	7
+
+struct poll_item {
+	uint8_t mode;
+	uint8_t pid;
+	unsigned int period;	/* target, ms */
+	unsigned int prio;	/* 1 (lowest) to 4 */
+	double finish;	/* virtual finish tag of the last poll */
+	unsigned long due;	/* diag_os_getms() */
+	unsigned long polls;
+	unsigned long errors;	/* polls where the request reported an error */
+};
+
+struct poll_sched {
+	struct poll_item items[0x100 + 2];
+	unsigned int nitems;
+	double vtime;	/* virtual time */
+	unsigned long tstart;
+	poll_done_fn *done;
+	void *handle;
+};
+
+/* Default target period and priority of a mode 1 PID */
+static void
+poll_defrate(uint8_t pid, unsigned int *period, unsigned int *prio) {
+	switch (pid) {
+	case 0x0C:	/* RPM */
+	case 0x0D:	/* speed */
+		*period = POLL_FAST;
+		*prio = 4;
+		return;
+	case 0x04:	/* load */
+	case 0x0B:	/* MAP */
+	case 0x0E:	/* timing advance */
+	case 0x10:	/* MAF */
+	case 0x11:	/* throttle */
+	case 0x43:	/* absolute load */
+	case 0x45:	/* relative throttle */
+	case 0x47:	/* throttle B, C; pedal D, E, F */
+	case 0x48:
+	case 0x49:
+	case 0x4A:
+	case 0x4B:
+	case 0x4C:	/* commanded throttle */
+		*period = POLL_QUICK;
+		*prio = 3;
+		return;
+	case 0x06:	/* fuel trims */
+	case 0x07:
+	case 0x08:
+	case 0x09:
+	case 0x0A:	/* fuel pressure */
+	case 0x22:
+	case 0x23:
+	case 0x2C:	/* EGR */
+	case 0x2D:
+	case 0x44:	/* commanded equivalence ratio */
+	case 0x5E:	/* fuel rate */
+		*period = POLL_MEDIUM;
+		*prio = 2;
+		return;
+	default:
+		break;
+	}
+	if (((pid >= 0x14) && (pid <= 0x1B)) ||
+			((pid >= 0x24) && (pid <= 0x2B)) ||
+			((pid >= 0x34) && (pid <= 0x3B))) {
+		/* O2 sensors */
+		*period = POLL_MEDIUM;
+		*prio = 2;
+		return;
+	}
+	*period = POLL_SLOW;
+	*prio = 1;
+	return;
+}
+
+static void
+poll_additem(struct poll_sched *ps, uint8_t mode, uint8_t pid,
+	unsigned int period, unsigned int prio) {
+	struct poll_item *pi;
+
+	assert(ps->nitems < ARRAY_SIZE(ps->items));
+	pi = &ps->items[ps->nitems++];
+	pi->mode = mode;
+	pi->pid = pid;
+	pi->period = period;
+	pi->prio = prio;
+	pi->due = ps->tstart;
+	return;
+}
+
+struct poll_sched *
+poll_new(poll_done_fn *done, void *handle) {
+	struct poll_sched *ps;
+	unsigned int i;
+	int rv;
+
+	if ((rv = diag_calloc(&ps, 1))) {
+		return diag_pseterr(rv);
+	}
+	ps->done = done;
+	ps->handle = handle;
+	ps->tstart = diag_os_getms();
+
+	/* PIDs 1 and 2 are skipped like in do_j1979_getdata(); 0x20, 0x40 etc
+	 * are just more "supported PIDs" bitmaps */
+	for (i = 3; i < 0x100; i++) {
+		unsigned int period, prio;
+
+		if (!merged_mode1_info[i] || ((i & 0x1F) == 0)) {
+			continue;
+		}
+		poll_defrate((uint8_t) i, &period, &prio);
+		poll_additem(ps, 1, (uint8_t) i, period, prio);
+	}
+	poll_additem(ps, POLL_MODE_FREEZE, 0, POLL_FREEZE, 1);
+	poll_additem(ps, POLL_MODE_DTC, 0, POLL_DTC, 1);
+
+	diag_os_ipending();	//on WIN32, "purge" the last state of the enter key
+	return ps;
+}
+
+void
+poll_del(struct poll_sched *ps) {
+	free(ps);
+	return;
+}
+
+/* Finish tag of an item if it was polled now */
+static double
+poll_tag(const struct poll_sched *ps, const struct poll_item *pi) {
+	double start = (pi->finish > ps->vtime)? pi->finish : ps->vtime;
+
+	return start + (double) pi->period / (1000.0 * pi->prio);
+}
+
+/*
+ * Pick the due items to poll : the one with the smallest tag, and if it's a
+ * mode 1 PID, up to maxbatch - 1 other due PIDs, by increasing tag.
+ * If nothing is due, *wait is set to the ms until the next item is.
+ * @return number of items in batch[]
+ */
+static unsigned int
+poll_pick(struct poll_sched *ps, unsigned long now, struct poll_item **batch,
+	unsigned int maxbatch, unsigned long *wait) {
+	struct poll_item *head = NULL;
+	double tags[POLL_MAXBATCH];
+	unsigned int i, j, n;
+
+	*wait = POLL_WAIT;
+	for (i = 0; i < ps->nitems; i++) {
+		struct poll_item *pi = &ps->items[i];
+		long early = (long) (pi->due - now);
+		double tag;
+
+		if (early > 0) {
+			if ((unsigned long) early < *wait) {
+				*wait = (unsigned long) early;
+			}
+			continue;
+		}
+		tag = poll_tag(ps, pi);
+		if ((head == NULL) || (tag < tags[0])) {
+			head = pi;
+			tags[0] = tag;
+		}
+	}
+	if (head == NULL) {
+		return 0;
+	}
+	batch[0] = head;
+	n = 1;
+	if (head->mode != 1) {
+		return n;
+	}
+
+	/* other due PIDs, kept sorted by tag */
+	for (i = 0; i < ps->nitems; i++) {
+		struct poll_item *pi = &ps->items[i];
+		double tag;
+
+		if ((pi == head) || (pi->mode != 1) || ((long) (pi->due - now) > 0)) {
+			continue;
+		}
+		tag = poll_tag(ps, pi);
+		for (j = n; (j > 1) && (tag < tags[j - 1]); j--) {
+			;
+		}
+		if (j >= maxbatch) {
+			continue;
+		}
+		if (n < maxbatch) {
+			n++;
+		}
+		memmove(&batch[j + 1], &batch[j], (n - 1 - j) * sizeof(batch[0]));
+		memmove(&tags[j + 1], &tags[j], (n - 1 - j) * sizeof(tags[0]));
+		batch[j] = pi;
+		tags[j] = tag;
+	}
+	return n;
+}
+
+/* Account for a poll of pi done at "now" */
+static void
+poll_served(struct poll_sched *ps, struct poll_item *pi, unsigned long now,
+	bool error) {
+	pi->finish = poll_tag(ps, pi);
+	pi->polls++;
+	if (error) {
+		pi->errors++;
+	}
+
+	/* keep the phase unless we fell a whole period behind */
+	pi->due += pi->period;
+	if ((long) (now - pi->due) > 0) {
+		pi->due = now + pi->period;
+	}
+	return;
+}
+
+int
+poll_step(struct poll_sched *ps, int interruptible) {
+	struct diag_l3_conn *d_conn = global_l3_conn;
+	struct poll_item *batch[POLL_MAXBATCH];
+	uint8_t pids[POLL_MAXBATCH];
+	unsigned int i, n, maxbatch;
+	unsigned long now, wait;
+	int rv = 0;
+
+	if (d_conn == NULL) {
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	maxbatch = j1979_multipid_max(d_conn, 1);
+	if (maxbatch > POLL_MAXBATCH) {
+		maxbatch = POLL_MAXBATCH;
+	}
+
+	while (1) {
+		if (interruptible && diag_os_ipending()) {
+			return 1;
+		}
+		now = diag_os_getms();
+		n = poll_pick(ps, now, batch, maxbatch, &wait);
+		if (n > 0) {
+			break;
+		}
+		diag_os_millisleep((unsigned int) wait);
+	}
+
+	switch (batch[0]->mode) {
+	case POLL_MODE_FREEZE:
+		rv = do_j1979_getfreeze(interruptible, 0);
+		break;
+	case POLL_MODE_DTC:
+		do_j1979_cms();
+		break;
+	default:
+		for (i = 0; i < n; i++) {
+			pids[i] = batch[i]->pid;
+		}
+		rv = l3_do_j1979_pidbatch(d_conn, 1, pids, n, 0, 0);
+		break;
+	}
+
+	/* self-clocked : virtual time is the tag of the item served first */
+	now = diag_os_getms();
+	for (i = 0; i < n; i++) {
+		poll_served(ps, batch[i], now, rv < 0);
+	}
+	ps->vtime = batch[0]->finish;
+
+	if (ps->done != NULL) {
+		for (i = 0; i < n; i++) {
+			ps->done(ps->handle, batch[i]->mode, batch[i]->pid);
+		}
+	}
+
+	if (ecu_session_lost()) {
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	return (rv == 1)? 1 : 0;
+}
+
+void
+poll_report(struct poll_sched *ps, FILE *fp) {
+	unsigned long elapsed = diag_os_getms() - ps->tstart;
+	unsigned int i;
+
+	if (elapsed == 0) {
+		elapsed = 1;
+	}
+	fprintf(fp, "Poll rates over %lu.%03lu s :\n", elapsed / 1000, elapsed % 1000);
+	fprintf(fp, "Item             target Hz  achieved Hz   polls  errors\n");
+	for (i = 0; i < ps->nitems; i++) {
+		const struct poll_item *pi = &ps->items[i];
+		char name[20];
+
+		switch (pi->mode) {
+		case POLL_MODE_FREEZE:
+			snprintf(name, sizeof(name), "Freeze frame");
+			break;
+		case POLL_MODE_DTC:
+			snprintf(name, sizeof(name), "DTCs");
+			break;
+		default:
+			snprintf(name, sizeof(name), "Mode 1 Pid 0x%02X", pi->pid);
+			break;
+		}
+		fprintf(fp, "%-16s %10.2f %12.2f %7lu %7lu\n", name,
+			1000.0 / pi->period, pi->polls * 1000.0 / elapsed,
+			pi->polls, pi->errors);
+	}
+	return;
+}
@@ -0,0 +1,53 @@
+#ifndef _SCANTOOL_POLL_H
+#define _SCANTOOL_POLL_H
+
+/* PID polling scheduler, for "monitor" (display and logging) and the AIF
+ * monitor.
+ *
+ * Each supported mode 1 PID, the freeze frame (mode 2) and the current
+ * DTCs (mode 7) is an item with a target poll rate and a priority : e.g.
+ * RPM and speed at 20 Hz, temperatures at 0.2 Hz, DTCs every 30 s.
+ * Items that are due are polled in weighted fair queuing order (weight :
+ * rate * priority), so when the bus can't keep up, each item gets a share
+ * of the requests in proportion to its weight instead of every PID waiting
+ * for a sweep of all the others.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+struct poll_sched;
+
+/** Called after each poll, once the data is in ecu_info[]
+ * @param mode : 1 (pid : the PID), 2 (freeze frame; pid 0) or 7 (DTCs; pid 0)
+ */
+typedef void (poll_done_fn)(void *handle, uint8_t mode, uint8_t pid);
+
+/** New scheduler for global_l3_conn, with every mode 1 PID in
+ * merged_mode1_info, the freeze frame and the DTCs; all due right away.
+ * @param done : called after each poll, if not NULL
+ * @return NULL if failed
+ */
+struct poll_sched *poll_new(poll_done_fn *done, void *handle);
+
+void poll_del(struct poll_sched *ps);
+
+/** Wait for the next item to be due and poll it, along with other due mode
+ * 1 PIDs that fit in the same request (see j1979_multipid_max()).
+ * @param interruptible : stop, and return 1, if stdin has input
+ *	(see diag_os_ipending())
+ * @return 0 if ok, 1 if interrupted, < 0 if the request failed
+ */
+int poll_step(struct poll_sched *ps, int interruptible);
+
+/** Print the target and achieved rate of every item */
+void poll_report(struct poll_sched *ps, FILE *fp);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _SCANTOOL_POLL_H */
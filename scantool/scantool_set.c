@@ -43,8 +43,6 @@
 /* struct global_cfg contains all global parameters */
 struct globcfg global_cfg;
 
-struct diag_l0_device *global_dl0d;
-
 
 /*
  * XXX All commands should probably have optional "init" hooks.
@@ -57,6 +55,8 @@ int set_init(void) {
 	global_cfg.src = 0xf1;	/* Our tester ID */
 	global_cfg.addrtype = 1;	/* Use functional addressing */
 	global_cfg.tgt = 0x33;	/* Dest ECU address */
+	global_cfg.can29 = 0;	/* 11-bit CAN IDs */
+	global_cfg.cankernel = 0;	/* freediag ISO15765 transport */
 
 	global_cfg.L1proto = DIAG_L1_ISO9141;	/* L1 protocol type */
 
@@ -90,6 +90,8 @@ static int cmd_set_speed(int argc, char **argv);
 static int cmd_set_testerid(int argc, char **argv);
 static int cmd_set_destaddr(int argc, char **argv);
 static int cmd_set_addrtype(int argc, char **argv);
+static int cmd_set_canid(int argc, char **argv);
+static int cmd_set_isotp(int argc, char **argv);
 static int cmd_set_l1protocol(int argc, char **argv);
 static int cmd_set_l2protocol(int argc, char **argv);
 static int cmd_set_initmode(int argc, char **argv);
@@ -117,6 +119,10 @@ const struct cmd_tbl_entry set_cmd_table[] = {
 
 	{ "addrtype", "addrtype [func/phys]", "Address type, physical or functional.",
 		cmd_set_addrtype, 0, NULL},
+	{ "canid", "canid [11/29]", "CAN identifier length (ISO15765 only).",
+		cmd_set_canid, 0, NULL},
+	{ "isotp", "isotp [freediag/kernel]", "ISO15765 transport : freediag's, or the kernel's (CAN_ISOTP) if the interface has it.",
+		cmd_set_isotp, 0, NULL},
 
 	{ "l1protocol", "l1protocol [protocolname]", "Hardware (L1) protocol to use. Use 'set l1protocol ?' to show valid choices.",
 		cmd_set_l1protocol, 0, NULL},
@@ -254,6 +260,8 @@ cmd_set_show(UNUSED(int argc), UNUSED(char **argv)) {
 	cmd_set_display(0,NULL);
 	cmd_set_testerid(0,NULL);
 	cmd_set_addrtype(0,NULL);
+	cmd_set_canid(0,NULL);
+	cmd_set_isotp(0,NULL);
 	cmd_set_destaddr(0,NULL);
 	cmd_set_l1protocol(0,NULL);
 	cmd_set_l2protocol(0,NULL);
@@ -431,6 +439,42 @@ cmd_set_addrtype(int argc, char **argv) {
 	return CMD_OK;
 }
 
+static int
+cmd_set_canid(int argc, char **argv) {
+	if (argc > 1) {
+		if (strcmp(argv[1], "29") == 0) {
+			global_cfg.can29 = 1;
+		} else if (strcmp(argv[1], "11") == 0) {
+			global_cfg.can29 = 0;
+		} else {
+			return CMD_USAGE;
+		}
+	} else {
+		printf("canid: %s-bit CAN identifiers\n",
+			global_cfg.can29 ? "29" : "11");
+	}
+
+	return CMD_OK;
+}
+
+static int
+cmd_set_isotp(int argc, char **argv) {
+	if (argc > 1) {
+		if (strcmp(argv[1], "kernel") == 0) {
+			global_cfg.cankernel = 1;
+		} else if (strcmp(argv[1], "freediag") == 0) {
+			global_cfg.cankernel = 0;
+		} else {
+			return CMD_USAGE;
+		}
+	} else {
+		printf("isotp: %s ISO15765 transport\n",
+			global_cfg.cankernel ? "kernel" : "freediag");
+	}
+
+	return CMD_OK;
+}
+
 static int cmd_set_l2protocol(int argc, char **argv) {
 	if (argc > 1) {
 		int i, helping = 0, found = 0;